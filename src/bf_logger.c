@@ -11,6 +11,7 @@
 FILE *logfp = NULL;
 char *logfn = NULL;
 pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+int echo_to_stdout = 1;
 
 void print_time(FILE *fp)
 {
@@ -41,6 +42,7 @@ void bf_logger_init(char *filename)
 	{
 		fprintf(stderr, "[FROM LOGGER]: unable to create log file.\n");
 		logfn = NULL;
+		pthread_mutex_unlock(&mutex1);
 		return;
 	}
 	fprintf(logfp, "Start of log file.\n\n");
@@ -56,6 +58,7 @@ int bf_log(const char *format, ...)
 	if(!logfn)
 	{
 		fprintf(stderr, "[FROM LOGGER]: unable to log the message as the log file has not been initialised.\n");
+		pthread_mutex_unlock(&mutex1);
 		return -1;
 	}
 
@@ -63,17 +66,23 @@ int bf_log(const char *format, ...)
 	if(!logfp)
 	{
 		fprintf(stderr, "[FROM LOGGER]: unable to open log file.\n");
+		pthread_mutex_unlock(&mutex1);
 		return -1;
 	}
 	
 	print_time(logfp);
 	print_thread_id(logfp);	
 
-	va_list argptr;
+	va_list argptr, stdout_argptr;
 	va_start(argptr, format);
+	va_copy(stdout_argptr, argptr);
 	vfprintf(logfp, format, argptr);
-	// output to standard output too
-	printf(format);
+	// output to standard output too, unless it carries data (see bf_logger_echo())
+	if(echo_to_stdout)
+	{
+		vprintf(format, stdout_argptr);
+	}
+	va_end(stdout_argptr);
 	va_end(argptr);
 	
 	fclose(logfp);
@@ -90,6 +99,7 @@ int bf_log_binary(const char *description, uint8_t *data, int len)
 	if(!logfn)
 	{
 		fprintf(stderr, "[FROM LOGGER]: bf_log_binary: unable to log the message as the log file has not been initialised.\n");
+		pthread_mutex_unlock(&mutex1);
 		return -1;
 	}
 
@@ -97,6 +107,7 @@ int bf_log_binary(const char *description, uint8_t *data, int len)
 	if(!logfp)
 	{
 		fprintf(stderr, "[FROM LOGGER]: bf_log_binary: unable to open log file.\n");
+		pthread_mutex_unlock(&mutex1);
 		return -1;
 	}
 
@@ -109,12 +120,22 @@ int bf_log_binary(const char *description, uint8_t *data, int len)
 	{
 		fprintf(logfp, "%x", data[i]);
 	}
+	fclose(logfp);
 
 	pthread_mutex_unlock(&mutex1);	
 
 	return 0;
 }
 
+void bf_logger_echo(int enable)
+{
+	pthread_mutex_lock(&mutex1);
+
+	echo_to_stdout = enable;
+
+	pthread_mutex_unlock(&mutex1);
+}
+
 void bf_logger_end()
 {
 	bf_log("\nEnd of log file.\n");
@@ -0,0 +1,362 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<arpa/inet.h>
+
+#include "blocklist.h"
+
+#include "bf_logger.h"
+
+struct blocklist_range4
+{
+	uint32_t first; // host byte order
+	uint32_t last;
+};
+
+struct blocklist_range6
+{
+	uint8_t first[16]; // network byte order, so memcmp() orders them
+	uint8_t last[16];
+};
+
+static struct blocklist_range4 *g_ranges4 = NULL;
+static int g_num_ranges4 = 0;
+static int g_max_ranges4 = 0;
+static struct blocklist_range6 *g_ranges6 = NULL;
+static int g_num_ranges6 = 0;
+static int g_max_ranges6 = 0;
+
+static int parse_line(char *line);
+static int parse_cidr(char *line, char *slash);
+static int parse_range(char *line, char *dash);
+static void add_range4(uint32_t first, uint32_t last);
+static void add_range6(const uint8_t *first, const uint8_t *last);
+static void merge_ranges4();
+static void merge_ranges6();
+static int compare_ranges4(const void *a, const void *b);
+static int compare_ranges6(const void *a, const void *b);
+static int contains4(uint32_t addr);
+static int contains6(const uint8_t *addr);
+static char *trim(char *str);
+
+int blocklist_load(const char *path)
+{
+	char line[BLOCKLIST_MAX_LINE];
+	FILE *fp;
+	int num_of_ranges = 0, num_of_invalid = 0;
+
+	if((fp = fopen(path, "r")) == NULL)
+	{
+		bf_log("[ERROR] blocklist_load(): Failed to open '%s'.\n", path);
+		return -1;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL)
+	{
+		switch(parse_line(line))
+		{
+			case 1:
+				num_of_ranges++;
+				break;
+			case -1:
+				num_of_invalid++;
+				break;
+		}
+	}
+	fclose(fp);
+
+	// the lookups need the ranges sorted and apart.
+	merge_ranges4();
+	merge_ranges6();
+	bf_log("[LOG] blocklist_load(): Read %d ranges from '%s' and skipped %d invalid lines. %d IPv4 and %d IPv6 ranges after merging.\n",
+		num_of_ranges, path, num_of_invalid, g_num_ranges4, g_num_ranges6);
+
+	return num_of_ranges;
+}
+
+int blocklist_contains(const char *ip)
+{
+	struct in_addr addr4;
+	struct in6_addr addr6;
+
+	if(inet_pton(AF_INET, ip, &addr4) == 1)
+	{
+		return contains4(ntohl(addr4.s_addr));
+	}
+	if(inet_pton(AF_INET6, ip, &addr6) == 1)
+	{
+		if(IN6_IS_ADDR_V4MAPPED(&addr6))
+		{
+			return contains4(((uint32_t)addr6.s6_addr[12] << 24) | ((uint32_t)addr6.s6_addr[13] << 16)
+				| ((uint32_t)addr6.s6_addr[14] << 8) | addr6.s6_addr[15]);
+		}
+		return contains6(addr6.s6_addr);
+	}
+
+	return 0;
+}
+
+int blocklist_size()
+{
+	return g_num_ranges4 + g_num_ranges6;
+}
+
+void blocklist_free()
+{
+	free(g_ranges4);
+	g_ranges4 = NULL;
+	g_num_ranges4 = g_max_ranges4 = 0;
+	free(g_ranges6);
+	g_ranges6 = NULL;
+	g_num_ranges6 = g_max_ranges6 = 0;
+}
+
+// returns 1 if a range was added, 0 for a blank line or comment and -1 if the line isn't valid.
+static int parse_line(char *line)
+{
+	char *sep;
+
+	line = trim(line);
+	if(*line == '\0' || *line == '#')
+	{
+		return 0;
+	}
+	// addresses have no dashes, but the names in front of P2P ranges may have dashes and slashes.
+	if((sep = strrchr(line, '-')) != NULL)
+	{
+		return parse_range(line, sep);
+	}
+	if((sep = strchr(line, '/')) != NULL)
+	{
+		return parse_cidr(line, sep);
+	}
+
+	return parse_range(line, NULL);
+}
+
+static int parse_cidr(char *line, char *slash)
+{
+	struct in_addr addr4;
+	struct in6_addr addr6;
+	uint8_t first[16], last[16];
+	uint32_t mask;
+	char *end;
+	long int bits;
+	int i;
+
+	*slash = '\0';
+	bits = strtol(slash + 1, &end, 10);
+	if(end == slash + 1 || *end != '\0' || bits < 0)
+	{
+		return -1;
+	}
+	if(inet_pton(AF_INET, line, &addr4) == 1 && bits <= 32)
+	{
+		mask = bits == 0 ? 0 : 0xFFFFFFFF << (32 - bits);
+		add_range4(ntohl(addr4.s_addr) & mask, ntohl(addr4.s_addr) | ~mask);
+		return 1;
+	}
+	if(inet_pton(AF_INET6, line, &addr6) == 1 && bits <= 128)
+	{
+		for(i = 0; i < 16; i++)
+		{
+			// the bits of this byte that are in the prefix.
+			mask = bits >= (i + 1) * 8 ? 0xFF : (bits <= i * 8 ? 0 : (0xFF << ((i + 1) * 8 - bits)) & 0xFF);
+			first[i] = addr6.s6_addr[i] & mask;
+			last[i] = addr6.s6_addr[i] | (~mask & 0xFF);
+		}
+		add_range6(first, last);
+		return 1;
+	}
+
+	return -1;
+}
+
+// first-last, with an optional "name:" in front of an IPv4 range. without a dash the line is one address.
+static int parse_range(char *line, char *dash)
+{
+	struct in_addr first4, last4;
+	struct in6_addr first6, last6;
+	char *colon, *to = line;
+
+	if(dash)
+	{
+		*dash = '\0';
+		to = trim(dash + 1);
+		if(strchr(line, '.') != NULL && (colon = strrchr(line, ':')) != NULL)
+		{
+			line = colon + 1;
+		}
+		line = trim(line);
+	}
+	if(inet_pton(AF_INET, line, &first4) == 1 && inet_pton(AF_INET, to, &last4) == 1)
+	{
+		if(ntohl(first4.s_addr) > ntohl(last4.s_addr))
+		{
+			return -1;
+		}
+		add_range4(ntohl(first4.s_addr), ntohl(last4.s_addr));
+		return 1;
+	}
+	if(inet_pton(AF_INET6, line, &first6) == 1 && inet_pton(AF_INET6, to, &last6) == 1)
+	{
+		if(memcmp(first6.s6_addr, last6.s6_addr, 16) > 0)
+		{
+			return -1;
+		}
+		add_range6(first6.s6_addr, last6.s6_addr);
+		return 1;
+	}
+
+	return -1;
+}
+
+static void add_range4(uint32_t first, uint32_t last)
+{
+	if(g_num_ranges4 == g_max_ranges4)
+	{
+		g_max_ranges4 = g_max_ranges4 ? g_max_ranges4 * 2 : 1024;
+		g_ranges4 = realloc(g_ranges4, sizeof(struct blocklist_range4) * g_max_ranges4);
+	}
+	g_ranges4[g_num_ranges4].first = first;
+	g_ranges4[g_num_ranges4].last = last;
+	g_num_ranges4++;
+}
+
+static void add_range6(const uint8_t *first, const uint8_t *last)
+{
+	if(g_num_ranges6 == g_max_ranges6)
+	{
+		g_max_ranges6 = g_max_ranges6 ? g_max_ranges6 * 2 : 64;
+		g_ranges6 = realloc(g_ranges6, sizeof(struct blocklist_range6) * g_max_ranges6);
+	}
+	memcpy(g_ranges6[g_num_ranges6].first, first, 16);
+	memcpy(g_ranges6[g_num_ranges6].last, last, 16);
+	g_num_ranges6++;
+}
+
+// sorts the ranges by their first address and joins the ones that overlap or touch, so at most one
+// range can hold an address and it is the last one starting at or before it.
+static void merge_ranges4()
+{
+	int i, n = 0;
+
+	if(g_num_ranges4 == 0)
+	{
+		return;
+	}
+	qsort(g_ranges4, g_num_ranges4, sizeof(struct blocklist_range4), compare_ranges4);
+	for(i = 1; i < g_num_ranges4; i++)
+	{
+		if(g_ranges4[n].last == 0xFFFFFFFF || g_ranges4[i].first <= g_ranges4[n].last + 1)
+		{
+			if(g_ranges4[i].last > g_ranges4[n].last)
+			{
+				g_ranges4[n].last = g_ranges4[i].last;
+			}
+		}
+		else
+		{
+			g_ranges4[++n] = g_ranges4[i];
+		}
+	}
+	g_num_ranges4 = n + 1;
+}
+
+static void merge_ranges6()
+{
+	int i, n = 0;
+
+	if(g_num_ranges6 == 0)
+	{
+		return;
+	}
+	qsort(g_ranges6, g_num_ranges6, sizeof(struct blocklist_range6), compare_ranges6);
+	for(i = 1; i < g_num_ranges6; i++)
+	{
+		// IPv6 ranges that only touch are left apart. there are few of them.
+		if(memcmp(g_ranges6[i].first, g_ranges6[n].last, 16) <= 0)
+		{
+			if(memcmp(g_ranges6[i].last, g_ranges6[n].last, 16) > 0)
+			{
+				memcpy(g_ranges6[n].last, g_ranges6[i].last, 16);
+			}
+		}
+		else
+		{
+			g_ranges6[++n] = g_ranges6[i];
+		}
+	}
+	g_num_ranges6 = n + 1;
+}
+
+static int compare_ranges4(const void *a, const void *b)
+{
+	uint32_t x = ((const struct blocklist_range4 *)a)->first;
+	uint32_t y = ((const struct blocklist_range4 *)b)->first;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int compare_ranges6(const void *a, const void *b)
+{
+	return memcmp(((const struct blocklist_range6 *)a)->first, ((const struct blocklist_range6 *)b)->first, 16);
+}
+
+static int contains4(uint32_t addr)
+{
+	int low = 0, high = g_num_ranges4 - 1, mid;
+
+	// the last range starting at or before addr.
+	while(low <= high)
+	{
+		mid = low + (high - low) / 2;
+		if(g_ranges4[mid].first <= addr)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid - 1;
+		}
+	}
+
+	return high >= 0 && addr <= g_ranges4[high].last;
+}
+
+static int contains6(const uint8_t *addr)
+{
+	int low = 0, high = g_num_ranges6 - 1, mid;
+
+	while(low <= high)
+	{
+		mid = low + (high - low) / 2;
+		if(memcmp(g_ranges6[mid].first, addr, 16) <= 0)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid - 1;
+		}
+	}
+
+	return high >= 0 && memcmp(addr, g_ranges6[high].last, 16) <= 0;
+}
+
+static char *trim(char *str)
+{
+	char *end;
+
+	while(*str == ' ' || *str == '\t')
+	{
+		str++;
+	}
+	end = str + strlen(str);
+	while(end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n'))
+	{
+		*--end = '\0';
+	}
+
+	return str;
+}
@@ -0,0 +1,128 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<time.h>
+#include<unistd.h>
+#include<arpa/inet.h>
+
+#include "blocklist.h"
+#include "bf_logger.h"
+
+/*
+blocklist_bench measures how fast the blocklist (see blocklist.h) loads and answers lookups.
+
+It writes a list of random IPv4 ranges, half CIDR and half first-last, loads it and looks up random
+addresses in text form, as peer_pool_add() gets them. For comparison a few of the lookups are also
+done by going through all the ranges one by one.
+
+	blocklist_bench [number-of-ranges [number-of-lookups]]
+*/
+
+#define DEFAULT_RANGES 300000
+#define DEFAULT_LOOKUPS 2000000
+#define LINEAR_LOOKUPS 2000
+#define LOG_FILE "logs/blocklist_bench.log"
+
+static double now_s()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t random_addr()
+{
+	return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+int main(int argc, char *argv[])
+{
+	int num_of_ranges = argc > 1 ? atoi(argv[1]) : DEFAULT_RANGES;
+	int num_of_lookups = argc > 2 ? atoi(argv[2]) : DEFAULT_LOOKUPS;
+	char path[] = "/tmp/blocklist_bench.XXXXXX";
+	char (*ips)[INET_ADDRSTRLEN];
+	uint32_t *firsts, *lasts;
+	struct in_addr addr;
+	double start, elapsed;
+	FILE *fp;
+	int i, j, fd, bits, hits;
+
+	if(num_of_ranges < 1 || num_of_lookups < 1)
+	{
+		printf("Usage: blocklist_bench [number-of-ranges [number-of-lookups]]\n");
+		return 1;
+	}
+	bf_logger_init(LOG_FILE);
+	bf_logger_echo(0);
+	srand(1);
+
+	// the ranges are kept for the linear lookups.
+	firsts = malloc(sizeof(uint32_t) * num_of_ranges);
+	lasts = malloc(sizeof(uint32_t) * num_of_ranges);
+	if((fd = mkstemp(path)) == -1 || (fp = fdopen(fd, "w")) == NULL)
+	{
+		printf("Failed to create %s.\n", path);
+		return 1;
+	}
+	for(i = 0; i < num_of_ranges; i++)
+	{
+		bits = 16 + rand() % 17;
+		firsts[i] = random_addr() & (0xFFFFFFFF << (32 - bits));
+		lasts[i] = firsts[i] | ~(0xFFFFFFFF << (32 - bits));
+		addr.s_addr = htonl(firsts[i]);
+		if(i % 2)
+		{
+			fprintf(fp, "%s/%d\n", inet_ntoa(addr), bits);
+		}
+		else
+		{
+			fprintf(fp, "range %d:%s-", i, inet_ntoa(addr));
+			addr.s_addr = htonl(lasts[i]);
+			fprintf(fp, "%s\n", inet_ntoa(addr));
+		}
+	}
+	fclose(fp);
+
+	start = now_s();
+	blocklist_load(path);
+	elapsed = now_s() - start;
+	unlink(path);
+	printf("Loaded %d ranges in %.3f s, %d after merging.\n", num_of_ranges, elapsed, blocklist_size());
+
+	ips = malloc(sizeof(*ips) * num_of_lookups);
+	for(i = 0; i < num_of_lookups; i++)
+	{
+		addr.s_addr = htonl(random_addr());
+		strcpy(ips[i], inet_ntoa(addr));
+	}
+
+	hits = 0;
+	start = now_s();
+	for(i = 0; i < num_of_lookups; i++)
+	{
+		hits += blocklist_contains(ips[i]);
+	}
+	elapsed = now_s() - start;
+	printf("Binary search: %d lookups in %.3f s, %.0f lookups/s, %d blocked.\n", num_of_lookups, elapsed, num_of_lookups / elapsed, hits);
+
+	hits = 0;
+	start = now_s();
+	for(i = 0; i < LINEAR_LOOKUPS && i < num_of_lookups; i++)
+	{
+		inet_pton(AF_INET, ips[i], &addr);
+		for(j = 0; j < num_of_ranges && (ntohl(addr.s_addr) < firsts[j] || ntohl(addr.s_addr) > lasts[j]); j++);
+		hits += j < num_of_ranges;
+	}
+	elapsed = now_s() - start;
+	printf("Linear scan:   %d lookups in %.3f s, %.0f lookups/s, %d blocked.\n", i, elapsed, i / elapsed, hits);
+
+	blocklist_free();
+	free(ips);
+	free(firsts);
+	free(lasts);
+	bf_logger_end();
+
+	return 0;
+}
@@ -0,0 +1,139 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+
+#include "choker.h"
+
+#include "pwp.h"
+#include "bf_logger.h"
+
+static int compare_rates(const void *a, const void *b)
+{
+	long int ra = (*(struct pwp_peer **)a)->choker_rate;
+	long int rb = (*(struct pwp_peer **)b)->choker_rate;
+
+	if(ra == rb)
+	{
+		return 0;
+	}
+	return ra > rb ? -1 : 1; // descending
+}
+
+void choker_init(struct choker *c)
+{
+	c->round = 0;
+}
+
+int choker_has_free_slot(struct pwp_peer_node *peers)
+{
+	int unchoked = 0;
+
+	for(; peers; peers = peers->next)
+	{
+		if(!peers->peer->am_choking)
+		{
+			unchoked++;
+		}
+	}
+
+	return unchoked < CHOKER_UPLOAD_SLOTS;
+}
+
+void choker_run(struct choker *c, struct pwp_peer_node *peers, int seeding)
+{
+	bf_log("++++++++++++++++++++ START:  CHOKER_RUN +++++++++++++++++++++++\n");
+	struct pwp_peer_node *curr;
+	struct pwp_peer **candidates = NULL;
+	struct pwp_peer *peer;
+	int num_of_peers, num_of_candidates, i, regular_slots;
+	long int downloaded, uploaded;
+
+	num_of_peers = 0;
+	for(curr = peers; curr; curr = curr->next)
+	{
+		num_of_peers++;
+	}
+	if(num_of_peers == 0)
+	{
+		goto cleanup;
+	}
+	candidates = malloc(num_of_peers * sizeof(struct pwp_peer *));
+
+	// 1. update the rates over the last round and collect the interested peers.
+	num_of_candidates = 0;
+	for(curr = peers; curr; curr = curr->next)
+	{
+		peer = curr->peer;
+		downloaded = peer->downloaded;
+		uploaded = peer->uploaded;
+		peer->download_rate = (downloaded - peer->choker_downloaded) * 1000 / CHOKER_INTERVAL_MS;
+		peer->upload_rate = (uploaded - peer->choker_uploaded) * 1000 / CHOKER_INTERVAL_MS;
+		peer->choker_downloaded = downloaded;
+		peer->choker_uploaded = uploaded;
+		peer->choker_rate = seeding ? peer->upload_rate : peer->download_rate;
+		peer->choker_unchoke = 0;
+
+		if(peer->interested)
+		{
+			candidates[num_of_candidates++] = peer;
+		}
+	}
+
+	// 2. the best peers get the regular slots.
+	qsort(candidates, num_of_candidates, sizeof(struct pwp_peer *), compare_rates);
+	regular_slots = CHOKER_UPLOAD_SLOTS - 1;
+	for(i = 0; i < num_of_candidates && i < regular_slots; i++)
+	{
+		candidates[i]->choker_unchoke = 1;
+	}
+
+	// 3. rotate the optimistic unchoke every few rounds, or if the current one is gone or won a regular slot.
+	peer = NULL;
+	for(curr = peers; curr; curr = curr->next)
+	{
+		if(curr->peer->optimistic_unchoke)
+		{
+			peer = curr->peer;
+		}
+	}
+	if(peer && (c->round % CHOKER_OPTIMISTIC_ROUNDS == 0 || !peer->interested || peer->choker_unchoke))
+	{
+		peer->optimistic_unchoke = 0;
+		peer = NULL;
+	}
+	if(!peer && num_of_candidates > regular_slots)
+	{
+		peer = candidates[regular_slots + rand() % (num_of_candidates - regular_slots)];
+		peer->optimistic_unchoke = 1;
+		bf_log("[LOG] choker_run(): New optimistic unchoke.\n");
+	}
+	if(peer)
+	{
+		peer->choker_unchoke = 1;
+	}
+
+	// 4. apply the decisions.
+	for(curr = peers; curr; curr = curr->next)
+	{
+		peer = curr->peer;
+		if(peer->choker_unchoke && peer->am_choking)
+		{
+			set_choking(peer, 0);
+		}
+		else if(!peer->choker_unchoke && !peer->am_choking)
+		{
+			set_choking(peer, 1);
+		}
+	}
+
+	bf_log("[LOG] choker_run(): Round %d done (%s). %d peers, %d interested.\n", c->round, seeding ? "seeding" : "leeching", num_of_peers, num_of_candidates);
+
+cleanup:
+	c->round++;
+	if(candidates)
+	{
+		free(candidates);
+	}
+	bf_log("---------------------------------------- FINISH:  CHOKER_RUN ----------------------------------------\n");
+}
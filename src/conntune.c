@@ -0,0 +1,156 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<pthread.h>
+
+#include "conntune.h"
+
+#include "pwp.h"
+#include "ratelimit.h"
+#include "bf_logger.h"
+
+static int g_conntune_fixed = 0;
+
+void conntune_init(struct conntune *ct)
+{
+	memset(ct, 0, sizeof(struct conntune));
+	ct->limit = g_conntune_fixed ? g_conntune_fixed : MAX_THREADS;
+	ct->fixed = g_conntune_fixed != 0;
+	// the first measurement covers connecting to the first peers and is only a baseline.
+	ct->holds = 1;
+	pthread_mutex_init(&ct->mutex, NULL);
+}
+
+void conntune_destroy(struct conntune *ct)
+{
+	pthread_mutex_destroy(&ct->mutex);
+}
+
+void conntune_set_fixed(int limit)
+{
+	g_conntune_fixed = limit < 0 ? 0 : (limit > CONNTUNE_MAX_LIMIT ? CONNTUNE_MAX_LIMIT : limit);
+}
+
+void conntune_update(struct pwp_torrent *t, long int elapsed_ms)
+{
+	struct conntune *ct = &t->tune;
+	uint64_t total;
+	long int rate, rate_per_thread;
+	int threads = t->num_of_threads;
+	int limit = ct->limit, settling = 0;
+	const char *reason;
+
+	ct->elapsed_ms += elapsed_ms;
+	if(ct->elapsed_ms < CONNTUNE_INTERVAL_MS)
+	{
+		return;
+	}
+	total = ratelimit_get_used(&t->download_bucket);
+	rate = (long int)((total - ct->downloaded) * 1000 / ct->elapsed_ms);
+	rate_per_thread = threads > 0 ? rate / threads : 0;
+	ct->downloaded = total;
+	ct->elapsed_ms = 0;
+
+	if(ct->fixed)
+	{
+		reason = "fixed";
+	}
+	else if(rate == 0)
+	{
+		// seeding, or no peer has anything for us. more connections won't tell us anything.
+		reason = "nothing downloaded";
+	}
+	else if(ct->last_rate_per_thread > 0 && rate_per_thread * 100 < ct->last_rate_per_thread * CONNTUNE_COLLAPSE_PERCENT
+		&& rate <= ct->last_rate)
+	{
+		reason = "rate per thread collapsed";
+		limit -= limit / 4 > 1 ? limit / 4 : 1;
+		ct->holds = CONNTUNE_HOLD_INTERVALS;
+	}
+	else if(ct->settling > 0)
+	{
+		// a new thread takes a while to connect and get going, so the step is judged after that.
+		reason = "settling";
+		ct->settling--;
+		settling = 1;
+	}
+	else if(ct->last_step == 1 && rate * 100 >= ct->step_rate * (100 + CONNTUNE_GAIN_PERCENT))
+	{
+		reason = "rate still rising";
+		limit++;
+	}
+	else if(ct->last_step == 1)
+	{
+		reason = "rate levelled off";
+		limit--;
+		ct->holds = CONNTUNE_HOLD_INTERVALS;
+	}
+	else if(threads < ct->limit * t->share.weight)
+	{
+		// the limit isn't what holds the torrent back.
+		reason = "fewer peers than the limit";
+	}
+	else if(ct->holds > 0)
+	{
+		reason = "holding";
+		ct->holds--;
+	}
+	else
+	{
+		reason = "probing";
+		limit++;
+	}
+
+	if(limit < CONNTUNE_MIN_LIMIT)
+	{
+		limit = CONNTUNE_MIN_LIMIT;
+	}
+	if(limit > CONNTUNE_MAX_LIMIT)
+	{
+		limit = CONNTUNE_MAX_LIMIT;
+	}
+	if(limit > ct->limit)
+	{
+		ct->last_step = 1;
+		ct->step_rate = rate;
+		ct->settling = CONNTUNE_SETTLE_INTERVALS;
+	}
+	else if(!settling)
+	{
+		ct->last_step = 0;
+	}
+	bf_log("[LOG] conntune_update(): %s: %ld B/s with %d threads, %ld B/s each: %s, limit %d -> %d per unit of weight.\n",
+		t->saved_filepath, rate, threads, rate_per_thread, reason, ct->limit, limit);
+	ct->limit = limit;
+	ct->last_rate = rate;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&ct->mutex);
+
+	// threads don't end when the limit goes down, so the slower ones over it are asked to leave.
+	ct->last_rate_per_thread = rate_per_thread;
+	ct->excess = threads > limit * t->share.weight ? threads - limit * t->share.weight : 0;
+
+	pthread_mutex_unlock(&ct->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+int conntune_should_leave(struct conntune *ct, long int download_rate)
+{
+	int rv = 0;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&ct->mutex);
+
+	if(ct->excess > 0 && download_rate <= ct->last_rate_per_thread)
+	{
+		ct->excess--;
+		rv = 1;
+	}
+
+	pthread_mutex_unlock(&ct->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return rv;
+}
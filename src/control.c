@@ -0,0 +1,661 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<stdarg.h>
+#include<stdint.h>
+#include<unistd.h>
+#include<poll.h>
+#include<pthread.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<sys/time.h>
+#include<sys/un.h>
+
+#include "control.h"
+
+#include "pwp.h"
+#include "peer_pool.h"
+#include "session.h"
+#include "fairshare.h"
+#include "ratelimit.h"
+#include "socktune.h"
+#include "util.h"
+#include "bf_logger.h"
+
+#define CONTROL_POLL_MS 1000
+#define CONTROL_RECV_TIMEOUT_S 5 // a client that doesn't send its command by then is dropped
+
+// a torrent that was added but isn't in the session yet.
+struct control_add
+{
+	uint8_t info_hash[20];
+	char *arg; // what was given to add
+	struct control_add *next;
+};
+
+static int g_control_fd = -1;
+static char g_control_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static control_hash_callback g_control_hash;
+static control_add_callback g_control_add;
+static pthread_t g_control_thread;
+static volatile int g_control_stop = 0;
+static int g_control_started = 0;
+
+// the adds waiting for the add thread, oldest first, and the one it is preparing.
+static struct control_add *g_control_adds = NULL;
+static struct control_add *g_control_preparing = NULL;
+static pthread_mutex_t g_control_adds_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_control_adds_cond = PTHREAD_COND_INITIALIZER;
+
+static void *control_thread(void *arg);
+static void *add_thread(void *arg);
+static void serve_client(int fd);
+static void run_command(int fd, char *line);
+static void list_adds(int fd);
+static void reply_sockets(int fd, struct pwp_torrent *t);
+static int queue_add(int fd, char *arg, char *hex);
+static int in_session(const uint8_t *info_hash);
+static void reply(int fd, const char *format, ...);
+static struct pwp_torrent *find_torrent(int fd, const char *id);
+static void hex_hash(const uint8_t *info_hash, char *hex);
+static char *torrent_name(struct pwp_torrent *t);
+static const char *state_name(int state);
+
+int control_start(const char *path, control_hash_callback hash, control_add_callback add)
+{
+	struct sockaddr_un addr;
+	pthread_t thread;
+	int fd;
+
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		bf_log("[ERROR] control_start(): The path of the control socket is too long.\n");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	{
+		bf_log("[ERROR] control_start(): Failed to create the control socket.\n");
+		return -1;
+	}
+	// a socket file left behind by a daemon that died is taken over, one that is served isn't.
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+	{
+		bf_log("[ERROR] control_start(): Another daemon is listening on %s.\n", path);
+		close(fd);
+		return -1;
+	}
+	unlink(path);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 8) == -1)
+	{
+		bf_log("[ERROR] control_start(): Failed to listen on %s.\n", path);
+		close(fd);
+		return -1;
+	}
+
+	g_control_fd = fd;
+	strcpy(g_control_path, path);
+	g_control_hash = hash;
+	g_control_add = add;
+	g_control_stop = 0;
+	if(pthread_create(&g_control_thread, NULL, control_thread, NULL) != 0)
+	{
+		bf_log("[ERROR] control_start(): Failed to start the control thread.\n");
+		control_stop();
+		return -1;
+	}
+	g_control_started = 1;
+	// the add thread isn't waited for when the daemon stops, as it may be fetching the metadata of a
+	// magnet link. it drops what it prepared once it sees g_control_stop.
+	if(pthread_create(&thread, NULL, add_thread, NULL) != 0)
+	{
+		bf_log("[ERROR] control_start(): Failed to start the add thread.\n");
+		control_stop();
+		return -1;
+	}
+	pthread_detach(thread);
+	bf_log("[LOG] control_start(): Listening for commands on %s.\n", path);
+
+	return 0;
+}
+
+void control_stop()
+{
+	struct control_add *add;
+
+	if(g_control_started)
+	{
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_control_adds_mutex);
+		// nothing is added to the session once this is set, as session_stop() follows.
+		g_control_stop = 1;
+		while((add = g_control_adds) != NULL)
+		{
+			g_control_adds = add->next;
+			free(add->arg);
+			free(add);
+		}
+		pthread_cond_broadcast(&g_control_adds_cond);
+		pthread_mutex_unlock(&g_control_adds_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+		pthread_join(g_control_thread, NULL);
+		g_control_started = 0;
+	}
+	if(g_control_fd != -1)
+	{
+		close(g_control_fd);
+		g_control_fd = -1;
+		unlink(g_control_path);
+	}
+}
+
+static void *control_thread(void *arg)
+{
+	struct pollfd pfd;
+	int fd;
+
+	while(!g_control_stop)
+	{
+		pfd.fd = g_control_fd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, CONTROL_POLL_MS) <= 0)
+		{
+			continue;
+		}
+		if((fd = accept(g_control_fd, NULL, NULL)) == -1)
+		{
+			continue;
+		}
+		serve_client(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+// prepares the adds one after the other and puts them into the session. magnet links can't be
+// fetched side by side anyway, as there is only one set of magnet metadata (magnet.h).
+static void *add_thread(void *arg)
+{
+	struct control_add *add;
+	struct pwp_torrent *t;
+	char hex[41];
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_control_adds_mutex);
+	while(!g_control_stop)
+	{
+		if((add = g_control_adds) == NULL)
+		{
+			pthread_cond_wait(&g_control_adds_cond, &g_control_adds_mutex);
+			continue;
+		}
+		g_control_adds = add->next;
+		g_control_preparing = add;
+		pthread_mutex_unlock(&g_control_adds_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		t = g_control_add(add->arg);
+
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_control_adds_mutex);
+		g_control_preparing = NULL;
+		if(t == NULL)
+		{
+			bf_log("[ERROR] control: Failed to prepare %s. It wasn't added.\n", add->arg);
+		}
+		else if(g_control_stop || in_session(t->info_hash))
+		{
+			// the data folder of its name may have held another torrent, which is the one prepared.
+			pwp_torrent_destroy(t);
+		}
+		else
+		{
+			hex_hash(t->info_hash, hex);
+			session_add_torrent(t);
+			bf_log("[LOG] control: Added %s to the session.\n", hex);
+		}
+		free(add->arg);
+		free(add);
+	}
+	pthread_mutex_unlock(&g_control_adds_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return NULL;
+}
+
+// reads one command line from the client and runs it.
+static void serve_client(int fd)
+{
+	char line[CONTROL_MAX_LINE];
+	struct timeval tv;
+	int len = 0, n;
+	char *end;
+
+	tv.tv_sec = CONTROL_RECV_TIMEOUT_S;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	// a client that shuts down its side after the command needn't end it with a newline.
+	line[0] = '\0';
+	while(len < CONTROL_MAX_LINE - 1 && strchr(line, '\n') == NULL)
+	{
+		if((n = recv(fd, line + len, CONTROL_MAX_LINE - 1 - len, 0)) <= 0)
+		{
+			break;
+		}
+		len += n;
+		line[len] = '\0';
+	}
+	if((end = strpbrk(line, "\r\n")) != NULL)
+	{
+		*end = '\0';
+	}
+
+	bf_log("[LOG] control: Command: %s\n", line);
+	run_command(fd, line);
+}
+
+static void run_command(int fd, char *line)
+{
+	struct pwp_torrent **torrents, *t;
+	char *command, *id, *arg, *rest, *name;
+	char hex[41];
+	int i, n, state, threads, weight, priority;
+	long int download_rate, upload_rate;
+
+	command = strtok_r(line, " \t", &rest);
+	if(command == NULL)
+	{
+		reply(fd, "ERROR no command\n");
+		return;
+	}
+
+	if(strcmp(command, "list") == 0)
+	{
+		n = session_list_torrents(&torrents);
+		for(i = 0; i < n; i++)
+		{
+			t = torrents[i];
+			state = session_torrent_state(t, &threads);
+			hex_hash(t->info_hash, hex);
+			name = torrent_name(t);
+			reply(fd, "%s %s %ld/%ld %ld %ld %d %d %d %d %s\n", hex, state_name(state), t->downloaded_pieces, t->num_of_pieces,
+				t->share.download_rate, t->share.upload_rate, num_of_connected_peers(t), threads,
+				t->share.weight, t->share.priority, name);
+			free(name);
+			session_release_torrent(t);
+		}
+		free(torrents);
+		list_adds(fd);
+		reply(fd, "OK\n");
+	}
+	else if(strcmp(command, "add") == 0)
+	{
+		// the rest of the line, as a path may have spaces in it.
+		while(*rest == ' ' || *rest == '\t')
+		{
+			rest++;
+		}
+		if(*rest == '\0')
+		{
+			reply(fd, "ERROR add needs a torrent file or magnet link\n");
+			return;
+		}
+		if(queue_add(fd, rest, hex) == 0)
+		{
+			reply(fd, "%s\nOK\n", hex);
+		}
+	}
+	else if(strcmp(command, "shutdown") == 0)
+	{
+		session_shutdown();
+		reply(fd, "OK\n");
+	}
+	else if(strcmp(command, "limit") == 0 && (id = strtok_r(NULL, " \t", &rest)) != NULL && strcmp(id, "global") == 0)
+	{
+		// KiB/s, as --download-rate and --upload-rate take. the torrents' shares follow at the next rebalance.
+		if(sscanf(rest, "%ld %ld", &download_rate, &upload_rate) != 2 || download_rate < 0 || upload_rate < 0)
+		{
+			reply(fd, "ERROR limit needs a download and an upload rate in KiB/s, 0 for none\n");
+			return;
+		}
+		ratelimit_set_rate(&g_global_download_bucket, download_rate * 1024);
+		ratelimit_set_rate(&g_global_upload_bucket, upload_rate * 1024);
+		reply(fd, "OK\n");
+	}
+	else if(strcmp(command, "remove") == 0 || strcmp(command, "pause") == 0 || strcmp(command, "resume") == 0
+		|| strcmp(command, "share") == 0 || strcmp(command, "priority") == 0 || strcmp(command, "stats") == 0
+		|| strcmp(command, "limit") == 0)
+	{
+		// limit has taken its id already, as it may have been global.
+		if(strcmp(command, "limit") != 0)
+		{
+			id = strtok_r(NULL, " \t", &rest);
+		}
+		if(id == NULL)
+		{
+			reply(fd, "ERROR %s needs the info hash of a torrent\n", command);
+			return;
+		}
+		if((t = find_torrent(fd, id)) == NULL)
+		{
+			return;
+		}
+		state = session_torrent_state(t, &threads);
+
+		if(strcmp(command, "remove") == 0)
+		{
+			// the session waits for every user of the torrent, including us.
+			session_release_torrent(t);
+			session_remove_torrent(t);
+			pwp_torrent_destroy(t);
+			reply(fd, "OK\n");
+		}
+		else if(strcmp(command, "pause") == 0)
+		{
+			session_release_torrent(t);
+			if(state != SESSION_TORRENT_PAUSED)
+			{
+				session_pause_torrent(t);
+			}
+			reply(fd, "OK\n");
+		}
+		else if(strcmp(command, "resume") == 0)
+		{
+			if(state == SESSION_TORRENT_PAUSED)
+			{
+				session_resume_torrent(t);
+			}
+			session_release_torrent(t);
+			reply(fd, "OK\n");
+		}
+		else if(strcmp(command, "share") == 0)
+		{
+			if(sscanf(rest, "%d %d", &weight, &priority) != 2)
+			{
+				session_release_torrent(t);
+				reply(fd, "ERROR share needs a weight and a priority\n");
+				return;
+			}
+			pwp_set_share(t, weight, priority);
+			session_release_torrent(t);
+			reply(fd, "OK\n");
+		}
+		else if(strcmp(command, "limit") == 0)
+		{
+			if(sscanf(rest, "%ld %ld", &download_rate, &upload_rate) != 2 || download_rate < 0 || upload_rate < 0)
+			{
+				session_release_torrent(t);
+				reply(fd, "ERROR limit needs a download and an upload rate in KiB/s, 0 for none\n");
+				return;
+			}
+			pwp_set_rate_limits(t, download_rate * 1024, upload_rate * 1024);
+			session_release_torrent(t);
+			reply(fd, "OK\n");
+		}
+		else if(strcmp(command, "priority") == 0)
+		{
+			if((arg = strtok_r(NULL, " \t", &rest)) == NULL || t->num_of_pieces == 0 || pwp_parse_piece_priority(t, arg) != 0)
+			{
+				session_release_torrent(t);
+				reply(fd, "ERROR priority needs skip, low, normal or high and the pieces, e.g. high:0-9\n");
+				return;
+			}
+			// a torrent that had all the pieces it wanted goes on with the ones it wants now.
+			if(state == SESSION_TORRENT_FINISHED && !is_wanted_download_complete(t))
+			{
+				session_resume_torrent(t);
+			}
+			session_release_torrent(t);
+			reply(fd, "OK\n");
+		}
+		else
+		{
+			hex_hash(t->info_hash, hex);
+			name = torrent_name(t);
+			reply(fd, "info_hash %s\nname %s\nstate %s\n", hex, name, state_name(state));
+			reply(fd, "pieces %ld\nhave %ld\nlength %ld\n", t->num_of_pieces, t->downloaded_pieces, t->total_length);
+			reply(fd, "downloaded %llu\nuploaded %llu\n", (unsigned long long)ratelimit_get_used(&t->download_bucket),
+				(unsigned long long)ratelimit_get_used(&t->upload_bucket));
+			reply(fd, "download_rate %ld\nupload_rate %ld\n", t->share.download_rate, t->share.upload_rate);
+			reply(fd, "download_limit %ld\nupload_limit %ld\n", t->share.download_limit, t->share.upload_limit);
+			reply(fd, "download_share %ld\nupload_share %ld\n", t->share.download_share, t->share.upload_share);
+			reply(fd, "weight %d\npriority %d\n", t->share.weight, t->share.priority);
+			reply(fd, "peers %d\nthreads %d\nuntried_peers %d\n", num_of_connected_peers(t), threads, peer_pool_untried(&t->peer_pool));
+			reply(fd, "web_seeds %d\n", t->num_of_web_seeds);
+			reply_sockets(fd, t);
+			free(name);
+			session_release_torrent(t);
+			reply(fd, "OK\n");
+		}
+	}
+	else
+	{
+		reply(fd, "ERROR unknown command %s\n", command);
+	}
+}
+
+// the adds not in the session yet, as list lines of a torrent without pieces or peers.
+static void list_adds(int fd)
+{
+	struct control_add *add;
+	char hex[41];
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_control_adds_mutex);
+	if(g_control_preparing)
+	{
+		hex_hash(g_control_preparing->info_hash, hex);
+		reply(fd, "%s preparing 0/0 0 0 0 0 0 0 %s\n", hex, g_control_preparing->arg);
+	}
+	for(add = g_control_adds; add; add = add->next)
+	{
+		hex_hash(add->info_hash, hex);
+		reply(fd, "%s preparing 0/0 0 0 0 0 0 0 %s\n", hex, add->arg);
+	}
+	pthread_mutex_unlock(&g_control_adds_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+// one "socket" line per TCP peer with socktune_describe_peer(). the lines are put together first,
+// so the peers list isn't held while a slow client reads them.
+static void reply_sockets(int fd, struct pwp_torrent *t)
+{
+	struct pwp_peer_node *node;
+	char line[256];
+	char *lines = NULL;
+	int len = 0, n;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->connected_peers_mutex);
+
+	for(node = t->connected_peers; node; node = node->next)
+	{
+		if(socktune_describe_peer(node->peer, line, sizeof(line)) != 0)
+		{
+			continue;
+		}
+		n = strlen(line);
+		lines = realloc(lines, len + 7 + n + 2);
+		len += sprintf(lines + len, "socket %s\n", line);
+	}
+
+	pthread_mutex_unlock(&t->connected_peers_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	// sent as they are, as reply() takes no more than a line's worth.
+	if(lines)
+	{
+		send(fd, lines, len, MSG_NOSIGNAL);
+		free(lines);
+	}
+}
+
+// hands arg to the add thread, unless its torrent is in the session or being added already. hex
+// gets its info hash. returns -1 after replying with the error.
+static int queue_add(int fd, char *arg, char *hex)
+{
+	struct control_add *add, **tail;
+	uint8_t info_hash[20];
+	int rv = 0;
+
+	if(g_control_hash(arg, info_hash) != 0)
+	{
+		reply(fd, "ERROR failed to add %s\n", arg);
+		return -1;
+	}
+	hex_hash(info_hash, hex);
+	if(in_session(info_hash))
+	{
+		reply(fd, "ERROR %s is in the session already\n", hex);
+		return -1;
+	}
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_control_adds_mutex);
+	if(g_control_preparing && memcmp(g_control_preparing->info_hash, info_hash, 20) == 0)
+	{
+		rv = -1;
+		goto cleanup;
+	}
+	for(tail = &g_control_adds; *tail; tail = &(*tail)->next)
+	{
+		if(memcmp((*tail)->info_hash, info_hash, 20) == 0)
+		{
+			rv = -1;
+			goto cleanup;
+		}
+	}
+	add = calloc(1, sizeof(struct control_add));
+	memcpy(add->info_hash, info_hash, 20);
+	add->arg = strdup(arg);
+	*tail = add;
+	pthread_cond_signal(&g_control_adds_cond);
+
+cleanup:
+	pthread_mutex_unlock(&g_control_adds_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+	if(rv != 0)
+	{
+		reply(fd, "ERROR %s is being added already\n", hex);
+	}
+
+	return rv;
+}
+
+// 1 if a torrent with this info hash is in the session.
+static int in_session(const uint8_t *info_hash)
+{
+	struct pwp_torrent **torrents;
+	int i, n, found = 0;
+
+	n = session_list_torrents(&torrents);
+	for(i = 0; i < n; i++)
+	{
+		if(memcmp(torrents[i]->info_hash, info_hash, 20) == 0)
+		{
+			found = 1;
+		}
+		session_release_torrent(torrents[i]);
+	}
+	free(torrents);
+
+	return found;
+}
+
+static void reply(int fd, const char *format, ...)
+{
+	char buf[CONTROL_MAX_LINE];
+	va_list ap;
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	if(len >= (int)sizeof(buf))
+	{
+		len = sizeof(buf) - 1;
+	}
+	// a client that went away just misses the reply.
+	send(fd, buf, len, MSG_NOSIGNAL);
+}
+
+// returns the torrent whose info hash starts with id, held with session_release_torrent(). replies
+// with the error and returns NULL if there is no such torrent or more than one.
+static struct pwp_torrent *find_torrent(int fd, const char *id)
+{
+	struct pwp_torrent **torrents, *t = NULL;
+	char hex[41];
+	int i, n, matches = 0;
+	int len = strlen(id);
+
+	n = session_list_torrents(&torrents);
+	for(i = 0; i < n; i++)
+	{
+		hex_hash(torrents[i]->info_hash, hex);
+		if(len <= 40 && strncasecmp(hex, id, len) == 0)
+		{
+			matches++;
+			if(t == NULL)
+			{
+				t = torrents[i];
+				continue;
+			}
+		}
+		session_release_torrent(torrents[i]);
+	}
+	free(torrents);
+
+	if(matches == 1)
+	{
+		return t;
+	}
+	if(t)
+	{
+		session_release_torrent(t);
+	}
+	reply(fd, matches == 0 ? "ERROR no torrent %s\n" : "ERROR %s matches more than one torrent\n", id);
+
+	return NULL;
+}
+
+static void hex_hash(const uint8_t *info_hash, char *hex)
+{
+	int i;
+
+	for(i = 0; i < 20; i++)
+	{
+		snprintf(hex + 2 * i, 3, "%02x", info_hash[i]);
+	}
+}
+
+// the name of the torrent's data folder, which is that of its saved file without ".saved".
+static char *torrent_name(struct pwp_torrent *t)
+{
+	char *name = NULL;
+
+	if(t->saved_filepath)
+	{
+		name = util_extract_filename(t->saved_filepath);
+	}
+
+	return name ? name : strdup("-");
+}
+
+static const char *state_name(int state)
+{
+	switch(state)
+	{
+		case SESSION_TORRENT_PAUSED:
+			return "paused";
+		case SESSION_TORRENT_FINISHED:
+			return "finished";
+		default:
+			return "active";
+	}
+}
@@ -0,0 +1,1427 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<errno.h>
+#include<time.h>
+#include<unistd.h>
+#include<poll.h>
+#include<pthread.h>
+#include<netdb.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+
+#include "dht.h"
+
+#include "pwp.h"
+#include "peer_pool.h"
+#include "session.h"
+#include "bencode.h"
+#include "sha1.h"
+#include "util.h"
+#include "bf_logger.h"
+
+#define DHT_MAX_MSG_LEN 1500
+#define DHT_MAX_QUERIES 64 // outstanding queries
+#define DHT_MAX_BOOTSTRAP 8
+#define DHT_MAX_CACHED_NODES 200
+#define DHT_POLL_MS 100
+#define DHT_TOKEN_LEN 8 // tokens we hand out
+#define DHT_MAX_TOKEN_LEN 32 // tokens we accept from others
+#define DHT_COMPACT_NODE_LEN 26 // 20 byte id, 4 byte IPv4 address and 2 byte port
+#define DHT_SEARCH_RETRY_MS 30000 // when a search found no nodes at all
+#define DHT_SEARCH_GIVE_UP_MS 10000 // how long a search waits for its first nodes
+
+#define QUERY_PING 0
+#define QUERY_FIND_NODE 1
+#define QUERY_GET_PEERS 2
+#define QUERY_ANNOUNCE_PEER 3
+
+#define SEARCH_NODE_NEW 0
+#define SEARCH_NODE_PENDING 1
+#define SEARCH_NODE_REPLIED 2
+#define SEARCH_NODE_FAILED 3
+
+struct dht_node
+{
+	uint8_t id[20];
+	struct sockaddr_in addr;
+	int failures; // queries in a row that it didn't answer
+};
+
+// nodes whose id shares exactly i leading bits with ours are in bucket i.
+struct dht_bucket
+{
+	struct dht_node nodes[DHT_K];
+	int count;
+};
+
+struct dht_search_node
+{
+	uint8_t id[20];
+	struct sockaddr_in addr;
+	int state; // one of the SEARCH_NODE values
+	uint8_t token[DHT_MAX_TOKEN_LEN];
+	int token_len;
+};
+
+struct dht_search
+{
+	int used; // peer searches: 1 while the torrent is in the session
+	int first_done; // peer searches: 1 once the first round has finished
+	int active;
+	int type; // QUERY_FIND_NODE or QUERY_GET_PEERS
+	uint8_t target[20];
+	struct dht_search_node nodes[DHT_SEARCH_NODES]; // closest first
+	int count;
+	uint64_t started_ms;
+	uint64_t next_ms; // when the next round starts if not active
+};
+
+struct dht_query
+{
+	int used;
+	uint16_t tid;
+	int type;
+	struct sockaddr_in addr;
+	struct dht_search *search; // NULL if the query isn't part of a search
+	uint64_t sent_ms;
+};
+
+struct dht_stored_torrent
+{
+	uint8_t info_hash[20];
+	uint8_t peers[DHT_MAX_STORED_PEERS][6]; // compact IPv4 address and port
+	int count;
+	int next; // slot replaced next once full
+};
+
+struct dht_msg_buf
+{
+	uint8_t data[DHT_MAX_MSG_LEN];
+	int len;
+};
+
+// what we need out of a KRPC message. strings point into the received packet.
+struct krpc_msg
+{
+	char y;
+	const char *t;
+	int t_len;
+	const char *q;
+	int q_len;
+	const char *id;
+	const char *target;
+	const char *info_hash;
+	const char *token;
+	int token_len;
+	long int port;
+	long int implied_port;
+	const char *nodes;
+	int nodes_len;
+	bencode_t values;
+	int has_values;
+};
+
+static int g_dht_fd = -1;
+static uint8_t g_dht_id[20];
+static uint16_t g_dht_peer_port;
+static struct dht_bucket g_dht_buckets[160];
+static struct dht_query g_dht_queries[DHT_MAX_QUERIES];
+static uint16_t g_dht_next_tid = 0;
+static struct dht_search g_dht_node_search; // find_node for our own id: fills the routing table
+static struct dht_search g_dht_peer_searches[DHT_MAX_SEARCHES]; // get_peers for the torrents of the session
+static struct dht_stored_torrent g_dht_torrents[DHT_MAX_STORED_TORRENTS];
+static int g_dht_num_of_torrents = 0;
+static uint8_t g_dht_secrets[2][8]; // current and previous secret for tokens
+static uint64_t g_dht_secret_ms;
+static char *g_dht_bootstrap_hosts[DHT_MAX_BOOTSTRAP];
+static uint16_t g_dht_bootstrap_ports[DHT_MAX_BOOTSTRAP];
+static int g_dht_num_of_bootstrap = 0;
+static pthread_mutex_t g_dht_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t g_dht_thread;
+static volatile int g_dht_stop = 0;
+static int g_dht_started = 0;
+
+static void *dht_thread(void *arg);
+static void process_packet(char *buf, int len, struct sockaddr_in *from);
+
+static uint64_t monotonic_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void random_bytes(uint8_t *buf, int len)
+{
+	int i;
+
+	for(i = 0; i < len; i++)
+	{
+		buf[i] = rand() & 0xff;
+	}
+}
+
+static int common_prefix_len(const uint8_t *a, const uint8_t *b)
+{
+	int i, j;
+	uint8_t x;
+
+	for(i = 0; i < 20; i++)
+	{
+		if((x = a[i] ^ b[i]) != 0)
+		{
+			for(j = 0; !(x & (0x80 >> j)); j++);
+			return i * 8 + j;
+		}
+	}
+
+	return 160;
+}
+
+// < 0 if a is closer to target than b, > 0 if b is closer.
+static int compare_distance(const uint8_t *a, const uint8_t *b, const uint8_t *target)
+{
+	int i;
+	uint8_t da, db;
+
+	for(i = 0; i < 20; i++)
+	{
+		da = a[i] ^ target[i];
+		db = b[i] ^ target[i];
+		if(da != db)
+		{
+			return da < db ? -1 : 1;
+		}
+	}
+
+	return 0;
+}
+
+static int same_addr(struct sockaddr_in *a, struct sockaddr_in *b)
+{
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/*********************** routing table ***********************/
+
+// a node that comes back with a new id (e.g. after a restart without a cache) is only kept under the new one.
+static void routing_forget_old_id(const uint8_t *id, struct sockaddr_in *addr)
+{
+	struct dht_bucket *bucket;
+	int b, i;
+
+	for(b = 0; b < 160; b++)
+	{
+		bucket = &g_dht_buckets[b];
+		for(i = 0; i < bucket->count; i++)
+		{
+			if(same_addr(&bucket->nodes[i].addr, addr) && memcmp(bucket->nodes[i].id, id, 20) != 0)
+			{
+				bucket->nodes[i] = bucket->nodes[--bucket->count];
+				return;
+			}
+		}
+	}
+}
+
+// called for every node that answered a query of ours or sent us one.
+static void routing_update(const uint8_t *id, struct sockaddr_in *addr)
+{
+	struct dht_bucket *bucket;
+	int i, worst = -1;
+	int prefix = common_prefix_len(id, g_dht_id);
+
+	if(prefix == 160)
+	{
+		return;
+	}
+	routing_forget_old_id(id, addr);
+	bucket = &g_dht_buckets[prefix];
+	for(i = 0; i < bucket->count; i++)
+	{
+		if(memcmp(bucket->nodes[i].id, id, 20) == 0)
+		{
+			bucket->nodes[i].addr = *addr;
+			bucket->nodes[i].failures = 0;
+			return;
+		}
+		if(bucket->nodes[i].failures > 0 && (worst == -1 || bucket->nodes[i].failures > bucket->nodes[worst].failures))
+		{
+			worst = i;
+		}
+	}
+	if(bucket->count < DHT_K)
+	{
+		i = bucket->count++;
+	}
+	else if(worst != -1)
+	{
+		// a full bucket only takes new nodes in place of ones that stopped answering.
+		i = worst;
+	}
+	else
+	{
+		return;
+	}
+	memcpy(bucket->nodes[i].id, id, 20);
+	bucket->nodes[i].addr = *addr;
+	bucket->nodes[i].failures = 0;
+}
+
+static void routing_failed(struct sockaddr_in *addr)
+{
+	struct dht_bucket *bucket;
+	int b, i;
+
+	for(b = 0; b < 160; b++)
+	{
+		bucket = &g_dht_buckets[b];
+		for(i = 0; i < bucket->count; i++)
+		{
+			if(!same_addr(&bucket->nodes[i].addr, addr))
+			{
+				continue;
+			}
+			if(++bucket->nodes[i].failures >= DHT_MAX_FAILURES)
+			{
+				bucket->nodes[i] = bucket->nodes[--bucket->count];
+			}
+			return;
+		}
+	}
+}
+
+// copies the (at most max) good nodes closest to target into out, closest first.
+static int routing_closest(const uint8_t *target, struct dht_node *out, int max)
+{
+	struct dht_node *node;
+	int b, i, j, n = 0;
+
+	for(b = 0; b < 160; b++)
+	{
+		for(i = 0; i < g_dht_buckets[b].count; i++)
+		{
+			node = &g_dht_buckets[b].nodes[i];
+			if(node->failures > 0)
+			{
+				continue;
+			}
+			// insertion into the sorted array, dropping the farthest when it is full.
+			for(j = n; j > 0 && compare_distance(node->id, out[j - 1].id, target) < 0; j--)
+			{
+				if(j < max)
+				{
+					out[j] = out[j - 1];
+				}
+			}
+			if(j < max)
+			{
+				out[j] = *node;
+				if(n < max)
+				{
+					n++;
+				}
+			}
+		}
+	}
+
+	return n;
+}
+
+/*********************** composing messages ***********************/
+
+static void put_raw(struct dht_msg_buf *b, const char *s)
+{
+	int len = strlen(s);
+
+	if(b->len + len <= DHT_MAX_MSG_LEN)
+	{
+		memcpy(b->data + b->len, s, len);
+		b->len += len;
+	}
+}
+
+static void put_str(struct dht_msg_buf *b, const void *s, int len)
+{
+	char prefix[16];
+
+	sprintf(prefix, "%d:", len);
+	put_raw(b, prefix);
+	if(b->len + len <= DHT_MAX_MSG_LEN)
+	{
+		memcpy(b->data + b->len, s, len);
+		b->len += len;
+	}
+}
+
+static void put_int(struct dht_msg_buf *b, long int num)
+{
+	char str[24];
+
+	sprintf(str, "i%lde", num);
+	put_raw(b, str);
+}
+
+static void send_msg(struct dht_msg_buf *b, struct sockaddr_in *addr)
+{
+	if(sendto(g_dht_fd, b->data, b->len, 0, (struct sockaddr *)addr, sizeof(*addr)) == -1)
+	{
+		bf_log("[ERROR] dht: sendto() failed: %s\n", strerror(errno));
+	}
+}
+
+static void put_compact_node(struct dht_msg_buf *b, struct dht_node *node)
+{
+	if(b->len + DHT_COMPACT_NODE_LEN <= DHT_MAX_MSG_LEN)
+	{
+		memcpy(b->data + b->len, node->id, 20);
+		memcpy(b->data + b->len + 20, &node->addr.sin_addr.s_addr, 4);
+		memcpy(b->data + b->len + 24, &node->addr.sin_port, 2);
+		b->len += DHT_COMPACT_NODE_LEN;
+	}
+}
+
+// writes the "nodes" key with the compact info of the nodes we know closest to target.
+static void put_closest_nodes(struct dht_msg_buf *b, const uint8_t *target)
+{
+	struct dht_node closest[DHT_K];
+	char prefix[24];
+	int i, n;
+
+	n = routing_closest(target, closest, DHT_K);
+	sprintf(prefix, "5:nodes%d:", n * DHT_COMPACT_NODE_LEN);
+	put_raw(b, prefix);
+	for(i = 0; i < n; i++)
+	{
+		put_compact_node(b, &closest[i]);
+	}
+}
+
+static int send_query(struct sockaddr_in *addr, int type, struct dht_search *search, const uint8_t *target, const uint8_t *token, int token_len)
+{
+	static const char *methods[] = { "ping", "find_node", "get_peers", "announce_peer" };
+	struct dht_msg_buf b;
+	struct dht_query *query = NULL;
+	uint8_t tid[2];
+	int i;
+
+	for(i = 0; i < DHT_MAX_QUERIES; i++)
+	{
+		if(!g_dht_queries[i].used)
+		{
+			query = &g_dht_queries[i];
+			break;
+		}
+	}
+	if(!query)
+	{
+		return -1;
+	}
+	query->used = 1;
+	query->tid = g_dht_next_tid++;
+	query->type = type;
+	query->addr = *addr;
+	query->search = search;
+	query->sent_ms = monotonic_ms();
+	tid[0] = query->tid >> 8;
+	tid[1] = query->tid & 0xff;
+
+	// keys have to be in sorted order.
+	b.len = 0;
+	put_raw(&b, "d1:ad2:id");
+	put_str(&b, g_dht_id, 20);
+	switch(type)
+	{
+		case QUERY_FIND_NODE:
+			put_raw(&b, "6:target");
+			put_str(&b, target, 20);
+			break;
+		case QUERY_GET_PEERS:
+			put_raw(&b, "9:info_hash");
+			put_str(&b, target, 20);
+			break;
+		case QUERY_ANNOUNCE_PEER:
+			put_raw(&b, "12:implied_porti0e9:info_hash");
+			put_str(&b, target, 20);
+			put_raw(&b, "4:port");
+			put_int(&b, g_dht_peer_port);
+			put_raw(&b, "5:token");
+			put_str(&b, token, token_len);
+			break;
+	}
+	put_raw(&b, "e1:q");
+	put_str(&b, methods[type], strlen(methods[type]));
+	put_raw(&b, "1:t");
+	put_str(&b, tid, 2);
+	put_raw(&b, "1:y1:qe");
+	send_msg(&b, addr);
+
+	return 0;
+}
+
+// starts a response to a query: the 'r' dictionary is left open after our id.
+static void start_response(struct dht_msg_buf *b)
+{
+	b->len = 0;
+	put_raw(b, "d1:rd2:id");
+	put_str(b, g_dht_id, 20);
+}
+
+static void finish_response(struct dht_msg_buf *b, struct krpc_msg *m, struct sockaddr_in *addr)
+{
+	put_raw(b, "e1:t");
+	put_str(b, m->t, m->t_len);
+	put_raw(b, "1:y1:re");
+	send_msg(b, addr);
+}
+
+static void send_error(struct krpc_msg *m, struct sockaddr_in *addr, int code, const char *text)
+{
+	struct dht_msg_buf b;
+
+	b.len = 0;
+	put_raw(&b, "d1:el");
+	put_int(&b, code);
+	put_str(&b, text, strlen(text));
+	put_raw(&b, "e1:t");
+	put_str(&b, m->t, m->t_len);
+	put_raw(&b, "1:y1:ee");
+	send_msg(&b, addr);
+}
+
+/*********************** tokens ***********************/
+
+static void make_token(struct sockaddr_in *addr, int secret, uint8_t *token)
+{
+	uint8_t buf[12];
+	uint8_t hash[20];
+
+	memcpy(buf, &addr->sin_addr.s_addr, 4);
+	memcpy(buf + 4, g_dht_secrets[secret], 8);
+	sha1_compute(buf, 12, hash);
+	memcpy(token, hash, DHT_TOKEN_LEN);
+}
+
+static int valid_token(struct sockaddr_in *addr, const char *token, int token_len)
+{
+	uint8_t expected[DHT_TOKEN_LEN];
+	int i;
+
+	if(token_len != DHT_TOKEN_LEN)
+	{
+		return 0;
+	}
+	for(i = 0; i < 2; i++)
+	{
+		make_token(addr, i, expected);
+		if(memcmp(expected, token, DHT_TOKEN_LEN) == 0)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*********************** searches ***********************/
+
+static void search_add(struct dht_search *s, const uint8_t *id, struct sockaddr_in *addr)
+{
+	int i, j;
+
+	if(memcmp(id, g_dht_id, 20) == 0 || addr->sin_port == 0)
+	{
+		return;
+	}
+	for(i = 0; i < s->count; i++)
+	{
+		if(memcmp(s->nodes[i].id, id, 20) == 0 || same_addr(&s->nodes[i].addr, addr))
+		{
+			return;
+		}
+	}
+	for(i = 0; i < s->count && compare_distance(s->nodes[i].id, id, s->target) < 0; i++);
+	if(i == DHT_SEARCH_NODES)
+	{
+		return;
+	}
+	if(s->count < DHT_SEARCH_NODES)
+	{
+		s->count++;
+	}
+	for(j = s->count - 1; j > i; j--)
+	{
+		s->nodes[j] = s->nodes[j - 1];
+	}
+	memcpy(s->nodes[i].id, id, 20);
+	s->nodes[i].addr = *addr;
+	s->nodes[i].state = SEARCH_NODE_NEW;
+	s->nodes[i].token_len = 0;
+}
+
+static void search_seed(struct dht_search *s)
+{
+	struct dht_node closest[DHT_SEARCH_NODES];
+	int i, n;
+
+	n = routing_closest(s->target, closest, DHT_SEARCH_NODES);
+	for(i = 0; i < n; i++)
+	{
+		search_add(s, closest[i].id, &closest[i].addr);
+	}
+}
+
+static void search_start(struct dht_search *s)
+{
+	s->active = 1;
+	s->count = 0;
+	s->started_ms = monotonic_ms();
+	search_seed(s);
+	bf_log("[LOG] dht: Starting %s search with %d nodes.\n", s->type == QUERY_GET_PEERS ? "get_peers" : "find_node", s->count);
+}
+
+static void search_finish(struct dht_search *s, uint64_t next_ms)
+{
+	s->active = 0;
+	s->next_ms = next_ms;
+	if(s->type == QUERY_GET_PEERS)
+	{
+		s->first_done = 1;
+	}
+}
+
+static void search_step(struct dht_search *s)
+{
+	uint64_t now = monotonic_ms();
+	int i, pending = 0, unfinished = 0, replied = 0, announced = 0;
+
+	if(!s->active)
+	{
+		if(now >= s->next_ms)
+		{
+			search_start(s);
+		}
+		return;
+	}
+	if(s->count == 0)
+	{
+		// we may not know any nodes yet; the bootstrap nodes' answers will bring some.
+		search_seed(s);
+		if(s->count == 0 && now - s->started_ms > DHT_SEARCH_GIVE_UP_MS)
+		{
+			bf_log("[LOG] dht: No nodes to search. Trying again later.\n");
+			search_finish(s, now + DHT_SEARCH_RETRY_MS);
+		}
+		return;
+	}
+
+	for(i = 0; i < s->count; i++)
+	{
+		pending += s->nodes[i].state == SEARCH_NODE_PENDING;
+	}
+	for(i = 0; i < s->count && pending < DHT_ALPHA; i++)
+	{
+		if(s->nodes[i].state == SEARCH_NODE_NEW && send_query(&s->nodes[i].addr, s->type, s, s->target, NULL, 0) == 0)
+		{
+			s->nodes[i].state = SEARCH_NODE_PENDING;
+			pending++;
+		}
+	}
+
+	// the search is over once the DHT_K closest nodes have all answered or failed.
+	for(i = 0; i < s->count && i < DHT_K; i++)
+	{
+		unfinished += s->nodes[i].state == SEARCH_NODE_NEW || s->nodes[i].state == SEARCH_NODE_PENDING;
+		replied += s->nodes[i].state == SEARCH_NODE_REPLIED;
+	}
+	if(unfinished)
+	{
+		return;
+	}
+	if(replied == 0)
+	{
+		bf_log("[LOG] dht: None of the closest nodes answered. Trying again later.\n");
+		search_finish(s, now + DHT_SEARCH_RETRY_MS);
+		return;
+	}
+
+	if(s->type == QUERY_GET_PEERS)
+	{
+		for(i = 0; i < s->count && i < DHT_K; i++)
+		{
+			if(s->nodes[i].state == SEARCH_NODE_REPLIED && s->nodes[i].token_len > 0
+				&& send_query(&s->nodes[i].addr, QUERY_ANNOUNCE_PEER, NULL, s->target, s->nodes[i].token, s->nodes[i].token_len) == 0)
+			{
+				announced++;
+			}
+		}
+		bf_log("[LOG] dht: get_peers search finished. Announced ourselves to %d nodes.\n", announced);
+	}
+	search_finish(s, now + DHT_SEARCH_INTERVAL_MS);
+}
+
+static void search_node_done(struct dht_search *s, struct sockaddr_in *addr, int state, const char *token, int token_len)
+{
+	int i;
+
+	for(i = 0; i < s->count; i++)
+	{
+		if(same_addr(&s->nodes[i].addr, addr) && s->nodes[i].state == SEARCH_NODE_PENDING)
+		{
+			s->nodes[i].state = state;
+			if(token && token_len > 0 && token_len <= DHT_MAX_TOKEN_LEN)
+			{
+				memcpy(s->nodes[i].token, token, token_len);
+				s->nodes[i].token_len = token_len;
+			}
+			return;
+		}
+	}
+}
+
+/*********************** receiving ***********************/
+
+static int parse_krpc(char *buf, int len, struct krpc_msg *m)
+{
+	bencode_t b1, b2, b3;
+	const char *key, *str;
+	int klen, slen;
+
+	memset(m, 0, sizeof(struct krpc_msg));
+	bencode_init(&b1, buf, len);
+	if(!bencode_is_dict(&b1))
+	{
+		return -1;
+	}
+	while(bencode_dict_has_next(&b1))
+	{
+		bencode_dict_get_next(&b1, &b2, &key, &klen);
+		if(klen == 1 && (key[0] == 'y' || key[0] == 't' || key[0] == 'q') && bencode_is_string(&b2))
+		{
+			bencode_string_value(&b2, &str, &slen);
+			if(key[0] == 'y' && slen == 1)
+			{
+				m->y = str[0];
+			}
+			else if(key[0] == 't')
+			{
+				m->t = str;
+				m->t_len = slen;
+			}
+			else if(key[0] == 'q')
+			{
+				m->q = str;
+				m->q_len = slen;
+			}
+		}
+		else if(klen == 1 && (key[0] == 'a' || key[0] == 'r') && bencode_is_dict(&b2))
+		{
+			while(bencode_dict_has_next(&b2))
+			{
+				bencode_dict_get_next(&b2, &b3, &key, &klen);
+				if(bencode_is_int(&b3))
+				{
+					if(klen == 4 && strncmp(key, "port", 4) == 0)
+					{
+						bencode_int_value(&b3, &m->port);
+					}
+					else if(klen == 12 && strncmp(key, "implied_port", 12) == 0)
+					{
+						bencode_int_value(&b3, &m->implied_port);
+					}
+					continue;
+				}
+				if(klen == 6 && strncmp(key, "values", 6) == 0 && bencode_is_list(&b3))
+				{
+					bencode_clone(&b3, &m->values);
+					m->has_values = 1;
+					continue;
+				}
+				if(!bencode_is_string(&b3))
+				{
+					continue;
+				}
+				bencode_string_value(&b3, &str, &slen);
+				if(klen == 2 && strncmp(key, "id", 2) == 0 && slen == 20)
+				{
+					m->id = str;
+				}
+				else if(klen == 6 && strncmp(key, "target", 6) == 0 && slen == 20)
+				{
+					m->target = str;
+				}
+				else if(klen == 9 && strncmp(key, "info_hash", 9) == 0 && slen == 20)
+				{
+					m->info_hash = str;
+				}
+				else if(klen == 5 && strncmp(key, "token", 5) == 0)
+				{
+					m->token = str;
+					m->token_len = slen;
+				}
+				else if(klen == 5 && strncmp(key, "nodes", 5) == 0)
+				{
+					m->nodes = str;
+					m->nodes_len = slen;
+				}
+			}
+		}
+	}
+
+	return (m->y && m->t) ? 0 : -1;
+}
+
+static struct dht_stored_torrent *find_torrent(const uint8_t *info_hash)
+{
+	int i;
+
+	for(i = 0; i < g_dht_num_of_torrents; i++)
+	{
+		if(memcmp(g_dht_torrents[i].info_hash, info_hash, 20) == 0)
+		{
+			return &g_dht_torrents[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void store_peer(const uint8_t *info_hash, struct sockaddr_in *addr, uint16_t port)
+{
+	struct dht_stored_torrent *t = find_torrent(info_hash);
+	uint8_t compact[6];
+	int i;
+
+	if(!t)
+	{
+		if(g_dht_num_of_torrents == DHT_MAX_STORED_TORRENTS)
+		{
+			return;
+		}
+		t = &g_dht_torrents[g_dht_num_of_torrents++];
+		memcpy(t->info_hash, info_hash, 20);
+		t->count = 0;
+		t->next = 0;
+	}
+	memcpy(compact, &addr->sin_addr.s_addr, 4);
+	port = htons(port);
+	memcpy(compact + 4, &port, 2);
+	for(i = 0; i < t->count; i++)
+	{
+		if(memcmp(t->peers[i], compact, 6) == 0)
+		{
+			return;
+		}
+	}
+	if(t->count < DHT_MAX_STORED_PEERS)
+	{
+		i = t->count++;
+	}
+	else
+	{
+		i = t->next;
+		t->next = (t->next + 1) % DHT_MAX_STORED_PEERS;
+	}
+	memcpy(t->peers[i], compact, 6);
+}
+
+static void process_query(struct krpc_msg *m, struct sockaddr_in *from)
+{
+	struct dht_msg_buf b;
+	struct dht_stored_torrent *t;
+	uint8_t token[DHT_TOKEN_LEN];
+	int i;
+
+	if(!m->q || !m->id)
+	{
+		send_error(m, from, 203, "Protocol Error");
+		return;
+	}
+	routing_update((const uint8_t *)m->id, from);
+
+	start_response(&b);
+	if(m->q_len == 4 && strncmp(m->q, "ping", 4) == 0)
+	{
+		finish_response(&b, m, from);
+	}
+	else if(m->q_len == 9 && strncmp(m->q, "find_node", 9) == 0 && m->target)
+	{
+		put_closest_nodes(&b, (const uint8_t *)m->target);
+		finish_response(&b, m, from);
+	}
+	else if(m->q_len == 9 && strncmp(m->q, "get_peers", 9) == 0 && m->info_hash)
+	{
+		t = find_torrent((const uint8_t *)m->info_hash);
+		if(!t || t->count == 0)
+		{
+			put_closest_nodes(&b, (const uint8_t *)m->info_hash);
+		}
+		make_token(from, 0, token);
+		put_raw(&b, "5:token");
+		put_str(&b, token, DHT_TOKEN_LEN);
+		if(t && t->count > 0)
+		{
+			put_raw(&b, "6:valuesl");
+			for(i = 0; i < t->count; i++)
+			{
+				put_str(&b, t->peers[i], 6);
+			}
+			put_raw(&b, "e");
+		}
+		finish_response(&b, m, from);
+	}
+	else if(m->q_len == 13 && strncmp(m->q, "announce_peer", 13) == 0 && m->info_hash)
+	{
+		if(!valid_token(from, m->token, m->token_len))
+		{
+			send_error(m, from, 203, "Bad Token");
+			return;
+		}
+		if(m->implied_port)
+		{
+			store_peer((const uint8_t *)m->info_hash, from, ntohs(from->sin_port));
+		}
+		else if(m->port > 0 && m->port < 65536)
+		{
+			store_peer((const uint8_t *)m->info_hash, from, (uint16_t)m->port);
+		}
+		finish_response(&b, m, from);
+	}
+	else
+	{
+		send_error(m, from, 204, "Method Unknown");
+	}
+}
+
+// nodes from a find_node or get_peers answer go into the search the query was for, or into every
+// active search if the query wasn't part of one (bootstrap and PORT pings).
+static void add_compact_nodes(struct krpc_msg *m, struct dht_search *search)
+{
+	struct sockaddr_in addr;
+	const uint8_t *entry;
+	int i, j;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	for(i = 0; i + DHT_COMPACT_NODE_LEN <= m->nodes_len; i += DHT_COMPACT_NODE_LEN)
+	{
+		entry = (const uint8_t *)m->nodes + i;
+		memcpy(&addr.sin_addr.s_addr, entry + 20, 4);
+		memcpy(&addr.sin_port, entry + 24, 2);
+		if(search)
+		{
+			search_add(search, entry, &addr);
+			continue;
+		}
+		if(g_dht_node_search.active)
+		{
+			search_add(&g_dht_node_search, entry, &addr);
+		}
+		for(j = 0; j < DHT_MAX_SEARCHES; j++)
+		{
+			if(g_dht_peer_searches[j].used && g_dht_peer_searches[j].active)
+			{
+				search_add(&g_dht_peer_searches[j], entry, &addr);
+			}
+		}
+	}
+}
+
+// the peers of a get_peers answer go to the torrent the search is for.
+static void add_values(struct krpc_msg *m, struct dht_search *search)
+{
+	bencode_t b;
+	const char *str;
+	char ip[INET_ADDRSTRLEN];
+	uint16_t port;
+	int len, added = 0;
+
+	while(bencode_list_has_next(&m->values))
+	{
+		bencode_list_get_next(&m->values, &b);
+		if(!bencode_is_string(&b))
+		{
+			continue;
+		}
+		bencode_string_value(&b, &str, &len);
+		if(len != 6)
+		{
+			continue;
+		}
+		inet_ntop(AF_INET, str, ip, sizeof(ip));
+		memcpy(&port, str + 4, 2);
+		added += session_add_peer(search->target, ip, ntohs(port), PEER_POOL_PRIORITY_DHT);
+	}
+	if(added)
+	{
+		bf_log("[LOG] dht: Added %d peers from get_peers.\n", added);
+	}
+}
+
+static void process_response(struct krpc_msg *m, struct sockaddr_in *from)
+{
+	struct dht_query *query = NULL;
+	uint16_t tid;
+	int i;
+
+	if(m->t_len != 2)
+	{
+		return;
+	}
+	tid = ((uint8_t)m->t[0] << 8) | (uint8_t)m->t[1];
+	for(i = 0; i < DHT_MAX_QUERIES; i++)
+	{
+		if(g_dht_queries[i].used && g_dht_queries[i].tid == tid && same_addr(&g_dht_queries[i].addr, from))
+		{
+			query = &g_dht_queries[i];
+			break;
+		}
+	}
+	if(!query)
+	{
+		return;
+	}
+	query->used = 0;
+
+	if(m->y == 'e' || !m->id)
+	{
+		if(query->search)
+		{
+			search_node_done(query->search, from, SEARCH_NODE_FAILED, NULL, 0);
+		}
+		return;
+	}
+
+	routing_update((const uint8_t *)m->id, from);
+	if(query->search)
+	{
+		search_node_done(query->search, from, SEARCH_NODE_REPLIED, m->token, m->token_len);
+	}
+	if(query->type == QUERY_FIND_NODE || query->type == QUERY_GET_PEERS)
+	{
+		add_compact_nodes(m, query->search);
+	}
+	if(query->type == QUERY_GET_PEERS && m->has_values && query->search && query->search->type == QUERY_GET_PEERS)
+	{
+		add_values(m, query->search);
+	}
+}
+
+static void process_packet(char *buf, int len, struct sockaddr_in *from)
+{
+	struct krpc_msg m;
+
+	if(parse_krpc(buf, len, &m) != 0)
+	{
+		return;
+	}
+	if(m.y == 'q')
+	{
+		process_query(&m, from);
+	}
+	else if(m.y == 'r' || m.y == 'e')
+	{
+		process_response(&m, from);
+	}
+}
+
+static void expire_queries()
+{
+	uint64_t now = monotonic_ms();
+	int i;
+
+	for(i = 0; i < DHT_MAX_QUERIES; i++)
+	{
+		if(!g_dht_queries[i].used || now - g_dht_queries[i].sent_ms < DHT_QUERY_TIMEOUT_MS)
+		{
+			continue;
+		}
+		g_dht_queries[i].used = 0;
+		if(g_dht_queries[i].search)
+		{
+			search_node_done(g_dht_queries[i].search, &g_dht_queries[i].addr, SEARCH_NODE_FAILED, NULL, 0);
+		}
+		routing_failed(&g_dht_queries[i].addr);
+	}
+}
+
+/*********************** node cache ***********************/
+
+static void load_cache()
+{
+	uint8_t *contents = NULL;
+	bencode_t b1, b2;
+	const char *key, *str;
+	struct sockaddr_in addr;
+	int len, klen, slen, i, loaded = 0;
+
+	random_bytes(g_dht_id, 20);
+	if(util_read_whole_file(DHT_CACHE_FILE, &contents, &len) != 0)
+	{
+		bf_log("[LOG] dht: No node cache. Using a new node id.\n");
+		return;
+	}
+	bencode_init(&b1, (const char *)contents, len);
+	if(!bencode_is_dict(&b1))
+	{
+		bf_log("[ERROR] dht: The node cache is malformed. Using a new node id.\n");
+		free(contents);
+		return;
+	}
+	while(bencode_dict_has_next(&b1))
+	{
+		bencode_dict_get_next(&b1, &b2, &key, &klen);
+		if(!bencode_is_string(&b2))
+		{
+			continue;
+		}
+		bencode_string_value(&b2, &str, &slen);
+		if(klen == 2 && strncmp(key, "id", 2) == 0 && slen == 20)
+		{
+			memcpy(g_dht_id, str, 20);
+		}
+		else if(klen == 5 && strncmp(key, "nodes", 5) == 0)
+		{
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			for(i = 0; i + DHT_COMPACT_NODE_LEN <= slen; i += DHT_COMPACT_NODE_LEN)
+			{
+				memcpy(&addr.sin_addr.s_addr, str + i + 20, 4);
+				memcpy(&addr.sin_port, str + i + 24, 2);
+				routing_update((const uint8_t *)str + i, &addr);
+				loaded++;
+			}
+		}
+	}
+	free(contents);
+	bf_log("[LOG] dht: Loaded %d nodes from the node cache.\n", loaded);
+}
+
+static void save_cache()
+{
+	struct dht_msg_buf b;
+	struct dht_node *node;
+	FILE *fp;
+	int i, n = 0;
+
+	b.len = 0;
+	for(i = 0; i < 160 * DHT_K && n < DHT_MAX_CACHED_NODES; i++)
+	{
+		if(i % DHT_K >= g_dht_buckets[i / DHT_K].count)
+		{
+			continue;
+		}
+		node = &g_dht_buckets[i / DHT_K].nodes[i % DHT_K];
+		if(node->failures == 0)
+		{
+			put_compact_node(&b, node);
+			n++;
+		}
+	}
+
+	if((fp = fopen(DHT_CACHE_FILE, "w")) == NULL)
+	{
+		bf_log("[ERROR] dht: Failed to write the node cache.\n");
+		return;
+	}
+	fprintf(fp, "d2:id20:");
+	fwrite(g_dht_id, 1, 20, fp);
+	fprintf(fp, "5:nodes%d:", b.len);
+	fwrite(b.data, 1, b.len, fp);
+	fprintf(fp, "e");
+	fclose(fp);
+	bf_log("[LOG] dht: Saved %d nodes to the node cache.\n", n);
+}
+
+/*********************** thread ***********************/
+
+void dht_add_bootstrap(const char *host, uint16_t port)
+{
+	if(g_dht_num_of_bootstrap < DHT_MAX_BOOTSTRAP)
+	{
+		g_dht_bootstrap_hosts[g_dht_num_of_bootstrap] = strdup(host);
+		g_dht_bootstrap_ports[g_dht_num_of_bootstrap] = port;
+		g_dht_num_of_bootstrap++;
+	}
+}
+
+// asks the bootstrap nodes for the nodes closest to us. their answers seed the searches.
+static void bootstrap()
+{
+	struct addrinfo hints, *res, *ai;
+	char port[8];
+	int i;
+
+	if(g_dht_num_of_bootstrap == 0)
+	{
+		dht_add_bootstrap("router.bittorrent.com", 6881);
+		dht_add_bootstrap("dht.transmissionbt.com", 6881);
+		dht_add_bootstrap("router.utorrent.com", 6881);
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	for(i = 0; i < g_dht_num_of_bootstrap; i++)
+	{
+		sprintf(port, "%d", g_dht_bootstrap_ports[i]);
+		if(getaddrinfo(g_dht_bootstrap_hosts[i], port, &hints, &res) != 0)
+		{
+			bf_log("[ERROR] dht: Failed to resolve bootstrap node %s.\n", g_dht_bootstrap_hosts[i]);
+			continue;
+		}
+		for(ai = res; ai; ai = ai->ai_next)
+		{
+			/* -X-X-X- CRITICAL REGION START -X-X-X- */
+			pthread_mutex_lock(&g_dht_mutex);
+
+			send_query((struct sockaddr_in *)ai->ai_addr, QUERY_FIND_NODE, NULL, g_dht_id, NULL, 0);
+
+			pthread_mutex_unlock(&g_dht_mutex);
+			/* -X-X-X- CRITICAL REGION END -X-X-X- */
+		}
+		freeaddrinfo(res);
+	}
+}
+
+int dht_start(uint16_t dht_port, uint16_t peer_port)
+{
+	struct sockaddr_in addr;
+
+	if((g_dht_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+	{
+		bf_log("[ERROR] dht_start(): Failed to create socket.\n");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(dht_port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if(bind(g_dht_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+	{
+		bf_log("[ERROR] dht_start(): Failed to bind to port %d: %s\n", dht_port, strerror(errno));
+		close(g_dht_fd);
+		g_dht_fd = -1;
+		return -1;
+	}
+
+	g_dht_peer_port = peer_port;
+	memset(g_dht_buckets, 0, sizeof(g_dht_buckets));
+	memset(g_dht_queries, 0, sizeof(g_dht_queries));
+	g_dht_num_of_torrents = 0;
+	random_bytes(g_dht_secrets[0], 8);
+	memcpy(g_dht_secrets[1], g_dht_secrets[0], 8);
+	g_dht_secret_ms = monotonic_ms();
+	load_cache();
+
+	memset(&g_dht_node_search, 0, sizeof(g_dht_node_search));
+	g_dht_node_search.type = QUERY_FIND_NODE;
+	memcpy(g_dht_node_search.target, g_dht_id, 20);
+	memset(g_dht_peer_searches, 0, sizeof(g_dht_peer_searches));
+	search_start(&g_dht_node_search);
+
+	g_dht_stop = 0;
+	if(pthread_create(&g_dht_thread, NULL, dht_thread, NULL) != 0)
+	{
+		bf_log("[ERROR] dht_start(): Failed to start the DHT thread.\n");
+		close(g_dht_fd);
+		g_dht_fd = -1;
+		return -1;
+	}
+	g_dht_started = 1;
+
+	return 0;
+}
+
+void dht_stop()
+{
+	if(!g_dht_started)
+	{
+		return;
+	}
+	g_dht_stop = 1;
+	pthread_join(g_dht_thread, NULL);
+	g_dht_started = 0;
+
+	save_cache();
+	close(g_dht_fd);
+	g_dht_fd = -1;
+}
+
+// NOTE: the caller must hold g_dht_mutex.
+static struct dht_search *find_peer_search(const uint8_t *info_hash)
+{
+	int i;
+
+	for(i = 0; i < DHT_MAX_SEARCHES; i++)
+	{
+		if(g_dht_peer_searches[i].used && memcmp(g_dht_peer_searches[i].target, info_hash, 20) == 0)
+		{
+			return &g_dht_peer_searches[i];
+		}
+	}
+
+	return NULL;
+}
+
+void dht_add_torrent(uint8_t *info_hash)
+{
+	struct dht_search *s = NULL;
+	int i;
+
+	if(!g_dht_started)
+	{
+		return;
+	}
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_dht_mutex);
+
+	for(i = 0; i < DHT_MAX_SEARCHES && !s; i++)
+	{
+		if(!g_dht_peer_searches[i].used)
+		{
+			s = &g_dht_peer_searches[i];
+		}
+	}
+	if(s && !find_peer_search(info_hash))
+	{
+		memset(s, 0, sizeof(struct dht_search));
+		s->used = 1;
+		s->type = QUERY_GET_PEERS;
+		memcpy(s->target, info_hash, 20);
+		search_start(s);
+	}
+
+	pthread_mutex_unlock(&g_dht_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	if(!s)
+	{
+		bf_log("[ERROR] dht_add_torrent(): Already searching for %d torrents. Not searching for this one.\n", DHT_MAX_SEARCHES);
+	}
+}
+
+void dht_remove_torrent(uint8_t *info_hash)
+{
+	struct dht_search *s;
+	int i;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_dht_mutex);
+
+	if((s = find_peer_search(info_hash)) != NULL)
+	{
+		// answers to its outstanding queries are still taken, just not for the search.
+		for(i = 0; i < DHT_MAX_QUERIES; i++)
+		{
+			if(g_dht_queries[i].search == s)
+			{
+				g_dht_queries[i].search = NULL;
+			}
+		}
+		s->used = 0;
+		s->active = 0;
+	}
+
+	pthread_mutex_unlock(&g_dht_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+int dht_searching(uint8_t *info_hash)
+{
+	struct dht_search *s;
+	int rv = 0;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_dht_mutex);
+
+	if(g_dht_started && (s = find_peer_search(info_hash)) != NULL)
+	{
+		rv = !s->first_done;
+	}
+
+	pthread_mutex_unlock(&g_dht_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return rv;
+}
+
+void dht_add_node(const char *ip, uint16_t port)
+{
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if(!g_dht_started || inet_pton(AF_INET, ip, &addr.sin_addr) != 1)
+	{
+		return;
+	}
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_dht_mutex);
+
+	// a find_node rather than a ping: the answer also brings nodes close to us.
+	send_query(&addr, QUERY_FIND_NODE, NULL, g_dht_id, NULL, 0);
+
+	pthread_mutex_unlock(&g_dht_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+static void *dht_thread(void *arg)
+{
+	struct pollfd pfd;
+	struct sockaddr_in from;
+	socklen_t from_len;
+	char buf[DHT_MAX_MSG_LEN + 1];
+	int i, len;
+
+	bootstrap();
+
+	pfd.fd = g_dht_fd;
+	pfd.events = POLLIN;
+	while(!g_dht_stop)
+	{
+		poll(&pfd, 1, DHT_POLL_MS);
+
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_dht_mutex);
+
+		from_len = sizeof(from);
+		while((len = recvfrom(g_dht_fd, buf, DHT_MAX_MSG_LEN, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len)) > 0)
+		{
+			// the bencode parser expects a terminated string.
+			buf[len] = '\0';
+			if(from.sin_family == AF_INET)
+			{
+				process_packet(buf, len, &from);
+			}
+			from_len = sizeof(from);
+		}
+		expire_queries();
+		if(monotonic_ms() - g_dht_secret_ms >= DHT_TOKEN_INTERVAL_MS)
+		{
+			memcpy(g_dht_secrets[1], g_dht_secrets[0], 8);
+			random_bytes(g_dht_secrets[0], 8);
+			g_dht_secret_ms = monotonic_ms();
+		}
+		search_step(&g_dht_node_search);
+		for(i = 0; i < DHT_MAX_SEARCHES; i++)
+		{
+			if(g_dht_peer_searches[i].used)
+			{
+				search_step(&g_dht_peer_searches[i]);
+			}
+		}
+
+		pthread_mutex_unlock(&g_dht_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+	}
+
+	return NULL;
+}
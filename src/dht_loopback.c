@@ -0,0 +1,243 @@
+#include<stdio.h>
+#include<limits.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<time.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<poll.h>
+#include<sys/types.h>
+#include<sys/wait.h>
+
+#include "dht.h"
+#include "bf_logger.h"
+
+/*
+dht_loopback runs a small DHT (see dht.h) on 127.0.0.1 and checks that a peer announced on one
+node is found from another.
+
+The DHT code runs one node per process, so every node is a child process with a directory of its
+own for its node cache. Node i listens on BASE_PORT + i and is bootstrapped off node i - 1, and
+node 0 gets to know the others when they query it. Once their tables have filled, node 0 searches
+for a random info hash and announces itself as PEER_PORT to the nodes closest to it. Then the last
+node searches for the same info hash and must be given 127.0.0.1:PEER_PORT by get_peers.
+
+	dht_loopback [nodes]
+
+Exits with 0 if the peer was found. The nodes log to logs/dht_loopback.<i>.log.
+*/
+
+#define DEFAULT_NODES 8
+#define MAX_NODES 64
+#define BASE_PORT 46900
+#define PEER_PORT 50000 // node i announces PEER_PORT + i
+#define SETTLE_MS 3000 // for the routing tables to fill before the announce
+#define SEARCH_TIMEOUT_MS 30000
+#define ANNOUNCE_DELIVERY_MS 500 // the announce_peer queries are on their way when the search ends
+
+#define CMD_ANNOUNCE 'a'
+#define CMD_FIND 'f'
+
+struct node_proc
+{
+	pid_t pid;
+	int cmd; // commands to the node; closing it stops the node
+	int result; // one byte per command: 'y' if it worked
+};
+
+static uint8_t g_info_hash[20];
+static volatile int g_found = 0;
+static char g_log_file[PATH_MAX];
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// dht.c hands the peers its searches find to the session. here they are only looked at.
+int session_add_peer(const uint8_t *info_hash, const char *ip, uint16_t port, int priority)
+{
+	if(memcmp(info_hash, g_info_hash, 20) == 0 && strcmp(ip, "127.0.0.1") == 0 && port == PEER_PORT)
+	{
+		g_found = 1;
+	}
+
+	return 1;
+}
+
+// searches for the info hash until the first round is over, which announces us too. returns 0 if
+// it finished in time.
+static int search(int *found)
+{
+	uint64_t start = now_ms();
+
+	dht_add_torrent(g_info_hash);
+	while(dht_searching(g_info_hash) && now_ms() - start < SEARCH_TIMEOUT_MS)
+	{
+		usleep(100 * 1000);
+	}
+	*found = g_found;
+
+	return dht_searching(g_info_hash) ? -1 : 0;
+}
+
+// runs node i until the parent closes cmd.
+static void run_node(int i, int cmd, int result)
+{
+	char dir[] = "/tmp/dht_loopback.XXXXXX";
+	char c, ok;
+	int found, j;
+	FILE *fp;
+
+	// the log is opened by name again and again, so the name has to hold in the node's directory too.
+	getcwd(g_log_file, sizeof(g_log_file) - 32);
+	sprintf(g_log_file + strlen(g_log_file), "/logs/dht_loopback.%d.log", i);
+	bf_logger_init(g_log_file);
+	bf_logger_echo(0);
+	if(mkdtemp(dir) == NULL || chdir(dir) == -1 || (fp = fopen(DHT_CACHE_FILE, "w")) == NULL)
+	{
+		printf("Node %d failed to create its directory.\n", i);
+		exit(1);
+	}
+	// a node cache without nodes, so the node starts from its bootstrap node alone. the forked nodes
+	// would all draw the same id and secrets from rand() if it weren't seeded for each of them.
+	fputs("d2:id20:", fp);
+	srand(time(NULL) + i);
+	for(j = 0; j < 20; j++)
+	{
+		fputc(rand(), fp);
+	}
+	fputs("e", fp);
+	fclose(fp);
+	// node 0 has nobody to ask yet. it learns about the others when they query it.
+	dht_add_bootstrap("127.0.0.1", BASE_PORT + (i > 0 ? i - 1 : 1));
+	if(dht_start(BASE_PORT + i, PEER_PORT + i) != 0)
+	{
+		printf("Node %d failed to start on UDP port %d.\n", i, BASE_PORT + i);
+		exit(1);
+	}
+	write(result, "y", 1);
+
+	while(read(cmd, &c, 1) == 1)
+	{
+		ok = 'n';
+		if(c == CMD_ANNOUNCE && search(&found) == 0)
+		{
+			usleep(ANNOUNCE_DELIVERY_MS * 1000);
+			ok = 'y';
+		}
+		else if(c == CMD_FIND && search(&found) == 0 && found)
+		{
+			ok = 'y';
+		}
+		write(result, &ok, 1);
+	}
+
+	dht_stop();
+	unlink(DHT_CACHE_FILE);
+	chdir("/");
+	rmdir(dir);
+	bf_logger_end();
+	exit(0);
+}
+
+// starts node i of nodes and waits until it is up.
+static int start_node(struct node_proc *nodes, int i)
+{
+	struct node_proc *node = &nodes[i];
+	int cmd[2], result[2], j;
+	char c;
+
+	if(pipe(cmd) == -1 || pipe(result) == -1 || (node->pid = fork()) == -1)
+	{
+		return -1;
+	}
+	if(node->pid == 0)
+	{
+		// the other nodes stop when the parent closes their pipes, so no copies of those stay open here.
+		for(j = 0; j < i; j++)
+		{
+			close(nodes[j].cmd);
+			close(nodes[j].result);
+		}
+		close(cmd[1]);
+		close(result[0]);
+		run_node(i, cmd[0], result[1]);
+	}
+	close(cmd[0]);
+	close(result[1]);
+	node->cmd = cmd[1];
+	node->result = result[0];
+
+	return read(node->result, &c, 1) == 1 && c == 'y' ? 0 : -1;
+}
+
+// returns 0 if the node carried the command out.
+static int command(struct node_proc *node, char c)
+{
+	char ok;
+
+	return write(node->cmd, &c, 1) == 1 && read(node->result, &ok, 1) == 1 && ok == 'y' ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct node_proc nodes[MAX_NODES];
+	int num_of_nodes = argc > 1 ? atoi(argv[1]) : DEFAULT_NODES;
+	int i, started, rv = 1;
+	uint64_t start;
+
+	// with two nodes node 0 would announce itself to the only other node, which doesn't query itself.
+	if(num_of_nodes < 3 || num_of_nodes > MAX_NODES)
+	{
+		printf("Usage: dht_loopback [nodes]  (3 to %d nodes)\n", MAX_NODES);
+		return 1;
+	}
+	srand(time(NULL));
+	for(i = 0; i < 20; i++)
+	{
+		g_info_hash[i] = rand();
+	}
+
+	fflush(NULL);
+	// every node is up before the next one bootstraps off it.
+	for(started = 0; started < num_of_nodes && start_node(nodes, started) == 0; started++);
+	if(started < num_of_nodes)
+	{
+		printf("FAILED: node %d didn't start.\n", started);
+		goto stop;
+	}
+	usleep(SETTLE_MS * 1000);
+
+	start = now_ms();
+	if(command(&nodes[0], CMD_ANNOUNCE) != 0)
+	{
+		printf("FAILED: node 0's get_peers search didn't finish, so it wasn't announced.\n");
+		goto stop;
+	}
+	if(command(&nodes[num_of_nodes - 1], CMD_FIND) != 0)
+	{
+		printf("FAILED: node %d didn't find the peer node 0 announced.\n", num_of_nodes - 1);
+		goto stop;
+	}
+	printf("OK: announced on node 0 and found by get_peers on node %d of %d in %.1f s.\n",
+		num_of_nodes - 1, num_of_nodes, (now_ms() - start) / 1000.0);
+	rv = 0;
+
+stop:
+	for(i = 0; i < started; i++)
+	{
+		close(nodes[i].cmd);
+		close(nodes[i].result);
+	}
+	for(i = 0; i < started; i++)
+	{
+		waitpid(nodes[i].pid, NULL, 0);
+	}
+
+	return rv;
+}
@@ -0,0 +1,513 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<errno.h>
+#include<unistd.h>
+#include<pthread.h>
+
+#include "diskio.h"
+
+#include "pwp.h"
+#include "fairshare.h"
+#include "bf_logger.h"
+
+struct diskio_job
+{
+	struct pwp_torrent *torrent;
+	int idx; // piece
+	long int offset; // write jobs: where in the saved file
+	uint8_t *data;
+	int len;
+	int result; // hash jobs: 0 if the piece matched its hash
+	int done;
+	diskio_done_callback done_callback;
+	void *arg;
+	struct diskio_job *next;
+};
+
+// one lock for all queues and the pending_writes / write_failed counts of the pieces.
+static pthread_mutex_t g_diskio_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_write_cond = PTHREAD_COND_INITIALIZER; // a write was queued
+static pthread_cond_t g_space_cond = PTHREAD_COND_INITIALIZER; // a write was taken off the queue
+static pthread_cond_t g_hash_cond = PTHREAD_COND_INITIALIZER; // a hash job was queued
+static pthread_cond_t g_done_cond = PTHREAD_COND_INITIALIZER; // a write or a hash job is done
+// the torrents' write queues that have blocks in them, in round robin order.
+static struct diskio_queue *g_active_head = NULL, *g_active_tail = NULL;
+static int g_active_weight = 0;
+static struct diskio_job *g_hash_head = NULL, *g_hash_tail = NULL;
+static struct diskio_job *g_parked = NULL; // hash jobs of pieces with writes still queued
+static int g_num_of_queued = 0;
+static pthread_t g_writers[DISKIO_WRITERS];
+static pthread_t g_hashers[DISKIO_HASHERS];
+static int g_num_of_writers = 0;
+static int g_num_of_hashers = 0;
+static int g_diskio_stop = 0;
+
+static int queue_share(struct pwp_torrent *t);
+static struct diskio_job *next_write();
+static void rotate_active();
+static void queue_hash(struct diskio_job *job);
+static void unpark(struct pwp_torrent *t, int idx);
+static void finish_hash(struct diskio_job *job, int result);
+static void *writer_thread(void *arg);
+static void *hasher_thread(void *arg);
+
+int diskio_start()
+{
+	int i;
+
+	g_diskio_stop = 0;
+	for(i = 0; i < DISKIO_WRITERS; i++)
+	{
+		if(pthread_create(&g_writers[g_num_of_writers], NULL, writer_thread, NULL) == 0)
+		{
+			g_num_of_writers++;
+		}
+	}
+	for(i = 0; i < DISKIO_HASHERS; i++)
+	{
+		if(pthread_create(&g_hashers[g_num_of_hashers], NULL, hasher_thread, NULL) == 0)
+		{
+			g_num_of_hashers++;
+		}
+	}
+	if(g_num_of_writers == 0 || g_num_of_hashers == 0)
+	{
+		bf_log("[ERROR] diskio_start(): Failed to start the disk workers.\n");
+		diskio_stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+void diskio_stop()
+{
+	int i;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_diskio_mutex);
+
+	g_diskio_stop = 1;
+	pthread_cond_broadcast(&g_write_cond);
+	pthread_cond_broadcast(&g_hash_cond);
+
+	pthread_mutex_unlock(&g_diskio_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	for(i = 0; i < g_num_of_writers; i++)
+	{
+		pthread_join(g_writers[i], NULL);
+	}
+	for(i = 0; i < g_num_of_hashers; i++)
+	{
+		pthread_join(g_hashers[i], NULL);
+	}
+	g_num_of_writers = 0;
+	g_num_of_hashers = 0;
+}
+
+void diskio_write(struct pwp_torrent *t, int idx, long int offset, uint8_t *data, int len)
+{
+	struct diskio_queue *q = &t->disk_queue;
+	struct diskio_job *job;
+
+	job = malloc(sizeof(struct diskio_job));
+	job->torrent = t;
+	job->idx = idx;
+	job->offset = offset;
+	job->data = data;
+	job->len = len;
+	job->next = NULL;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_diskio_mutex);
+
+	while(g_num_of_queued >= DISKIO_MAX_QUEUED || q->queued >= queue_share(t))
+	{
+		pthread_cond_wait(&g_space_cond, &g_diskio_mutex);
+	}
+	if(q->tail)
+	{
+		q->tail->next = job;
+	}
+	else
+	{
+		q->head = job;
+	}
+	q->tail = job;
+	q->queued++;
+	g_num_of_queued++;
+	if(!q->active)
+	{
+		q->active = 1;
+		q->deficit = 0;
+		q->weight = t->share.weight;
+		q->priority = t->share.priority;
+		q->next = NULL;
+		if(g_active_tail)
+		{
+			g_active_tail->next = q;
+		}
+		else
+		{
+			g_active_head = q;
+		}
+		g_active_tail = q;
+		g_active_weight += q->weight;
+	}
+	t->pieces[idx].pending_writes++;
+	pthread_cond_signal(&g_write_cond);
+
+	pthread_mutex_unlock(&g_diskio_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+int diskio_verify(struct pwp_torrent *t, int idx)
+{
+	return diskio_verify_result(diskio_verify_start(t, idx, NULL, NULL), 1);
+}
+
+struct diskio_job *diskio_verify_start(struct pwp_torrent *t, int idx, diskio_done_callback done, void *arg)
+{
+	struct diskio_job *job;
+
+	job = calloc(1, sizeof(struct diskio_job));
+	job->torrent = t;
+	job->idx = idx;
+	job->done_callback = done;
+	job->arg = arg;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_diskio_mutex);
+
+	// the piece is read back from the file, so it waits for its writes; the last one unparks it.
+	if(t->pieces[idx].pending_writes > 0)
+	{
+		job->next = g_parked;
+		g_parked = job;
+	}
+	else
+	{
+		queue_hash(job);
+	}
+
+	pthread_mutex_unlock(&g_diskio_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return job;
+}
+
+int diskio_verify_result(struct diskio_job *job, int wait)
+{
+	int result;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_diskio_mutex);
+
+	while(wait && !job->done)
+	{
+		pthread_cond_wait(&g_done_cond, &g_diskio_mutex);
+	}
+	result = job->done ? job->result : DISKIO_PENDING;
+
+	pthread_mutex_unlock(&g_diskio_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	if(result != DISKIO_PENDING)
+	{
+		free(job);
+	}
+
+	return result;
+}
+
+void diskio_wait(struct pwp_torrent *t)
+{
+	int i;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_diskio_mutex);
+
+	for(i = 0; i < t->num_of_pieces; i++)
+	{
+		while(t->pieces[i].pending_writes > 0)
+		{
+			pthread_cond_wait(&g_done_cond, &g_diskio_mutex);
+		}
+	}
+
+	pthread_mutex_unlock(&g_diskio_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+// blocks the torrent may have queued: its weighted share of DISKIO_MAX_QUEUED among the torrents with
+// blocks queued. NOTE: must be called with g_diskio_mutex held.
+static int queue_share(struct pwp_torrent *t)
+{
+	struct diskio_queue *q = &t->disk_queue;
+	int weight = q->active ? q->weight : t->share.weight;
+	int share = DISKIO_MAX_QUEUED * weight / (g_active_weight + (q->active ? 0 : weight));
+
+	return share > DISKIO_MIN_QUEUED ? share : DISKIO_MIN_QUEUED;
+}
+
+// takes the next block to write by deficit round robin over the active queues of the highest
+// priority. a queue gets FAIRSHARE_DISK_QUANTUM bytes per unit of weight at the start of each turn.
+// NOTE: must be called with g_diskio_mutex held.
+static struct diskio_job *next_write()
+{
+	struct diskio_queue *q;
+	struct diskio_job *job;
+	int priority, found = 0;
+
+	for(q = g_active_head; q; q = q->next)
+	{
+		if(!found || q->priority > priority)
+		{
+			priority = q->priority;
+			found = 1;
+		}
+	}
+	if(!found)
+	{
+		return NULL;
+	}
+
+	while(1)
+	{
+		q = g_active_head;
+		if(q->priority == priority)
+		{
+			if(q->deficit < q->head->len)
+			{
+				q->deficit += FAIRSHARE_DISK_QUANTUM * q->weight;
+			}
+			if(q->deficit >= q->head->len)
+			{
+				break;
+			}
+		}
+		rotate_active();
+	}
+
+	job = q->head;
+	if((q->head = job->next) == NULL)
+	{
+		q->tail = NULL;
+	}
+	q->queued--;
+	q->deficit -= job->len;
+	g_num_of_queued--;
+	if(!q->head)
+	{
+		// an empty queue leaves the round robin and loses what is left of its deficit.
+		if((g_active_head = q->next) == NULL)
+		{
+			g_active_tail = NULL;
+		}
+		g_active_weight -= q->weight;
+		q->active = 0;
+		q->deficit = 0;
+		q->next = NULL;
+	}
+	else if(q->deficit < q->head->len)
+	{
+		rotate_active();
+	}
+
+	return job;
+}
+
+// ends the turn of the queue at the head. NOTE: must be called with g_diskio_mutex held.
+static void rotate_active()
+{
+	struct diskio_queue *q = g_active_head;
+
+	if(q == g_active_tail)
+	{
+		return;
+	}
+	g_active_head = q->next;
+	q->next = NULL;
+	g_active_tail->next = q;
+	g_active_tail = q;
+}
+
+// hands the job to the hash workers, or fails it at once if a write of its piece failed.
+// NOTE: must be called with g_diskio_mutex held.
+static void queue_hash(struct diskio_job *job)
+{
+	struct pwp_piece *piece = &job->torrent->pieces[job->idx];
+
+	if(piece->write_failed)
+	{
+		piece->write_failed = 0;
+		bf_log("[ERROR] queue_hash(): Failed to write piece %d to the saved file.\n", job->idx);
+		finish_hash(job, -1);
+		return;
+	}
+	job->next = NULL;
+	if(g_hash_tail)
+	{
+		g_hash_tail->next = job;
+	}
+	else
+	{
+		g_hash_head = job;
+	}
+	g_hash_tail = job;
+	pthread_cond_signal(&g_hash_cond);
+}
+
+// queues the parked jobs of piece idx, whose writes are all done. NOTE: must be called with g_diskio_mutex held.
+static void unpark(struct pwp_torrent *t, int idx)
+{
+	struct diskio_job **link = &g_parked, *job;
+
+	while((job = *link) != NULL)
+	{
+		if(job->torrent == t && job->idx == idx)
+		{
+			*link = job->next;
+			queue_hash(job);
+		}
+		else
+		{
+			link = &job->next;
+		}
+	}
+}
+
+// NOTE: must be called with g_diskio_mutex held. the job belongs to its owner again once done is set.
+static void finish_hash(struct diskio_job *job, int result)
+{
+	job->result = result;
+	job->done = 1;
+	pthread_cond_broadcast(&g_done_cond);
+	if(job->done_callback)
+	{
+		job->done_callback(job->arg);
+	}
+}
+
+// the queues are written out before the writers stop.
+static void *writer_thread(void *arg)
+{
+	struct diskio_job *job;
+	ssize_t rv;
+	int written;
+
+	while(1)
+	{
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_diskio_mutex);
+
+		while(!g_active_head && !g_diskio_stop)
+		{
+			pthread_cond_wait(&g_write_cond, &g_diskio_mutex);
+		}
+		if((job = next_write()) == NULL)
+		{
+			pthread_mutex_unlock(&g_diskio_mutex);
+			break;
+		}
+		// threads queueing blocks for different torrents wait for different things.
+		pthread_cond_broadcast(&g_space_cond);
+
+		pthread_mutex_unlock(&g_diskio_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		// a block of a piece that is complete, or sealed by a hedged copy (see stream.h), would
+		// overwrite verified data. the piece's lock is held while writing, so the piece can't be
+		// completed or sealed between the check and the write.
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&job->torrent->pieces_mutexes[job->idx]);
+
+		written = 0;
+		if(job->torrent->pieces[job->idx].status == PIECE_STATUS_COMPLETE || job->torrent->pieces[job->idx].sealed)
+		{
+			written = job->len;
+			bf_log("[LOG] writer_thread(): Dropped a block of piece %d, which is in the saved file already.\n", job->idx);
+		}
+		for(rv = 0; written < job->len; written += rv)
+		{
+			if((rv = pwrite(job->torrent->saved_fd, job->data + written, job->len - written, job->offset + written)) <= 0)
+			{
+				if(rv == -1 && errno == EINTR)
+				{
+					rv = 0;
+					continue;
+				}
+				bf_log("[ERROR] writer_thread(): Failed to write to the saved file: %s\n", strerror(errno));
+				break;
+			}
+		}
+
+		pthread_mutex_unlock(&job->torrent->pieces_mutexes[job->idx]);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_diskio_mutex);
+
+		if(written < job->len)
+		{
+			job->torrent->pieces[job->idx].write_failed = 1;
+		}
+		if(--job->torrent->pieces[job->idx].pending_writes == 0)
+		{
+			unpark(job->torrent, job->idx);
+		}
+		pthread_cond_broadcast(&g_done_cond);
+
+		pthread_mutex_unlock(&g_diskio_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		free(job->data);
+		free(job);
+	}
+
+	return NULL;
+}
+
+static void *hasher_thread(void *arg)
+{
+	struct diskio_job *job;
+	int result;
+
+	while(1)
+	{
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_diskio_mutex);
+
+		while(!g_hash_head && !g_diskio_stop)
+		{
+			pthread_cond_wait(&g_hash_cond, &g_diskio_mutex);
+		}
+		if((job = g_hash_head) == NULL)
+		{
+			pthread_mutex_unlock(&g_diskio_mutex);
+			break;
+		}
+		if((g_hash_head = job->next) == NULL)
+		{
+			g_hash_tail = NULL;
+		}
+
+		pthread_mutex_unlock(&g_diskio_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		result = verify_piece(job->torrent, job->idx);
+
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_diskio_mutex);
+
+		finish_hash(job, result == 0 ? 0 : -1);
+
+		pthread_mutex_unlock(&g_diskio_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+	}
+
+	return NULL;
+}
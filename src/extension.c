@@ -0,0 +1,464 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<pthread.h>
+#include<arpa/inet.h>
+
+#include "extension.h"
+
+#include "pwp.h"
+#include "bencode.h"
+#include "peer_pool.h"
+#include "magnet.h"
+#include "utp.h"
+#include "bf_logger.h"
+
+#define CLIENT_NAME "MeanTorrent"
+
+// returns the index of addr in addrs, -1 if it isn't there.
+static int find_addr(struct peer_addr *addrs, int num, struct peer_addr *addr)
+{
+	int i;
+
+	for(i = 0; i < num; i++)
+	{
+		if(addrs[i].port == addr->port && strcmp(addrs[i].ip, addr->ip) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// appends the compact form of addr if it is of the given family: 4 byte (IPv4) or 16 byte (IPv6) ip
+// followed by a 2 byte port. returns the number of bytes appended.
+static int append_compact(uint8_t *buf, struct peer_addr *addr, int family)
+{
+	uint16_t port = htons(addr->port);
+	int ip_len = (family == AF_INET6) ? 16 : 4;
+
+	if(inet_pton(family, addr->ip, buf) != 1)
+	{
+		return 0;
+	}
+	memcpy(buf + ip_len, &port, 2);
+
+	return ip_len + 2;
+}
+
+// notes the peers of a compact 'added' or 'added6' string whose flags, from 'added.f' or 'added6.f',
+// say they take uTP connections.
+static void note_utp_peers(const char *str, int len, const char *flags, int num_flags, int family)
+{
+	int entry_len = (family == AF_INET6) ? 18 : 6;
+	int i;
+	uint16_t port;
+	char ip[INET6_ADDRSTRLEN];
+
+	for(i = 0; (i + 1) * entry_len <= len && i < num_flags && i < PWP_MAX_PEX_PEERS; i++)
+	{
+		if(flags[i] & PEX_FLAG_UTP)
+		{
+			inet_ntop(family, str + i * entry_len, ip, sizeof(ip));
+			memcpy(&port, str + (i + 1) * entry_len - 2, 2);
+			utp_note_peer(ip, ntohs(port), 1);
+		}
+	}
+}
+
+// adds the peers of a compact 'added' (IPv4) or 'added6' (IPv6) string to the torrent's pool.
+static int add_compact_peers(struct peer_pool *pool, const char *str, int len, int family)
+{
+	int entry_len = (family == AF_INET6) ? 18 : 6;
+	int i, added = 0;
+	uint16_t port;
+	char ip[INET6_ADDRSTRLEN];
+
+	for(i = 0; i + entry_len <= len && i < PWP_MAX_PEX_PEERS * entry_len; i += entry_len)
+	{
+		inet_ntop(family, str + i, ip, sizeof(ip));
+		memcpy(&port, str + i + entry_len - 2, 2);
+		added += peer_pool_add(pool, ip, ntohs(port), PEER_POOL_PRIORITY_PEX);
+	}
+
+	return added;
+}
+
+// wraps a bencoded payload into an EXTENDED message with the given extension id.
+static uint8_t *compose_extended(uint8_t ext_id, uint8_t *payload, int payload_len, int *len)
+{
+	uint8_t *msg;
+	int l;
+
+	*len = 4 + 1 + 1 + payload_len;
+	msg = malloc(*len);
+	l = htonl(2 + payload_len);
+	memcpy(msg, &l, 4);
+	msg[4] = EXTENDED_MSG_ID;
+	msg[5] = ext_id;
+	memcpy(msg + 6, payload, payload_len);
+
+	return msg;
+}
+
+uint8_t *extension_compose_handshake(int *len)
+{
+	char dict[128];
+	int n;
+
+	n = sprintf(dict, "d1:md11:ut_metadatai%de6:ut_pexi%dee1:pi%de1:v%d:%se", EXTENSION_UT_METADATA_ID, EXTENSION_UT_PEX_ID,
+		PWP_LISTEN_PORT, (int)strlen(CLIENT_NAME), CLIENT_NAME);
+
+	return compose_extended(EXTENSION_HANDSHAKE_ID, (uint8_t *)dict, n, len);
+}
+
+int extension_process_msg(uint8_t *msg, struct pwp_peer *peer)
+{
+	int len = ntohl(*((int *)msg)) - 2; // length of the payload after the message id and extension id
+	uint8_t ext_id;
+	uint8_t *payload;
+	int rv;
+
+	if(len < 0)
+	{
+		bf_log("[ERROR] extension_process_msg(): EXTENDED message is too short.\n");
+		return -1;
+	}
+	ext_id = msg[5];
+
+	// the bencode parser expects a terminated string so work on a copy.
+	payload = malloc(len + 1);
+	memcpy(payload, msg + 6, len);
+	payload[len] = '\0';
+
+	switch(ext_id)
+	{
+		case EXTENSION_HANDSHAKE_ID:
+			bf_log("*-*-* Got extended HANDSHAKE message.\n");
+			rv = extension_process_handshake(payload, len, peer);
+			break;
+		case EXTENSION_UT_PEX_ID:
+			bf_log("*-*-* Got ut_pex message.\n");
+			rv = extension_process_pex(payload, len, peer);
+			break;
+		case EXTENSION_UT_METADATA_ID:
+			bf_log("*-*-* Got ut_metadata message.\n");
+			rv = extension_process_metadata(payload, len, peer);
+			break;
+		default:
+			bf_log("[LOG] extension_process_msg(): Ignoring message for unknown extension id %d.\n", ext_id);
+			rv = 0;
+			break;
+	}
+
+	free(payload);
+	return rv;
+}
+
+int extension_process_handshake(uint8_t *payload, int len, struct pwp_peer *peer)
+{
+	bencode_t b1, b2, b3;
+	const char *key;
+	int klen;
+	long int num;
+
+	bencode_init(&b1, (const char *)payload, len);
+	if(!bencode_is_dict(&b1))
+	{
+		bf_log("[ERROR] extension_process_handshake(): Extended handshake is not a dictionary.\n");
+		return -1;
+	}
+
+	while(bencode_dict_has_next(&b1))
+	{
+		bencode_dict_get_next(&b1, &b2, &key, &klen);
+		if(klen == 1 && strncmp(key, "m", 1) == 0 && bencode_is_dict(&b2))
+		{
+			while(bencode_dict_has_next(&b2))
+			{
+				bencode_dict_get_next(&b2, &b3, &key, &klen);
+				if(klen == 6 && strncmp(key, "ut_pex", 6) == 0 && bencode_is_int(&b3))
+				{
+					bencode_int_value(&b3, &num);
+					peer->ut_pex_id = (num > 0 && num < 256) ? (int)num : 0;
+				}
+				else if(klen == 11 && strncmp(key, "ut_metadata", 11) == 0 && bencode_is_int(&b3))
+				{
+					bencode_int_value(&b3, &num);
+					peer->ut_metadata_id = (num > 0 && num < 256) ? (int)num : 0;
+				}
+			}
+		}
+		else if(klen == 1 && strncmp(key, "p", 1) == 0 && bencode_is_int(&b2))
+		{
+			bencode_int_value(&b2, &num);
+			// for inbound peers this is the only way to learn the port they can be reached at.
+			if(peer->addr.port == 0 && num > 0 && num < 65536)
+			{
+				peer->addr.port = (uint16_t)num;
+			}
+		}
+		else if(klen == 13 && strncmp(key, "metadata_size", 13) == 0 && bencode_is_int(&b2))
+		{
+			bencode_int_value(&b2, &num);
+			magnet_metadata_set_size(num);
+		}
+	}
+
+	bf_log("[LOG] extension_process_handshake(): Peer's ut_pex id is %d and ut_metadata id is %d.\n", peer->ut_pex_id, peer->ut_metadata_id);
+	return 0;
+}
+
+int extension_process_pex(uint8_t *payload, int len, struct pwp_peer *peer)
+{
+	bencode_t b1, b2;
+	const char *key, *str;
+	const char *peers[2] = {NULL, NULL}; // the 'added' and 'added6' strings, which come before their flags
+	int klen, slen, added = 0, num_peers[2];
+
+	bencode_init(&b1, (const char *)payload, len);
+	if(!bencode_is_dict(&b1))
+	{
+		bf_log("[ERROR] extension_process_pex(): ut_pex message is not a dictionary.\n");
+		return -1;
+	}
+
+	while(bencode_dict_has_next(&b1))
+	{
+		bencode_dict_get_next(&b1, &b2, &key, &klen);
+		if(!bencode_is_string(&b2))
+		{
+			continue;
+		}
+		if(klen == 5 && strncmp(key, "added", 5) == 0)
+		{
+			bencode_string_value(&b2, &peers[0], &num_peers[0]);
+			added += add_compact_peers(&peer->torrent->peer_pool, peers[0], num_peers[0], AF_INET);
+		}
+		else if(klen == 6 && strncmp(key, "added6", 6) == 0)
+		{
+			bencode_string_value(&b2, &peers[1], &num_peers[1]);
+			added += add_compact_peers(&peer->torrent->peer_pool, peers[1], num_peers[1], AF_INET6);
+		}
+		else if(klen == 7 && strncmp(key, "added.f", 7) == 0 && peers[0])
+		{
+			bencode_string_value(&b2, &str, &slen);
+			note_utp_peers(peers[0], num_peers[0], str, slen, AF_INET);
+		}
+		else if(klen == 8 && strncmp(key, "added6.f", 8) == 0 && peers[1])
+		{
+			bencode_string_value(&b2, &str, &slen);
+			note_utp_peers(peers[1], num_peers[1], str, slen, AF_INET6);
+		}
+	}
+
+	bf_log("[LOG] extension_process_pex(): %d new peers from peer exchange.\n", added);
+	return 0;
+}
+
+// removes piece from the peer's outstanding metadata requests. returns -1 if we didn't ask for it.
+static int forget_metadata_request(struct pwp_peer *peer, int piece)
+{
+	int i;
+
+	for(i = 0; i < peer->num_metadata_requests; i++)
+	{
+		if(peer->metadata_requests[i] == piece)
+		{
+			peer->metadata_requests[i] = peer->metadata_requests[--peer->num_metadata_requests];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int extension_process_metadata(uint8_t *payload, int len, struct pwp_peer *peer)
+{
+	bencode_t b1, b2;
+	const char *key, *dict;
+	int klen, dict_len;
+	long int num, msg_type = -1, piece = -1;
+	uint8_t *msg;
+	char reply[64];
+	int n, rv = 0;
+
+	bencode_init(&b1, (const char *)payload, len);
+	if(!bencode_is_dict(&b1))
+	{
+		bf_log("[ERROR] extension_process_metadata(): ut_metadata message is not a dictionary.\n");
+		return -1;
+	}
+	bencode_dict_get_start_and_len(&b1, &dict, &dict_len);
+	while(bencode_dict_has_next(&b1))
+	{
+		bencode_dict_get_next(&b1, &b2, &key, &klen);
+		if(!bencode_is_int(&b2))
+		{
+			continue;
+		}
+		bencode_int_value(&b2, &num);
+		if(klen == 8 && strncmp(key, "msg_type", 8) == 0)
+		{
+			msg_type = num;
+		}
+		else if(klen == 5 && strncmp(key, "piece", 5) == 0)
+		{
+			piece = num;
+		}
+	}
+
+	switch(msg_type)
+	{
+		case 0: // request
+			if(!peer->ut_metadata_id)
+			{
+				break;
+			}
+			n = sprintf(reply, "d8:msg_typei2e5:piecei%ldee", piece);
+			msg = compose_extended((uint8_t)peer->ut_metadata_id, (uint8_t *)reply, n, &n);
+			rv = pwp_send(peer, msg, n);
+			free(msg);
+			break;
+		case 1: // data, which follows the dictionary
+			if(forget_metadata_request(peer, (int)piece) != 0)
+			{
+				break;
+			}
+			if(magnet_metadata_add_piece((int)piece, payload + dict_len, len - dict_len) != 0)
+			{
+				rv = -1;
+			}
+			break;
+		case 2: // reject
+			if(forget_metadata_request(peer, (int)piece) == 0)
+			{
+				magnet_metadata_release_piece((int)piece);
+			}
+			bf_log("[LOG] extension_process_metadata(): Peer rejected our request for metadata piece %ld.\n", piece);
+			// it won't give us the rest either.
+			peer->ut_metadata_id = 0;
+			break;
+	}
+
+	return rv;
+}
+
+int extension_request_metadata(struct pwp_peer *peer, int piece)
+{
+	char request[64];
+	uint8_t *msg;
+	int n, rv;
+
+	if(!peer->ut_metadata_id || peer->num_metadata_requests == PWP_MAX_METADATA_REQUESTS)
+	{
+		return -1;
+	}
+	n = sprintf(request, "d8:msg_typei0e5:piecei%dee", piece);
+	msg = compose_extended((uint8_t)peer->ut_metadata_id, (uint8_t *)request, n, &n);
+	rv = pwp_send(peer, msg, n);
+	free(msg);
+	if(rv == 0)
+	{
+		peer->metadata_requests[peer->num_metadata_requests++] = piece;
+	}
+
+	return rv;
+}
+
+uint8_t *extension_compose_pex(struct pwp_peer *peer, int *len)
+{
+	struct peer_addr current[PWP_MAX_PEX_PEERS];
+	struct pwp_peer_node *node;
+	uint8_t *payload, *curr, *added[2], *flags[2], *dropped[2], *msg;
+	int num_current, num_added[2], num_dropped[2], i, n, f, compact_len;
+	int families[2] = {AF_INET, AF_INET6};
+
+	if(!peer->ut_pex_id)
+	{
+		return NULL;
+	}
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&peer->torrent->connected_peers_mutex);
+
+	num_current = 0;
+	for(node = peer->torrent->connected_peers; node && num_current < PWP_MAX_PEX_PEERS; node = node->next)
+	{
+		if(node->peer != peer && node->peer->addr.port != 0)
+		{
+			current[num_current++] = node->peer->addr;
+		}
+	}
+
+	pthread_mutex_unlock(&peer->torrent->connected_peers_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	// IPv4 peers go in added/dropped and IPv6 ones in added6/dropped6
+	for(f = 0; f < 2; f++)
+	{
+		added[f] = malloc(num_current * 18 + 1);
+		flags[f] = malloc(num_current + 1);
+		dropped[f] = malloc(peer->num_pex_sent * 18 + 1);
+		num_added[f] = 0;
+		num_dropped[f] = 0;
+		for(i = 0, n = 0; i < num_current; i++)
+		{
+			if(find_addr(peer->pex_sent, peer->num_pex_sent, &current[i]) == -1
+				&& (compact_len = append_compact(added[f] + num_added[f], &current[i], families[f])) > 0)
+			{
+				num_added[f] += compact_len;
+				flags[f][n++] = utp_peer_supported(current[i].ip, current[i].port) ? PEX_FLAG_UTP : 0;
+			}
+		}
+		for(i = 0; i < peer->num_pex_sent; i++)
+		{
+			if(find_addr(current, num_current, &peer->pex_sent[i]) == -1)
+			{
+				num_dropped[f] += append_compact(dropped[f] + num_dropped[f], &peer->pex_sent[i], families[f]);
+			}
+		}
+	}
+	memcpy(peer->pex_sent, current, num_current * sizeof(struct peer_addr));
+	peer->num_pex_sent = num_current;
+
+	msg = NULL;
+	if(num_added[0] || num_dropped[0] || num_added[1] || num_dropped[1])
+	{
+		payload = malloc(128 + num_added[0] + num_added[0] / 6 + num_dropped[0] + num_added[1] + num_added[1] / 18 + num_dropped[1]);
+		curr = payload;
+		*curr++ = 'd';
+		for(f = 0; f < 2; f++)
+		{
+			n = num_added[f] / (f ? 18 : 6);
+			curr += sprintf((char *)curr, "%d:%s%d:", f ? 6 : 5, f ? "added6" : "added", num_added[f]);
+			memcpy(curr, added[f], num_added[f]);
+			curr += num_added[f];
+			curr += sprintf((char *)curr, "%d:%s%d:", f ? 8 : 7, f ? "added6.f" : "added.f", n);
+			memcpy(curr, flags[f], n);
+			curr += n;
+		}
+		for(f = 0; f < 2; f++)
+		{
+			curr += sprintf((char *)curr, "%d:%s%d:", f ? 8 : 7, f ? "dropped6" : "dropped", num_dropped[f]);
+			memcpy(curr, dropped[f], num_dropped[f]);
+			curr += num_dropped[f];
+		}
+		*curr++ = 'e';
+
+		msg = compose_extended((uint8_t)peer->ut_pex_id, payload, curr - payload, len);
+		free(payload);
+		bf_log("[LOG] extension_compose_pex(): %d added and %d dropped peers.\n", num_added[0] / 6 + num_added[1] / 18, num_dropped[0] / 6 + num_dropped[1] / 18);
+	}
+
+	for(f = 0; f < 2; f++)
+	{
+		free(added[f]);
+		free(flags[f]);
+		free(dropped[f]);
+	}
+
+	return msg;
+}
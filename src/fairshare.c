@@ -0,0 +1,251 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<limits.h>
+
+#include "fairshare.h"
+
+#include "pwp.h"
+#include "ratelimit.h"
+#include "bf_logger.h"
+
+#define SATURATED_PERCENT 90 // a torrent using this much of its share is taken to want more
+
+// one torrent in one direction while the global rate is divided.
+struct demand
+{
+	struct pwp_torrent *torrent;
+	long int demand; // bytes per second, LONG_MAX if it would take any amount
+	long int share;
+	int done;
+};
+
+static void divide(struct demand *demands, int n, long int total);
+static long int estimate_demand(long int used, long int share, long int limit);
+
+void fairshare_init(struct fairshare *fs)
+{
+	memset(fs, 0, sizeof(struct fairshare));
+	fs->weight = FAIRSHARE_DEFAULT_WEIGHT;
+}
+
+int fairshare_max_threads(struct pwp_torrent *t)
+{
+	return t->tune.limit * t->share.weight;
+}
+
+// the bucket's rate is the lower of the limit and the share, where 0 stands for no limit or no share.
+static long int combine(long int limit, long int share)
+{
+	if(limit == RATELIMIT_UNLIMITED)
+	{
+		return share;
+	}
+	if(share == 0)
+	{
+		return limit;
+	}
+	return limit < share ? limit : share;
+}
+
+void fairshare_apply(struct pwp_torrent *t)
+{
+	long int rate;
+
+	rate = combine(t->share.download_limit, t->share.download_share);
+	if(ratelimit_get_rate(&t->download_bucket) != rate)
+	{
+		ratelimit_set_rate(&t->download_bucket, rate);
+	}
+	rate = combine(t->share.upload_limit, t->share.upload_share);
+	if(ratelimit_get_rate(&t->upload_bucket) != rate)
+	{
+		ratelimit_set_rate(&t->upload_bucket, rate);
+	}
+}
+
+void fairshare_rebalance(struct pwp_torrent *torrents, long int elapsed_ms)
+{
+	struct demand *down, *up;
+	struct pwp_torrent *t;
+	long int global_down, global_up, used;
+	uint64_t total;
+	int i, n;
+
+	if(elapsed_ms <= 0)
+	{
+		return;
+	}
+	for(n = 0, t = torrents; t; t = t->next, n++);
+	if(n == 0)
+	{
+		return;
+	}
+	down = malloc(sizeof(struct demand) * n);
+	up = malloc(sizeof(struct demand) * n);
+	global_down = ratelimit_get_rate(&g_global_download_bucket);
+	global_up = ratelimit_get_rate(&g_global_upload_bucket);
+
+	for(i = 0, t = torrents; t; t = t->next, i++)
+	{
+		total = ratelimit_get_used(&t->download_bucket);
+		used = (long int)((total - t->share.downloaded) * 1000 / elapsed_ms);
+		t->share.downloaded = total;
+		t->share.download_rate = used;
+		down[i].torrent = t;
+		down[i].demand = estimate_demand(used, t->share.download_share, t->share.download_limit);
+
+		total = ratelimit_get_used(&t->upload_bucket);
+		used = (long int)((total - t->share.uploaded) * 1000 / elapsed_ms);
+		t->share.uploaded = total;
+		t->share.upload_rate = used;
+		up[i].torrent = t;
+		up[i].demand = estimate_demand(used, t->share.upload_share, t->share.upload_limit);
+	}
+
+	// without a global limit the torrents don't compete for anything we know the size of.
+	if(global_down != RATELIMIT_UNLIMITED)
+	{
+		divide(down, n, global_down);
+	}
+	if(global_up != RATELIMIT_UNLIMITED)
+	{
+		divide(up, n, global_up);
+	}
+
+	for(i = 0; i < n; i++)
+	{
+		t = down[i].torrent;
+		t->share.download_share = global_down == RATELIMIT_UNLIMITED ? 0 : down[i].share;
+		t->share.upload_share = global_up == RATELIMIT_UNLIMITED ? 0 : up[i].share;
+		fairshare_apply(t);
+	}
+
+	free(down);
+	free(up);
+}
+
+// a torrent that got close to its share is limited by it and would take more. otherwise it is
+// given room to grow by a quarter of what it used.
+static long int estimate_demand(long int used, long int share, long int limit)
+{
+	long int demand, headroom;
+
+	if(share == 0 || used * 100 >= share * SATURATED_PERCENT)
+	{
+		demand = LONG_MAX;
+	}
+	else
+	{
+		headroom = used / 4;
+		demand = used + (headroom > FAIRSHARE_MIN_HEADROOM ? headroom : FAIRSHARE_MIN_HEADROOM);
+	}
+	if(limit != RATELIMIT_UNLIMITED && limit < demand)
+	{
+		demand = limit;
+	}
+
+	return demand;
+}
+
+// weighted max-min fairness, one priority at a time from the highest. within a priority, every
+// torrent whose demand is below its weighted share of what is left gets its demand, and the
+// rest is divided again among the others until all of them want at least their share.
+static void divide(struct demand *demands, int n, long int total)
+{
+	long int remaining = total, fair, fixed;
+	int i, priority = INT_MIN, found, weights, num_fixed;
+
+	for(i = 0; i < n; i++)
+	{
+		demands[i].done = 0;
+		demands[i].share = 0;
+	}
+
+	while(1)
+	{
+		found = 0;
+		for(i = 0; i < n; i++)
+		{
+			if(!demands[i].done && (!found || demands[i].torrent->share.priority > priority))
+			{
+				priority = demands[i].torrent->share.priority;
+				found = 1;
+			}
+		}
+		if(!found)
+		{
+			break;
+		}
+
+		do
+		{
+			weights = 0;
+			for(i = 0; i < n; i++)
+			{
+				if(!demands[i].done && demands[i].torrent->share.priority == priority)
+				{
+					weights += demands[i].torrent->share.weight;
+				}
+			}
+			if(weights == 0)
+			{
+				break;
+			}
+			fixed = 0;
+			num_fixed = 0;
+			for(i = 0; i < n; i++)
+			{
+				if(demands[i].done || demands[i].torrent->share.priority != priority)
+				{
+					continue;
+				}
+				fair = remaining / weights * demands[i].torrent->share.weight;
+				if(demands[i].demand <= fair)
+				{
+					demands[i].share = demands[i].demand;
+					demands[i].done = 1;
+					fixed += demands[i].demand;
+					num_fixed++;
+				}
+			}
+			remaining -= fixed;
+		} while(num_fixed > 0);
+
+		// the torrents left want more than their share. they get it and lower priorities get what remains.
+		for(i = 0; i < n; i++)
+		{
+			if(!demands[i].done && demands[i].torrent->share.priority == priority)
+			{
+				demands[i].share = remaining / weights * demands[i].torrent->share.weight;
+				demands[i].done = 1;
+			}
+		}
+		if(weights > 0)
+		{
+			remaining = 0;
+		}
+	}
+
+	// what nobody wants now is spread by weight too, so a torrent that speeds up isn't held back
+	// until the next rebalance.
+	if(remaining > 0)
+	{
+		for(i = 0, weights = 0; i < n; i++)
+		{
+			weights += demands[i].torrent->share.weight;
+		}
+		for(i = 0; i < n; i++)
+		{
+			demands[i].share += remaining / weights * demands[i].torrent->share.weight;
+		}
+	}
+	for(i = 0; i < n; i++)
+	{
+		if(demands[i].share < FAIRSHARE_MIN_RATE)
+		{
+			demands[i].share = FAIRSHARE_MIN_RATE;
+		}
+	}
+}
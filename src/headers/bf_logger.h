@@ -13,6 +13,9 @@ int bf_log(const char *format, ...);
 
 int bf_log_binary(const char *description, uint8_t *data, int len);
 
+// messages are echoed to standard output unless this is turned off.
+void bf_logger_echo(int enable);
+
 void bf_logger_end();
 
 #endif // BF_LOGGER_H
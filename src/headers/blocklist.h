@@ -0,0 +1,40 @@
+#ifndef BLOCKLIST_H
+#define BLOCKLIST_H
+
+#pragma once
+
+/*
+IP blocklist: addresses we never connect to and never accept a connection from.
+
+blocklist_load() reads a text file with one entry per line, any of
+
+	10.0.0.0/8		2001:db8::/32		CIDR
+	1.2.3.4-1.2.3.250	2001:db8::1-2001:db8::ff	a range, both ends included
+	Some name:1.2.3.4-1.2.3.250				the P2P (PeerGuardian) format
+	192.0.2.7		2001:db8::7		a single address
+
+Blank lines and lines starting with # are skipped, as are lines that can't be parsed. The ranges
+are kept as two arrays, IPv4 and IPv6, sorted by their first address with overlapping ranges
+merged, so an IPv4 range takes 8 bytes and a lookup is a binary search: about 20 steps for a
+million ranges. Every candidate peer is checked as it is added to a peer pool, whatever its
+source (see peer_pool_add()), and every inbound connection before a thread is started for it.
+IPv4 mapped IPv6 addresses are looked up as IPv4.
+
+Load the lists before session_start(). Lookups don't lock: the tables aren't changed afterwards.
+*/
+
+#define BLOCKLIST_MAX_LINE 512
+
+// adds the ranges in the file at path to the blocklist. returns the number of ranges read or -1 if
+// the file can't be read.
+int blocklist_load(const char *path);
+
+// returns 1 if the address, IPv4 or IPv6 in text form, is on the blocklist.
+int blocklist_contains(const char *ip);
+
+// number of ranges after merging.
+int blocklist_size();
+
+void blocklist_free();
+
+#endif // BLOCKLIST_H
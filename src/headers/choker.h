@@ -0,0 +1,35 @@
+#ifndef CHOKER_H
+#define CHOKER_H
+
+#pragma once
+
+struct pwp_peer_node;
+
+/*
+Tit-for-tat choker.
+
+Every round the interested peers are ranked by the rate at which they gave us data (or, once we
+are seeding, by the rate at which we uploaded to them) and the best CHOKER_UPLOAD_SLOTS - 1 of them
+are unchoked. One more slot goes to an optimistic unchoke, a random choked interested peer, which
+is rotated every CHOKER_OPTIMISTIC_ROUNDS rounds so that new peers get a chance to prove themselves.
+Everyone else is choked.
+*/
+
+#define CHOKER_INTERVAL_MS 10000
+#define CHOKER_UPLOAD_SLOTS 4 // includes the optimistic unchoke
+#define CHOKER_OPTIMISTIC_ROUNDS 3
+
+struct choker
+{
+	int round;
+};
+
+void choker_init(struct choker *c);
+
+// runs one choke round over the connected peers. NOTE: the caller must hold the lock of the list.
+void choker_run(struct choker *c, struct pwp_peer_node *peers, int seeding);
+
+// returns 1 if fewer than CHOKER_UPLOAD_SLOTS peers are unchoked. NOTE: the caller must hold the lock of the list.
+int choker_has_free_slot(struct pwp_peer_node *peers);
+
+#endif // CHOKER_H
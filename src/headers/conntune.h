@@ -0,0 +1,85 @@
+#ifndef CONNTUNE_H
+#define CONNTUNE_H
+
+#pragma once
+
+#include<stdint.h>
+#include<pthread.h>
+
+/*
+Connection count tuning: how many outbound peer threads a torrent runs.
+
+How many connections are worth having depends on the swarm, the link and the peers, so it isn't
+fixed. Every torrent starts at MAX_THREADS per unit of weight and session_run() calls
+conntune_update() every second. Every CONNTUNE_INTERVAL_MS that measures the torrent's download
+rate and the rate per connection and hill climbs:
+
+	- a step up is judged CONNTUNE_SETTLE_INTERVALS measurements after it was taken, as a new
+	  thread takes a while to connect, handshake and be unchoked. the limit goes up again if the
+	  rate rose by CONNTUNE_GAIN_PERCENT or more since the step. if it didn't, the rate has
+	  levelled off: the step is taken back and the limit is held for CONNTUNE_HOLD_INTERVALS
+	  before probing up once more.
+	- if the rate per connection fell below CONNTUNE_COLLAPSE_PERCENT of what it was without the
+	  rate going up, the connections are only splitting the bandwidth or choking the link, and a
+	  quarter of them are given up.
+	- otherwise, once the hold is over, the limit is probed up by one.
+	- the limit isn't changed while the torrent runs fewer threads than it may, as then the peers
+	  it knows of are what holds it back, nor while nothing is downloaded.
+
+The limit stays between CONNTUNE_MIN_LIMIT and CONNTUNE_MAX_LIMIT per unit of weight (see
+fairshare.h) and the session's free slots cap it in any case. Threads don't end when the limit goes
+down: after a piece, get_pieces() asks conntune_should_leave() and, while the torrent runs more
+threads than it may, the peers downloading no faster than the average of its threads leave.
+
+Every decision is logged with the rates behind it. `--connections N` fixes the limit instead
+(conntune_set_fixed()); the rates are logged all the same, so a hand-picked limit can be compared
+with the tuned ones.
+
+conntune_update() is called with the session lock held, which guards the limit too. What the
+peer threads ask about is guarded by the mutex of the struct.
+*/
+
+#define CONNTUNE_INTERVAL_MS 5000
+#define CONNTUNE_SETTLE_INTERVALS 3 // covers the uTP attempt and the RECV_TIMEOUT_SECS wait for the bitfield
+#define CONNTUNE_GAIN_PERCENT 10
+#define CONNTUNE_COLLAPSE_PERCENT 50
+#define CONNTUNE_HOLD_INTERVALS 6
+#define CONNTUNE_MIN_LIMIT 1
+#define CONNTUNE_MAX_LIMIT 16 // SESSION_MAX_THREADS
+
+struct pwp_torrent;
+
+struct conntune
+{
+	int limit; // threads per unit of weight
+	int fixed; // 1 if set by hand and not tuned
+	uint64_t downloaded; // bucket usage at the last measurement
+	long int elapsed_ms; // since the last measurement
+	long int last_rate; // bytes per second at the last measurement
+	int last_step; // 1 while a step up is being judged
+	long int step_rate; // bytes per second when the limit went up last
+	int settling; // measurements left before the last step is judged
+	int holds; // measurements left before the limit is probed up again
+	// the rest is guarded by mutex.
+	long int last_rate_per_thread;
+	int excess; // threads that should leave
+	pthread_mutex_t mutex;
+};
+
+void conntune_init(struct conntune *ct);
+
+void conntune_destroy(struct conntune *ct);
+
+// fixes the limit of the torrents created after the call at limit threads per unit of weight. 0
+// turns tuning back on.
+void conntune_set_fixed(int limit);
+
+// measures the torrent and adjusts its limit, elapsed_ms after the last call.
+// NOTE: must be called with the session lock held.
+void conntune_update(struct pwp_torrent *t, long int elapsed_ms);
+
+// returns 1 if an outbound peer thread downloading at download_rate bytes per second should leave
+// for the torrent to get down to its limit.
+int conntune_should_leave(struct conntune *ct, long int download_rate);
+
+#endif // CONNTUNE_H
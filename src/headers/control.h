@@ -0,0 +1,63 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#pragma once
+
+#include<stdint.h>
+
+/*
+The control socket of a client running as a daemon (mtc --daemon).
+
+The client listens on a Unix domain socket, CONTROL_DEFAULT_PATH in the working directory unless
+another path is given. A client such as mtcctl connects, sends one command as a line of text and
+reads the reply until the connection is closed. The reply is zero or more lines of output followed
+by a line with either OK or ERROR and the reason:
+
+	add <torrent-file-or-magnet-link>	replies with its info hash and adds the torrent once
+						it is prepared
+	remove <id>				takes the torrent out of the session; its files are kept
+	pause <id>				drops its connections until it is resumed
+	resume <id>
+	share <id> <weight> <priority>		see fairshare.h
+	limit <id> <download> <upload>		rate limits of the torrent in KiB/s, 0 for none (see
+						pwp_set_rate_limits())
+	limit global <download> <upload>	the global rate limits, as --download-rate and
+						--upload-rate set them at startup
+	priority <id> <priority>:<pieces>	e.g. skip:100- or high:0-9, see pwp_parse_piece_priority()
+	list					one line per torrent: info hash, state, pieces had/total,
+						download and upload rate in bytes per second, peers,
+						threads, weight, priority and name
+	stats <id>				one "key value" line per statistic of the torrent, and a
+						socket line per TCP peer (see socktune.h)
+	shutdown				stops the daemon
+
+<id> is the info hash of the torrent in hex or any prefix of it that matches only one torrent.
+
+One thread serves the connections one after the other, so a command is never run while another
+one is. A torrent file is read from the daemon's side, so its path must be absolute or relative
+to the daemon's working directory.
+
+Preparing a torrent announces it to its tracker, and a magnet link's metadata has to be fetched
+from peers first, which can take minutes. So add only works out the info hash, which takes no
+network, and replies with it. An add thread then prepares the torrents one after the other and
+adds each to the session when it is ready. Until then list shows it as preparing and the other
+commands don't know it. One that fails to be prepared is logged and dropped.
+*/
+
+#define CONTROL_DEFAULT_PATH "mtc.sock"
+#define CONTROL_MAX_LINE 4096
+
+struct pwp_torrent;
+
+// the info hash of what was given to add, without touching the network. returns -1 on error.
+typedef int (*control_hash_callback)(char *arg, uint8_t *info_hash);
+
+// makes a torrent, not yet added to the session, from what was given to add. returns NULL on error.
+typedef struct pwp_torrent *(*control_add_callback)(char *arg);
+
+// listens on the socket at path and serves commands until control_stop().
+int control_start(const char *path, control_hash_callback hash, control_add_callback add);
+
+void control_stop();
+
+#endif // CONTROL_H
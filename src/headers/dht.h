@@ -0,0 +1,64 @@
+#ifndef DHT_H
+#define DHT_H
+
+#pragma once
+
+#include<stdint.h>
+
+/*
+Mainline DHT (BEP 5).
+
+We run one DHT node on UDP port DHT_PORT. Its routing table has one bucket of up to DHT_K nodes
+per length of the id prefix a node shares with ours, so it knows many nodes close to us and a few
+far away. Nodes get into the table by answering our queries or by querying us. They are dropped
+after DHT_MAX_FAILURES unanswered queries in a row, or replaced when their bucket is full.
+
+Peers for each torrent of the session are found with an iterative get_peers search. It keeps the
+DHT_SEARCH_NODES nodes closest to the info hash that it knows of. At most DHT_ALPHA of them are
+queried at a time, and every answer brings closer nodes or peers. The peers go into the torrent's
+peer pool with PEER_POOL_PRIORITY_DHT. Once the DHT_K closest nodes have answered, or have failed to, we are
+announced to those that answered, using the token each of them gave us. The search is repeated
+every DHT_SEARCH_INTERVAL_MS.
+
+Other nodes' queries are answered too: ping, find_node, get_peers and announce_peer. We store the
+peers announced to us, at most DHT_MAX_STORED_PEERS for each of DHT_MAX_STORED_TORRENTS torrents.
+
+The routing table starts from the nodes saved in DHT_CACHE_FILE by the last run, from the
+bootstrap routers, and from the DHT ports that peers send in PORT messages. When the client stops,
+the node id and the good nodes are saved again, so the next start doesn't depend on the routers.
+*/
+
+#define DHT_PORT 6882 // PWP_LISTEN_PORT's UDP port belongs to uTP
+#define DHT_K 8
+#define DHT_ALPHA 3
+#define DHT_SEARCH_NODES 16
+#define DHT_MAX_FAILURES 3
+#define DHT_QUERY_TIMEOUT_MS 2000
+#define DHT_SEARCH_INTERVAL_MS (15 * 60 * 1000)
+#define DHT_TOKEN_INTERVAL_MS (5 * 60 * 1000) // a token is valid for up to twice this
+#define DHT_MAX_STORED_TORRENTS 64
+#define DHT_MAX_STORED_PEERS 32
+#define DHT_MAX_SEARCHES 64 // torrents searched for at a time
+#define DHT_CACHE_FILE "dht.cache" // in the directory mtc runs in
+
+// adds a bootstrap node. the default routers are only used if none is added. call before dht_start().
+void dht_add_bootstrap(const char *host, uint16_t port);
+
+// starts the node, announcing peer_port as ours.
+int dht_start(uint16_t dht_port, uint16_t peer_port);
+
+// stops the node and saves the node cache.
+void dht_stop();
+
+// starts searching for peers of the torrent. does nothing if the node isn't running.
+void dht_add_torrent(uint8_t *info_hash);
+
+void dht_remove_torrent(uint8_t *info_hash);
+
+// returns 1 until the first search for peers of the torrent has finished.
+int dht_searching(uint8_t *info_hash);
+
+// pings a node learnt from a peer's PORT message, so that it can get into the routing table.
+void dht_add_node(const char *ip, uint16_t port);
+
+#endif // DHT_H
@@ -0,0 +1,79 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#pragma once
+
+#include<stdint.h>
+
+
+/*
+Disk writers and hash workers, shared by all torrents of the session.
+
+A peer's thread doesn't write the blocks it receives to the saved file itself. diskio_write()
+queues each block and one of DISKIO_WRITERS writer threads puts it at its offset with pwrite(). At
+most DISKIO_MAX_QUEUED blocks wait in the queues; beyond that diskio_write() blocks, so a peer that
+sends faster than the disk can take it is held back rather than filling up memory. Every torrent
+has its own queue, and the writers and the queue space are shared between them by weight (see
+fairshare.h).
+
+Once all blocks of a piece are in, diskio_verify() waits for the writes of that piece and has one
+of DISKIO_HASHERS hash workers read the piece back and check its SHA1 with verify_piece(). A
+failed write makes the verification fail, and the piece is downloaded again. A thread that
+mustn't block, such as the web seeds' curl thread, uses diskio_verify_start() instead: the piece is
+parked until its writes are done, then hashed, and the thread picks up the result later with
+diskio_verify_result().
+
+Blocks of a piece that is complete, or sealed by a verified hedged copy (see stream.h), are dropped
+by the writers instead of being written over the verified data.
+*/
+
+#define DISKIO_WRITERS 2
+#define DISKIO_HASHERS 2
+#define DISKIO_MAX_QUEUED 256 // blocks, i.e. 4 MiB of 16 KiB blocks
+#define DISKIO_MIN_QUEUED 16 // blocks any torrent may queue, whatever its share
+#define DISKIO_PENDING 1 // diskio_verify_result() of a piece not hashed yet
+
+struct pwp_torrent;
+struct diskio_job;
+
+// a torrent's blocks waiting to be written. only touched by diskio.c, under its lock.
+struct diskio_queue
+{
+	struct diskio_job *head;
+	struct diskio_job *tail;
+	int queued;
+	long int deficit; // bytes the queue may still write in its current turn
+	int weight; // of the torrent when the queue became active
+	int priority;
+	int active; // 1 while it is on the round robin list
+	struct diskio_queue *next;
+};
+
+int diskio_start();
+
+// writes out the queue and stops the workers.
+void diskio_stop();
+
+// queues len bytes for the torrent's saved file at offset, which lies in piece idx. data must
+// have come from malloc(); it is freed once written.
+void diskio_write(struct pwp_torrent *t, int idx, long int offset, uint8_t *data, int len);
+
+// returns 0 if piece idx, as written to the saved file, matches its hash.
+int diskio_verify(struct pwp_torrent *t, int idx);
+
+// called by a hash worker when a diskio_verify_start() job is done. NOTE: called with diskio's lock
+// held, so it must not block or call into diskio.
+typedef void (*diskio_done_callback)(void *arg);
+
+// like diskio_verify() but returns at once. done(arg) is called, if done isn't NULL, once the
+// result is in.
+struct diskio_job *diskio_verify_start(struct pwp_torrent *t, int idx, diskio_done_callback done, void *arg);
+
+// returns DISKIO_PENDING while the job isn't done and wait is 0, otherwise what diskio_verify() would
+// have, after waiting for it if need be. the job is freed unless DISKIO_PENDING is returned.
+int diskio_verify_result(struct diskio_job *job, int wait);
+
+// waits until every write queued for the torrent is done, e.g. before the torrent is destroyed.
+void diskio_wait(struct pwp_torrent *t);
+
+#endif // DISKIO_H
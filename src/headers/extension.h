@@ -0,0 +1,55 @@
+#ifndef EXTENSION_H
+#define EXTENSION_H
+
+#pragma once
+
+#include<stdint.h>
+
+#include "pwp.h"
+
+/*
+Extension protocol (BEP 10) and Peer Exchange (ut_pex, BEP 11).
+
+If both handshakes set the extension protocol bit, both ends send an extended handshake: a
+bencoded dictionary whose 'm' entry maps the names of the extensions they support to the ids
+they want to receive them with. All extension messages are EXTENDED messages (id 20) whose
+first payload byte is that id, 0 being the extended handshake itself.
+
+ut_pex messages carry the addresses of peers that were connected ('added', 'added6' for IPv6)
+or disconnected ('dropped', 'dropped6') since the last message to the same peer. Addresses we
+receive go into the torrent's peer pool. 'added.f' and 'added6.f' have a byte of flags per added
+peer, of which we use PEX_FLAG_UTP both ways (see utp_peer_supported()).
+
+ut_metadata messages (BEP 9) request, send or reject 16 KiB pieces of the info dictionary. They
+are only used while the metadata of a magnet link is fetched (see magnet.h). We don't keep the
+info dictionary around while downloading, so other peers' requests are always rejected.
+*/
+
+#define EXTENDED_MSG_ID 20
+#define EXTENSION_HANDSHAKE_ID 0
+#define EXTENSION_UT_PEX_ID 1 // id we want to receive ut_pex messages with
+#define EXTENSION_UT_METADATA_ID 2 // and ut_metadata messages
+
+#define PEX_INTERVAL_MS 60000 // BEP 11: at most one ut_pex message per minute
+#define PEX_FLAG_UTP 0x04 // the peer takes uTP connections
+
+// our extended handshake as a complete EXTENDED message.
+uint8_t *extension_compose_handshake(int *len);
+
+// msg is a complete EXTENDED message (length prefix included).
+int extension_process_msg(uint8_t *msg, struct pwp_peer *peer);
+
+int extension_process_handshake(uint8_t *payload, int len, struct pwp_peer *peer);
+
+int extension_process_pex(uint8_t *payload, int len, struct pwp_peer *peer);
+
+int extension_process_metadata(uint8_t *payload, int len, struct pwp_peer *peer);
+
+// asks the peer for one piece of the metadata. the piece is remembered in the peer's metadata requests.
+int extension_request_metadata(struct pwp_peer *peer, int piece);
+
+// composes a ut_pex message with the changes to our connected peers since the last one sent to this
+// peer. returns NULL if the peer doesn't support ut_pex or nothing has changed.
+uint8_t *extension_compose_pex(struct pwp_peer *peer, int *len);
+
+#endif // EXTENSION_H
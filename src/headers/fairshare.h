@@ -0,0 +1,72 @@
+#ifndef FAIRSHARE_H
+#define FAIRSHARE_H
+
+#pragma once
+
+#include<stdint.h>
+
+/*
+Weighted fair sharing between the torrents of a session.
+
+Every torrent has a weight (FAIRSHARE_DEFAULT_WEIGHT unless set with pwp_set_share()) and a
+priority (0 by default). Torrents of a higher priority are always served before those of a lower
+one; torrents of the same priority share by weight. Three things are shared out this way:
+
+Connection slots. session_run() hands out free peer thread slots by deficit round robin: every
+round, each torrent that can use a slot is given 'weight' credits and starts one thread per
+credit. Credits left over because the session ran out of slots carry over to the next round, so
+over time a torrent gets slots in proportion to its weight. A torrent whose peer pool is empty
+loses its credits. A torrent may run up to its connection limit (see conntune.h) threads per unit
+of weight.
+
+Bandwidth. When a global rate limit is set, fairshare_rebalance() divides it among the torrents
+every FAIRSHARE_INTERVAL_MS by weighted max-min fairness. A torrent that used less than its share
+last time is only given what it used plus some headroom, and what it leaves is split among the
+others by weight. The share becomes the rate of the torrent's bucket, capped by any limit set
+with pwp_set_rate_limits(). Peers pace their REQUESTs by that bucket as before, so the share is
+enforced before the data is asked for.
+
+Disk queue depth. The write queue of diskio.h keeps one queue per torrent. The writers take blocks
+from them by deficit round robin, FAIRSHARE_DISK_QUANTUM bytes per unit of weight per turn, and a
+torrent may only queue its weighted share of DISKIO_MAX_QUEUED blocks. So one fast swarm can't
+fill the queue and hold up the peers of the other torrents.
+*/
+
+#define FAIRSHARE_DEFAULT_WEIGHT 1
+#define FAIRSHARE_MAX_WEIGHT 64
+#define FAIRSHARE_INTERVAL_MS 1000
+#define FAIRSHARE_MIN_RATE 2048 // bytes per second a torrent is never pushed below
+#define FAIRSHARE_MIN_HEADROOM 16384 // bytes per second an unsaturated torrent may grow by
+#define FAIRSHARE_DISK_QUANTUM 16384 // bytes, one block
+
+struct pwp_torrent;
+
+struct fairshare
+{
+	int weight;
+	int priority;
+	long int download_limit; // set with pwp_set_rate_limits(), 0 = unlimited
+	long int upload_limit;
+	long int download_share; // bytes per second given by the last rebalance, 0 = none
+	long int upload_share;
+	uint64_t downloaded; // bucket usage at the last rebalance
+	uint64_t uploaded;
+	long int download_rate; // bytes per second measured by the last rebalance
+	long int upload_rate;
+	int slot_credits; // deficit round robin of connection slots
+	int slot_blocked; // the torrent's peer pool ran dry while slots were handed out
+};
+
+void fairshare_init(struct fairshare *fs);
+
+// threads the torrent may run at most.
+int fairshare_max_threads(struct pwp_torrent *t);
+
+// sets the rates of the torrent's buckets from its limits and shares.
+void fairshare_apply(struct pwp_torrent *t);
+
+// divides the global rate limits among the torrents of the list (linked by next), elapsed_ms after
+// the last call. NOTE: the list must not change during the call.
+void fairshare_rebalance(struct pwp_torrent *torrents, long int elapsed_ms);
+
+#endif // FAIRSHARE_H
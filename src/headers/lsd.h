@@ -0,0 +1,45 @@
+#ifndef LSD_H
+#define LSD_H
+
+#pragma once
+
+#include<stdint.h>
+
+/*
+Local Service Discovery (BEP 14).
+
+Peers on the same LAN find each other with announces sent to a multicast group, LSD_ADDRESS
+(and LSD_ADDRESS6 for IPv6) on LSD_PORT:
+
+	BT-SEARCH * HTTP/1.1\r\n
+	Host: 239.192.152.143:6771\r\n
+	Port: <port we accept peers on>\r\n
+	Infohash: <40 hex digits>\r\n
+	cookie: <random, to recognise our own announces>\r\n
+	\r\n
+	\r\n
+
+One thread sends an announce for every torrent of the session when it is added and then every
+LSD_ANNOUNCE_INTERVAL_MS, and listens for the announces of others. A peer announcing the info
+hash of one of our torrents is added to its peer pool with PEER_POOL_PRIORITY_LSD, ahead of the
+peers from the tracker, the DHT, peer exchange and the peer cache. The sockets
+are bound with SO_REUSEADDR and multicast loopback stays on, so several clients on one host see
+each other's announces.
+*/
+
+#define LSD_ADDRESS "239.192.152.143"
+#define LSD_ADDRESS6 "ff15::efc0:988f"
+#define LSD_PORT 6771
+#define LSD_ANNOUNCE_INTERVAL_MS 300000
+
+// starts listening for announces. torrents are announced with the given listen port.
+int lsd_start(uint16_t port);
+
+// announces the torrent now and every LSD_ANNOUNCE_INTERVAL_MS from then on.
+void lsd_add_torrent(uint8_t *info_hash);
+
+void lsd_remove_torrent(uint8_t *info_hash);
+
+void lsd_stop();
+
+#endif // LSD_H
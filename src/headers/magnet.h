@@ -0,0 +1,73 @@
+#ifndef MAGNET_H
+#define MAGNET_H
+
+#pragma once
+
+#include<stdint.h>
+
+/*
+Magnet links and metadata exchange (ut_metadata, BEP 9).
+
+A magnet link only carries the info hash of a torrent, and optionally its name (dn) and trackers
+(tr). The info dictionary is fetched from peers instead: pwp_fetch_metadata() connects to the
+peers of the trackers, the DHT and LSD like session_run() does. Peers whose extended handshake
+advertises ut_metadata and the metadata_size are asked for the metadata in MAGNET_PIECE_LEN
+pieces, a few at a time from every peer, so the pieces come in from several peers in parallel.
+
+The pieces are put together here. Once all of them are in, the SHA1 of the whole must match the
+info hash, otherwise all pieces are fetched again. magnet_write_torrent() then writes a torrent
+file with that info dictionary and the first tracker, which is read like any other torrent file.
+*/
+
+#define MAGNET_PIECE_LEN 16384
+#define MAGNET_MAX_SIZE (16 * 1024 * 1024) // larger metadata_size values are not believed
+#define MAGNET_MAX_TRACKERS 8
+
+struct magnet_link
+{
+	uint8_t info_hash[20];
+	char info_hash_hex[41];
+	char *name; // dn, or the hex info hash if there is none
+	char *trackers[MAGNET_MAX_TRACKERS];
+	int num_of_trackers;
+};
+
+int magnet_is_link(const char *str);
+
+// parses a magnet:? URI. its xt must be urn:btih: with a hex or base32 info hash.
+int magnet_parse(const char *uri, struct magnet_link *ml);
+
+void magnet_free(struct magnet_link *ml);
+
+// the functions below are thread-safe.
+
+// starts collecting the metadata of the torrent with this info hash.
+void magnet_metadata_init(uint8_t *info_hash);
+
+// 1 between magnet_metadata_init() and magnet_metadata_free().
+int magnet_metadata_active();
+
+// takes the metadata_size from a peer's extended handshake if the size isn't known yet.
+void magnet_metadata_set_size(long int size);
+
+// claims a piece that isn't being fetched from any peer. returns -1 if there is none.
+int magnet_metadata_next_piece();
+
+// makes a claimed piece available to other peers again.
+void magnet_metadata_release_piece(int piece);
+
+// length of the piece's data, -1 if it doesn't exist.
+int magnet_metadata_piece_len(int piece);
+
+// stores a piece and checks the metadata against the info hash once the last one is in.
+int magnet_metadata_add_piece(int piece, const uint8_t *data, int len);
+
+// 1 once the complete metadata has been verified.
+int magnet_metadata_done();
+
+// writes a torrent file with the verified metadata. announce_url may be NULL.
+int magnet_write_torrent(const char *filename, const char *announce_url);
+
+void magnet_metadata_free();
+
+#endif // MAGNET_H
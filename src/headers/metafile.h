@@ -18,6 +18,8 @@ struct metafile_info
 	char *pieces;
 	int info_len;
 	uint8_t *info_val;
+	char **url_list; // web seeds (BEP 19)
+	int num_of_urls;
 };
 
 int parse_multiple_files(bencode_t *files_list, struct metafile_info *mi);
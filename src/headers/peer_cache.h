@@ -0,0 +1,72 @@
+#ifndef PEER_CACHE_H
+#define PEER_CACHE_H
+
+#pragma once
+
+#include<stdint.h>
+#include<time.h>
+#include<pthread.h>
+
+#include "peer_pool.h"
+
+/*
+Peer cache: the peers of a torrent that delivered data, kept across runs.
+
+Every outbound connection is recorded when it ends (peer_cache_record()), and so is every inbound
+one whose peer told us its listen port in the extended handshake. A peer that sent us blocks gets
+its time of success and download rate, the rate averaged with the one it had before, and its
+failures are cleared. A peer of the cache that can't be connected to counts a failure. One that
+was connected but sent nothing, e.g. as it had no piece we wanted, is left as it was.
+
+The cache is saved in the torrent's data folder when the torrent stops and loaded when it is
+created again. Its peers go into the peer pool with PEER_POOL_PRIORITY_CACHE, the best first, so
+they are connected to before the tracker's, including the ones the tracker lists too, but after
+the LAN peers of LSD. A peer is
+dropped after PEER_CACHE_MAX_FAILURES failures in a row or once it hasn't delivered for
+PEER_CACHE_MAX_AGE seconds, and the worst one makes room once the cache is full.
+
+The file is "MTPC" followed by one PEER_CACHE_RECORD_LEN byte record per peer, numbers in network
+byte order: the address as IPv6 (IPv4 mapped for IPv4), the port, the time of the last success in
+seconds since the epoch, the rate in bytes per second and the number of failures.
+
+All functions are thread-safe.
+*/
+
+#define PEER_CACHE_MAX 200
+#define PEER_CACHE_MAX_FAILURES 3
+#define PEER_CACHE_MAX_AGE (30 * 24 * 3600)
+#define PEER_CACHE_RECORD_LEN 32 // 16 address + 2 port + 8 last success + 4 rate + 2 failures
+
+struct peer_cache_entry
+{
+	struct peer_addr addr;
+	time_t last_success;
+	uint32_t rate; // bytes per second
+	int failures; // in a row
+};
+
+struct peer_cache
+{
+	char *path; // NULL until peer_cache_load()
+	struct peer_cache_entry *entries;
+	int num_of_entries;
+	pthread_mutex_t mutex;
+};
+
+void peer_cache_init(struct peer_cache *cache);
+
+void peer_cache_destroy(struct peer_cache *cache);
+
+// reads the cache saved at path, if there is one, and saves it there from now on.
+int peer_cache_load(struct peer_cache *cache, const char *path);
+
+// adds the peers of the cache to pool, the best first.
+void peer_cache_fill_pool(struct peer_cache *cache, struct peer_pool *pool);
+
+// records how a connection to ip:port went: whether it was made and what it delivered in how long.
+void peer_cache_record(struct peer_cache *cache, const char *ip, uint16_t port, int connected, long int downloaded, long int ms);
+
+// writes the cache to its file. returns -1 on error.
+int peer_cache_save(struct peer_cache *cache);
+
+#endif // PEER_CACHE_H
@@ -0,0 +1,74 @@
+#ifndef PEER_POOL_H
+#define PEER_POOL_H
+
+#pragma once
+
+#include<stdint.h>
+#include<pthread.h>
+#include<netinet/in.h>
+
+/*
+Pool of candidate peer addresses. Every torrent has its own.
+
+Every source of peers (the tracker response, peer exchange, ...) adds addresses here and session_run()
+takes the next one to connect to out of it. An address is only ever added once: entries stay in
+the pool after they have been handed out, so an address learnt again from another source is
+recognised as a duplicate and dropped. So are addresses on the blocklist (see blocklist.h). Entries
+with a higher priority are handed out first and entries with the same priority in the order they
+were added. A duplicate from a source of a higher priority raises the entry to that priority if it
+hasn't been handed out yet.
+
+All functions are thread-safe.
+*/
+
+#define PEER_POOL_MAX 1000 // addresses beyond this are dropped
+#define PEER_POOL_BUCKETS 256
+
+#define PEER_POOL_PRIORITY_PEX 1
+#define PEER_POOL_PRIORITY_TRACKER 2
+#define PEER_POOL_PRIORITY_DHT 2 // as good as the tracker's: both are peers of the whole swarm
+#define PEER_POOL_PRIORITY_CACHE 3 // peers that delivered in an earlier run (see peer_cache.h)
+#define PEER_POOL_PRIORITY_LSD 4 // peers on our LAN (see lsd.h) are much cheaper to download from
+
+struct peer_addr
+{
+	char ip[INET6_ADDRSTRLEN];
+	uint16_t port;
+};
+
+struct peer_pool_entry
+{
+	struct peer_addr addr;
+	int priority;
+	long int seq; // order in which entries were added
+	int tried; // 1 once handed out by peer_pool_next()
+	struct peer_pool_entry *next; // next entry in the same bucket
+};
+
+struct peer_pool
+{
+	struct peer_pool_entry *buckets[PEER_POOL_BUCKETS];
+	int count;
+	int untried;
+	long int next_seq;
+	pthread_mutex_t mutex;
+};
+
+void peer_pool_init(struct peer_pool *pool);
+
+void peer_pool_destroy(struct peer_pool *pool);
+
+// returns 1 if the address was added, 0 if it is already in the pool (or the pool is full). an
+// address already in the pool and not handed out yet is raised to priority if that is higher.
+int peer_pool_add(struct peer_pool *pool, const char *ip, uint16_t port, int priority);
+
+// copies the best address that hasn't been handed out yet into addr. returns -1 if there is none.
+int peer_pool_next(struct peer_pool *pool, struct peer_addr *addr);
+
+// number of addresses that haven't been handed out yet.
+int peer_pool_untried(struct peer_pool *pool);
+
+// makes every address a candidate again, e.g. when a paused torrent is resumed.
+void peer_pool_retry_all(struct peer_pool *pool);
+
+#endif // PEER_POOL_H
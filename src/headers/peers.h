@@ -9,12 +9,14 @@
 
 struct peer
 {
-	uint8_t ip[4];
+	int family; // AF_INET or AF_INET6
+	uint8_t ip[16]; // only the first 4 bytes are used for AF_INET
 	uint16_t port;
 	
 	struct peer *next;
 };
 
+// reads the compact 'peers' (IPv4) and 'peers6' (IPv6, BEP 7) strings of a tracker response.
 int peers_extract(char *contents, int len, struct peer **head);
 
 int peers_extract_from_file(char *filename, struct peer **head);
@@ -34,7 +36,7 @@ Whole file is one bencoded dictionary with following keys.
 5. piece_length (integer): length of each piece in bytes
 6. piece_hashes: sha1 hashes of all the pieces.
 7. peers (list of dictionaries): each element is a dictionary with following keys.
-	a. ip
+	a. ip: dotted IPv4 or textual IPv6 address
 	b. port
 */
 void peers_create_metadata(char *announce, int len, uint8_t *info_hash, uint8_t *piece_hashes, uint8_t *our_peer_id, long int total_length, long int num_of_pieces, long int piece_length, const char *metadata_filename);
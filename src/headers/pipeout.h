@@ -0,0 +1,34 @@
+#ifndef PIPEOUT_H
+#define PIPEOUT_H
+
+#pragma once
+
+/*
+Sequential output: a torrent is written to a pipe in order as it downloads (mtc --stdout).
+
+The bytes from first to last of the saved file, the whole of it unless a range is given, are
+written to the output as the pieces holding them are verified, strictly in order. Only the pieces
+of the range are downloaded (see is_piece_wanted()), and of those only the ones up to
+PIPEOUT_WINDOW_PIECES past the piece being written: the window moves on as the output takes the
+data. Peers that have nothing to do in the window keep their connections and wait for it
+(wait_for_window()). The piece being written and the next ones get deadlines as for a streaming
+client (see stream.h), so they are fetched first and a slow peer is hedged.
+
+The saved file is created sparse, so only the pieces in the window take up space on disk, not the
+whole torrent. Pieces written to the output stay in the saved file and are seeded.
+
+Once the last byte is written the session is shut down. If the output is closed, or the torrent
+runs out of peers first, the session is shut down as well and pipeout_stop() returns -1.
+*/
+
+#define PIPEOUT_WINDOW_PIECES 32
+
+struct pwp_torrent;
+
+// writes bytes first to last of the torrent to fd. call before session_add_torrent().
+int pipeout_start(struct pwp_torrent *t, long int first, long int last, int fd);
+
+// waits for the output to finish. returns 0 if every byte was written.
+int pipeout_stop();
+
+#endif // PIPEOUT_H
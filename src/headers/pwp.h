@@ -7,12 +7,88 @@
 #include<pthread.h>
 
 #include "bencode.h"
+#include "timer.h"
+#include "ratelimit.h"
+#include "peer_pool.h"
+#include "peer_cache.h"
+#include "peers.h"
+#include "choker.h"
+#include "fairshare.h"
+#include "conntune.h"
+#include "diskio.h"
+#include "stream.h"
+
+#define PWP_LISTEN_PORT 6881 // port we accept peers on; this is also the port announced to the tracker
+#define PWP_MAX_ALLOWED_FAST 16 // ALLOWED FAST pieces remembered per peer (BEP 6)
+#define PWP_MAX_PEX_PEERS 50 // BEP 11: at most this many peers in one ut_pex message
+#define PWP_MAX_METADATA_REQUESTS 2 // ut_metadata requests outstanding per peer (BEP 9)
+#define PWP_OUTBOX_MAX (256 * 1024) // bytes queued for a peer that doesn't read before it is disconnected
+
+#define MAX_THREADS 4 // threads fetching metadata, and the connection limit a torrent starts with (see conntune.h)
+
+struct pwp_torrent;
+struct webseed_set;
 
 struct pwp_peer
 {
         uint8_t peer_id[20];
+	struct pwp_torrent *torrent; // the torrent this connection is for
         int unchoked;
 	int has_pieces;
+	int socketfd;
+	int outbound; // 1 if we connected to the peer
+	pthread_mutex_t send_mutex; // held while a complete message is being written to socketfd
+	// messages queued by the timer thread and the choker, which can't wait for socketfd (see pwp_queue_msg()).
+	// they are sent ahead of anything else, right away if the socket takes them or else by the peer's thread.
+	uint8_t *outbox;
+	int outbox_len;
+	int outbox_size;
+	pthread_mutex_t outbox_mutex; // guards the outbox, never held while waiting for socketfd
+	struct timer keep_alive_timer;
+	struct timer deadline_timer; // connect timeout and request deadline
+	int timed_out; // set when deadline_timer fires
+	struct rate_bucket download_bucket; // child of the torrent's download bucket
+	struct rate_bucket upload_bucket; // child of the torrent's upload bucket
+	int am_choking; // 1 if we are choking this peer
+	int interested; // 1 if this peer is interested in our pieces
+	long int uploaded; // bytes uploaded to this peer
+	long int downloaded; // bytes of blocks downloaded from this peer
+	// the rest is maintained by the choker (see choker.h) under the lock of the connected peers list.
+	long int download_rate; // bytes per second over the last choke round
+	long int upload_rate;
+	long int choker_downloaded; // value of 'downloaded' at the last choke round
+	long int choker_uploaded;
+	long int choker_rate; // rate used for ranking in the current round
+	int choker_unchoke; // decision of the current round
+	int optimistic_unchoke; // 1 if this peer holds the optimistic unchoke slot
+	// Fast Extension (BEP 6)
+	int fast_extension; // 1 if both ends set the fast extension bit in their handshakes
+	int has_all; // 1 if the peer sent HAVE ALL. such peers aren't added to the per piece lists.
+	int suggested_piece; // last piece the peer sent SUGGEST PIECE for, -1 if none
+	int allowed_fast[PWP_MAX_ALLOWED_FAST]; // pieces we may request while choked
+	int num_allowed_fast;
+	// extension protocol (BEP 10) and peer exchange, see extension.h
+	struct peer_addr addr; // where the peer accepts connections. port is 0 if not known (yet).
+	int extension_protocol; // 1 if both ends set the extension protocol bit in their handshakes
+	int ut_pex_id; // id the peer wants ut_pex messages with, 0 if it doesn't support them
+	struct timer pex_timer;
+	struct peer_addr pex_sent[PWP_MAX_PEX_PEERS]; // connected peers as of the last ut_pex message sent to this peer
+	int num_pex_sent;
+	int ut_metadata_id; // id the peer wants ut_metadata messages with, 0 if it doesn't support them
+	int metadata_requests[PWP_MAX_METADATA_REQUESTS]; // metadata pieces asked for and not received yet
+	int num_metadata_requests;
+	// super seeding (BEP 16), see superseed.h
+	uint8_t *bitfield; // pieces the peer has told us about
+	uint8_t *revealed; // pieces we sent HAVE for
+	int superseed_piece; // piece revealed last, -1 if none
+	// streaming (see stream.h)
+	int hedging; // 1 if the piece chosen last was started by another peer already
+	uint8_t *hedge_data; // the piece being hedged, kept in memory until it is verified
+	// mainline DHT (BEP 5), see dht.h
+	int dht; // 1 if both ends set the DHT bit in their handshakes
+	// socket buffer sizes the kernel granted socktune_adjust() (see socktune.h), 0 while it auto-tunes them
+	int rcvbuf;
+	int sndbuf;
 };
 
 struct pwp_peer_node // node for linked list of peers
@@ -21,11 +97,97 @@ struct pwp_peer_node // node for linked list of peers
 	struct pwp_peer_node *next;
 };
 
+#define PIECE_STATUS_NOT_AVAILABLE 0
+#define PIECE_STATUS_AVAILABLE 1
+#define PIECE_STATUS_STARTED 2
+#define PIECE_STATUS_COMPLETE 3
+
+// pieces of a higher priority are downloaded first. skipped pieces are never requested.
+#define PIECE_PRIORITY_SKIP 0
+#define PIECE_PRIORITY_LOW 1
+#define PIECE_PRIORITY_NORMAL 2
+#define PIECE_PRIORITY_HIGH 3
+
 struct pwp_piece
 {
-	struct pwp_peer_node *peers; // this is the HEAD pointer
+	// which peers have the piece is kept in their bitfields (see peer_has_piece()), not here, as
+	// the peers come and go while the torrent lives on.
 	uint8_t status; // this is one of the PIECE_STATUS values
 	long int piece_length; // we need to store this for each piece because the last piece will have a different size from the rest.
+	// blocks of the piece queued with diskio_write() and not written yet, and whether one of them failed. see diskio.h.
+	int pending_writes;
+	int write_failed;
+	int hedges; // extra downloads of a started piece a streaming client waits for, see stream.h
+	int sealed; // 1 once a hedged copy is in the saved file. blocks queued for the piece after that are dropped.
+	uint8_t priority; // one of the PIECE_PRIORITY values
+};
+
+// everything we know about one torrent of the session (see session.h). the protocol code gets at it
+// through peer->torrent, so any number of torrents can be downloaded side by side.
+struct pwp_torrent
+{
+	uint8_t info_hash[20];
+	uint8_t our_peer_id[20];
+	long int total_length;
+	long int piece_length;
+	long int num_of_pieces; // 0 while the metadata of a magnet link is fetched
+	uint8_t *piece_hashes;
+	struct pwp_piece *pieces;
+	pthread_mutex_t *pieces_mutexes;
+	long int downloaded_pieces;
+	pthread_mutex_t downloaded_pieces_mutex;
+	char *saved_filepath;
+	char *resume_filepath;
+	int saved_fd; // blocks are written through this and uploaded from it with sendfile()
+	// used to lock one byte of resume file when updating it. there will be one mutex per byte of the resume file
+	pthread_mutex_t *resume_mutexes;
+	// pieces not complete yet at each PIECE_PRIORITY. the priorities are kept in the resume file
+	// after the bitfield, one byte per piece, and are written there under priorities_mutex too.
+	long int pieces_left[PIECE_PRIORITY_HIGH + 1];
+	pthread_mutex_t priorities_mutex;
+	// torrent level of the global -> torrent -> peer token bucket hierarchy.
+	struct rate_bucket download_bucket;
+	struct rate_bucket upload_bucket;
+	// weight, priority and bandwidth shares among the torrents of the session (see fairshare.h).
+	struct fairshare share;
+	struct conntune tune; // how many outbound threads it may run
+	// blocks waiting for the disk writers (see diskio.h).
+	struct diskio_queue disk_queue;
+	// pieces streaming clients wait for (see stream.h).
+	struct stream_deadlines deadlines;
+	// only the pieces from first_wanted to last_wanted and up to window_end are downloaded (see pipeout.h).
+	int first_wanted;
+	int last_wanted;
+	volatile int window_end;
+	// peers we currently have a connection with. used by the choker.
+	struct pwp_peer_node *connected_peers;
+	pthread_mutex_t connected_peers_mutex;
+	struct choker choker;
+	struct timer choke_timer;
+	// pieces we have, laid out as the payload of a BITFIELD message, and the completed pieces that are
+	// still to be announced with HAVE. have_batch is only used by have_callback() on the timer thread.
+	uint8_t *have_bitfield;
+	int have_bitfield_len;
+	int *have_queue;
+	int have_queue_len;
+	int *have_flushing;
+	uint8_t *have_batch;
+	pthread_mutex_t have_mutex;
+	struct timer have_timer;
+	// candidates for outbound connections from the tracker, peer exchange, LSD and the DHT.
+	struct peer_pool peer_pool;
+	struct peer_cache peer_cache; // the peers that delivered, kept for the next run
+	int super_seeding; // super seeding (BEP 16) once the download is complete
+	// HTTP web seeds (BEP 19), see webseed.h.
+	char **web_seed_urls;
+	int num_of_web_seeds;
+	struct webseed_set *webseeds; // NULL if they aren't running
+	// the rest belongs to the session (see session.h) and is only touched under its lock.
+	int num_of_threads; // outbound peer threads running for this torrent
+	int users; // threads that got the torrent from session_find_torrent() and haven't released it
+	int finished; // no more outbound connections are made for it
+	int paused; // set by session_pause_torrent(): no connections at all until it is resumed
+	struct pwp_torrent *next;
 };
 
 struct pwp_block
@@ -37,24 +199,35 @@ struct pwp_block
 
 struct talk_to_peer_args
 {
-    uint8_t *info_hash;
-    uint8_t *our_peer_id;
+    struct pwp_torrent *torrent;
     char *ip;
     uint16_t port;
 };
 
-struct thread_data
-{
-	struct talk_to_peer_args *args;
-	pthread_t thread_descriptor;
-};
-
 uint8_t *compose_handshake(uint8_t *info_hash, uint8_t *our_peer_id, int *len);
 uint8_t *compose_interested(int *len);
 uint8_t *compose_request(int piece_idx, int block_offset, int block_length, int *len);
+uint8_t *compose_choke(int *len);
+uint8_t *compose_unchoke(int *len);
+uint8_t *compose_bitfield(struct pwp_torrent *t, int *len);
+uint8_t *compose_have(int piece_idx, int *len);
+uint8_t *compose_port(uint16_t port, int *len);
+uint8_t *compose_have_all(int *len);
+uint8_t *compose_have_none(int *len);
+uint8_t *compose_reject(int piece_idx, int block_offset, int block_length, int *len);
 
 uint8_t extract_msg_id(uint8_t *response);
+int pwp_send(struct pwp_peer *peer, uint8_t *msg, int len);
+// queues msg for the peer without waiting for its socket. for threads that mustn't be held up by the
+// peer, such as the timer thread, or that hold a lock others wait for, such as the peers list's.
+void pwp_queue_msg(struct pwp_peer *peer, const uint8_t *msg, int len);
+void init_peer(struct pwp_peer *peer, struct pwp_torrent *t, int socketfd);
+void destroy_peer(struct pwp_peer *peer);
 void *talk_to_peer(void *args);
+int connect_tcp(struct pwp_peer *peer_status, char *ip, uint16_t port);
+int accept_peer(int socketfd, const char *ip);
+int validate_handshake(uint8_t *msg, int len, uint8_t *info_hash);
+int peer_session(struct pwp_peer *peer_status, uint8_t *inbound_hs, int inbound_hs_len);
 
 int receive_msg(int socketfd, fd_set *recvfd, uint8_t **msg, int *len);
 int receive_msg_hs(int socketfd, fd_set *recvfd, uint8_t **msg, int *len);
@@ -62,21 +235,105 @@ int get_len(int socketfd, fd_set *recvfd, int *len);
 int get_len_hs(int socketfd, fd_set *recvfd, int *len);
 int process_msgs(uint8_t *msgs, int len, int has_hs, struct pwp_peer *peer);
 int receive_msg_for_len(int socketfd, fd_set *recvfd, int len, uint8_t *msg);
+int process_port(uint8_t *msg, struct pwp_peer *peer);
+
 int process_have(uint8_t *msg, struct pwp_peer *peer);
 int process_bitfield(uint8_t *msg, struct pwp_peer *peer); 
-int choose_random_piece_idx(uint8_t *peer_id);
+int process_have_all(struct pwp_peer *peer);
+int process_allowed_fast(uint8_t *msg, struct pwp_peer *peer);
+int process_suggest(uint8_t *msg, struct pwp_peer *peer);
+int process_request(uint8_t *msg, struct pwp_peer *peer);
+int send_have_state(struct pwp_peer *peer);
+int wait_for_unchoke(struct pwp_peer *peer);
+int wait_for_window(struct pwp_peer *peer);
+int is_piece_wanted(struct pwp_torrent *t, int idx);
+int send_block(struct pwp_peer *peer, int idx, int block_offset, int block_length);
+void set_choking(struct pwp_peer *peer, int choke);
+int serve_peer(struct pwp_peer *peer);
+int choose_random_piece_idx(struct pwp_peer *peer);
+int choose_webseed_piece_idx(struct pwp_torrent *t, int thin_swarm);
+int can_request_piece(struct pwp_peer *peer, int idx);
+int is_allowed_fast(struct pwp_peer *peer, int idx);
+int peer_has_piece(struct pwp_peer *peer, int idx);
+int peer_has_all_pieces(struct pwp_peer *peer);
+int is_super_seeding(struct pwp_torrent *t);
+int is_download_complete(struct pwp_torrent *t);
+int is_wanted_download_complete(struct pwp_torrent *t);
+int num_of_connected_peers(struct pwp_torrent *t);
 int are_same_peers(uint8_t *peer_id1, uint8_t *peer_id2);
 void linked_list_add(struct pwp_peer_node **head, struct pwp_peer *peer);
 int linked_list_contains_peer_id(struct pwp_peer_node *head, uint8_t *peer_id);
 void linked_list_free(struct pwp_peer_node **head);
+void linked_list_remove(struct pwp_peer_node **head, struct pwp_peer *peer);
+int register_peer(struct pwp_peer *peer);
+void unregister_peer(struct pwp_peer *peer);
 int get_pieces(int socketfd, struct pwp_peer *peer);
-int download_piece(int idx, int socketfd, FILE *savedfp, struct pwp_peer *peer);
+int download_piece(int idx, int socketfd, struct pwp_peer *peer);
+int verify_piece(struct pwp_torrent *t, int idx);
+int complete_piece(struct pwp_torrent *t, int idx);
+void release_piece(struct pwp_torrent *t, int idx);
+int pace_requests(struct pwp_peer *peer, struct pwp_block *blocks, int num_of_blocks, int max_requests);
 uint8_t *prepare_requests(int piece_idx, struct pwp_block *blocks, int num_of_blocks, int max_requests, int *len);
-int download_block(int socketfd, int expected_piece_idx, FILE *savedfp, struct pwp_block *block, struct pwp_peer *peer);
-int initialise_pieces(struct pwp_piece *pieces, long int total_length, long int num_of_pieces, long int piece_length, const char *path_to_resume_file);
-int update_resume_file(const char *path_to_resume_file, int downloaded_piece_index);
+int download_block(int socketfd, int expected_piece_idx, struct pwp_block *block, struct pwp_peer *peer);
+int initialise_pieces(struct pwp_torrent *t);
+int update_resume_file(struct pwp_torrent *t, int downloaded_piece_index);
+void announce_piece(struct pwp_torrent *t, int idx);
+
+// reads the metadata file made by mtc and the resume file. the torrent is handed to session_add_torrent().
+struct pwp_torrent *pwp_torrent_create(char *md_filepath, char *saved_filepath, char *resume_filepath);
+
+// a torrent that only has an info hash, for fetching the metadata of a magnet link.
+struct pwp_torrent *pwp_torrent_create_empty(uint8_t *info_hash, uint8_t *our_peer_id);
+
+// NOTE: the torrent must have been removed from the session.
+void pwp_torrent_destroy(struct pwp_torrent *t);
+
+// starts the torrent's periodic timers and its web seeds. called by session_add_torrent().
+void pwp_torrent_start(struct pwp_torrent *t);
+
+// cancels the timers and stops the web seeds.
+void pwp_torrent_stop(struct pwp_torrent *t);
+
+// fetches the metadata of a magnet link (see magnet.h) from the tracker peers and those found by the DHT
+// and LSD. the session must have been started. returns 0 once magnet_metadata_done().
+int pwp_fetch_metadata(uint8_t *info_hash, uint8_t *our_peer_id, struct peer *tracker_peers);
+
+// sets the torrent-wide rate limits in bytes per second (0 = unlimited). can be called at any time;
+// the control socket's limit command does.
+void pwp_set_rate_limits(struct pwp_torrent *t, long int download_rate, long int upload_rate);
+
+// sets the torrent's weight (1 to FAIRSHARE_MAX_WEIGHT) and priority among the torrents of the
+// session (see fairshare.h). can be called at any time; the disk queue picks it up when it next fills.
+void pwp_set_share(struct pwp_torrent *t, int weight, int priority);
+
+// sets the PIECE_PRIORITY of pieces first to last and saves it with the resume data. can be called
+// at any time; pieces already started are finished. returns -1 if the pieces or priority are invalid.
+int pwp_set_piece_priority(struct pwp_torrent *t, int first, int last, int priority);
+
+// sets the priority and pieces given as "<priority>:<first>[-[<last>]]", with the priority one of
+// skip, low, normal and high and the pieces counted from 0. a missing last is the last piece.
+// returns -1 if the string isn't valid for the torrent.
+int pwp_parse_piece_priority(struct pwp_torrent *t, const char *arg);
+
+// peers known to speak uTP (see utp.h) are tried over it before TCP unless this is turned off. call before session_start().
+void pwp_enable_utp(int enable);
+
+// once all pieces are downloaded they are seeded with super seeding (see superseed.h). applies to the torrents created after the call.
+void pwp_enable_super_seeding(int enable);
+
+// peers on the LAN are found with local service discovery (see lsd.h) unless this is turned off. call before session_start().
+void pwp_enable_lsd(int enable);
+
+// peers of the swarm are also found with the mainline DHT (see dht.h) unless this is turned off. call before session_start().
+void pwp_enable_dht(int enable);
+
+// the settings above, for the session.
+extern int g_utp_enabled;
+extern int g_lsd_enabled;
+extern int g_dht_enabled;
 
-int pwp_start(char *md_filepath, char *saved_filepath, char *resume_filepath);
+// adds an HTTP web seed (see webseed.h) for the torrent's file. call before session_add_torrent().
+void pwp_add_web_seed(struct pwp_torrent *t, const char *url);
 
 int extract_next_peer(bencode_t *list_of_peers, char **ip, uint16_t *port);
 
@@ -0,0 +1,57 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#pragma once
+
+#include<stdint.h>
+#include<pthread.h>
+
+/*
+Hierarchical token buckets.
+
+Every bucket refills at 'rate' bytes per second up to 'burst' bytes and may have a parent.
+Bytes are only granted when every bucket on the way up to the root has the tokens, and are
+then taken from all of them. The hierarchy used by pwp.c is global -> torrent -> peer, once
+for download and once for upload. A rate of 0 means unlimited.
+
+All functions are thread-safe and rates can be changed at any time.
+*/
+
+#define RATELIMIT_UNLIMITED 0
+#define RATELIMIT_MIN_BURST 65536 // so that at least a few blocks can always be granted in one go
+
+struct rate_bucket
+{
+	long int rate; // bytes per second
+	long int burst; // max tokens that can be accumulated
+	double tokens;
+	uint64_t last_refill_ms;
+	uint64_t used; // bytes granted so far, also while unlimited
+	struct rate_bucket *parent;
+	pthread_mutex_t mutex;
+};
+
+extern struct rate_bucket g_global_download_bucket;
+extern struct rate_bucket g_global_upload_bucket;
+
+void ratelimit_init(struct rate_bucket *b, long int rate, struct rate_bucket *parent);
+
+void ratelimit_destroy(struct rate_bucket *b);
+
+void ratelimit_set_rate(struct rate_bucket *b, long int rate);
+
+long int ratelimit_get_rate(struct rate_bucket *b);
+
+// bytes granted by the bucket since it was initialised.
+uint64_t ratelimit_get_used(struct rate_bucket *b);
+
+// grants up to 'bytes' bytes without waiting. returns 0 if fewer than 'min_bytes' are available.
+long int ratelimit_request(struct rate_bucket *b, long int bytes, long int min_bytes);
+
+// returns the number of milliseconds until 'bytes' bytes could be granted.
+long int ratelimit_delay_ms(struct rate_bucket *b, long int bytes);
+
+// like ratelimit_request() but waits until at least 'min_bytes' bytes are granted.
+long int ratelimit_acquire(struct rate_bucket *b, long int bytes, long int min_bytes);
+
+#endif // RATELIMIT_H
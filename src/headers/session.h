@@ -0,0 +1,89 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#pragma once
+
+#include<stdint.h>
+
+#include "pwp.h"
+#include "timer.h"
+
+/*
+A session downloads any number of torrents at once in one process.
+
+The torrents share one engine: the timer wheel that drives the protocol timers of all of them, the
+listener and the uTP socket on PWP_LISTEN_PORT (an inbound peer's handshake tells which torrent it
+wants), local service discovery and the DHT node, which look for peers of every torrent, and the
+disk writers and hash workers (see diskio.h). They share the connection limits too: at most
+SESSION_MAX_THREADS outbound peer threads in all and SESSION_MAX_INBOUND_THREADS inbound peers in
+all. The outbound slots, the rate limits and the disk queue are shared by weight (see fairshare.h).
+
+session_run() goes over the torrents once a second, or whenever a thread finishes, and starts
+threads for the candidates in their peer pools as slots become free. A torrent is finished once it is complete or has run out of
+peers, i.e. no thread of its own is running, its web seeds are done and the DHT's first search for
+it is over. No new connections are made for a finished torrent, though its inbound peers are still
+served. session_run() returns when every torrent is finished.
+
+Run as a daemon (see control.h), session_run() keeps going until session_shutdown() is called, and
+torrents come and go while it runs. A torrent that is out of peers then isn't finished but waits
+for LSD or the DHT to find more. A paused torrent keeps its place in the session but has no
+connections, timers or web seeds; inbound peers asking for it are turned away.
+*/
+
+#define SESSION_MAX_THREADS 16 // outbound peer threads over all torrents
+#define SESSION_MAX_INBOUND_THREADS 8 // inbound connections are refused beyond this
+#define TIMER_TICK_MS 100
+
+// what session_torrent_state() returns.
+#define SESSION_TORRENT_ACTIVE 0
+#define SESSION_TORRENT_PAUSED 1
+#define SESSION_TORRENT_FINISHED 2
+
+// drives the timers of every torrent of the session.
+extern struct timer_wheel g_timer_wheel;
+
+// starts the timer wheel, the disk workers, the listener and, unless turned off, uTP, LSD and the DHT.
+int session_start();
+
+// the session owns the torrent from now on. its timers and web seeds are started, and LSD and
+// the DHT start looking for its peers.
+void session_add_torrent(struct pwp_torrent *t);
+
+// takes the torrent out of the session. its connections are shut down and this waits until no
+// thread uses it any more; then it can be destroyed with pwp_torrent_destroy().
+void session_remove_torrent(struct pwp_torrent *t);
+
+// stops the torrent's connections, timers and web seeds and waits until its threads are gone. the
+// caller must not hold it from session_find_torrent().
+void session_pause_torrent(struct pwp_torrent *t);
+
+// lets the torrent connect again. the peers it knew are all tried again.
+void session_resume_torrent(struct pwp_torrent *t);
+
+// returns one of SESSION_TORRENT_* and the number of outbound threads the torrent runs.
+int session_torrent_state(struct pwp_torrent *t, int *num_of_threads);
+
+// sets *torrents to a malloc'd array of the torrents of the session and returns their number. each
+// of them must be handed back with session_release_torrent() and the array freed.
+int session_list_torrents(struct pwp_torrent ***torrents);
+
+// returns the torrent with the info hash, NULL if there is none or it is paused. the torrent stays
+// valid until it is handed back with session_release_torrent().
+struct pwp_torrent *session_find_torrent(const uint8_t *info_hash);
+
+void session_release_torrent(struct pwp_torrent *t);
+
+// adds a candidate peer to the pool of the torrent with the info hash. returns 1 if it is a new one.
+int session_add_peer(const uint8_t *info_hash, const char *ip, uint16_t port, int priority);
+
+// downloads the torrents until every one of them is finished or, if keep_running is set, until
+// session_shutdown() is called.
+int session_run(int keep_running);
+
+// makes session_run() return. safe to call from a signal handler.
+void session_shutdown();
+
+// stops everything session_start() started and destroys the torrents still in the session.
+void session_stop();
+
+#endif // SESSION_H
@@ -0,0 +1,53 @@
+#ifndef SOCKTUNE_H
+#define SOCKTUNE_H
+
+#pragma once
+
+#include<stddef.h>
+
+#include "pwp.h"
+
+/*
+Socket tuning for TCP peer connections.
+
+Most of what we send a peer is small: REQUEST, HAVE and choke messages. With Nagle's algorithm a
+REQUEST can sit in the send buffer until the previous segment is acknowledged, so every TCP peer
+socket gets TCP_NODELAY when it is connected or accepted. Blocks are written in one go with their
+header, so they don't suffer from it.
+
+Linux sizes the socket buffers on its own, up to tcp_rmem[2]/tcp_wmem[2], but it grows them only as
+fast as it sees the window fill, which a fast peer far away can outrun. Every choke round
+socktune_adjust() takes the rate the choker measured for the peer and the RTT the kernel measured
+for the socket, and wants a buffer of twice their product (the bandwidth-delay product plus room
+for jitter), between SOCKTUNE_MIN_BUF and SOCKTUNE_MAX_BUF.
+
+Setting SO_RCVBUF or SO_SNDBUF turns the kernel's auto-tuning off for that buffer for good, and
+the size set is capped at net.core.rmem_max/wmem_max, which on a stock kernel is far below what
+auto-tuning may reach. So a buffer is only ever grown: it is set once the wanted size, capped at
+rmem_max/wmem_max, is larger than what the socket has now, and never below that. Where the cap is
+smaller than what auto-tuning has given the socket, the kernel is left to it. The size the kernel
+actually granted is read back and kept.
+
+The settings of each socket are logged every round and listed by the control socket's stats
+command (control.h). Sockets that aren't TCP (uTP connections are socket pairs) are left alone.
+*/
+
+#define SOCKTUNE_MIN_BUF (64 * 1024)
+#define SOCKTUNE_MAX_BUF (4 * 1024 * 1024)
+#define SOCKTUNE_BDP_FACTOR 2
+
+// sets the options for control traffic. returns -1 if the socket isn't TCP.
+int socktune_init(int socketfd);
+
+// resizes the peer's socket buffers from its rates and RTT and logs its settings.
+// NOTE: the caller must hold the lock of the connected peers list.
+void socktune_adjust(struct pwp_peer *peer);
+
+// writes the socket's RTT, buffer sizes and TCP_NODELAY into buf. returns -1 if the socket isn't TCP.
+int socktune_describe(int socketfd, char *buf, size_t len);
+
+// writes the peer's address and rates, socktune_describe() of its socket and whether the buffers were
+// set by us into buf. returns -1 if the socket isn't TCP.
+int socktune_describe_peer(struct pwp_peer *peer, char *buf, size_t len);
+
+#endif // SOCKTUNE_H
@@ -0,0 +1,84 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#pragma once
+
+#include<stdint.h>
+#include<pthread.h>
+
+/*
+Streaming: the saved file of a torrent is served over HTTP while it downloads (mtc --stream).
+
+A small HTTP/1.1 server listens on 127.0.0.1, STREAM_DEFAULT_PORT unless another port is given. It
+serves the saved file of each torrent of the session at /<info hash in hex>, and at / too while
+the session has a single torrent. GET and HEAD are understood, with one byte range as in
+
+	Range: bytes=1000-1999	or	bytes=1000-	or	bytes=-1000
+
+so a media player can seek. Every connection is served by its own thread, at most
+STREAM_MAX_CLIENTS of them, and carries one request.
+
+Only bytes of pieces that passed their SHA1 check are sent. The server goes through the range a
+piece at a time. The piece it is at and the next STREAM_READAHEAD_PIECES of the range are given
+deadlines: now for the first and STREAM_DEADLINE_STEP_MS more for each one after it. Then it waits
+for the first one and sends it, so a client waits for no more than the pieces it asked for.
+
+The peers' piece picker (choose_random_piece_idx()) asks stream_choose_piece() first. It hands out
+the free piece with the earliest deadline the peer has. When all of them are taken, a peer that
+downloads at least as fast as the average of the torrent's peers may hedge: it downloads again a
+piece that is less than STREAM_HEDGE_MS from its deadline and that a slower peer has started. The
+hedged copy is kept in memory and checked against the hash there, and only a good one is written
+to the saved file, which seals the piece: the blocks the slower peer still has queued for the disk
+are dropped (see commit_hedge()). The copy verified first counts and the later one is dropped (see
+complete_piece()). A deadline that isn't renewed for STREAM_DEADLINE_TTL_MS, e.g. because the
+client went away, is forgotten.
+*/
+
+#define STREAM_DEFAULT_PORT 8888
+#define STREAM_MAX_CLIENTS 8
+#define STREAM_MAX_DEADLINES 64 // per torrent
+#define STREAM_READAHEAD_PIECES 8
+#define STREAM_DEADLINE_STEP_MS 1000
+#define STREAM_HEDGE_MS 2000
+#define STREAM_DEADLINE_TTL_MS 5000
+
+struct pwp_torrent;
+struct pwp_peer;
+
+struct stream_deadline
+{
+	int idx;
+	uint64_t due_ms; // CLOCK_MONOTONIC
+	uint64_t renewed_ms;
+};
+
+// a torrent's pieces with deadlines. only touched by stream.c.
+struct stream_deadlines
+{
+	struct stream_deadline entries[STREAM_MAX_DEADLINES];
+	int num;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; // broadcast whenever a piece of the torrent is complete
+};
+
+void stream_deadlines_init(struct stream_deadlines *d);
+
+void stream_deadlines_destroy(struct stream_deadlines *d);
+
+// serves the torrents of the session on 127.0.0.1:port until stream_stop().
+int stream_start(uint16_t port);
+
+void stream_stop();
+
+// returns the piece with a deadline the peer should download next, marked as started, or -1 if there is none.
+int stream_choose_piece(struct pwp_peer *peer);
+
+// gives piece idx and the pieces after it up to last_idx deadlines, as for a client of the server,
+// and waits until it is verified. returns -1 if it won't be: the torrent is paused, finished or out
+// of the session, the server stops or, unless client is -1, that socket's other end closed it.
+int stream_wait_for_piece(struct pwp_torrent *t, int idx, int last_idx, int client);
+
+// called once piece idx of the torrent is verified and recorded.
+void stream_piece_done(struct pwp_torrent *t, int idx);
+
+#endif // STREAM_H
@@ -0,0 +1,26 @@
+#ifndef SUPERSEED_H
+#define SUPERSEED_H
+
+#pragma once
+
+#include "pwp.h"
+
+/*
+Super seeding (BEP 16).
+
+An initial seed that advertises all of its pieces tends to upload the same pieces to several
+peers. In super seeding mode we claim to have nothing and reveal one piece at a time to each peer
+with a HAVE message, the piece that is rarest among the connected peers and the pieces already
+revealed to others. A peer only gets its next piece once the last one has been seen at another
+peer (that peer's HAVE), i.e. once it has passed the piece on, or straight away if there is no
+one left who lacks it. Requests for pieces that weren't revealed to the peer are refused.
+*/
+
+// reveals the next piece to the peer. returns its index, -1 if there is nothing left for this peer.
+// NOTE: the caller must hold the lock of the list.
+int superseed_reveal(struct pwp_peer_node *peers, struct pwp_peer *peer);
+
+// to be called when from sent HAVE for idx. NOTE: the caller must hold the lock of the list.
+void superseed_have(struct pwp_peer_node *peers, struct pwp_peer *from, int idx);
+
+#endif // SUPERSEED_H
@@ -0,0 +1,75 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#pragma once
+
+#include<stdint.h>
+#include<pthread.h>
+
+/*
+Hierarchical timer wheel.
+
+Timers are kept in TIMER_WHEEL_LEVELS wheels of TIMER_WHEEL_SLOTS slots each. Level 0 has a
+resolution of one tick, level 1 a resolution of TIMER_WHEEL_SLOTS ticks and so on. Adding and
+cancelling a timer is O(1) (doubly linked lists). When the level 0 wheel wraps around, the
+current slot of the next level is cascaded down into the lower wheels.
+
+Callbacks are run on the wheel's own thread with the wheel unlocked, so a callback may re-arm
+its own timer (that is how periodic timers are done) or add and cancel other timers.
+*/
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef void (*timer_callback)(void *arg);
+
+struct timer
+{
+	uint64_t expires; // in ticks
+	timer_callback callback;
+	void *arg;
+	int pending; // 1 if the timer is in one of the wheels or in the expired list
+	struct timer *prev;
+	struct timer *next;
+};
+
+struct timer_wheel
+{
+	uint64_t now; // the next tick to be processed
+	long int tick_ms;
+	struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // list heads (sentinels)
+	struct timer expired; // timers whose callbacks are about to be run
+	struct timer *running; // timer whose callback is being run right now
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int stop;
+};
+
+int timer_wheel_init(struct timer_wheel *tw, long int tick_ms);
+
+// starts a thread that advances the wheel once every tick
+int timer_wheel_start(struct timer_wheel *tw);
+
+// stops the thread started by timer_wheel_start(). pending timers are not run.
+void timer_wheel_stop(struct timer_wheel *tw);
+
+void timer_wheel_destroy(struct timer_wheel *tw);
+
+// runs callbacks of all timers due within the next 'ticks' ticks
+void timer_wheel_advance(struct timer_wheel *tw, uint64_t ticks);
+
+void timer_init(struct timer *t, timer_callback callback, void *arg);
+
+// arms the timer to fire after delay_ms. if the timer is already pending it is re-armed.
+void timer_add(struct timer_wheel *tw, struct timer *t, long int delay_ms);
+
+// disarms the timer. if its callback is running on the wheel thread, waits for it to return
+// (unless called from that callback) so that the timer can be freed straight afterwards.
+void timer_cancel(struct timer_wheel *tw, struct timer *t);
+
+int timer_pending(struct timer_wheel *tw, struct timer *t);
+
+#endif // TIMER_H
@@ -3,6 +3,9 @@
 
 #pragma once
 
+#include<stdint.h>
+#include<sys/socket.h>
+
 int util_read_whole_file(const char *filename, uint8_t **contents, int *file_len);
 
 int util_hex_to_ba(char *hex, uint8_t *ba);
@@ -22,4 +25,12 @@ char *util_extract_filename(char *path);
 
 int util_write_new_file(const char *filename, uint8_t *contents, int len);
 
+// fills addr with the IPv4 or IPv6 address in ip. returns -1 if ip is neither.
+int util_make_sockaddr(const char *ip, uint16_t port, struct sockaddr_storage *addr, int *len);
+
+// writes the address of addr to ip, IPv4 mapped IPv6 addresses in dotted IPv4 form.
+void util_sockaddr_ip(struct sockaddr_storage *addr, char *ip, int ip_len);
+
+int util_bind_dual_stack(int type, uint16_t port);
+
 #endif // UTIL_H
@@ -0,0 +1,51 @@
+#ifndef UTP_H
+#define UTP_H
+
+#pragma once
+
+#include<stdint.h>
+
+/*
+uTP, the Micro Transport Protocol (BEP 29).
+
+uTP runs over one UDP socket shared by all connections. Its congestion control (LEDBAT) keeps the
+one way delay our packets add to the path close to UTP_TARGET_DELAY_US, so it backs off as soon
+as other traffic starts queueing behind ours. Packet losses are recognised with selective ACKs and
+duplicate ACKs, or in the worst case by the retransmission timeout.
+
+To the rest of the client a uTP connection looks like a connected stream socket: every connection
+is one end of an AF_UNIX socketpair whose other end is driven by the uTP thread. Whatever is
+written to it is sent to the peer and whatever the peer sends can be read from it, so the PWP code
+works on it exactly as on a TCP socket. Closing or shutting it down closes the uTP connection.
+
+A peer that doesn't speak uTP only answers a connection attempt with silence, so trying uTP first
+costs every such peer the whole timeout. The addresses known to take uTP connections, from
+connections they opened with us (a peer sends from its one UDP socket, so from its listen port), ones we opened with them or the uTP flag of peer exchange, are
+remembered, and so are the ones a connection attempt failed for (utp_note_peer()). Only the former
+are worth trying (utp_peer_supported()). The last UTP_KNOWN_MAX addresses are kept.
+
+Build with -DUTP_SIMULATED_LOSS=n to drop n% of the outgoing packets for testing.
+*/
+
+#define UTP_TARGET_DELAY_US 100000
+#define UTP_KNOWN_MAX 1024
+
+// called from the uTP thread for every connection a peer opens with us. fd belongs to the callee.
+typedef void (*utp_accept_callback)(int fd, const char *ip, void *arg);
+
+// starts the uTP thread with a UDP socket bound to port. on_accept may be NULL to refuse inbound connections.
+int utp_init(uint16_t port, utp_accept_callback on_accept, void *arg);
+
+// resets all connections and stops the uTP thread.
+void utp_shutdown();
+
+// returns a connected socket, or -1 if the peer didn't answer within timeout_ms.
+int utp_connect(const char *ip, uint16_t port, int timeout_ms);
+
+// records whether ip:port took a uTP connection. connections and connection attempts record it themselves.
+void utp_note_peer(const char *ip, uint16_t port, int supported);
+
+// returns 1 if ip:port is known to take uTP connections and no attempt has failed since.
+int utp_peer_supported(const char *ip, uint16_t port);
+
+#endif // UTP_H
@@ -0,0 +1,42 @@
+#ifndef WEBSEED_H
+#define WEBSEED_H
+
+#pragma once
+
+#include "pwp.h"
+
+/*
+HTTP web seeds (BEP 19).
+
+The url-list of a torrent names HTTP servers that have the whole file. They are downloaded from
+like peers that have every piece: a piece is chosen and marked as started just as by a peer's
+thread, fetched with one HTTP Range request, handed to the disk writers as it arrives and then
+verified and completed with the same functions as a piece from a peer.
+
+The thread never blocks outside curl_multi_poll(). A downloaded piece is hashed by the hash workers
+(diskio_verify_start()), which wake the thread when it is done, and the slot of its request stays
+taken until then. A transfer that runs out of tokens in the rate limit buckets is paused with
+CURL_WRITEFUNC_PAUSE and resumed once ratelimit_delay_ms() has passed.
+
+One thread per torrent runs all of its web seeds with a curl multi handle, up to WEBSEED_MAX_REQUESTS requests per
+seed at a time. Pieces that none of the connected peers has are fetched first. Other pieces are
+only fetched while fewer than WEBSEED_THIN_SWARM peers are connected, so the web seeds fill the
+gaps of the swarm rather than compete with it. A seed is dropped after WEBSEED_MAX_FAILURES
+failed requests in a row.
+*/
+
+#define WEBSEED_MAX_REQUESTS 4
+#define WEBSEED_THIN_SWARM 4
+#define WEBSEED_MAX_FAILURES 5
+#define WEBSEED_POLL_MS 1000 // how often to look for more pieces while waiting for the transfers
+
+// starts the web seed thread for the torrent's web_seed_urls. the pieces must have been initialised.
+int webseed_start(struct pwp_torrent *t);
+
+// returns 1 until the thread has finished, i.e. the download is complete or every seed was dropped.
+int webseed_running(struct pwp_torrent *t);
+
+// aborts the transfers in progress and waits for the thread. their pieces are released.
+void webseed_stop(struct pwp_torrent *t);
+
+#endif // WEBSEED_H
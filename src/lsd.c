@@ -0,0 +1,374 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<stdint.h>
+#include<time.h>
+#include<unistd.h>
+#include<poll.h>
+#include<pthread.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+
+#include "lsd.h"
+
+#include "pwp.h"
+#include "peer_pool.h"
+#include "session.h"
+#include "util.h"
+#include "bf_logger.h"
+
+#define LSD_MAX_MSG_LEN 1400
+#define LSD_POLL_MS 1000
+
+struct lsd_torrent
+{
+	char info_hash[41]; // hex
+	uint64_t next_announce;
+	struct lsd_torrent *next;
+};
+
+static int g_lsd_fds[2] = { -1, -1 }; // IPv4 and IPv6
+static struct lsd_torrent *g_lsd_torrents = NULL;
+static pthread_mutex_t g_lsd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char g_lsd_cookie[17];
+static uint16_t g_lsd_port;
+static pthread_t g_lsd_thread;
+static volatile int g_lsd_stop = 0;
+static int g_lsd_started = 0;
+
+static void *lsd_thread(void *arg);
+
+static uint64_t monotonic_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// a UDP socket bound to LSD_PORT that is a member of the LSD group of its family.
+static int open_socket(int family)
+{
+	struct sockaddr_storage addr;
+	struct ip_mreq mreq;
+	struct ipv6_mreq mreq6;
+	int fd, addr_len, on = 1;
+
+	if((fd = socket(family, SOCK_DGRAM, 0)) == -1)
+	{
+		return -1;
+	}
+	// other clients on this host listen on the same port.
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	if(family == AF_INET)
+	{
+		((struct sockaddr_in *)&addr)->sin_family = AF_INET;
+		((struct sockaddr_in *)&addr)->sin_port = htons(LSD_PORT);
+		((struct sockaddr_in *)&addr)->sin_addr.s_addr = htonl(INADDR_ANY);
+		addr_len = sizeof(struct sockaddr_in);
+	}
+	else
+	{
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+		((struct sockaddr_in6 *)&addr)->sin6_family = AF_INET6;
+		((struct sockaddr_in6 *)&addr)->sin6_port = htons(LSD_PORT);
+		((struct sockaddr_in6 *)&addr)->sin6_addr = in6addr_any;
+		addr_len = sizeof(struct sockaddr_in6);
+	}
+	if(bind(fd, (struct sockaddr *)&addr, addr_len) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	if(family == AF_INET)
+	{
+		inet_pton(AF_INET, LSD_ADDRESS, &mreq.imr_multiaddr);
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+		if(setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1)
+		{
+			close(fd);
+			return -1;
+		}
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &on, sizeof(on));
+	}
+	else
+	{
+		inet_pton(AF_INET6, LSD_ADDRESS6, &mreq6.ipv6mr_multiaddr);
+		mreq6.ipv6mr_interface = 0;
+		if(setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq6, sizeof(mreq6)) == -1)
+		{
+			close(fd);
+			return -1;
+		}
+		setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &on, sizeof(on));
+	}
+
+	return fd;
+}
+
+int lsd_start(uint16_t port)
+{
+	int i;
+
+	for(i = 0; i < 16; i++)
+	{
+		g_lsd_cookie[i] = "0123456789abcdef"[rand() % 16];
+	}
+	g_lsd_cookie[16] = '\0';
+	g_lsd_port = port;
+
+	g_lsd_fds[0] = open_socket(AF_INET);
+	g_lsd_fds[1] = open_socket(AF_INET6);
+	if(g_lsd_fds[0] == -1 && g_lsd_fds[1] == -1)
+	{
+		bf_log("[ERROR] lsd_start(): Failed to join the LSD multicast groups.\n");
+		return -1;
+	}
+
+	g_lsd_stop = 0;
+	if(pthread_create(&g_lsd_thread, NULL, lsd_thread, NULL) != 0)
+	{
+		bf_log("[ERROR] lsd_start(): Failed to start the LSD thread.\n");
+		lsd_stop();
+		return -1;
+	}
+	g_lsd_started = 1;
+
+	return 0;
+}
+
+void lsd_add_torrent(uint8_t *info_hash)
+{
+	struct lsd_torrent *lt;
+	int i;
+
+	lt = malloc(sizeof(struct lsd_torrent));
+	for(i = 0; i < 20; i++)
+	{
+		snprintf(lt->info_hash + 2 * i, 3, "%02x", info_hash[i]);
+	}
+	lt->next_announce = 0; // right away
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_lsd_mutex);
+
+	lt->next = g_lsd_torrents;
+	g_lsd_torrents = lt;
+
+	pthread_mutex_unlock(&g_lsd_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+void lsd_remove_torrent(uint8_t *info_hash)
+{
+	struct lsd_torrent **curr, *lt;
+	char hex[41];
+	int i;
+
+	for(i = 0; i < 20; i++)
+	{
+		snprintf(hex + 2 * i, 3, "%02x", info_hash[i]);
+	}
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_lsd_mutex);
+
+	for(curr = &g_lsd_torrents; *curr; curr = &(*curr)->next)
+	{
+		if(strcmp((*curr)->info_hash, hex) == 0)
+		{
+			lt = *curr;
+			*curr = lt->next;
+			free(lt);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&g_lsd_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+void lsd_stop()
+{
+	struct lsd_torrent *lt;
+	int i;
+
+	if(g_lsd_started)
+	{
+		g_lsd_stop = 1;
+		pthread_join(g_lsd_thread, NULL);
+		g_lsd_started = 0;
+	}
+	for(i = 0; i < 2; i++)
+	{
+		if(g_lsd_fds[i] != -1)
+		{
+			close(g_lsd_fds[i]);
+			g_lsd_fds[i] = -1;
+		}
+	}
+	while((lt = g_lsd_torrents) != NULL)
+	{
+		g_lsd_torrents = lt->next;
+		free(lt);
+	}
+}
+
+static void send_announce(int fd, int family, const char *info_hash)
+{
+	struct sockaddr_storage addr;
+	char msg[LSD_MAX_MSG_LEN];
+	int len, addr_len;
+	const char *host = (family == AF_INET) ? LSD_ADDRESS ":6771" : "[" LSD_ADDRESS6 "]:6771";
+
+	len = snprintf(msg, sizeof(msg), "BT-SEARCH * HTTP/1.1\r\nHost: %s\r\nPort: %d\r\nInfohash: %s\r\ncookie: %s\r\n\r\n\r\n",
+		host, g_lsd_port, info_hash, g_lsd_cookie);
+	util_make_sockaddr(family == AF_INET ? LSD_ADDRESS : LSD_ADDRESS6, LSD_PORT, &addr, &addr_len);
+	if(sendto(fd, msg, len, 0, (struct sockaddr *)&addr, addr_len) == -1)
+	{
+		bf_log("[ERROR] lsd: Failed to send announce to the %s group.\n", family == AF_INET ? "IPv4" : "IPv6");
+	}
+}
+
+// returns the value of the header in the message, NULL if it is missing. header names are case insensitive.
+// if next isn't NULL, it is set to where to look for another header with the same name.
+static char *header_value(char *msg, const char *name, char *value, int value_len, char **next)
+{
+	char *line, *end;
+	int name_len = strlen(name);
+	int len;
+
+	for(line = strstr(msg, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n"))
+	{
+		if(strncasecmp(line + 2, name, name_len) != 0 || line[2 + name_len] != ':')
+		{
+			continue;
+		}
+		line += 2 + name_len + 1;
+		while(*line == ' ')
+		{
+			line++;
+		}
+		if((end = strstr(line, "\r\n")) == NULL || (len = end - line) >= value_len)
+		{
+			return NULL;
+		}
+		memcpy(value, line, len);
+		value[len] = '\0';
+		if(next)
+		{
+			*next = end;
+		}
+		return value;
+	}
+
+	return NULL;
+}
+
+// an announce may carry several Infohash headers. the peer is added to each of our torrents among them.
+static void process_announce(char *msg, struct sockaddr_storage *from)
+{
+	char ip[INET6_ADDRSTRLEN];
+	char port[8], info_hash[48], cookie[48];
+	uint8_t hash[20];
+	char *next;
+	long int p;
+
+	if(strncmp(msg, "BT-SEARCH * HTTP/1.1\r\n", 22) != 0
+		|| !header_value(msg, "Port", port, sizeof(port), NULL))
+	{
+		return;
+	}
+	// our own announce, looped back to us.
+	if(header_value(msg, "cookie", cookie, sizeof(cookie), NULL) && strcmp(cookie, g_lsd_cookie) == 0)
+	{
+		return;
+	}
+	p = atol(port);
+	if(p <= 0 || p > 65535)
+	{
+		return;
+	}
+
+	util_sockaddr_ip(from, ip, sizeof(ip));
+	for(next = msg; header_value(next, "Infohash", info_hash, sizeof(info_hash), &next); )
+	{
+		if(strlen(info_hash) != 40 || util_hex_to_ba(info_hash, hash) != 0)
+		{
+			continue;
+		}
+		if(session_add_peer(hash, ip, (uint16_t)p, PEER_POOL_PRIORITY_LSD))
+		{
+			bf_log("[LOG] lsd: Found local peer %s:%ld.\n", ip, p);
+		}
+	}
+}
+
+static void *lsd_thread(void *arg)
+{
+	struct pollfd fds[2];
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	struct lsd_torrent *lt;
+	char msg[LSD_MAX_MSG_LEN + 1];
+	int i, len;
+
+	for(i = 0; i < 2; i++)
+	{
+		fds[i].fd = g_lsd_fds[i]; // poll() skips negative descriptors
+		fds[i].events = POLLIN;
+	}
+
+	while(!g_lsd_stop)
+	{
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_lsd_mutex);
+
+		for(lt = g_lsd_torrents; lt; lt = lt->next)
+		{
+			if(monotonic_ms() < lt->next_announce)
+			{
+				continue;
+			}
+			if(g_lsd_fds[0] != -1)
+			{
+				send_announce(g_lsd_fds[0], AF_INET, lt->info_hash);
+			}
+			if(g_lsd_fds[1] != -1)
+			{
+				send_announce(g_lsd_fds[1], AF_INET6, lt->info_hash);
+			}
+			lt->next_announce = monotonic_ms() + LSD_ANNOUNCE_INTERVAL_MS;
+		}
+
+		pthread_mutex_unlock(&g_lsd_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		if(poll(fds, 2, LSD_POLL_MS) <= 0)
+		{
+			continue;
+		}
+		for(i = 0; i < 2; i++)
+		{
+			if(!(fds[i].revents & POLLIN))
+			{
+				continue;
+			}
+			from_len = sizeof(from);
+			if((len = recvfrom(fds[i].fd, msg, LSD_MAX_MSG_LEN, 0, (struct sockaddr *)&from, &from_len)) > 0)
+			{
+				msg[len] = '\0';
+				process_announce(msg, &from);
+			}
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,205 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<limits.h>
+#include<time.h>
+#include<unistd.h>
+#include<sys/types.h>
+#include<sys/wait.h>
+
+#include "lsd.h"
+#include "bf_logger.h"
+
+/*
+lsd_loopback runs two LSD instances (see lsd.h) on this host and checks that each finds the other
+through the multicast group.
+
+The LSD code runs one instance per process, so both are child processes. Instance i announces
+PEER_PORT + i as its listen port. Instance 1 adds the torrent first, so that it is listening for it
+when instance 0 adds it and announces it, and must find instance 0. Then instance 1 announces again
+and instance 0 must find it. Neither may take its own announce, which comes back to it as multicast
+loopback is on, for a peer.
+
+	lsd_loopback
+
+Exits with 0 if both found each other. The instances log to logs/lsd_loopback.<i>.log.
+*/
+
+#define PEER_PORT 50100 // instance i announces PEER_PORT + i
+#define FIND_TIMEOUT_MS 5000
+
+#define CMD_ADD 'a' // add the torrent, which announces it
+#define CMD_READD 'r' // remove it and add it again, to announce it once more
+#define CMD_FIND 'f' // wait for the other instance's announce
+
+struct lsd_proc
+{
+	pid_t pid;
+	int cmd; // commands to the instance; closing it stops the instance
+	int result; // one byte per command: 'y' if it worked
+};
+
+static uint8_t g_info_hash[20];
+static volatile int g_has_torrent = 0;
+static volatile int g_found = 0; // the other instance's announce came
+static volatile int g_found_self = 0; // our own announce was taken for a peer
+static int g_port;
+static char g_log_file[PATH_MAX];
+
+// lsd.c hands the peers it hears of to the session, which takes them only for its torrents.
+int session_add_peer(const uint8_t *info_hash, const char *ip, uint16_t port, int priority)
+{
+	if(!g_has_torrent || memcmp(info_hash, g_info_hash, 20) != 0)
+	{
+		return 0;
+	}
+	if(port == g_port)
+	{
+		g_found_self = 1;
+	}
+	else if(port == PEER_PORT || port == PEER_PORT + 1)
+	{
+		g_found = 1;
+	}
+
+	return 1;
+}
+
+// runs instance i until the parent closes cmd.
+static void run_instance(int i, int cmd, int result)
+{
+	char c, ok;
+	int waited;
+
+	getcwd(g_log_file, sizeof(g_log_file) - 32);
+	sprintf(g_log_file + strlen(g_log_file), "/logs/lsd_loopback.%d.log", i);
+	bf_logger_init(g_log_file);
+	bf_logger_echo(0);
+	// the cookie that tells our own announces apart comes from rand(), so it needs its own seed.
+	srand(time(NULL) + i);
+	g_port = PEER_PORT + i;
+	if(lsd_start(g_port) != 0)
+	{
+		printf("Instance %d failed to start LSD.\n", i);
+		exit(1);
+	}
+	write(result, "y", 1);
+
+	while(read(cmd, &c, 1) == 1)
+	{
+		ok = 'y';
+		if(c == CMD_ADD || c == CMD_READD)
+		{
+			if(c == CMD_READD)
+			{
+				lsd_remove_torrent(g_info_hash);
+			}
+			g_has_torrent = 1;
+			lsd_add_torrent(g_info_hash);
+		}
+		else if(c == CMD_FIND)
+		{
+			for(waited = 0; !g_found && waited < FIND_TIMEOUT_MS; waited += 100)
+			{
+				usleep(100 * 1000);
+			}
+			ok = g_found && !g_found_self ? 'y' : 'n';
+		}
+		write(result, &ok, 1);
+	}
+
+	lsd_stop();
+	bf_logger_end();
+	exit(0);
+}
+
+// starts instance i of procs and waits until it is up.
+static int start_instance(struct lsd_proc *procs, int i)
+{
+	struct lsd_proc *proc = &procs[i];
+	int cmd[2], result[2], j;
+	char c;
+
+	if(pipe(cmd) == -1 || pipe(result) == -1 || (proc->pid = fork()) == -1)
+	{
+		return -1;
+	}
+	if(proc->pid == 0)
+	{
+		// the other instance stops when the parent closes its pipes, so no copies of those stay open here.
+		for(j = 0; j < i; j++)
+		{
+			close(procs[j].cmd);
+			close(procs[j].result);
+		}
+		close(cmd[1]);
+		close(result[0]);
+		run_instance(i, cmd[0], result[1]);
+	}
+	close(cmd[0]);
+	close(result[1]);
+	proc->cmd = cmd[1];
+	proc->result = result[0];
+
+	return read(proc->result, &c, 1) == 1 && c == 'y' ? 0 : -1;
+}
+
+// returns 0 if the instance carried the command out.
+static int command(struct lsd_proc *proc, char c)
+{
+	char ok;
+
+	return write(proc->cmd, &c, 1) == 1 && read(proc->result, &ok, 1) == 1 && ok == 'y' ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lsd_proc procs[2];
+	int i, started, rv = 1;
+
+	srand(time(NULL));
+	for(i = 0; i < 20; i++)
+	{
+		g_info_hash[i] = rand();
+	}
+
+	fflush(NULL);
+	for(started = 0; started < 2 && start_instance(procs, started) == 0; started++);
+	if(started < 2)
+	{
+		printf("FAILED: instance %d didn't start.\n", started);
+		goto stop;
+	}
+
+	if(command(&procs[1], CMD_ADD) != 0 || command(&procs[0], CMD_ADD) != 0)
+	{
+		printf("FAILED: the torrent couldn't be added.\n");
+		goto stop;
+	}
+	if(command(&procs[1], CMD_FIND) != 0)
+	{
+		printf("FAILED: instance 1 didn't find instance 0, or took its own announce for a peer.\n");
+		goto stop;
+	}
+	if(command(&procs[1], CMD_READD) != 0 || command(&procs[0], CMD_FIND) != 0)
+	{
+		printf("FAILED: instance 0 didn't find instance 1, or took its own announce for a peer.\n");
+		goto stop;
+	}
+	printf("OK: both LSD instances found each other through %s:%d and ignored their own announces.\n", LSD_ADDRESS, LSD_PORT);
+	rv = 0;
+
+stop:
+	for(i = 0; i < started; i++)
+	{
+		close(procs[i].cmd);
+		close(procs[i].result);
+	}
+	for(i = 0; i < started; i++)
+	{
+		waitpid(procs[i].pid, NULL, 0);
+	}
+
+	return rv;
+}
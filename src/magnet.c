@@ -0,0 +1,439 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<ctype.h>
+#include<pthread.h>
+
+#include "magnet.h"
+
+#include "sha1.h"
+#include "util.h"
+#include "bf_logger.h"
+
+#define MAGNET_PREFIX "magnet:?"
+
+#define METADATA_PIECE_MISSING 0
+#define METADATA_PIECE_REQUESTED 1
+#define METADATA_PIECE_RECEIVED 2
+
+static pthread_mutex_t g_metadata_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_metadata_active = 0;
+static uint8_t g_metadata_info_hash[20];
+static uint8_t *g_metadata = NULL;
+static long int g_metadata_size = 0; // 0 until a peer tells us
+static int g_num_of_metadata_pieces = 0;
+static int *g_metadata_pieces = NULL; // METADATA_PIECE_* of every piece
+static int g_num_of_received_pieces = 0;
+static int g_metadata_verified = 0;
+
+// decodes the %XX escapes of a URI component in place. '+' is a space.
+static void uri_decode(char *str)
+{
+	char *in, *out;
+	unsigned int c;
+
+	for(in = out = str; *in; in++, out++)
+	{
+		if(*in == '%' && isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2]))
+		{
+			sscanf(in + 1, "%2x", &c);
+			*out = (char)c;
+			in += 2;
+		}
+		else
+		{
+			*out = (*in == '+') ? ' ' : *in;
+		}
+	}
+	*out = '\0';
+}
+
+// RFC 4648 base32 without padding: 32 characters for the 20 bytes of an info hash.
+static int base32_decode(const char *str, uint8_t *out)
+{
+	uint32_t buffer = 0;
+	int bits = 0, i, n = 0, v;
+
+	for(i = 0; i < 32; i++)
+	{
+		if(str[i] >= 'A' && str[i] <= 'Z')
+		{
+			v = str[i] - 'A';
+		}
+		else if(str[i] >= 'a' && str[i] <= 'z')
+		{
+			v = str[i] - 'a';
+		}
+		else if(str[i] >= '2' && str[i] <= '7')
+		{
+			v = str[i] - '2' + 26;
+		}
+		else
+		{
+			return -1;
+		}
+		buffer = (buffer << 5) | v;
+		bits += 5;
+		if(bits >= 8)
+		{
+			bits -= 8;
+			out[n++] = (buffer >> bits) & 0xff;
+		}
+	}
+
+	return 0;
+}
+
+static int parse_info_hash(const char *value, uint8_t *info_hash)
+{
+	int len = strlen(value);
+	char hex[41];
+	int i;
+
+	if(strncasecmp(value, "urn:btih:", 9) != 0)
+	{
+		return -1;
+	}
+	value += 9;
+	len -= 9;
+	if(len == 40)
+	{
+		for(i = 0; i < 40; i++)
+		{
+			if(!isxdigit((unsigned char)value[i]))
+			{
+				return -1;
+			}
+			hex[i] = tolower((unsigned char)value[i]);
+		}
+		hex[40] = '\0';
+		return util_hex_to_ba(hex, info_hash);
+	}
+	if(len == 32)
+	{
+		return base32_decode(value, info_hash);
+	}
+
+	return -1;
+}
+
+int magnet_is_link(const char *str)
+{
+	return strncmp(str, MAGNET_PREFIX, strlen(MAGNET_PREFIX)) == 0;
+}
+
+int magnet_parse(const char *uri, struct magnet_link *ml)
+{
+	char *params = NULL, *param, *value, *save = NULL, *c;
+	int has_hash = 0, i;
+	int rv = 0;
+
+	memset(ml, 0, sizeof(struct magnet_link));
+	if(!magnet_is_link(uri))
+	{
+		rv = -1;
+		goto cleanup;
+	}
+	params = strdup(uri + strlen(MAGNET_PREFIX));
+	for(param = strtok_r(params, "&", &save); param; param = strtok_r(NULL, "&", &save))
+	{
+		if((value = strchr(param, '=')) == NULL)
+		{
+			continue;
+		}
+		*value++ = '\0';
+		uri_decode(value);
+		if(strcmp(param, "xt") == 0 && !has_hash)
+		{
+			has_hash = parse_info_hash(value, ml->info_hash) == 0;
+		}
+		else if(strcmp(param, "dn") == 0 && !ml->name && *value)
+		{
+			ml->name = strdup(value);
+		}
+		else if(strncmp(param, "tr", 2) == 0 && ml->num_of_trackers < MAGNET_MAX_TRACKERS)
+		{
+			// tr, or tr.1, tr.2 ... as some clients write them.
+			ml->trackers[ml->num_of_trackers++] = strdup(value);
+		}
+	}
+	if(!has_hash)
+	{
+		bf_log("[ERROR] magnet_parse(): The magnet link has no BitTorrent info hash.\n");
+		rv = -1;
+		goto cleanup;
+	}
+
+	for(i = 0; i < 20; i++)
+	{
+		sprintf(ml->info_hash_hex + i * 2, "%02x", ml->info_hash[i]);
+	}
+	if(!ml->name)
+	{
+		ml->name = strdup(ml->info_hash_hex);
+	}
+	// the name becomes the name of the torrent's directory.
+	for(c = ml->name; *c; c++)
+	{
+		if(*c == '/')
+		{
+			*c = '_';
+		}
+	}
+	if(ml->name[0] == '.')
+	{
+		ml->name[0] = '_';
+	}
+
+cleanup:
+	if(params)
+	{
+		free(params);
+	}
+	if(rv != 0)
+	{
+		magnet_free(ml);
+	}
+	return rv;
+}
+
+void magnet_free(struct magnet_link *ml)
+{
+	int i;
+
+	if(ml->name)
+	{
+		free(ml->name);
+		ml->name = NULL;
+	}
+	for(i = 0; i < ml->num_of_trackers; i++)
+	{
+		free(ml->trackers[i]);
+	}
+	ml->num_of_trackers = 0;
+}
+
+void magnet_metadata_init(uint8_t *info_hash)
+{
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_metadata_mutex);
+
+	memcpy(g_metadata_info_hash, info_hash, 20);
+	g_metadata_size = 0;
+	g_num_of_metadata_pieces = 0;
+	g_num_of_received_pieces = 0;
+	g_metadata_verified = 0;
+	g_metadata_active = 1;
+
+	pthread_mutex_unlock(&g_metadata_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+int magnet_metadata_active()
+{
+	int rv;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_metadata_mutex);
+
+	rv = g_metadata_active;
+
+	pthread_mutex_unlock(&g_metadata_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return rv;
+}
+
+void magnet_metadata_set_size(long int size)
+{
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_metadata_mutex);
+
+	if(g_metadata_active && g_metadata_size == 0 && size > 0 && size <= MAGNET_MAX_SIZE)
+	{
+		g_metadata_size = size;
+		g_num_of_metadata_pieces = (size + MAGNET_PIECE_LEN - 1) / MAGNET_PIECE_LEN;
+		g_metadata = malloc(size);
+		g_metadata_pieces = calloc(g_num_of_metadata_pieces, sizeof(int));
+		g_num_of_received_pieces = 0;
+		bf_log("[LOG] magnet: The metadata is %ld bytes in %d pieces.\n", size, g_num_of_metadata_pieces);
+	}
+
+	pthread_mutex_unlock(&g_metadata_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+int magnet_metadata_next_piece()
+{
+	int i, rv = -1;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_metadata_mutex);
+
+	for(i = 0; i < g_num_of_metadata_pieces && !g_metadata_verified; i++)
+	{
+		if(g_metadata_pieces[i] == METADATA_PIECE_MISSING)
+		{
+			g_metadata_pieces[i] = METADATA_PIECE_REQUESTED;
+			rv = i;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&g_metadata_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return rv;
+}
+
+void magnet_metadata_release_piece(int piece)
+{
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_metadata_mutex);
+
+	if(piece >= 0 && piece < g_num_of_metadata_pieces && g_metadata_pieces[piece] == METADATA_PIECE_REQUESTED)
+	{
+		g_metadata_pieces[piece] = METADATA_PIECE_MISSING;
+	}
+
+	pthread_mutex_unlock(&g_metadata_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+int magnet_metadata_piece_len(int piece)
+{
+	int rv = -1;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_metadata_mutex);
+
+	if(piece >= 0 && piece < g_num_of_metadata_pieces)
+	{
+		rv = (piece == g_num_of_metadata_pieces - 1) ? g_metadata_size - (long int)piece * MAGNET_PIECE_LEN : MAGNET_PIECE_LEN;
+	}
+
+	pthread_mutex_unlock(&g_metadata_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return rv;
+}
+
+int magnet_metadata_add_piece(int piece, const uint8_t *data, int len)
+{
+	uint8_t hash[20];
+	int expected_len, i;
+	int rv = 0;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_metadata_mutex);
+
+	if(piece < 0 || piece >= g_num_of_metadata_pieces || g_metadata_pieces[piece] == METADATA_PIECE_RECEIVED)
+	{
+		goto cleanup;
+	}
+	expected_len = (piece == g_num_of_metadata_pieces - 1) ? g_metadata_size - (long int)piece * MAGNET_PIECE_LEN : MAGNET_PIECE_LEN;
+	if(len != expected_len)
+	{
+		bf_log("[ERROR] magnet_metadata_add_piece(): Piece %d is %d bytes instead of %d.\n", piece, len, expected_len);
+		g_metadata_pieces[piece] = METADATA_PIECE_MISSING;
+		rv = -1;
+		goto cleanup;
+	}
+	memcpy(g_metadata + (long int)piece * MAGNET_PIECE_LEN, data, len);
+	g_metadata_pieces[piece] = METADATA_PIECE_RECEIVED;
+	g_num_of_received_pieces++;
+	if(g_num_of_received_pieces < g_num_of_metadata_pieces)
+	{
+		goto cleanup;
+	}
+
+	sha1_compute(g_metadata, g_metadata_size, hash);
+	if(memcmp(hash, g_metadata_info_hash, 20) == 0)
+	{
+		bf_log("[LOG] magnet: Got all %d pieces of the metadata and it matches the info hash.\n", g_num_of_metadata_pieces);
+		g_metadata_verified = 1;
+		goto cleanup;
+	}
+	// some peer sent bad data, or the metadata_size we believed was wrong. start over.
+	bf_log("[ERROR] magnet_metadata_add_piece(): The metadata doesn't match the info hash. Fetching it again.\n");
+	for(i = 0; i < g_num_of_metadata_pieces; i++)
+	{
+		g_metadata_pieces[i] = METADATA_PIECE_MISSING;
+	}
+	g_num_of_received_pieces = 0;
+	rv = -1;
+
+cleanup:
+	pthread_mutex_unlock(&g_metadata_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return rv;
+}
+
+int magnet_metadata_done()
+{
+	int rv;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_metadata_mutex);
+
+	rv = g_metadata_verified;
+
+	pthread_mutex_unlock(&g_metadata_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return rv;
+}
+
+int magnet_write_torrent(const char *filename, const char *announce_url)
+{
+	FILE *fp;
+	int rv = 0;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_metadata_mutex);
+
+	if(!g_metadata_verified)
+	{
+		rv = -1;
+		goto cleanup;
+	}
+	if((fp = fopen(filename, "w")) == NULL)
+	{
+		bf_log("[ERROR] magnet_write_torrent(): Failed to create %s.\n", filename);
+		rv = -1;
+		goto cleanup;
+	}
+	if(!announce_url)
+	{
+		announce_url = "";
+	}
+	fprintf(fp, "d8:announce%d:%s4:info", (int)strlen(announce_url), announce_url);
+	fwrite(g_metadata, 1, g_metadata_size, fp);
+	fprintf(fp, "e");
+	fclose(fp);
+
+cleanup:
+	pthread_mutex_unlock(&g_metadata_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return rv;
+}
+
+void magnet_metadata_free()
+{
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_metadata_mutex);
+
+	free(g_metadata);
+	free(g_metadata_pieces);
+	g_metadata = NULL;
+	g_metadata_pieces = NULL;
+	g_metadata_size = 0;
+	g_num_of_metadata_pieces = 0;
+	g_metadata_active = 0;
+
+	pthread_mutex_unlock(&g_metadata_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
@@ -8,6 +8,22 @@
 #include "bencode.h"
 #include "bf_logger.h"
 
+static void add_url(struct metafile_info *mi, bencode_t *b)
+{
+	const char *str;
+	int len;
+
+	bencode_string_value(b, &str, &len);
+	if(len == 0)
+	{
+		return;
+	}
+	mi->url_list = realloc(mi->url_list, sizeof(char *) * (mi->num_of_urls + 1));
+	mi->url_list[mi->num_of_urls] = calloc(len + 1, 1);
+	strncpy(mi->url_list[mi->num_of_urls], str, len);
+	mi->num_of_urls++;
+}
+
 int read_metafile(char *filename, struct metafile_info *mi)
 {
 	FILE *fp;
@@ -17,6 +33,8 @@ int read_metafile(char *filename, struct metafile_info *mi)
 	bencode_t b1, b2, b3; // bn where n represents level of nestedness
 
 	rv = 0;
+	mi->url_list = NULL;
+	mi->num_of_urls = 0;
 	
 	util_read_whole_file(filename, &contents, &len);
 
@@ -122,6 +140,31 @@ int read_metafile(char *filename, struct metafile_info *mi)
 	mi->pieces = (uint8_t *)malloc(len);
 	memcpy((char *)(mi->pieces), str, len);
 
+	// the keys after 'info'. 'url-list' is either one URL or a list of them.
+	while(bencode_dict_has_next(&b1))
+	{
+		bencode_dict_get_next(&b1, &b2, &str, &len);
+		if(len != 8 || strncmp(str, "url-list", 8) != 0)
+		{
+			continue;
+		}
+		if(bencode_is_string(&b2))
+		{
+			add_url(mi, &b2);
+		}
+		else if(bencode_is_list(&b2))
+		{
+			while(bencode_list_has_next(&b2))
+			{
+				bencode_list_get_next(&b2, &b3);
+				if(bencode_is_string(&b3))
+				{
+					add_url(mi, &b3);
+				}
+			}
+		}
+	}
+
 cleanup:
 	if(contents)
 	{
@@ -182,6 +225,7 @@ void metafile_print(struct metafile_info *mi)
 	printf("Length: %ld\n", mi->length);
 	printf("Piece length: %ld\n", mi->piece_length);
 	printf("Number of pieces: %ld\n", mi->num_of_pieces);
+	printf("Web seeds: %d\n", mi->num_of_urls);
 	printf("Pieces:\n");	
 }
 
@@ -216,4 +260,14 @@ void metafile_free(struct metafile_info *mi)
 		free(mi->info_val);
 		mi->info_val = NULL;
 	}
+
+	if(mi->url_list)
+	{
+		while(mi->num_of_urls > 0)
+		{
+			free(mi->url_list[--mi->num_of_urls]);
+		}
+		free(mi->url_list);
+		mi->url_list = NULL;
+	}
 }
@@ -5,23 +5,48 @@
 #include<curl/easy.h>
 #include<sys/stat.h>
 #include<sys/types.h>
+#include<getopt.h>
+#include<signal.h>
+#include<unistd.h>
 
 #include "metafile.h"
 #include "sha1.h"
 #include "peers.h"
 #include "pwp.h"
+#include "peer_cache.h"
+#include "conntune.h"
 #include "util.h"
+#include "ratelimit.h"
+#include "dht.h"
+#include "magnet.h"
+#include "session.h"
+#include "fairshare.h"
+#include "control.h"
+#include "stream.h"
+#include "pipeout.h"
+#include "blocklist.h"
+#include "bf_logger.h"
 
 #define PEER_ID_HEX "dd0e76bcc7f711e3af893c77e686ca85b8f12e24";
 /*********************************************************************/
 
 #define LOG_FILE "logs/client.log"
-#define USAGE_MESSAGE "Usage: client <path-to-torrent-file> {fresh|new}\n"
+#define USAGE_MESSAGE "Usage: client [--download-rate KiB/s] [--upload-rate KiB/s] [--no-utp] [--no-lsd] [--no-dht] [--dht-bootstrap host:port]... [--blocklist path]... [--connections N] [--super-seed] [--daemon [--control socket-path]] [--stream[=port]] [--stdout [--range first-last]] {[--weight N] [--priority N] [--piece-priority skip|low|normal|high:first[-[last]]]... {<path-to-torrent-file>|<magnet-link>}}... [fresh|new]\n"
 
 #define MODE_DEFAULT 0
 #define MODE_FRESH 1
 #define MODE_NEW 2
 
+struct torrent_arg
+{
+	char *path; // torrent file or magnet link
+	int weight;
+	int priority;
+	// its --piece-priority options, in piece_priorities
+	int first_piece_priority;
+	int num_of_piece_priorities;
+};
+
 struct buffer_struct
 {
 	char *buffer;
@@ -35,95 +60,475 @@ char *make_tracker_http_request(char *request, int *len);
 int generate_announce_file(struct metafile_info *mi, char *hash, char *filename_to_generate);
 int generate_metadata_file(char *announce_filename, struct metafile_info *mi, char *filename_to_generate);
 int create_resume_file(const char *filename, int num_of_pieces);
+void add_web_seeds(struct pwp_torrent *t, struct metafile_info *mi);
+struct pwp_torrent *prepare_torrent(char *path_to_torrent, int mode);
+int fetch_magnet_torrent(struct magnet_link *ml, char *torrent_filename);
+static int hash_from_control(char *path_to_torrent, uint8_t *info_hash);
+static struct pwp_torrent *add_from_control(char *path_to_torrent);
+static void handle_stop_signal(int signum);
+static int parse_range(char *range, long int *first, long int *last);
 
 int main(int argc, char *argv[])
-{	
-	char *torrent_filename = NULL;
-	char *filename = NULL;
-	char *announce_filename = NULL;
-	char *metadata_filename = NULL;
-	char *resume_filename = NULL;
-	char *saved_filename = NULL;
-	char hash[41];
-	struct metafile_info mi;
-	struct stat s;
+{
+	struct pwp_torrent *t;
+	int num_of_torrents = 0;
+	int num_of_args = 0;
+	int weight = FAIRSHARE_DEFAULT_WEIGHT;
+	int priority = 0;
+	int daemon = 0;
+	int stream_port = 0;
+	int to_stdout = 0;
+	char *range = NULL;
+	long int first = 0, last = -1;
+	int out_fd = -1;
+	char **piece_priorities = malloc(sizeof(char *) * argc);
+	int num_of_piece_priorities = 0, num_of_assigned_piece_priorities = 0;
+	char *control_path = CONTROL_DEFAULT_PATH;
 	int rv = 0;
-	int torrent_already_present = 1;
 	char absolute_path[100];
 
 	realpath(LOG_FILE, absolute_path);
 	bf_logger_init(absolute_path);
 
-	bf_log("[LOG] The Mean Torrent Client has started.\n");
+	// a peer going away shows up as an error from send() or sendfile(). sendfile() can't be told not to raise SIGPIPE.
+	signal(SIGPIPE, SIG_IGN);
 
-	if(argc < 2 || argc > 3) 
+	static struct option long_options[] =
 	{
-		printf(USAGE_MESSAGE);
-		return -1;
+		{"download-rate", required_argument, NULL, 'd'},
+		{"upload-rate", required_argument, NULL, 'u'},
+		{"no-utp", no_argument, NULL, 'n'},
+		{"super-seed", no_argument, NULL, 's'},
+		{"no-lsd", no_argument, NULL, 'l'},
+		{"no-dht", no_argument, NULL, 'D'},
+		{"dht-bootstrap", required_argument, NULL, 'b'},
+		{"weight", required_argument, NULL, 'w'},
+		{"priority", required_argument, NULL, 'p'},
+		{"daemon", no_argument, NULL, 'a'},
+		{"control", required_argument, NULL, 'c'},
+		{"stream", optional_argument, NULL, 'S'},
+		{"stdout", no_argument, NULL, 'o'},
+		{"range", required_argument, NULL, 'r'},
+		{"piece-priority", required_argument, NULL, 'P'},
+		{"blocklist", required_argument, NULL, 'B'},
+		{"connections", required_argument, NULL, 'C'},
+		{NULL, 0, NULL, 0}
+	};
+	int opt;
+	char *colon;
+	// torrents and the mode in the order given, with the weight and priority in force at that point.
+	struct torrent_arg *args = malloc(sizeof(struct torrent_arg) * argc);
+	// the leading '-' returns the torrents as options too, so --weight and --priority apply to the torrents after them.
+	while((opt = getopt_long(argc, argv, "-d:u:nslDb:w:p:ac:S::or:P:B:C:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+			case 1:
+				args[num_of_args].path = optarg;
+				args[num_of_args].weight = weight;
+				args[num_of_args].priority = priority;
+				// piece priorities only apply to the torrent after them.
+				args[num_of_args].first_piece_priority = num_of_assigned_piece_priorities;
+				args[num_of_args].num_of_piece_priorities = num_of_piece_priorities - num_of_assigned_piece_priorities;
+				num_of_assigned_piece_priorities = num_of_piece_priorities;
+				num_of_args++;
+				break;
+			case 'w':
+				weight = atoi(optarg);
+				break;
+			case 'p':
+				priority = atoi(optarg);
+				break;
+			case 'a':
+				daemon = 1;
+				break;
+			case 'c':
+				control_path = optarg;
+				break;
+			case 'S':
+				stream_port = optarg ? atoi(optarg) : STREAM_DEFAULT_PORT;
+				break;
+			case 'o':
+				to_stdout = 1;
+				break;
+			case 'r':
+				range = optarg;
+				break;
+			case 'P':
+				piece_priorities[num_of_piece_priorities++] = optarg;
+				break;
+			case 'B':
+				// the lists are read up front: lookups don't lock, so they can't change once peers come in.
+				if(blocklist_load(optarg) == -1)
+				{
+					printf("Failed to read the blocklist %s.\n", optarg);
+					free(args);
+					free(piece_priorities);
+					return -1;
+				}
+				break;
+			case 'C':
+				// a fixed connection limit instead of the tuned one (see conntune.h), e.g. to compare the two.
+				conntune_set_fixed(atoi(optarg));
+				break;
+			case 'd':
+				// global limits apply to everything this process downloads.
+				ratelimit_set_rate(&g_global_download_bucket, atol(optarg) * 1024);
+				break;
+			case 'u':
+				ratelimit_set_rate(&g_global_upload_bucket, atol(optarg) * 1024);
+				break;
+			case 'n':
+				// TCP only
+				pwp_enable_utp(0);
+				break;
+			case 's':
+				pwp_enable_super_seeding(1);
+				break;
+			case 'l':
+				pwp_enable_lsd(0);
+				break;
+			case 'D':
+				pwp_enable_dht(0);
+				break;
+			case 'b':
+				// host:port. the default routers are only used if no node is given.
+				if((colon = strrchr(optarg, ':')) == NULL)
+				{
+					printf(USAGE_MESSAGE);
+					free(args);
+					free(piece_priorities);
+					return -1;
+				}
+				*colon = '\0';
+				dht_add_bootstrap(optarg, atoi(colon + 1));
+				break;
+			default:
+				printf(USAGE_MESSAGE);
+				free(args);
+				free(piece_priorities);
+				return -1;
+		}
 	}
 
-	char *path_to_torrent = argv[1];
-	// initialise mode
+	// initialise mode. it applies to every torrent given.
 	int mode = MODE_DEFAULT;
-	if(argc == 3)
+	if(num_of_args >= 2)
 	{
-		if(strcmp(argv[2], "fresh") == 0)
+		if(strcmp(args[num_of_args - 1].path, "fresh") == 0)
 		{
 			mode = MODE_FRESH;
+			num_of_args--;
 		}
-		else if(strcmp(argv[2], "new") == 0)
+		else if(strcmp(args[num_of_args - 1].path, "new") == 0)
 		{
 			mode = MODE_NEW;
+			num_of_args--;
 		}
-		else
+	}
+	// a daemon is given its torrents over the control socket (see control.h).
+	if(num_of_args < 1 && !daemon)
+	{
+		printf(USAGE_MESSAGE);
+		free(args);
+		free(piece_priorities);
+		return -1;
+	}
+
+	// the output takes one torrent, and stdout is for its data alone.
+	if(to_stdout)
+	{
+		if(num_of_args != 1 || daemon || stream_port || (range && parse_range(range, &first, &last) != 0))
 		{
 			printf(USAGE_MESSAGE);
+			free(args);
+			free(piece_priorities);
 			return -1;
 		}
-	}	
+		fflush(stdout);
+		out_fd = dup(STDOUT_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		bf_logger_echo(0);
+	}
+	else if(range)
+	{
+		printf(USAGE_MESSAGE);
+		free(args);
+		free(piece_priorities);
+		return -1;
+	}
+
+	bf_log("[LOG] The Mean Torrent Client has started.\n");
+
+	// magnet links are fetched with the session's DHT and LSD, so it is started first.
+	if(session_start() != 0)
+	{
+		bf_log("[ERROR] client.main(): Failed to start the session. Aborting.\n");
+		rv = -1;
+		goto cleanup;
+	}
+
+	int i, j;
+	for(i = 0; i < num_of_args; i++)
+	{
+		if((t = prepare_torrent(args[i].path, mode)) == NULL)
+		{
+			bf_log("[ERROR] client.main(): Skipping %s.\n", args[i].path);
+			rv = -1;
+			continue;
+		}
+		pwp_set_share(t, args[i].weight, args[i].priority);
+		for(j = 0; j < args[i].num_of_piece_priorities; j++)
+		{
+			if(pwp_parse_piece_priority(t, piece_priorities[args[i].first_piece_priority + j]) != 0)
+			{
+				break;
+			}
+		}
+		if(j < args[i].num_of_piece_priorities)
+		{
+			printf("Invalid piece priority %s for %s.\n", piece_priorities[args[i].first_piece_priority + j], args[i].path);
+			pwp_torrent_destroy(t);
+			rv = -1;
+			continue;
+		}
+		if(to_stdout && pipeout_start(t, first, last == -1 || last >= t->total_length ? t->total_length - 1 : last, out_fd) != 0)
+		{
+			printf("The range isn't in %s.\n", args[i].path);
+			pwp_torrent_destroy(t);
+			rv = -1;
+			continue;
+		}
+		session_add_torrent(t);
+		num_of_torrents++;
+	}
+
+	if(stream_port && stream_start(stream_port) != 0)
+	{
+		printf("Failed to listen on port %d for streaming.\n", stream_port);
+		session_stop();
+		rv = -1;
+		goto cleanup;
+	}
+	if(daemon && control_start(control_path, hash_from_control, add_from_control) != 0)
+	{
+		printf("Failed to listen on the control socket %s.\n", control_path);
+		stream_stop();
+		session_stop();
+		rv = -1;
+		goto cleanup;
+	}
+	// a daemon and a streaming server keep going after the downloads are done, until they are stopped.
+	if(daemon || stream_port)
+	{
+		signal(SIGINT, handle_stop_signal);
+		signal(SIGTERM, handle_stop_signal);
+		if(daemon)
+		{
+			printf("Running as a daemon. Commands are taken on %s.\n", control_path);
+		}
+		if(stream_port)
+		{
+			printf("Streaming at http://127.0.0.1:%d/<info hash>, or / with one torrent.\n", stream_port);
+		}
+		session_run(1);
+		bf_log("[LOG] client.main(): The session was shut down.\n");
+		control_stop();
+		stream_stop();
+	}
+	else if(num_of_torrents > 0)
+	{
+		if(session_run(0) != 0)
+		{
+			bf_log("[ERROR] client.main(): There was a problem communicating with remote peers.\n");
+			rv = -1;
+		}
+		else
+		{
+			bf_log("[LOG] client.main(): Performed pwp comm. successfully.\n");
+		}
+		if(to_stdout && pipeout_stop() != 0)
+		{
+			printf("Not all of the range was written out.\n");
+			rv = -1;
+		}
+	}
+
+	session_stop();
+
+cleanup:
+	blocklist_free();
+	if(out_fd != -1)
+	{
+		close(out_fd);
+	}
+	free(args);
+	free(piece_priorities);
+	bf_logger_end();
+
+	return rv;
+}
+
+// the info hash of a magnet link or of a torrent file's info dictionary. neither asks a tracker.
+static int hash_from_control(char *path_to_torrent, uint8_t *info_hash)
+{
+	struct metafile_info mi;
+	struct magnet_link ml;
+	int rv = 0;
+
+	memset(&mi, 0, sizeof(mi));
+	memset(&ml, 0, sizeof(ml));
+	if(magnet_is_link(path_to_torrent))
+	{
+		if(magnet_parse(path_to_torrent, &ml) != 0)
+		{
+			rv = -1;
+			goto cleanup;
+		}
+		memcpy(info_hash, ml.info_hash, 20);
+	}
+	else
+	{
+		// read_metafile() doesn't check that the file could be read.
+		if(access(path_to_torrent, R_OK) != 0 || read_metafile(path_to_torrent, &mi) != 0)
+		{
+			rv = -1;
+			goto cleanup;
+		}
+		sha1_compute(mi.info_val, mi.info_len, info_hash);
+	}
 
-	filename = util_extract_filename(path_to_torrent);
+cleanup:
+	metafile_free(&mi);
+	magnet_free(&ml);
+
+	return rv;
+}
+
+// torrents added over the control socket are resumed from their data folder, if there is one.
+static struct pwp_torrent *add_from_control(char *path_to_torrent)
+{
+	return prepare_torrent(path_to_torrent, MODE_DEFAULT);
+}
+
+static void handle_stop_signal(int signum)
+{
+	session_shutdown();
+}
+
+// first-last, first- or -last, in bytes and inclusive. a missing last is the end of the torrent
+// and is returned as -1. returns -1 if the range isn't valid.
+static int parse_range(char *range, long int *first, long int *last)
+{
+	char *dash, *end;
+
+	if((dash = strchr(range, '-')) == NULL)
+	{
+		return -1;
+	}
+	*first = dash == range ? 0 : strtol(range, &end, 10);
+	if(dash != range && end != dash)
+	{
+		return -1;
+	}
+	*last = dash[1] == '\0' ? -1 : strtol(dash + 1, &end, 10);
+	if(dash[1] != '\0' && *end != '\0')
+	{
+		return -1;
+	}
+	if(*first < 0 || (*last != -1 && *last < *first))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+// sets up the data folder of a torrent file or magnet link, named after the torrent, and creates
+// the torrent from it. returns NULL on error.
+struct pwp_torrent *prepare_torrent(char *path_to_torrent, int mode)
+{
+	char *torrent_filename = NULL;
+	char *filename = NULL;
+	char *basepath = NULL;
+	char *announce_filename = NULL;
+	char *metadata_filename = NULL;
+	char *resume_filename = NULL;
+	char *saved_filename = NULL;
+	char *peers_filename = NULL;
+	char *dir;
+	char hash[41];
+	struct metafile_info mi;
+	struct magnet_link ml;
+	struct pwp_torrent *t = NULL;
+	int is_magnet = 0;
+	struct stat s;
+	int torrent_already_present = 1;
+
+	memset(&mi, 0, sizeof(mi));
+	memset(&ml, 0, sizeof(ml));
+	if(magnet_is_link(path_to_torrent))
+	{
+		if(magnet_parse(path_to_torrent, &ml) != 0)
+		{
+			printf("Not a valid magnet link.\n");
+			goto cleanup;
+		}
+		is_magnet = 1;
+		filename = strdup(ml.name);
+	}
+	else
+	{
+		filename = util_extract_filename(path_to_torrent);
+	}
 	// check if folder with the same name as filename exists. if not then create one.
 	if(stat(filename, &s) == -1)
 	{
 		// create the folder
 		if(mkdir(filename, 0700) != 0)
 		{
-			bf_log("[ERROR] client.main(): There was an error creating directory %s.\n", filename);
+			bf_log("[ERROR] prepare_torrent(): There was an error creating directory %s.\n", filename);
 			perror(NULL);
 			goto cleanup;
 		}
 	}
 
-	// move into that directory
-	if(chdir(filename) == -1)
-	{
-		bf_log("[ERROR] client.main(): Problem changing to directory %s.\n", filename);
-		perror(NULL);
-		goto cleanup;
-	}
-	
-	torrent_filename = util_concatenate(filename, ".torrent");
+	// the files of the torrent live in that folder. the process doesn't change into it as the
+	// folders of all torrents of the session are in use at the same time.
+	dir = util_concatenate(filename, "/");
+	basepath = util_concatenate(dir, filename);
+	free(dir);
+
+	torrent_filename = util_concatenate(basepath, ".torrent");
 	// check if the folder contains torrent file (i.e. filename+".torrent")
 	if(stat(torrent_filename, &s) == -1)
 	{
 		torrent_already_present = 0;
-		// copy the torrent file into this folder
-		// src: path_to_torrent; dest: torrent_filename
-		char *relative_path = util_concatenate("../", path_to_torrent);	
-		if(util_copy_file(relative_path, torrent_filename) < 0)
+		if(is_magnet)
 		{
-			bf_log("[ERROR] client.main(): Failed to copy the torrent file into the data folder.\n");
-			free(relative_path);
-			goto cleanup;
+			// the torrent file is made from the metadata the peers send us.
+			if(fetch_magnet_torrent(&ml, torrent_filename) != 0)
+			{
+				bf_log("[ERROR] prepare_torrent(): Failed to fetch the metadata of the magnet link.\n");
+				goto cleanup;
+			}
+		}
+		else
+		{
+			// copy the torrent file into this folder
+			if(util_copy_file(path_to_torrent, torrent_filename) < 0)
+			{
+				bf_log("[ERROR] prepare_torrent(): Failed to copy the torrent file into the data folder.\n");
+				goto cleanup;
+			}
 		}
-		free(relative_path);
 	}
 
-	announce_filename = util_concatenate(filename, ".announce");
-	metadata_filename = util_concatenate(filename, ".metadata");
-	resume_filename = util_concatenate(filename, ".resume");
-	saved_filename = util_concatenate(filename, ".saved");
+	announce_filename = util_concatenate(basepath, ".announce");
+	metadata_filename = util_concatenate(basepath, ".metadata");
+	resume_filename = util_concatenate(basepath, ".resume");
+	saved_filename = util_concatenate(basepath, ".saved");
+	peers_filename = util_concatenate(basepath, ".peers");
 
 	// if torrent isn't already present we assume that it is a DIFFERENT torrent.
 	if((mode == MODE_NEW) || (!torrent_already_present))
@@ -149,11 +554,15 @@ int main(int argc, char *argv[])
                         remove(saved_filename);
                 }
 	}
+	// the peers of the torrent are still good when it is downloaded again, but not for a different one.
+	if(!torrent_already_present && stat(peers_filename, &s) == 0)
+	{
+		remove(peers_filename);
+	}
 
 
 	if(parse_torrent_file(torrent_filename, &mi, hash) != 0)
         {
-               	rv = -1;
        	        goto cleanup;
         }
 
@@ -163,7 +572,7 @@ int main(int argc, char *argv[])
 		// create a new announce file
 		generate_announce_file(&mi, hash, announce_filename);
 		// create a new metadata file
-		generate_metadata_file(announce_filename, &mi, metadata_filename);	
+		generate_metadata_file(announce_filename, &mi, metadata_filename);
 	}
 
 	// if saved file doesn't already exist then create a new one along with new resume file.
@@ -172,15 +581,13 @@ int main(int argc, char *argv[])
 	{
 	        if(util_create_file_of_size(saved_filename, mi.length) != 0)
         	{
-                	bf_log("[ERROR] client.main(): Failed to create saved file. Aborting.\n");
-	                rv = -1;
+                	bf_log("[ERROR] prepare_torrent(): Failed to create saved file. Aborting.\n");
         	        goto cleanup;
         	}
 		// create a resume file which is just a bit string containing one (unset) bit for every piece.
  		if(create_resume_file(resume_filename, mi.num_of_pieces) != 0)
 		{
-			bf_log("[ERROR] client.main(): Failed to create resume file. Aborting.\n");
-			rv = -1;
+			bf_log("[ERROR] prepare_torrent(): Failed to create resume file. Aborting.\n");
 			goto cleanup;
 		}
 	}
@@ -188,30 +595,29 @@ int main(int argc, char *argv[])
 	// if saved file doesn't exist then report error and abort
 	if(stat(saved_filename, &s) == -1)
 	{
-		bf_log("[ERROR] client.main(): Saved file should exist by now but it doesn't. Aborting.\n");
-		rv = -1;
+		bf_log("[ERROR] prepare_torrent(): Saved file should exist by now but it doesn't. Aborting.\n");
 		goto cleanup;
 	}
 
-	// free mi instance as it won't be needed any further. note that this free method will be called again 
-	// under cleanup label but that doesn't matter as metafile_free() is idempotent.
-	metafile_free(&mi);
-
-	// call pwp_start
-	if(pwp_start(metadata_filename, saved_filename, resume_filename) != 0)
-        {
-                bf_log("[ERROR] client.main(): There was a problem communicating with remote peer.\n");
-        }
-        else
-        {
-                bf_log("[LOG] client.main(): Performed pwp comm. successfully.\n");
-        }
+	if((t = pwp_torrent_create(metadata_filename, saved_filename, resume_filename)) == NULL)
+	{
+		bf_log("[ERROR] prepare_torrent(): Failed to read the metadata of %s.\n", filename);
+		goto cleanup;
+	}
+	add_web_seeds(t, &mi);
+	// the peers that delivered in the last run are connected to first.
+	peer_cache_load(&t->peer_cache, peers_filename);
+	peer_cache_fill_pool(&t->peer_cache, &t->peer_pool);
 
 cleanup:
 	if(filename)
 	{
 		free(filename);
 	}
+	if(basepath)
+	{
+		free(basepath);
+	}
 	if(torrent_filename)
 	{
 		free(torrent_filename);
@@ -232,11 +638,14 @@ cleanup:
 	{
 		free(saved_filename);
 	}
+	if(peers_filename)
+	{
+		free(peers_filename);
+	}
 	metafile_free(&mi);
+	magnet_free(&ml);
 
-	bf_logger_end();
-
-	return rv;
+	return t;
 }
 
 int generate_announce_file(struct metafile_info *mi, char *hash, char *filename_to_generate)
@@ -335,6 +744,83 @@ char *make_tracker_http_request(char *request, int *len)
 	return output.buffer;
 }
 
+// asks the trackers of the magnet link for peers, fetches the metadata from them and writes it as a torrent file.
+int fetch_magnet_torrent(struct magnet_link *ml, char *torrent_filename)
+{
+	struct peer *tracker_peers = NULL, *head, **tail = &tracker_peers;
+	char *request, *response, *announce_url = NULL;
+	char *peer_id_hex = PEER_ID_HEX;
+	uint8_t our_peer_id[20];
+	int i, len, rv = 0;
+
+	util_hex_to_ba(peer_id_hex, our_peer_id);
+	for(i = 0; i < ml->num_of_trackers; i++)
+	{
+		// only HTTP trackers are supported. 'left' isn't known until we have the metadata.
+		if(strncmp(ml->trackers[i], "http", 4) != 0)
+		{
+			continue;
+		}
+		if(!announce_url)
+		{
+			announce_url = ml->trackers[i];
+		}
+		request = get_first_request(ml->trackers[i], ml->info_hash_hex, peer_id_hex, 0);
+		response = make_tracker_http_request(request, &len);
+		if(peers_extract(response, len, &head) == 0)
+		{
+			*tail = head;
+			while(*tail)
+			{
+				tail = &(*tail)->next;
+			}
+		}
+		free(request);
+		free(response);
+	}
+
+	printf("Fetching the metadata of %s from peers...\n", ml->info_hash_hex);
+	if(pwp_fetch_metadata(ml->info_hash, our_peer_id, tracker_peers) != 0 || magnet_write_torrent(torrent_filename, announce_url) != 0)
+	{
+		rv = -1;
+	}
+
+	magnet_metadata_free();
+	peers_free(tracker_peers);
+	return rv;
+}
+
+// BEP 19: a URL ending in '/' names a directory and the file's path within the torrent is appended to it.
+void add_web_seeds(struct pwp_torrent *t, struct metafile_info *mi)
+{
+	char *url, *name, *file_name;
+	int i, len;
+
+	for(i=0; i<mi->num_of_urls; i++)
+	{
+		len = strlen(mi->url_list[i]);
+		if(len == 0 || mi->url_list[i][len - 1] != '/')
+		{
+			pwp_add_web_seed(t, mi->url_list[i]);
+			continue;
+		}
+		name = curl_easy_escape(NULL, mi->top_most_directory, 0);
+		file_name = mi->file_name ? curl_easy_escape(NULL, mi->file_name, 0) : NULL;
+		url = malloc(len + strlen(name) + (file_name ? strlen(file_name) + 1 : 0) + 1);
+		strcpy(url, mi->url_list[i]);
+		strcat(url, name);
+		if(file_name)
+		{
+			strcat(url, "/");
+			strcat(url, file_name);
+			curl_free(file_name);
+		}
+		curl_free(name);
+		pwp_add_web_seed(t, url);
+		free(url);
+	}
+}
+
 int parse_torrent_file(char *torrent_filename, struct metafile_info *mi, char *hash)
 {
 	uint8_t sha1[20];
@@ -368,7 +854,7 @@ char *get_first_request(char *announce_url, char *info_hash_hex, char *peer_id_h
 	char *request = "http://tracker.documentfoundation.org:6969/announce?info_hash=\%2f\%7e\%c3\%b7\%42\%ec\%28\%28\%64\%92\%aa\%ad\%58\%f7\%58\%a9\%7c\%8d\%dd\%55&peer_id=\%dd\%0e\%76\%bc\%c7\%f7\%11\%e3\%af\%89\%3c\%77\%e6\%86\%ca\%85\%b8\%f1\%2e\%20&port=6881&uploaded=0&downloaded=0&left=206739284&compact=1&event=started";
 */
 	char *request;
-	char *request_format = "%s?info_hash=%s&peer_id=%s&port=6881&uploaded=0&downloaded=0&left=%d&compact=1&event=started";
+	char *request_format = "%s?info_hash=%s&peer_id=%s&port=%d&uploaded=0&downloaded=0&left=%d&compact=1&event=started";
 	char url_encoded_info_hash[61];
 	char url_encoded_peer_id[61];
 	int i, j;
@@ -390,7 +876,7 @@ char *get_first_request(char *announce_url, char *info_hash_hex, char *peer_id_h
 
 	request = calloc(512, 1);
 
-	sprintf(request, request_format, announce_url, url_encoded_info_hash, url_encoded_peer_id, file_size);
+	sprintf(request, request_format, announce_url, url_encoded_info_hash, url_encoded_peer_id, PWP_LISTEN_PORT, file_size);
 	
 	return request;
 }
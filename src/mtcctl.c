@@ -0,0 +1,121 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<limits.h>
+#include<unistd.h>
+#include<getopt.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+
+#include "control.h"
+
+/*
+mtcctl sends one command to a client running as a daemon (see control.h) and prints the reply.
+It exits with 0 if the command succeeded and 1 otherwise.
+*/
+
+#define USAGE_MESSAGE "Usage: mtcctl [--control socket-path] {add <path-to-torrent-file>|<magnet-link>} | {remove|pause|resume|stats <info-hash>} | {share <info-hash> <weight> <priority>} | {limit <info-hash>|global <download-KiB/s> <upload-KiB/s>} | {priority <info-hash> skip|low|normal|high:first[-[last]]} | list | shutdown\n"
+
+int main(int argc, char *argv[])
+{
+	char *control_path = CONTROL_DEFAULT_PATH;
+	char command[CONTROL_MAX_LINE];
+	char *reply = NULL;
+	int reply_len = 0;
+	char absolute_path[PATH_MAX];
+	struct sockaddr_un addr;
+	char *last;
+	int fd, i, len, n;
+	int rv = 1;
+
+	static struct option long_options[] =
+	{
+		{"control", required_argument, NULL, 'c'},
+		{NULL, 0, NULL, 0}
+	};
+	int opt;
+	while((opt = getopt_long(argc, argv, "c:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+			case 'c':
+				control_path = optarg;
+				break;
+			default:
+				printf(USAGE_MESSAGE);
+				return 1;
+		}
+	}
+	if(optind >= argc)
+	{
+		printf(USAGE_MESSAGE);
+		return 1;
+	}
+
+	// the daemon may run in another directory, so it is given the torrent file's absolute path.
+	len = 0;
+	for(i = optind; i < argc; i++)
+	{
+		char *arg = argv[i];
+		if(i == optind + 1 && strcmp(argv[optind], "add") == 0 && strncmp(arg, "magnet:", 7) != 0 && realpath(arg, absolute_path) != NULL)
+		{
+			arg = absolute_path;
+		}
+		len += snprintf(command + len, sizeof(command) - len, "%s%s", i > optind ? " " : "", arg);
+		if(len >= (int)sizeof(command) - 1)
+		{
+			printf("The command is too long.\n");
+			return 1;
+		}
+	}
+	command[len++] = '\n';
+
+	if(strlen(control_path) >= sizeof(addr.sun_path))
+	{
+		printf("The path of the control socket is too long.\n");
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, control_path);
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+	{
+		printf("Failed to connect to the daemon at %s.\n", control_path);
+		return 1;
+	}
+	if(send(fd, command, len, 0) != len)
+	{
+		printf("Failed to send the command.\n");
+		close(fd);
+		return 1;
+	}
+
+	// the reply is short; it is read whole and the last line tells whether the command succeeded.
+	while(1)
+	{
+		reply = realloc(reply, reply_len + CONTROL_MAX_LINE + 1);
+		if((n = recv(fd, reply + reply_len, CONTROL_MAX_LINE, 0)) <= 0)
+		{
+			break;
+		}
+		reply_len += n;
+	}
+	close(fd);
+	reply[reply_len] = '\0';
+	fputs(reply, stdout);
+
+	while(reply_len > 0 && reply[reply_len - 1] == '\n')
+	{
+		reply[--reply_len] = '\0';
+	}
+	last = strrchr(reply, '\n');
+	last = last ? last + 1 : reply;
+	if(strcmp(last, "OK") == 0)
+	{
+		rv = 0;
+	}
+	free(reply);
+
+	return rv;
+}
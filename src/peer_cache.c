@@ -0,0 +1,291 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<time.h>
+#include<pthread.h>
+#include<arpa/inet.h>
+
+#include "peer_cache.h"
+
+#include "util.h"
+#include "bf_logger.h"
+
+#define PEER_CACHE_MAGIC "MTPC"
+
+static struct peer_cache_entry *find_entry(struct peer_cache *cache, const char *ip, uint16_t port);
+static struct peer_cache_entry *new_entry(struct peer_cache *cache, uint32_t rate);
+static int is_stale(struct peer_cache_entry *entry, time_t now);
+static long int score(const struct peer_cache_entry *entry);
+static int compare_entries(const void *a, const void *b);
+static void put_uint(uint8_t *buf, uint64_t value, int len);
+static uint64_t get_uint(const uint8_t *buf, int len);
+
+void peer_cache_init(struct peer_cache *cache)
+{
+	cache->path = NULL;
+	cache->entries = malloc(sizeof(struct peer_cache_entry) * PEER_CACHE_MAX);
+	cache->num_of_entries = 0;
+	pthread_mutex_init(&cache->mutex, NULL);
+}
+
+void peer_cache_destroy(struct peer_cache *cache)
+{
+	free(cache->path);
+	cache->path = NULL;
+	free(cache->entries);
+	cache->entries = NULL;
+	cache->num_of_entries = 0;
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+int peer_cache_load(struct peer_cache *cache, const char *path)
+{
+	struct peer_cache_entry entry;
+	struct in6_addr addr;
+	uint8_t *data = NULL;
+	int len, i;
+	time_t now = time(NULL);
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&cache->mutex);
+
+	free(cache->path);
+	cache->path = strdup(path);
+	cache->num_of_entries = 0;
+	// a torrent that was never run has no cache yet.
+	if(util_read_whole_file(path, &data, &len) == 0 && len >= 4 && memcmp(data, PEER_CACHE_MAGIC, 4) == 0)
+	{
+		for(i = 4; i + PEER_CACHE_RECORD_LEN <= len && cache->num_of_entries < PEER_CACHE_MAX; i += PEER_CACHE_RECORD_LEN)
+		{
+			memcpy(addr.s6_addr, data + i, 16);
+			if(IN6_IS_ADDR_V4MAPPED(&addr))
+			{
+				inet_ntop(AF_INET, &addr.s6_addr[12], entry.addr.ip, sizeof(entry.addr.ip));
+			}
+			else
+			{
+				inet_ntop(AF_INET6, &addr, entry.addr.ip, sizeof(entry.addr.ip));
+			}
+			entry.addr.port = get_uint(data + i + 16, 2);
+			entry.last_success = get_uint(data + i + 18, 8);
+			entry.rate = get_uint(data + i + 26, 4);
+			entry.failures = get_uint(data + i + 30, 2);
+			if(!is_stale(&entry, now))
+			{
+				cache->entries[cache->num_of_entries++] = entry;
+			}
+		}
+	}
+	bf_log("[LOG] peer_cache_load(): %d peers in '%s'.\n", cache->num_of_entries, path);
+
+	pthread_mutex_unlock(&cache->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	free(data);
+	return 0;
+}
+
+void peer_cache_fill_pool(struct peer_cache *cache, struct peer_pool *pool)
+{
+	int i;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&cache->mutex);
+
+	// the pool hands out peers of the same priority in the order they were added.
+	qsort(cache->entries, cache->num_of_entries, sizeof(struct peer_cache_entry), compare_entries);
+	for(i = 0; i < cache->num_of_entries; i++)
+	{
+		peer_pool_add(pool, cache->entries[i].addr.ip, cache->entries[i].addr.port, PEER_POOL_PRIORITY_CACHE);
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+void peer_cache_record(struct peer_cache *cache, const char *ip, uint16_t port, int connected, long int downloaded, long int ms)
+{
+	struct peer_cache_entry *entry;
+	uint32_t rate;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&cache->mutex);
+
+	entry = find_entry(cache, ip, port);
+	if(connected && downloaded > 0)
+	{
+		rate = downloaded * 1000 / (ms > 0 ? ms : 1);
+		if(entry == NULL && (entry = new_entry(cache, rate)) != NULL)
+		{
+			strcpy(entry->addr.ip, ip);
+			entry->addr.port = port;
+			entry->rate = rate;
+		}
+		if(entry)
+		{
+			entry->rate = (entry->rate + rate) / 2;
+			entry->last_success = time(NULL);
+			entry->failures = 0;
+		}
+	}
+	else if(!connected && entry)
+	{
+		entry->failures++;
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+int peer_cache_save(struct peer_cache *cache)
+{
+	struct in6_addr addr;
+	struct in_addr addr4;
+	struct peer_cache_entry *entry;
+	uint8_t *data, *record;
+	char *tmp_path = NULL;
+	time_t now = time(NULL);
+	int i, len, rv = 0;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&cache->mutex);
+
+	if(cache->path == NULL)
+	{
+		pthread_mutex_unlock(&cache->mutex);
+		return 0;
+	}
+	data = malloc(4 + PEER_CACHE_RECORD_LEN * cache->num_of_entries);
+	memcpy(data, PEER_CACHE_MAGIC, 4);
+	len = 4;
+	for(i = 0; i < cache->num_of_entries; i++)
+	{
+		entry = &cache->entries[i];
+		if(is_stale(entry, now))
+		{
+			continue;
+		}
+		memset(&addr, 0, sizeof(addr));
+		if(inet_pton(AF_INET, entry->addr.ip, &addr4) == 1)
+		{
+			addr.s6_addr[10] = 0xFF;
+			addr.s6_addr[11] = 0xFF;
+			memcpy(&addr.s6_addr[12], &addr4, 4);
+		}
+		else if(inet_pton(AF_INET6, entry->addr.ip, &addr) != 1)
+		{
+			continue;
+		}
+		record = data + len;
+		memcpy(record, addr.s6_addr, 16);
+		put_uint(record + 16, entry->addr.port, 2);
+		put_uint(record + 18, entry->last_success, 8);
+		put_uint(record + 26, entry->rate, 4);
+		put_uint(record + 30, entry->failures, 2);
+		len += PEER_CACHE_RECORD_LEN;
+	}
+
+	// written next to the old file and renamed over it, so a crash leaves one or the other.
+	tmp_path = util_concatenate(cache->path, ".tmp");
+	if(util_write_new_file(tmp_path, data, len) != 0 || rename(tmp_path, cache->path) != 0)
+	{
+		bf_log("[ERROR] peer_cache_save(): Failed to write '%s'.\n", cache->path);
+		remove(tmp_path);
+		rv = -1;
+	}
+	else
+	{
+		bf_log("[LOG] peer_cache_save(): Saved %d peers in '%s'.\n", (len - 4) / PEER_CACHE_RECORD_LEN, cache->path);
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	free(tmp_path);
+	free(data);
+	return rv;
+}
+
+// NOTE: must be called with cache->mutex held.
+static struct peer_cache_entry *find_entry(struct peer_cache *cache, const char *ip, uint16_t port)
+{
+	int i;
+
+	for(i = 0; i < cache->num_of_entries; i++)
+	{
+		if(cache->entries[i].addr.port == port && strcmp(cache->entries[i].addr.ip, ip) == 0)
+		{
+			return &cache->entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+// returns a free entry for a peer that delivered at rate, making room by dropping the worst peer if
+// the cache is full. returns NULL if that one is still better.
+// NOTE: must be called with cache->mutex held.
+static struct peer_cache_entry *new_entry(struct peer_cache *cache, uint32_t rate)
+{
+	struct peer_cache_entry *worst = NULL;
+	int i;
+
+	if(cache->num_of_entries < PEER_CACHE_MAX)
+	{
+		return &cache->entries[cache->num_of_entries++];
+	}
+	for(i = 0; i < cache->num_of_entries; i++)
+	{
+		if(!worst || score(&cache->entries[i]) < score(worst))
+		{
+			worst = &cache->entries[i];
+		}
+	}
+
+	return score(worst) < rate ? worst : NULL;
+}
+
+static int is_stale(struct peer_cache_entry *entry, time_t now)
+{
+	return entry->failures >= PEER_CACHE_MAX_FAILURES || now - entry->last_success > PEER_CACHE_MAX_AGE;
+}
+
+// peers that failed lately rank below the ones that didn't.
+static long int score(const struct peer_cache_entry *entry)
+{
+	return entry->rate / (1 + entry->failures);
+}
+
+// the best first.
+static int compare_entries(const void *a, const void *b)
+{
+	long int x = score((const struct peer_cache_entry *)a);
+	long int y = score((const struct peer_cache_entry *)b);
+
+	return x > y ? -1 : (x < y ? 1 : 0);
+}
+
+static void put_uint(uint8_t *buf, uint64_t value, int len)
+{
+	int i;
+
+	for(i = len - 1; i >= 0; i--)
+	{
+		buf[i] = value & 0xFF;
+		value >>= 8;
+	}
+}
+
+static uint64_t get_uint(const uint8_t *buf, int len)
+{
+	uint64_t value = 0;
+	int i;
+
+	for(i = 0; i < len; i++)
+	{
+		value = (value << 8) | buf[i];
+	}
+
+	return value;
+}
@@ -0,0 +1,179 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<pthread.h>
+
+#include "peer_pool.h"
+
+#include "blocklist.h"
+#include "bf_logger.h"
+
+static unsigned int hash_addr(const char *ip, uint16_t port)
+{
+	unsigned int h = 5381;
+
+	for(; *ip; ip++)
+	{
+		h = h * 33 + (uint8_t)*ip;
+	}
+	h = h * 33 + port;
+
+	return h % PEER_POOL_BUCKETS;
+}
+
+void peer_pool_init(struct peer_pool *pool)
+{
+	memset(pool->buckets, 0, sizeof(pool->buckets));
+	pool->count = 0;
+	pool->untried = 0;
+	pool->next_seq = 0;
+	pthread_mutex_init(&pool->mutex, NULL);
+}
+
+void peer_pool_destroy(struct peer_pool *pool)
+{
+	struct peer_pool_entry *curr, *temp;
+	int i;
+
+	for(i = 0; i < PEER_POOL_BUCKETS; i++)
+	{
+		curr = pool->buckets[i];
+		while(curr)
+		{
+			temp = curr;
+			curr = curr->next;
+			free(temp);
+		}
+		pool->buckets[i] = NULL;
+	}
+	pool->count = 0;
+	pool->untried = 0;
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+int peer_pool_add(struct peer_pool *pool, const char *ip, uint16_t port, int priority)
+{
+	struct peer_pool_entry *curr;
+	unsigned int h;
+	int rv = 0;
+
+	if(port == 0 || strlen(ip) >= INET6_ADDRSTRLEN || blocklist_contains(ip))
+	{
+		return 0;
+	}
+	h = hash_addr(ip, port);
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&pool->mutex);
+
+	for(curr = pool->buckets[h]; curr; curr = curr->next)
+	{
+		if(curr->addr.port == port && strcmp(curr->addr.ip, ip) == 0)
+		{
+			// a better source for a peer not handed out yet moves it up, e.g. a cached peer the tracker lists too.
+			if(!curr->tried && priority > curr->priority)
+			{
+				curr->priority = priority;
+				curr->seq = pool->next_seq++;
+			}
+			goto unlock;
+		}
+	}
+	if(pool->count >= PEER_POOL_MAX)
+	{
+		goto unlock;
+	}
+
+	curr = malloc(sizeof(struct peer_pool_entry));
+	strcpy(curr->addr.ip, ip);
+	curr->addr.port = port;
+	curr->priority = priority;
+	curr->seq = pool->next_seq++;
+	curr->tried = 0;
+	curr->next = pool->buckets[h];
+	pool->buckets[h] = curr;
+	pool->count++;
+	pool->untried++;
+	rv = 1;
+
+unlock:
+	pthread_mutex_unlock(&pool->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	if(rv)
+	{
+		bf_log("[LOG] peer_pool_add(): Added %s:%d (priority %d).\n", ip, port, priority);
+	}
+	return rv;
+}
+
+int peer_pool_next(struct peer_pool *pool, struct peer_addr *addr)
+{
+	struct peer_pool_entry *curr, *best = NULL;
+	int i;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&pool->mutex);
+
+	if(pool->untried > 0)
+	{
+		for(i = 0; i < PEER_POOL_BUCKETS; i++)
+		{
+			for(curr = pool->buckets[i]; curr; curr = curr->next)
+			{
+				if(curr->tried)
+				{
+					continue;
+				}
+				if(!best || curr->priority > best->priority || (curr->priority == best->priority && curr->seq < best->seq))
+				{
+					best = curr;
+				}
+			}
+		}
+	}
+	if(best)
+	{
+		best->tried = 1;
+		pool->untried--;
+		*addr = best->addr;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return best ? 0 : -1;
+}
+
+void peer_pool_retry_all(struct peer_pool *pool)
+{
+	struct peer_pool_entry *curr;
+	int i;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&pool->mutex);
+
+	for(i = 0; i < PEER_POOL_BUCKETS; i++)
+	{
+		for(curr = pool->buckets[i]; curr; curr = curr->next)
+		{
+			curr->tried = 0;
+		}
+	}
+	pool->untried = pool->count;
+
+	pthread_mutex_unlock(&pool->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+int peer_pool_untried(struct peer_pool *pool)
+{
+	int untried;
+
+	pthread_mutex_lock(&pool->mutex);
+	untried = pool->untried;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return untried;
+}
@@ -2,6 +2,7 @@
 #include<stdlib.h>
 #include<string.h>
 #include<stdint.h>
+#include<arpa/inet.h>
 
 #include "peers.h"
 
@@ -21,60 +22,73 @@ int peers_extract_from_file(char *filename, struct peer **head)
 
 	return rv;
 }
+// appends the peers of a compact string: entry_len is 6 for 'peers' (4 byte ip) and 18 for 'peers6'
+// (16 byte ip, BEP 7), both followed by a 2 byte port in network order.
+static void append_compact_peers(const char *str, int len, int family, struct peer ***tail)
+{
+	int ip_len = (family == AF_INET6) ? 16 : 4;
+	int entry_len = ip_len + 2;
+	struct peer *curr;
+	uint16_t port;
+	int i;
+
+	for(i = 0; i + entry_len <= len; i += entry_len)
+	{
+		curr = malloc(sizeof(struct peer));
+		curr->family = family;
+		memcpy(curr->ip, str + i, ip_len);
+		memcpy(&port, str + i + ip_len, 2);
+		curr->port = ntohs(port);
+		curr->next = NULL;
+		**tail = curr;
+		*tail = &curr->next;
+	}
+}
+
 int peers_extract(char *contents, int len, struct peer **head)
 {
-	int rv, i;
-	const char *temp, *str;
+	int rv;
+	const char *str;
 	bencode_t b1, b2;// bn where n represents level of nestedness
-        struct peer *curr, *next;
-        uint8_t *swap;
+	struct peer **tail;
+	int klen, slen;
 
 	rv = 0;
+	*head = NULL;
+	tail = head;
+	if(len <= 0)
+	{
+		// the tracker didn't answer. peers may still come from the DHT or web seeds.
+		return -1;
+	}
 	bencode_init(&b1, contents, len);
 
-	// keep going until we hit the key 'peers'
-	while(1)
+	// IPv4 peers come in 'peers' and IPv6 ones in 'peers6'. either can be missing.
+	while(bencode_dict_has_next(&b1))
 	{
-		if(!bencode_dict_get_next(&b1, &b2, &str, &len))
+		bencode_dict_get_next(&b1, &b2, &str, &klen);
+		if(!bencode_is_string(&b2))
 		{
-			bf_log("[ERROR] peers_extract(): The bencoded dictionary doesn't contain the key 'peers'. Aborting.\n");
-			rv = -1;
-			goto cleanup;
+			continue;
 		}
-		if(strncmp(str, "peers", 5) == 0)
+		if(klen == 5 && strncmp(str, "peers", 5) == 0)
 		{
-			break;
+			bencode_string_value(&b2, &str, &slen);
+			append_compact_peers(str, slen, AF_INET, &tail);
+		}
+		else if(klen == 6 && strncmp(str, "peers6", 6) == 0)
+		{
+			bencode_string_value(&b2, &str, &slen);
+			append_compact_peers(str, slen, AF_INET6, &tail);
 		}
 	}
-	bencode_string_value(&b2, &str, &len);
-	if(len == 0)
+
+	if(*head == NULL)
 	{
-		fprintf(stderr, "No peers found.\n");
+		bf_log("[ERROR] peers_extract(): No peers found in 'peers' or 'peers6'.\n");
 		rv = -1;
-		goto cleanup;
 	}
-	curr = malloc(sizeof(struct peer));
-	*head = curr;
-	next = curr;
-	
-	temp = str;
-	for(i=0; i<len; i+=6)
-	{
-		curr = next;
-		memcpy(curr->ip, temp, 4);
-		temp += 4;
-		swap = (uint8_t *) &(curr->port);
-		memcpy(swap, temp + 1, 1);
-		memcpy(swap + 1, temp, 1);
-		temp += 2;
-		next = malloc(sizeof(struct peer));
-		curr->next = next;
-	}
-
-	free(next);
-	curr->next = NULL;
 
-cleanup:
 	return rv;
 }        
 
@@ -113,7 +127,7 @@ void peers_create_metadata(char *announce, int len, uint8_t *info_hash, uint8_t
 {
 	struct peer *head, *curr;
 	FILE *fp;
-	char buf[30];
+	char buf[INET6_ADDRSTRLEN];
 	int piece_hashes_len = num_of_pieces * 20; // where 20 is length of sha1 hash
 
 	fp = fopen(metadata_filename, "w");
@@ -136,10 +150,10 @@ void peers_create_metadata(char *announce, int len, uint8_t *info_hash, uint8_t
 	fprintf(fp, "12:piece_hashes%d:", piece_hashes_len);
         fwrite(piece_hashes, 1, piece_hashes_len, fp);	
 
+	// without peers the list is left empty; the torrent may still have web seeds.
 	if(peers_extract(announce, len, &head) != 0)
 	{
 		fprintf(stderr, "Got problem while extracting peers from announce file.\n");
-		goto cleanup;
 	}
 	fprintf(fp, "5:peersl"); /* start of list of peers */
 	curr = head;
@@ -148,7 +162,7 @@ void peers_create_metadata(char *announce, int len, uint8_t *info_hash, uint8_t
 		fprintf(fp, "d"); /* start of dictionary for every peer */
 
 		fprintf(fp, "2:ip");
-		sprintf(buf, "%d.%d.%d.%d", curr->ip[0], curr->ip[1], curr->ip[2], curr->ip[3]);		
+		inet_ntop(curr->family, curr->ip, buf, sizeof(buf));
 		len = strlen(buf);
 		fprintf(fp, "%d:%s", len, buf);
 		fprintf(fp, "4:porti%de", curr->port);
@@ -157,10 +171,10 @@ void peers_create_metadata(char *announce, int len, uint8_t *info_hash, uint8_t
 		curr = curr->next;
 	}
 	fprintf(fp, "e"); /* end of list of peers */
+	peers_free(head);
 
 	// end of root dictionary:
 	fprintf(fp, "e");
 
-cleanup:
 	fclose(fp);
 }
@@ -0,0 +1,106 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<sys/types.h>
+#include<sys/sendfile.h>
+
+#include "pipeout.h"
+
+#include "pwp.h"
+#include "stream.h"
+#include "session.h"
+#include "bf_logger.h"
+
+static struct pwp_torrent *g_pipeout_torrent;
+static long int g_pipeout_first;
+static long int g_pipeout_last;
+static int g_pipeout_fd;
+static pthread_t g_pipeout_thread;
+static int g_pipeout_started = 0;
+
+static void *pipeout_thread(void *arg);
+
+int pipeout_start(struct pwp_torrent *t, long int first, long int last, int fd)
+{
+	if(first < 0 || last >= t->total_length || first > last)
+	{
+		bf_log("[ERROR] pipeout_start(): Bytes %ld to %ld aren't in the torrent, which has %ld.\n", first, last, t->total_length);
+		return -1;
+	}
+
+	g_pipeout_torrent = t;
+	g_pipeout_first = first;
+	g_pipeout_last = last;
+	g_pipeout_fd = fd;
+	t->first_wanted = first / t->piece_length;
+	t->last_wanted = last / t->piece_length;
+	t->window_end = t->first_wanted + PIPEOUT_WINDOW_PIECES - 1;
+
+	if(pthread_create(&g_pipeout_thread, NULL, pipeout_thread, NULL) != 0)
+	{
+		bf_log("[ERROR] pipeout_start(): Failed to start the output thread.\n");
+		return -1;
+	}
+	g_pipeout_started = 1;
+	bf_log("[LOG] pipeout_start(): Writing bytes %ld to %ld, pieces %d to %d.\n", first, last, t->first_wanted, t->last_wanted);
+
+	return 0;
+}
+
+int pipeout_stop()
+{
+	void *rv;
+
+	if(!g_pipeout_started)
+	{
+		return -1;
+	}
+	pthread_join(g_pipeout_thread, &rv);
+	g_pipeout_started = 0;
+
+	return (int)(long)rv;
+}
+
+static void *pipeout_thread(void *arg)
+{
+	struct pwp_torrent *t = g_pipeout_torrent;
+	long int end;
+	off_t offset = g_pipeout_first;
+	int idx, rv = 0;
+
+	while(offset <= g_pipeout_last)
+	{
+		idx = offset / t->piece_length;
+		if(stream_wait_for_piece(t, idx, t->last_wanted, -1) != 0)
+		{
+			bf_log("[ERROR] pipeout_thread(): Piece %d won't be downloaded. Giving up the output.\n", idx);
+			rv = -1;
+			break;
+		}
+		end = (long int)(idx + 1) * t->piece_length;
+		if(end > g_pipeout_last + 1)
+		{
+			end = g_pipeout_last + 1;
+		}
+		while(offset < end)
+		{
+			if(sendfile(g_pipeout_fd, t->saved_fd, &offset, end - offset) <= 0)
+			{
+				bf_log("[ERROR] pipeout_thread(): Failed to write to the output: %s\n", strerror(errno));
+				rv = -1;
+				goto cleanup;
+			}
+		}
+		// the piece is out, so the window moves on.
+		t->window_end = idx + PIPEOUT_WINDOW_PIECES;
+	}
+
+cleanup:
+	bf_log("[LOG] pipeout_thread(): Wrote %ld bytes.\n", (long int)(offset - g_pipeout_first));
+	session_shutdown();
+
+	return (void *)(long)rv;
+}
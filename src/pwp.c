@@ -3,6 +3,7 @@
 #include<string.h>
 #include<stdint.h>
 #include<errno.h>
+#include<limits.h>
 
 #include<netdb.h>
 #include<sys/types.h>
@@ -10,8 +11,12 @@
 #include<netinet/in.h>
 #include<arpa/inet.h>
 #include<sys/time.h>
+#include<time.h>
 #include<pthread.h>
 #include<fcntl.h>
+#include<unistd.h>
+#include<sys/sendfile.h>
+#include<poll.h>
 
 #include"pwp.h"
 
@@ -19,6 +24,22 @@
 #include "util.h"
 #include "bf_logger.h"
 #include "sha1.h"
+#include "timer.h"
+#include "ratelimit.h"
+#include "choker.h"
+#include "peer_pool.h"
+#include "peer_cache.h"
+#include "extension.h"
+#include "utp.h"
+#include "superseed.h"
+#include "webseed.h"
+#include "lsd.h"
+#include "dht.h"
+#include "magnet.h"
+#include "socktune.h"
+#include "session.h"
+#include "diskio.h"
+#include "fairshare.h"
 
 #define MAX_DATA_LEN 1024
 
@@ -31,59 +52,113 @@
 #define REQUEST_MSG_ID 6
 #define PIECE_MSG_ID 7
 #define CANCEL_MSG_ID 8
+#define PORT_MSG_ID 9
+#define SUGGEST_MSG_ID 13 // fast extension messages from here...
+#define HAVE_ALL_MSG_ID 14
+#define HAVE_NONE_MSG_ID 15
+#define REJECT_MSG_ID 16
+#define ALLOWED_FAST_MSG_ID 17 // ...to here
 #define KEEP_ALIVE_MSG_ID 100
 
+#define FAST_EXTENSION_BYTE 7 // index in the reserved bytes of the handshake
+#define FAST_EXTENSION_BIT 0x04
+#define EXTENSION_PROTOCOL_BYTE 5
+#define EXTENSION_PROTOCOL_BIT 0x10
+#define DHT_BYTE 7
+#define DHT_BIT 0x01
+
 #define RECV_OK 0
 #define RECV_TO 1 // normal timeout
 #define RECV_ERROR -1 // error e.g. when received only 2 bytes from the 4 bytes which specify length of msg
-
-#define PIECE_STATUS_NOT_AVAILABLE 0
-#define PIECE_STATUS_AVAILABLE 1
-#define PIECE_STATUS_STARTED 2
-#define PIECE_STATUS_COMPLETE 3 
+#define RECV_REJECTED 2 // download_block(): the peer sent REJECT for one of our requests
+#define RECV_CHOKED 3 // download_block(): the peer choked us and, without the fast extension, dropped our requests
+#define GET_PIECES_LEAVE 1 // get_pieces(): the thread gives way to bring the torrent down to its connection limit
+#define DOWNLOAD_PIECE_LOST 2 // download_piece(): the connection is gone, so no other piece is tried either
 
 #define BLOCK_LEN 16384 // i.e. 2^14 which is commonly used
 #define BLOCK_STATUS_NOT_DOWNLOADED 0
 #define BLOCK_STATUS_DOWNLOADED 1 
 
 #define BLOCK_REQUESTS_COUNT 3 // max no of requests sent every time
+#define MAX_REQUEST_LEN 131072 // requests for more than this are dropped, as other clients do
 
-#define MAX_THREADS 4
-#define PIECES_TO_DOWNLOAD 3
+#define CONNECT_TIMEOUT_MS 10000
+#define UTP_CONNECT_TIMEOUT_MS 4000 // peers that don't answer over uTP within this time are tried over TCP
+#define REQUEST_TIMEOUT_MS 30000 // peer is dropped if none of the outstanding requests is answered within this time
+#define KEEP_ALIVE_INTERVAL_MS 90000 // peers drop connections after two minutes without any message
+#define HAVE_BATCH_MS TIMER_TICK_MS // pieces completed within this time are announced together
+#define FETCH_IDLE_TIMEOUTS 3 // RECV_TIMEOUT_SECS periods a peer may stay quiet while fetching metadata
+#define RECV_TIMEOUT_SECS 10 // how long to wait for more messages before deciding that the peer has gone quiet
+#define SUPERSEED_IDLE_TIMEOUTS 18 // super seeding: receive timeouts in a row after which a peer is given up on
+#define SERVE_IDLE_TIMEOUTS 12 // receive timeouts in a row, two minutes, after which a peer we serve is given up on
 
-struct pwp_piece *g_pieces = NULL;
-long int g_total_length = -1;
-long int g_piece_length = -1;
-long int g_num_of_pieces = -1;
-long int g_downloaded_pieces = 0;
-uint8_t *g_piece_hashes;
-char *g_saved_filepath = NULL;
-char *g_resume_filepath = NULL;
+// outbound connections try uTP first and fall back to TCP. inbound ones are accepted over both.
+int g_utp_enabled = 1;
 
-pthread_mutex_t *g_pieces_mutexes = NULL;
-// used to lock one byte of resume file when updating it. there will be one mutex per byte of the resume file
-pthread_mutex_t *g_resume_mutexes = NULL;
-pthread_mutex_t g_downloaded_pieces_mutex = PTHREAD_MUTEX_INITIALIZER;
+// super seeding (BEP 16) once the download is complete.
+int g_super_seeding = 0;
 
-int pwp_start(char *md_filepath, char *saved_filepath, char *resume_filepath)
-{
-//	bf_logger_init(LOG_FILE);
+// local service discovery (BEP 14) finds peers on the LAN.
+int g_lsd_enabled = 1;
+
+// the mainline DHT (BEP 5) finds peers of the whole swarm without the tracker.
+int g_dht_enabled = 1;
 
-	bf_log("++++++++++++++++++++ START:  PWP_START +++++++++++++++++++++++\n");
+// magnet links: threads fetching the metadata and their sockets, -1 when not connected.
+static pthread_mutex_t g_fetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_fetch_busy = 0;
+static int g_fetch_sockets[MAX_THREADS];
+
+struct fetch_metadata_args
+{
+	struct pwp_torrent *torrent;
+	int idx; // slot in g_fetch_sockets
+};
+
+static void init_torrent(struct pwp_torrent *t);
+static int wanted_pieces_left(struct pwp_torrent *t);
+static int choose_piece_at_priority(struct pwp_peer *peer, int priority);
+static long int pieces_left_at_priority(struct pwp_torrent *t, int priority);
+static int save_piece_priorities(struct pwp_torrent *t);
+static void keep_alive_callback(void *arg);
+static int flush_outbox(struct pwp_peer *peer, int wait);
+static int check_piece_hash(struct pwp_torrent *t, int idx, uint8_t *piece_data);
+static int valid_msg_len(uint8_t msg_id, int msg_len);
+static int commit_hedge(struct pwp_torrent *t, int idx, uint8_t *piece_data);
+static void deadline_callback(void *arg);
+static void choke_callback(void *arg);
+static void have_callback(void *arg);
+static void pex_callback(void *arg);
+static void *fetch_metadata_thread(void *arg);
+static void set_fetch_socket(int idx, int socketfd);
+static int fetch_metadata_from_peer(struct pwp_torrent *t, char *ip, uint16_t port, int idx);
+
+struct pwp_torrent *pwp_torrent_create(char *md_filepath, char *saved_filepath, char *resume_filepath)
+{
+	bf_log("++++++++++++++++++++ START:  PWP_TORRENT_CREATE +++++++++++++++++++++++\n");
 
 	uint8_t *metadata;
 	const char *str;
 	int len, i;
-	long int num;
 	int rv = 0;
-	bencode_t b1, b2, b3, b4; // bn where n is the level of nestedness
-	uint8_t info_hash[20];
-	uint8_t our_peer_id[20];
-	char *ip;
+	bencode_t b1, b2; // bn where n is the level of nestedness
+	char *ip = NULL;
 	uint16_t port;
+	struct pwp_torrent *t;
+
+	metadata = NULL;
+	t = calloc(1, sizeof(struct pwp_torrent));
+	init_torrent(t);
+	t->saved_filepath = strdup(saved_filepath);
+	t->resume_filepath = strdup(resume_filepath);
 
-	g_saved_filepath = saved_filepath;
-	g_resume_filepath = resume_filepath;
+	// blocks are written to the file by the disk writers and uploaded from it with sendfile().
+	if((t->saved_fd = open(t->saved_filepath, O_RDWR)) == -1)
+	{
+		bf_log("[ERROR] pwp_torrent_create(): Failed to open saved file: %s\n", strerror(errno));
+		rv = -1;
+		goto cleanup;
+	}
 
 	if(util_read_whole_file(md_filepath, &metadata, &len) != 0)
 	{
@@ -102,7 +177,7 @@ int pwp_start(char *md_filepath, char *saved_filepath, char *resume_filepath)
                 goto cleanup;
         }
         bencode_string_value(&b2, &str, &len);
-        memcpy(info_hash, str, len);
+        memcpy(t->info_hash, str, len);
 
 	bencode_dict_get_next(&b1, &b2, &str, &len);
         if(strncmp(str, "our_peer_id", 11) != 0)
@@ -112,7 +187,7 @@ int pwp_start(char *md_filepath, char *saved_filepath, char *resume_filepath)
                 goto cleanup;
         }
         bencode_string_value(&b2, &str, &len);
-        memcpy(our_peer_id, str, len);
+        memcpy(t->our_peer_id, str, len);
 
 	bencode_dict_get_next(&b1, &b2, &str, &len);
         if(strncmp(str, "total_length", 12) != 0)
@@ -121,7 +196,7 @@ int pwp_start(char *md_filepath, char *saved_filepath, char *resume_filepath)
                 bf_log(  "Failed to find 'num_of_pieces' in metadata file.\n");
                 goto cleanup;
         }
-        bencode_int_value(&b2, &g_total_length);
+        bencode_int_value(&b2, &t->total_length);
 
 	bencode_dict_get_next(&b1, &b2, &str, &len);
         if(strncmp(str, "num_of_pieces", 13) != 0)
@@ -130,22 +205,29 @@ int pwp_start(char *md_filepath, char *saved_filepath, char *resume_filepath)
                 bf_log(  "Failed to find 'num_of_pieces' in metadata file.\n");
                 goto cleanup;
         }
-        bencode_int_value(&b2, &g_num_of_pieces);
+        bencode_int_value(&b2, &t->num_of_pieces);
 
-        g_pieces_mutexes = malloc(sizeof(pthread_mutex_t) * g_num_of_pieces);
-        for(i=0; i<g_num_of_pieces; i++)
+        t->pieces_mutexes = malloc(sizeof(pthread_mutex_t) * t->num_of_pieces);
+        for(i=0; i<t->num_of_pieces; i++)
         {
-                 pthread_mutex_init(&g_pieces_mutexes[i], NULL);
+                 pthread_mutex_init(&t->pieces_mutexes[i], NULL);
         }
 
-	int num_of_resume_bytes = g_num_of_pieces / 8;
-	num_of_resume_bytes += (g_num_of_pieces % 8) ? 1 : 0;
-	g_resume_mutexes = malloc(sizeof(pthread_mutex_t) * num_of_resume_bytes);
+	int num_of_resume_bytes = t->num_of_pieces / 8;
+	num_of_resume_bytes += (t->num_of_pieces % 8) ? 1 : 0;
+	t->resume_mutexes = malloc(sizeof(pthread_mutex_t) * num_of_resume_bytes);
         for(i=0; i<num_of_resume_bytes; i++)
         {
-                 pthread_mutex_init(&g_resume_mutexes[i], NULL);
+                 pthread_mutex_init(&t->resume_mutexes[i], NULL);
         }
 
+	// the resume file has the layout of a bitfield; initialise_pieces() fills this in from it.
+	t->have_bitfield_len = num_of_resume_bytes;
+	t->have_bitfield = calloc(num_of_resume_bytes, 1);
+	t->have_queue = malloc(sizeof(int) * t->num_of_pieces);
+	t->have_flushing = malloc(sizeof(int) * t->num_of_pieces);
+	t->have_batch = malloc(9 * t->num_of_pieces);
+
         bencode_dict_get_next(&b1, &b2, &str, &len);
         if(strncmp(str, "piece_length", 12) != 0)
         {
@@ -153,7 +235,7 @@ int pwp_start(char *md_filepath, char *saved_filepath, char *resume_filepath)
                 bf_log(  "Failed to find 'piece_length' in metadata file.\n");
                 goto cleanup;
         }
-        bencode_int_value(&b2, &g_piece_length);	
+        bencode_int_value(&b2, &t->piece_length);	
 
 	bencode_dict_get_next(&b1, &b2, &str, &len);
         if(strncmp(str, "piece_hashes", 12) != 0)
@@ -163,8 +245,8 @@ int pwp_start(char *md_filepath, char *saved_filepath, char *resume_filepath)
                 goto cleanup;
         }
         bencode_string_value(&b2, &str, &len);
-        g_piece_hashes = malloc(len);
-        memcpy(g_piece_hashes, str, len);
+        t->piece_hashes = malloc(len);
+        memcpy(t->piece_hashes, str, len);
 	
 	bencode_dict_get_next(&b1, &b2, &str, &len);
         if(strncmp(str, "peers", 5) != 0)
@@ -174,328 +256,1024 @@ int pwp_start(char *md_filepath, char *saved_filepath, char *resume_filepath)
                 goto cleanup;
         }
 
-	g_pieces = calloc(sizeof(struct pwp_piece) * g_num_of_pieces, 1);
-        if(initialise_pieces(g_pieces, g_total_length, g_num_of_pieces, g_piece_length, g_resume_filepath) == -1)
+	t->pieces = calloc(sizeof(struct pwp_piece) * t->num_of_pieces, 1);
+        if(initialise_pieces(t) == -1)
         {
                 rv = -1;
-                bf_log("[ERROR] pwp_start(): Failied to initialise g_pieces. Aborting.\n");
+                bf_log("[ERROR] pwp_torrent_create(): Failied to initialise pieces. Aborting.\n");
                 goto cleanup;
         }
 
-	struct talk_to_peer_args *args;
-	pthread_t thread1;
-	int t1_rv, thread_count;
-	void *ttp_rv;		
-	struct thread_data *td = malloc(MAX_THREADS * sizeof(struct thread_data));
+	// the tracker's peers are the first candidates. more are added by peer exchange, LSD and the DHT as we go.
+	while(extract_next_peer(&b2, &ip, &port) == 0)
+	{
+		peer_pool_add(&t->peer_pool, ip, port, PEER_POOL_PRIORITY_TRACKER);
+		free(ip);
+		ip = NULL;
+	}
+
+cleanup:
+	bf_log(" ------------------------------------ FINISH: PWP_TORRENT_CREATE  ----------------------------------------\n");
+	if(metadata)
+	{
+		free(metadata);
+	}
+	if(ip)
+	{
+		free(ip);
+	}
+	if(rv != 0)
+	{
+		pwp_torrent_destroy(t);
+		t = NULL;
+	}
 
-	thread_count = 0;
+	return t;
+}
 
-/******** INITIAL loop to start initial MAX_THREADS threads ************/
+struct pwp_torrent *pwp_torrent_create_empty(uint8_t *info_hash, uint8_t *our_peer_id)
+{
+	struct pwp_torrent *t;
 
-// NOTE: throughout this application one thread talks to one peer only.
+	t = calloc(1, sizeof(struct pwp_torrent));
+	init_torrent(t);
+	memcpy(t->info_hash, info_hash, 20);
+	memcpy(t->our_peer_id, our_peer_id, 20);
 
-	while((extract_next_peer(&b2, &ip, &port) == 0) && (thread_count < MAX_THREADS))
-	{	
-		args = malloc(sizeof(struct talk_to_peer_args));
-		args->info_hash = info_hash;
-		args->our_peer_id = our_peer_id;
-		args->ip = ip;
-		args->port = port;
-		t1_rv = pthread_create(&thread1, NULL, talk_to_peer, (void *)args);
-		
-		td[thread_count].args = args;
-		td[thread_count].thread_descriptor = thread1;	
-		bf_log("[LOG] pwp_start(): Started a fresh thread with id: %d.\n", thread1);
-		thread_count++;
+	return t;
+}
+
+// what a torrent needs before anything else is known about it.
+static void init_torrent(struct pwp_torrent *t)
+{
+	t->saved_fd = -1;
+	t->super_seeding = g_super_seeding;
+	t->first_wanted = 0;
+	t->last_wanted = INT_MAX;
+	t->window_end = INT_MAX;
+	pthread_mutex_init(&t->downloaded_pieces_mutex, NULL);
+	pthread_mutex_init(&t->connected_peers_mutex, NULL);
+	pthread_mutex_init(&t->have_mutex, NULL);
+	pthread_mutex_init(&t->priorities_mutex, NULL);
+	ratelimit_init(&t->download_bucket, RATELIMIT_UNLIMITED, &g_global_download_bucket);
+	ratelimit_init(&t->upload_bucket, RATELIMIT_UNLIMITED, &g_global_upload_bucket);
+	fairshare_init(&t->share);
+	conntune_init(&t->tune);
+	stream_deadlines_init(&t->deadlines);
+	peer_pool_init(&t->peer_pool);
+	peer_cache_init(&t->peer_cache);
+	choker_init(&t->choker);
+	timer_init(&t->choke_timer, choke_callback, t);
+	timer_init(&t->have_timer, have_callback, t);
+}
+
+void pwp_torrent_destroy(struct pwp_torrent *t)
+{
+	int i;
+
+	if(t->saved_fd != -1)
+	{
+		close(t->saved_fd);
+	}
+	peer_pool_destroy(&t->peer_pool);
+	peer_cache_destroy(&t->peer_cache);
+	conntune_destroy(&t->tune);
+	free(t->pieces);
+	if(t->pieces_mutexes)
+	{
+		for(i=0; i<t->num_of_pieces; i++)
+		{
+			pthread_mutex_destroy(&t->pieces_mutexes[i]);
+		}
+		free(t->pieces_mutexes);
+	}
+	if(t->resume_mutexes)
+	{
+		for(i=0; i<t->have_bitfield_len; i++)
+		{
+			pthread_mutex_destroy(&t->resume_mutexes[i]);
+		}
+		free(t->resume_mutexes);
 	}
+	for(i=0; i<t->num_of_web_seeds; i++)
+	{
+		free(t->web_seed_urls[i]);
+	}
+	free(t->web_seed_urls);
+	free(t->piece_hashes);
+	free(t->have_bitfield);
+	free(t->have_queue);
+	free(t->have_flushing);
+	free(t->have_batch);
+	free(t->saved_filepath);
+	free(t->resume_filepath);
+	ratelimit_destroy(&t->download_bucket);
+	ratelimit_destroy(&t->upload_bucket);
+	pthread_mutex_destroy(&t->downloaded_pieces_mutex);
+	pthread_mutex_destroy(&t->connected_peers_mutex);
+	pthread_mutex_destroy(&t->have_mutex);
+	pthread_mutex_destroy(&t->priorities_mutex);
+	stream_deadlines_destroy(&t->deadlines);
+	free(t);
+}
 
-	rv = -1;
-	
-	int count = 0;
-	struct timespec ts;
+void pwp_torrent_start(struct pwp_torrent *t)
+{
+	int i;
 
-/********** SECOND loop to replace any completed threads with new ones. *******************/
-	while(count < g_num_of_pieces)
+	timer_add(&g_timer_wheel, &t->choke_timer, CHOKER_INTERVAL_MS);
+
+	// web seeds have every piece, so every piece we lack can be downloaded from them.
+	if(t->num_of_web_seeds > 0 && !is_wanted_download_complete(t))
 	{
-		// this for loop goes over each thread checking if it has completed. 
-		for(thread_count = 0; thread_count < MAX_THREADS; thread_count++)
+		for(i=0; i<t->num_of_pieces; i++)
 		{
-			clock_gettime(CLOCK_REALTIME, &ts);
-        	        ts.tv_sec += 1;
-	                rv = pthread_timedjoin_np(td[thread_count].thread_descriptor, &ttp_rv, &ts);
-			if(rv == 0) // rv == 0 means that the thread completed execution
-			{
-				// 1. free resources
-				bf_log("[LOG] pwp_start: >>> Thread Completed <<< rv from talk_to_peer thread id: %d is %d.\n\n", td[thread_count].thread_descriptor, (int)ttp_rv);
-				free(td[thread_count].args);
-				td[thread_count].args = NULL;
-
-				// 2. start new thread in its place
-				if(extract_next_peer(&b2, &ip, &port) == 0)
-			        {
-		                	args = malloc(sizeof(struct talk_to_peer_args));
-        		        	args->info_hash = info_hash;
-                			args->our_peer_id = our_peer_id;
-	        		        args->ip = ip;
-        		        	args->port = port;
-	               		 	t1_rv = pthread_create(&thread1, NULL, talk_to_peer, (void *)args);
-		
-			                td[thread_count].args = args;
-                			td[thread_count].thread_descriptor = thread1;
-					bf_log("[LOG] pwp_start(): Started a replacement thread with id: %d.\n", thread1);
-				}
-                	}
-			else
+			/* -X-X-X- CRITICAL REGION START -X-X-X- */
+			pthread_mutex_lock(&t->pieces_mutexes[i]);
+
+			if(t->pieces[i].status == PIECE_STATUS_NOT_AVAILABLE)
 			{
-				bf_log("[LOG] ********pwp_start(): Couldn't join thread %d within timeout.\n", td[thread_count].thread_descriptor);
+				t->pieces[i].status = PIECE_STATUS_AVAILABLE;
 			}
-        	}
-
-		/* -X-X-X- CRITICAL REGION START -X-X-X- */
-		pthread_mutex_lock(&g_downloaded_pieces_mutex);
-	
-		count = g_downloaded_pieces;
 
-		pthread_mutex_unlock(&g_downloaded_pieces_mutex);
-		/* -X-X-X- CRITICAL REGION END -X-X-X- */
-	}
-	bf_log("[LOG] pwp_start(): Finished the while loop to download at least 3 pieces. Going to join all threads.\n");
-		
-	// Final for-loop to ensure that all the threads have joined
-	for(thread_count = 0; thread_count < MAX_THREADS; thread_count++)
-	{
-		bf_log("[LOG] pwp_start(): Joining thread %d.\n", td[thread_count].thread_descriptor);
-		pthread_join(td[thread_count].thread_descriptor, NULL);
-		 bf_log("[LOG] pwp_start(): Successfully joined thread %d.\n", td[thread_count].thread_descriptor);
-		if(td[thread_count].args)
+			pthread_mutex_unlock(&t->pieces_mutexes[i]);
+			/* -X-X-X- CRITICAL REGION END -X-X-X- */
+		}
+		if(webseed_start(t) != 0)
 		{
-			free(td[thread_count].args);
-			td[thread_count].args = NULL;
+			bf_log("[ERROR] pwp_torrent_start(): Failed to start the web seeds. Only peers will be downloaded from.\n");
 		}
 	}
+}
 
-	free(td);
-/********** end of what will be while loop for every peer ****************/
-	rv = 0; // if here then things have gone according to plan.
-
-cleanup:
-	bf_log(" ------------------------------------ FINISH: PWP_START  ----------------------------------------\n");
-	if(metadata)
+void pwp_torrent_stop(struct pwp_torrent *t)
+{
+	if(t->webseeds)
 	{
-		bf_log("[LOG] Freeing metadata.\n");
-		free(metadata);
+		webseed_stop(t);
 	}
-	if(ip)
+	timer_cancel(&g_timer_wheel, &t->choke_timer);
+	timer_cancel(&g_timer_wheel, &t->have_timer);
+	peer_cache_save(&t->peer_cache);
+}
+
+int pwp_fetch_metadata(uint8_t *info_hash, uint8_t *our_peer_id, struct peer *tracker_peers)
+{
+	bf_log("++++++++++++++++++++ START:  PWP_FETCH_METADATA +++++++++++++++++++++++\n");
+
+	struct fetch_metadata_args args[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	struct pwp_torrent *t;
+	struct peer *curr;
+	char ip[INET6_ADDRSTRLEN];
+	int num_of_threads = 0;
+	int i, rv = 0;
+
+	t = pwp_torrent_create_empty(info_hash, our_peer_id);
+	for(curr = tracker_peers; curr; curr = curr->next)
 	{
-		bf_log("[LOG] Freeing IP.\n");
-		free(ip);
+		inet_ntop(curr->family, curr->ip, ip, sizeof(ip));
+		peer_pool_add(&t->peer_pool, ip, curr->port, PEER_POOL_PRIORITY_TRACKER);
 	}
+	magnet_metadata_init(info_hash);
+	// in the session, LSD and the DHT look for its peers too. having no pieces, it isn't downloaded by session_run().
+	session_add_torrent(t);
 
-	if(g_pieces)
+	for(i = 0; i < MAX_THREADS; i++)
 	{
-		bf_log("[LOG] pwp_start: before freeing g_pieces, freeing linked lists of peers inside each piece.\n");
-		for(i=0; i<g_num_of_pieces; i++)
+		args[i].torrent = t;
+		args[i].idx = i;
+		g_fetch_sockets[i] = -1;
+		if(pthread_create(&threads[num_of_threads], NULL, fetch_metadata_thread, &args[i]) == 0)
 		{
-			linked_list_free(&g_pieces[i].peers);
+			num_of_threads++;
 		}
-		bf_log("[LOG] pwp_start: freeing g_pieces.\n");
-		free(g_pieces);
 	}
-	if(g_pieces_mutexes)
+	for(i = 0; i < num_of_threads; i++)
 	{
-		bf_log("[LOG] pwp_start: freeing g_pieces_mutexes.\n");
-		free(g_pieces_mutexes);
+		pthread_join(threads[i], NULL);
 	}
-	if(g_resume_mutexes)
+
+	if(!magnet_metadata_done())
 	{
-		bf_log("[LOG] pwp_start: freeing g_resume_mutexes.\n");
-		free(g_resume_mutexes);
+		bf_log("[ERROR] pwp_fetch_metadata(): Ran out of peers before getting the metadata.\n");
+		rv = -1;
 	}
-	if(g_piece_hashes)
-        {
-                bf_log("[LOG] pwp_start: freeing g_piece_hashes.\n");
-                free(g_piece_hashes);
-        }
-	
-	return rv;	
+
+	bf_log(" ------------------------------------ FINISH: PWP_FETCH_METADATA  ----------------------------------------\n");
+	session_remove_torrent(t);
+	pwp_torrent_destroy(t);
+
+	return rv;
 }
 
-int extract_next_peer(bencode_t *list_of_peers, char **ip, uint16_t *port)
+// takes candidates out of the peer pool until the metadata is complete or there are no more peers.
+static void *fetch_metadata_thread(void *arg)
 {
-	bf_log("++++++++++++++++++++ START:  EXTRACT_NEXT_PEER +++++++++++++++++++++++\n");
-	int rv = 0;
-	bencode_t b1, b2;
-	const char *str;
-        int len;
-        long int num;
-	
-	if(!bencode_list_has_next(list_of_peers))
-        {
-		bf_log("[LOG] extract_next_peer: no more peers.\n");
-		rv = -1;
-		goto cleanup;
-	}
-        
-	bencode_list_get_next(list_of_peers, &b1);
+	struct fetch_metadata_args *args = (struct fetch_metadata_args *)arg;
+	struct pwp_torrent *t = args->torrent;
+	struct peer_addr addr;
+	int got_peer, others_busy, i;
 
-        // this is a peer in b1 now and b1 is a dictionary.
-        bencode_dict_get_next(&b1, &b2, &str, &len);
-        if(strncmp(str, "ip", 2) != 0)
-        {
-		rv = -1;
-                bf_log("[LOG] Failed to find 'ip' in metadata file.\n");
-                goto cleanup;
-        }
-        bencode_string_value(&b2, &str, &len);
-        *ip = malloc(len + 1); // +1 is to leave space for null terminator char
-        memcpy(*ip, str, len);
-        (*ip)[len] = '\0';
+	while(!magnet_metadata_done())
+	{
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_fetch_mutex);
 
-        bencode_dict_get_next(&b1, &b2, &str, &len);
-        if(strncmp(str, "port", 4) != 0)
-        {
-		rv = -1;
-                bf_log(  "Failed to find 'port' in metadata file.\n");
-                goto cleanup;
-        }
-        bencode_int_value(&b2, &num);
-        *port = (uint16_t)num;
+		got_peer = peer_pool_next(&t->peer_pool, &addr) == 0;
+		others_busy = g_fetch_busy;
+		g_fetch_busy += got_peer;
 
-cleanup:
-	bf_log(" ------------------------------------ FINISH: EXTRACT_NEXT_PEER ----------------------------------------\n");
-	return rv;
+		pthread_mutex_unlock(&g_fetch_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		if(got_peer)
+		{
+			fetch_metadata_from_peer(t, addr.ip, addr.port, args->idx);
+
+			/* -X-X-X- CRITICAL REGION START -X-X-X- */
+			pthread_mutex_lock(&g_fetch_mutex);
+
+			g_fetch_busy--;
+			if(magnet_metadata_done())
+			{
+				// the other threads are waiting for messages they no longer need.
+				for(i = 0; i < MAX_THREADS; i++)
+				{
+					if(g_fetch_sockets[i] != -1)
+					{
+						shutdown(g_fetch_sockets[i], SHUT_RDWR);
+					}
+				}
+			}
+
+			pthread_mutex_unlock(&g_fetch_mutex);
+			/* -X-X-X- CRITICAL REGION END -X-X-X- */
+			continue;
+		}
+		// the peers of the other threads may still tell us about more peers and so may the DHT.
+		if(!others_busy && !dht_searching(t->info_hash))
+		{
+			break;
+		}
+		sleep(1);
+	}
 
+	return NULL;
 }
 
-// int talk_to_peer(uint8_t *info_hash, uint8_t *our_peer_id, char *ip, uint16_t port)
-void *talk_to_peer(void *args)
+static void set_fetch_socket(int idx, int socketfd)
 {
-	bf_log("++++++++++++++++++++ START:  TALK_TO_PEER +++++++++++++++++++++++\n");
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_fetch_mutex);
 
-	int rv, valopt;
-	int hs_len;
-	uint8_t *hs;
-	int socketfd;
-	long int socket_flags;
-	struct sockaddr_in peer;
-	socklen_t lon;
-	uint16_t peer_port;
-	int len;
-	fd_set recvfd;
-	struct timeval tv;
-	uint8_t *msg;
-	int msg_len;	
-	uint8_t *recvd_msg = NULL;
-	struct pwp_peer peer_status;
+	g_fetch_sockets[idx] = socketfd;
 
-	struct talk_to_peer_args *ttp_args = (struct talk_to_peer_args *)args;	
+	pthread_mutex_unlock(&g_fetch_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
 
-	bf_log("*** Going to process peer: %s:%d\n", ttp_args->ip, ttp_args->port);
+static int fetch_metadata_from_peer(struct pwp_torrent *t, char *ip, uint16_t port, int idx)
+{
+	bf_log("++++++++++++++++++++ START:  FETCH_METADATA_FROM_PEER +++++++++++++++++++++++\n");
 
-	peer_status.unchoked = 0;
-	peer_status.has_pieces = 0;
-	rv = 0;
-	FD_ZERO(&recvfd);
-	tv.tv_sec = 10;
-	tv.tv_usec = 0;
+	struct pwp_peer peer;
+	fd_set recvfd;
+	uint8_t *msg = NULL;
+	int socketfd, len, piece, i;
+	int handshaken = 0, idle = 0;
+	int rv = 0;
 
-	hs = compose_handshake(ttp_args->info_hash, ttp_args->our_peer_id, &hs_len);
-	
-	peer_port = htons(ttp_args->port);
-	if((socketfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+	bf_log("*** Going to fetch metadata from peer: %s:%d\n", ip, port);
+	init_peer(&peer, t, -1);
+	if((socketfd = connect_tcp(&peer, ip, port)) == -1)
 	{
-		perror("socket");
 		rv = -1;
 		goto cleanup;
 	}
+	peer.socketfd = socketfd;
+	set_fetch_socket(idx, socketfd);
 
-	// set the socket to non-blocking when making connection. we'll set it back to blocking
-	// once it is connected. we set it to non-blocking so that we can do timeout on connect().
-	socket_flags = fcntl(socketfd, F_GETFL, NULL);
-	socket_flags |= O_NONBLOCK;
-	fcntl(socketfd, F_SETFL, socket_flags);
-
-	FD_SET(socketfd, &recvfd);
-
-	len = sizeof(struct sockaddr_in);
-	bzero(&peer, len);
-	peer.sin_family = AF_INET;
-	peer.sin_port = peer_port;
-	if(inet_aton(ttp_args->ip, &peer.sin_addr) == 0)
+	msg = compose_handshake(t->info_hash, t->our_peer_id, &len);
+	rv = pwp_send(&peer, msg, len);
+	free(msg);
+	msg = NULL;
+	if(rv == -1)
+	{
+		goto cleanup;
+	}
+	if(receive_msg_hs(socketfd, &recvfd, &msg, &len) != RECV_OK || validate_handshake(msg, len, t->info_hash) != 0)
 	{
-		bf_log("[ERROR] talk_to_peer(): Failed to read in ip address of the peer.\n");
+		bf_log("[ERROR] fetch_metadata_from_peer(): Didn't get a valid handshake.\n");
 		rv = -1;
 		goto cleanup;
 	}
+	if(!(msg[msg[0] + 1 + EXTENSION_PROTOCOL_BYTE] & EXTENSION_PROTOCOL_BIT))
+	{
+		bf_log("[LOG] fetch_metadata_from_peer(): Peer doesn't support the extension protocol.\n");
+		rv = -1;
+		goto cleanup;
+	}
+	free(msg);
+	msg = extension_compose_handshake(&len);
+	rv = pwp_send(&peer, msg, len);
+	free(msg);
+	msg = NULL;
+	if(rv == -1)
+	{
+		goto cleanup;
+	}
 
-	bf_log("[LOG] Going to connect with the peer.\n");
-	rv = connect(socketfd, (struct sockaddr *)&peer, len);
-
-	if(rv < 0)
+	while(!magnet_metadata_done())
 	{
-		if(errno == EINPROGRESS)
+		rv = receive_msg(socketfd, &recvfd, &msg, &len);
+		if(rv == RECV_TO && ++idle < FETCH_IDLE_TIMEOUTS)
 		{
-			if(select(socketfd+1, NULL, &recvfd, NULL, &tv) > 0)
-			{
-				/* >>>>>>>>>>>>>>>>> HERE!!! <<<<<<<<<<<<<<<<<<<*/
-				lon = sizeof(int);
-				getsockopt(socketfd, SOL_SOCKET, SO_ERROR, (void *)(&valopt), &lon);
-				if(valopt)
-				{
-					bf_log("[ERROR] Error in connection() %d - %s\n", valopt, strerror(valopt));
-					rv = -1;
-					goto cleanup;
-				}
-			}
-			else
+			continue;
+		}
+		if(rv != RECV_OK)
+		{
+			rv = -1;
+			goto cleanup;
+		}
+		idle = 0;
+		if(extract_msg_id(msg) == EXTENDED_MSG_ID && len >= 6)
+		{
+			handshaken |= msg[5] == EXTENSION_HANDSHAKE_ID;
+			if(extension_process_msg(msg, &peer) != 0)
 			{
-				bf_log("[LOG] Connection either timed out...\n");
 				rv = -1;
 				goto cleanup;
 			}
 		}
-		else
+		free(msg);
+		msg = NULL;
+		if(!handshaken)
 		{
-			bf_log("[LOG] Got error when connecting to a peer: %d - %s\n", errno, strerror(errno));
+			continue;
+		}
+		// also when the peer rejected one of our requests.
+		if(!peer.ut_metadata_id)
+		{
+			bf_log("[LOG] fetch_metadata_from_peer(): Peer won't give us the metadata.\n");
 			rv = -1;
 			goto cleanup;
 		}
+		while(peer.num_metadata_requests < PWP_MAX_METADATA_REQUESTS && (piece = magnet_metadata_next_piece()) != -1)
+		{
+			if(extension_request_metadata(&peer, piece) != 0)
+			{
+				magnet_metadata_release_piece(piece);
+				rv = -1;
+				goto cleanup;
+			}
+		}
 	}
+	rv = 0;
 
-	// set the socket back to blocking...
-	socket_flags = fcntl(socketfd, F_GETFL, NULL);
-	socket_flags &= (~O_NONBLOCK);
-	fcntl(socketfd,F_SETFL, socket_flags);
+cleanup:
+	bf_log(" ------------------------------------ FINISH: FETCH_METADATA_FROM_PEER  ----------------------------------------\n");
+	for(i = 0; i < peer.num_metadata_requests; i++)
+	{
+		magnet_metadata_release_piece(peer.metadata_requests[i]);
+	}
+	if(msg)
+	{
+		free(msg);
+	}
+	destroy_peer(&peer);
+	if(socketfd > 0)
+	{
+		set_fetch_socket(idx, -1);
+		close(socketfd);
+	}
+	return rv;
+}
 
-	bf_log("[LOG] Connected successfully.\n");
+void pwp_set_rate_limits(struct pwp_torrent *t, long int download_rate, long int upload_rate)
+{
+	t->share.download_limit = download_rate;
+	t->share.upload_limit = upload_rate;
+	fairshare_apply(t);
+}
+
+void pwp_set_share(struct pwp_torrent *t, int weight, int priority)
+{
+	if(weight < 1)
+	{
+		weight = 1;
+	}
+	if(weight > FAIRSHARE_MAX_WEIGHT)
+	{
+		weight = FAIRSHARE_MAX_WEIGHT;
+	}
+	t->share.weight = weight;
+	t->share.priority = priority;
+}
+
+int pwp_set_piece_priority(struct pwp_torrent *t, int first, int last, int priority)
+{
+	int i, rv;
+
+	if(first < 0 || last >= t->num_of_pieces || first > last || priority < PIECE_PRIORITY_SKIP || priority > PIECE_PRIORITY_HIGH)
+	{
+		return -1;
+	}
+
+	for(i = first; i <= last; i++)
+	{
+		/*-X-X-X- START OF CRITICAL REGION  -X-X-X-*/
+		pthread_mutex_lock(&t->pieces_mutexes[i]);
+
+		// a complete piece was taken off the count of its priority already.
+		if(t->pieces[i].status != PIECE_STATUS_COMPLETE)
+		{
+			/* -X-X-X- CRITICAL REGION START -X-X-X- */
+			pthread_mutex_lock(&t->priorities_mutex);
+
+			t->pieces_left[t->pieces[i].priority]--;
+			t->pieces_left[priority]++;
+
+			pthread_mutex_unlock(&t->priorities_mutex);
+			/* -X-X-X- CRITICAL REGION END -X-X-X- */
+		}
+		t->pieces[i].priority = priority;
+
+		pthread_mutex_unlock(&t->pieces_mutexes[i]);
+		/*-X-X-X- END OF CRITICAL REGION  -X-X-X-*/
+	}
+
+	rv = save_piece_priorities(t);
+	bf_log("[LOG] pwp_set_piece_priority(): Pieces %d to %d of %s have priority %d now.\n", first, last, t->saved_filepath, priority);
+
+	return rv;
+}
+
+int pwp_parse_piece_priority(struct pwp_torrent *t, const char *arg)
+{
+	static const char *names[] = {"skip", "low", "normal", "high"};
+	const char *colon;
+	char *end;
+	long int first, last;
+	int priority;
+
+	if((colon = strchr(arg, ':')) == NULL)
+	{
+		return -1;
+	}
+	for(priority = PIECE_PRIORITY_SKIP; priority <= PIECE_PRIORITY_HIGH; priority++)
+	{
+		if(strlen(names[priority]) == (size_t)(colon - arg) && strncmp(arg, names[priority], colon - arg) == 0)
+		{
+			break;
+		}
+	}
+	if(priority > PIECE_PRIORITY_HIGH)
+	{
+		return -1;
+	}
+
+	first = strtol(colon + 1, &end, 10);
+	if(end == colon + 1)
+	{
+		return -1;
+	}
+	last = first;
+	if(*end == '-' && end[1] == '\0')
+	{
+		last = t->num_of_pieces - 1;
+		end++;
+	}
+	else if(*end == '-')
+	{
+		last = strtol(end + 1, &end, 10);
+	}
+	if(*end != '\0')
+	{
+		return -1;
+	}
+
+	return pwp_set_piece_priority(t, first, last, priority);
+}
+
+void pwp_enable_utp(int enable)
+{
+	g_utp_enabled = enable;
+}
+
+void pwp_enable_super_seeding(int enable)
+{
+	g_super_seeding = enable;
+}
+
+void pwp_enable_lsd(int enable)
+{
+	g_lsd_enabled = enable;
+}
+
+void pwp_enable_dht(int enable)
+{
+	g_dht_enabled = enable;
+}
+
+void pwp_add_web_seed(struct pwp_torrent *t, const char *url)
+{
+	t->web_seed_urls = realloc(t->web_seed_urls, sizeof(char *) * (t->num_of_web_seeds + 1));
+	t->web_seed_urls[t->num_of_web_seeds++] = strdup(url);
+}
+
+// super seeding only applies to a seed; while downloading we announce our pieces as usual.
+int is_super_seeding(struct pwp_torrent *t)
+{
+	return t->super_seeding && is_download_complete(t);
+}
+
+int is_download_complete(struct pwp_torrent *t)
+{
+	int count;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->downloaded_pieces_mutex);
+
+	count = t->downloaded_pieces;
+
+	pthread_mutex_unlock(&t->downloaded_pieces_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	// a torrent without metadata yet has nothing to complete.
+	return t->num_of_pieces > 0 && count >= t->num_of_pieces;
+}
+
+// whether every piece that isn't skipped is downloaded.
+int is_wanted_download_complete(struct pwp_torrent *t)
+{
+	long int left = 0;
+	int i;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->priorities_mutex);
+
+	for(i = PIECE_PRIORITY_LOW; i <= PIECE_PRIORITY_HIGH; i++)
+	{
+		left += t->pieces_left[i];
+	}
+
+	pthread_mutex_unlock(&t->priorities_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return t->num_of_pieces > 0 && left == 0;
+}
+
+int extract_next_peer(bencode_t *list_of_peers, char **ip, uint16_t *port)
+{
+	bf_log("++++++++++++++++++++ START:  EXTRACT_NEXT_PEER +++++++++++++++++++++++\n");
+	int rv = 0;
+	bencode_t b1, b2;
+	const char *str;
+        int len;
+        long int num;
+	
+	if(!bencode_list_has_next(list_of_peers))
+        {
+		bf_log("[LOG] extract_next_peer: no more peers.\n");
+		rv = -1;
+		goto cleanup;
+	}
+        
+	bencode_list_get_next(list_of_peers, &b1);
+
+        // this is a peer in b1 now and b1 is a dictionary.
+        bencode_dict_get_next(&b1, &b2, &str, &len);
+        if(strncmp(str, "ip", 2) != 0)
+        {
+		rv = -1;
+                bf_log("[LOG] Failed to find 'ip' in metadata file.\n");
+                goto cleanup;
+        }
+        bencode_string_value(&b2, &str, &len);
+        *ip = malloc(len + 1); // +1 is to leave space for null terminator char
+        memcpy(*ip, str, len);
+        (*ip)[len] = '\0';
+
+        bencode_dict_get_next(&b1, &b2, &str, &len);
+        if(strncmp(str, "port", 4) != 0)
+        {
+		rv = -1;
+                bf_log(  "Failed to find 'port' in metadata file.\n");
+                goto cleanup;
+        }
+        bencode_int_value(&b2, &num);
+        *port = (uint16_t)num;
+
+cleanup:
+	bf_log(" ------------------------------------ FINISH: EXTRACT_NEXT_PEER ----------------------------------------\n");
+	return rv;
+
+}
+
+void init_peer(struct pwp_peer *peer, struct pwp_torrent *t, int socketfd)
+{
+	long int num_of_pieces = t ? t->num_of_pieces : 0;
+
+	peer->torrent = t;
+	peer->outbound = 0;
+	peer->unchoked = 0;
+	peer->has_pieces = 0;
+	peer->am_choking = 1;
+	peer->interested = 0;
+	peer->uploaded = 0;
+	peer->downloaded = 0;
+	peer->download_rate = 0;
+	peer->upload_rate = 0;
+	peer->choker_downloaded = 0;
+	peer->choker_uploaded = 0;
+	peer->choker_rate = 0;
+	peer->choker_unchoke = 0;
+	peer->optimistic_unchoke = 0;
+	peer->fast_extension = 0;
+	peer->has_all = 0;
+	peer->suggested_piece = -1;
+	peer->num_allowed_fast = 0;
+	peer->addr.ip[0] = '\0';
+	peer->addr.port = 0;
+	peer->extension_protocol = 0;
+	peer->dht = 0;
+	peer->rcvbuf = 0;
+	peer->sndbuf = 0;
+	peer->ut_pex_id = 0;
+	peer->ut_metadata_id = 0;
+	peer->num_metadata_requests = 0;
+	peer->num_pex_sent = 0;
+	peer->bitfield = calloc((num_of_pieces + 7) / 8, 1);
+	peer->revealed = calloc((num_of_pieces + 7) / 8, 1);
+	peer->superseed_piece = -1;
+	peer->hedging = 0;
+	peer->hedge_data = NULL;
+	peer->socketfd = socketfd;
+	peer->timed_out = 0;
+	pthread_mutex_init(&peer->send_mutex, NULL);
+	peer->outbox = NULL;
+	peer->outbox_len = 0;
+	peer->outbox_size = 0;
+	pthread_mutex_init(&peer->outbox_mutex, NULL);
+	timer_init(&peer->keep_alive_timer, keep_alive_callback, peer);
+	timer_init(&peer->deadline_timer, deadline_callback, peer);
+	timer_init(&peer->pex_timer, pex_callback, peer);
+	// until an inbound peer's handshake tells which torrent it wants, it only counts against the global limits.
+	ratelimit_init(&peer->download_bucket, RATELIMIT_UNLIMITED, t ? &t->download_bucket : &g_global_download_bucket);
+	ratelimit_init(&peer->upload_bucket, RATELIMIT_UNLIMITED, t ? &t->upload_bucket : &g_global_upload_bucket);
+}
+
+// NOTE: the peer must not be registered any more. this doesn't close the socket.
+void destroy_peer(struct pwp_peer *peer)
+{
+	// the timers point at the peer which is about to go out of scope.
+	timer_cancel(&g_timer_wheel, &peer->keep_alive_timer);
+	timer_cancel(&g_timer_wheel, &peer->deadline_timer);
+	timer_cancel(&g_timer_wheel, &peer->pex_timer);
+	pthread_mutex_destroy(&peer->send_mutex);
+	pthread_mutex_destroy(&peer->outbox_mutex);
+	free(peer->outbox);
+	ratelimit_destroy(&peer->download_bucket);
+	ratelimit_destroy(&peer->upload_bucket);
+	free(peer->bitfield);
+	free(peer->revealed);
+}
+
+void *talk_to_peer(void *args)
+{
+	bf_log("++++++++++++++++++++ START:  TALK_TO_PEER +++++++++++++++++++++++\n");
+
+	int rv;
+	int socketfd = -1;
+	struct pwp_peer peer_status;
+	struct timespec started, finished;
+
+	struct talk_to_peer_args *ttp_args = (struct talk_to_peer_args *)args;	
+
+	bf_log("*** Going to process peer: %s:%d\n", ttp_args->ip, ttp_args->port);
+
+	init_peer(&peer_status, ttp_args->torrent, -1);
+	peer_status.outbound = 1;
+	strncpy(peer_status.addr.ip, ttp_args->ip, INET6_ADDRSTRLEN - 1);
+	peer_status.addr.ip[INET6_ADDRSTRLEN - 1] = '\0';
+	peer_status.addr.port = ttp_args->port;
+	rv = 0;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	// a peer that doesn't speak uTP would hold us up for the whole timeout, so only the ones known to are tried.
+	if(g_utp_enabled && utp_peer_supported(ttp_args->ip, ttp_args->port))
+	{
+		socketfd = utp_connect(ttp_args->ip, ttp_args->port, UTP_CONNECT_TIMEOUT_MS);
+	}
+	if(socketfd == -1)
+	{
+		socketfd = connect_tcp(&peer_status, ttp_args->ip, ttp_args->port);
+	}
+	if(socketfd == -1)
+	{
+		rv = -1;
+		goto cleanup;
+	}
+	peer_status.socketfd = socketfd;
+
+	bf_log("[LOG] Connected successfully.\n");
+	rv = peer_session(&peer_status, NULL, 0);
+
+cleanup:
+	bf_log(" ------------------------------------ FINISH: TALK_TO_PEER  ----------------------------------------\n");	
+
+	bf_log("[LOG] In cleanup.\n");
+	// the next run connects to the peers that delivered first (see peer_cache.h).
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	peer_cache_record(&ttp_args->torrent->peer_cache, ttp_args->ip, ttp_args->port, socketfd != -1, peer_status.downloaded,
+		(finished.tv_sec - started.tv_sec) * 1000 + (finished.tv_nsec - started.tv_nsec) / 1000000);
+	destroy_peer(&peer_status);
+	if(socketfd > 0)
+	{
+		bf_log("[LOG] Closing socket.\n");
+		close(socketfd);
+	}
+	return (void *)rv;
+}
+
+// returns a TCP socket connected to ip:port, or -1 if it couldn't be connected within CONNECT_TIMEOUT_MS.
+int connect_tcp(struct pwp_peer *peer_status, char *ip, uint16_t port)
+{
+	int rv, valopt;
+	int socketfd;
+	long int socket_flags;
+	struct sockaddr_storage peer;
+	socklen_t lon;
+	int len;
+	fd_set recvfd;
+
+	FD_ZERO(&recvfd);
+	if(util_make_sockaddr(ip, port, &peer, &len) != 0)
+	{
+		bf_log("[ERROR] connect_tcp(): Failed to read in ip address of the peer.\n");
+		return -1;
+	}
+	if((socketfd = socket(peer.ss_family, SOCK_STREAM, 0)) == -1)
+	{
+		perror("socket");
+		return -1;
+	}
+	// the deadline callback shuts this socket down.
+	peer_status->socketfd = socketfd;
+
+	// set the socket to non-blocking when making connection. we'll set it back to blocking
+	// once it is connected. we set it to non-blocking so that we can do timeout on connect().
+	socket_flags = fcntl(socketfd, F_GETFL, NULL);
+	socket_flags |= O_NONBLOCK;
+	fcntl(socketfd, F_SETFL, socket_flags);
+
+	FD_SET(socketfd, &recvfd);
+
+	bf_log("[LOG] Going to connect with the peer.\n");
+	// the deadline timer shuts the socket down if the connection isn't made in time, which wakes up the select() below.
+	timer_add(&g_timer_wheel, &peer_status->deadline_timer, CONNECT_TIMEOUT_MS);
+	rv = connect(socketfd, (struct sockaddr *)&peer, len);
+
+	if(rv < 0)
+	{
+		if(errno == EINPROGRESS)
+		{
+			rv = select(socketfd+1, NULL, &recvfd, NULL, NULL);
+			timer_cancel(&g_timer_wheel, &peer_status->deadline_timer);
+			if(rv > 0 && !peer_status->timed_out)
+			{
+				/* >>>>>>>>>>>>>>>>> HERE!!! <<<<<<<<<<<<<<<<<<<*/
+				lon = sizeof(int);
+				getsockopt(socketfd, SOL_SOCKET, SO_ERROR, (void *)(&valopt), &lon);
+				if(valopt)
+				{
+					bf_log("[ERROR] Error in connection() %d - %s\n", valopt, strerror(valopt));
+					rv = -1;
+					goto cleanup;
+				}
+			}
+			else
+			{
+				bf_log("[LOG] Connection either timed out...\n");
+				rv = -1;
+				goto cleanup;
+			}
+		}
+		else
+		{
+			bf_log("[LOG] Got error when connecting to a peer: %d - %s\n", errno, strerror(errno));
+			rv = -1;
+			goto cleanup;
+		}
+	}
+	timer_cancel(&g_timer_wheel, &peer_status->deadline_timer);
+
+	// set the socket back to blocking...
+	socket_flags = fcntl(socketfd, F_GETFL, NULL);
+	socket_flags &= (~O_NONBLOCK);
+	fcntl(socketfd,F_SETFL, socket_flags);
+	socktune_init(socketfd);
+	rv = 0;
+
+cleanup:
+	peer_status->socketfd = -1;
+	if(rv != 0)
+	{
+		close(socketfd);
+		return -1;
+	}
+	return socketfd;
+}
+
+// serves a connection a peer opened with us, over TCP or uTP. its handshake tells which of the session's
+// torrents it wants. closes the socket.
+int accept_peer(int socketfd, const char *ip)
+{
+	bf_log("++++++++++++++++++++ START:  ACCEPT_PEER +++++++++++++++++++++++\n");
+	int rv, len;
+	fd_set recvfd;
+	uint8_t *recvd_msg = NULL;
+	struct pwp_peer peer_status;
+	struct pwp_torrent *t = NULL;
+	struct timespec started, finished;
+
+	init_peer(&peer_status, NULL, socketfd);
+
+	// the remote end speaks first. its handshake tells us whether it wants one of our torrents at all.
+	timer_add(&g_timer_wheel, &peer_status.deadline_timer, CONNECT_TIMEOUT_MS);
+	rv = receive_msg_hs(socketfd, &recvfd, &recvd_msg, &len);
+	timer_cancel(&g_timer_wheel, &peer_status.deadline_timer);
+	rv = (rv != RECV_OK || peer_status.timed_out) ? -1 : 0;
+	destroy_peer(&peer_status);
+	if(rv != 0)
+	{
+		bf_log("[LOG] accept_peer(): Didn't receive a handshake from the inbound peer.\n");
+		goto cleanup;
+	}
+	if(len < 19 + 8 + 20 + 20 || (t = session_find_torrent(recvd_msg + 1 + 19 + 8)) == NULL)
+	{
+		bf_log("[LOG] accept_peer(): Inbound peer's handshake is not for one of our torrents. Dropping it.\n");
+		rv = -1;
+		goto cleanup;
+	}
+	if(validate_handshake(recvd_msg, len, t->info_hash) != 0)
+	{
+		bf_log("[LOG] accept_peer(): Inbound peer's handshake is not a BitTorrent handshake. Dropping it.\n");
+		rv = -1;
+		goto cleanup;
+	}
+	if(t->num_of_pieces == 0)
+	{
+		bf_log("[LOG] accept_peer(): We don't have the metadata of the torrent the inbound peer wants yet. Dropping it.\n");
+		rv = -1;
+		goto cleanup;
+	}
+
+	init_peer(&peer_status, t, socketfd);
+	// the port it connected from isn't the one it listens on. that comes with the extended handshake, if at all.
+	strncpy(peer_status.addr.ip, ip, INET6_ADDRSTRLEN - 1);
+	peer_status.addr.ip[INET6_ADDRSTRLEN - 1] = '\0';
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	rv = peer_session(&peer_status, recvd_msg, len);
+	// a peer that told us where it listens can be connected to next time if it delivered.
+	if(peer_status.addr.port != 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &finished);
+		peer_cache_record(&t->peer_cache, peer_status.addr.ip, peer_status.addr.port, 1, peer_status.downloaded,
+			(finished.tv_sec - started.tv_sec) * 1000 + (finished.tv_nsec - started.tv_nsec) / 1000000);
+	}
+	destroy_peer(&peer_status);
+
+cleanup:
+	bf_log("---------------------------------------- FINISH:  ACCEPT_PEER ----------------------------------------\n");
+	if(t)
+	{
+		session_release_torrent(t);
+	}
+	close(socketfd);
+	if(recvd_msg)
+	{
+		free(recvd_msg);
+	}
+
+	return rv;
+}
+
+// returns 0 if msg (as returned by receive_msg_hs()) is a BitTorrent handshake for info_hash.
+// NOTE: len, like the one from receive_msg_hs(), doesn't count the first byte (length of the protocol string).
+int validate_handshake(uint8_t *msg, int len, uint8_t *info_hash)
+{
+	if(len < 19 + 8 + 20 + 20 || msg[0] != 19 || memcmp(msg + 1, "BitTorrent protocol", 19) != 0)
+	{
+		return -1;
+	}
+	if(memcmp(msg + 1 + 19 + 8, info_hash, 20) != 0)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+// everything after the connection is made, for outbound and inbound peers alike. inbound_hs is
+// the handshake the peer already sent us if it connected to us, NULL otherwise.
+int peer_session(struct pwp_peer *peer_status, uint8_t *inbound_hs, int inbound_hs_len)
+{
+	bf_log("++++++++++++++++++++ START:  PEER_SESSION +++++++++++++++++++++++\n");
+	struct pwp_torrent *t = peer_status->torrent;
+	int rv;
+	int hs_len;
+	uint8_t *hs;
+	int socketfd = peer_status->socketfd;
+	int len;
+	fd_set recvfd;
+	uint8_t *msg;
+	int msg_len;	
+	uint8_t *recvd_msg = NULL;
+	int registered = 0;
+
+	hs = compose_handshake(t->info_hash, t->our_peer_id, &hs_len);
 
 	/*********** SEND HANDSHAKE ****************/
 	bf_log("[LOG] Sent handshake.\n");
-	if(send(socketfd, hs, hs_len, 0) == -1)
+	if(pwp_send(peer_status, hs, hs_len) == -1)
 	{
-		perror("send");
 		rv = -1;
 		goto cleanup;
 	}	
 
 	/*********** RECEIVE HANDSHAKE + BITFIELD + HAVE's (possibly) ***********/
-	rv = receive_msg_hs(socketfd, &recvfd, &recvd_msg, &len);
-	bf_log("[LOG] rv from receive_msg: %d.\n", rv);
-        if(rv == RECV_ERROR)
-        {
-		goto cleanup;
-        }
-        if(rv != RECV_TO)
-        {
+	if(inbound_hs)
+	{
+		bf_log("[LOG] Processing handshake of inbound peer.\n");
+		process_msgs(inbound_hs, inbound_hs_len, 1, peer_status);
+	}
+	else
+	{
+		rv = receive_msg_hs(socketfd, &recvfd, &recvd_msg, &len);
+		bf_log("[LOG] rv from receive_msg: %d.\n", rv);
+		if(rv != RECV_OK)
+		{
+			rv = -1;
+			goto cleanup;
+		}
+		if(validate_handshake(recvd_msg, len, t->info_hash) != 0)
+		{
+			bf_log("[ERROR] peer_session(): Peer's handshake is not for our torrent.\n");
+			rv = -1;
+			goto cleanup;
+		}
 		bf_log("[LOG] Received handshake response of length %d. Going to process it now.\n", len);
-		process_msgs(recvd_msg, len, 1, &peer_status);
+		process_msgs(recvd_msg, len, 1, peer_status);
 		bf_log("[LOG] Done pocessing handshake.\n");
-        }
-        if(recvd_msg)
-        {
 		free(recvd_msg);
-                recvd_msg = NULL;
-        }	
+		recvd_msg = NULL;
+	}
+
+	/*********** SEND BITFIELD (or HAVE ALL / HAVE NONE) ****************/
+	// this waits for the peer's handshake because the fast extension messages may only be used if both ends support it.
+	if(send_have_state(peer_status) == -1)
+	{
+		rv = -1;
+		goto cleanup;
+	}
+
+	// now that we know its peer id, make sure we aren't already talking to this peer over another connection.
+	if(register_peer(peer_status) != 0)
+	{
+		bf_log("[LOG] peer_session(): Already connected to this peer. Dropping the connection.\n");
+		rv = -1;
+		goto cleanup;
+	}
+	registered = 1;
+
+	/*********** EXTENDED HANDSHAKE ****************/
+	if(peer_status->extension_protocol)
+	{
+		bf_log("[LOG] Sending extended handshake.\n");
+		msg = extension_compose_handshake(&msg_len);
+		rv = pwp_send(peer_status, msg, msg_len);
+		free(msg);
+		if(rv == -1)
+		{
+			goto cleanup;
+		}
+		// the first ut_pex message goes out soon so that a new peer learns about the others quickly.
+		timer_add(&g_timer_wheel, &peer_status->pex_timer, PEX_INTERVAL_MS / 6);
+	}
+
+	/*********** PORT ****************/
+	if(peer_status->dht)
+	{
+		msg = compose_port(DHT_PORT, &msg_len);
+		rv = pwp_send(peer_status, msg, msg_len);
+		free(msg);
+		if(rv == -1)
+		{
+			goto cleanup;
+		}
+	}
 
 	do
 	{
@@ -508,7 +1286,7 @@ void *talk_to_peer(void *args)
 		if(rv != RECV_TO)
 		{
 			bf_log("[LOG] Received next msg after HS. Len: %d. Goinf to process it now.\n", len);
-			process_msgs(recvd_msg, len, 0, &peer_status);
+			process_msgs(recvd_msg, len, 0, peer_status);
 		}
 		if(recvd_msg)
 		{
@@ -518,76 +1296,65 @@ void *talk_to_peer(void *args)
 	} while(rv != RECV_TO);
 
 	bf_log("[LOG] Finished receiving until timeout. Checking if peer has any pieces.\n");
+	// the peer's bitfield is in by now so the first piece revealed to it is one it lacks.
+	if(is_super_seeding(t))
+	{
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&t->connected_peers_mutex);
+
+		superseed_reveal(t->connected_peers, peer_status);
+
+		pthread_mutex_unlock(&t->connected_peers_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+	}
 	// check if this peer has any pieces we don't have and then send interested.
-	if(!peer_status.has_pieces)
+	if(!peer_status->has_pieces)
 	{
-		bf_log("** Peer has no pieces, so not sending interested.\n");
-		rv = -1;
+		bf_log("** Peer has no pieces, so not sending interested. Serving its requests instead.\n");
+		rv = serve_peer(peer_status);
 		goto cleanup;
 	}	
 
 	/************** SEND INTERESTED ***********************/
 	msg = compose_interested(&msg_len);
 	
-	if(send(socketfd, msg, msg_len, 0) == -1)
+	rv = pwp_send(peer_status, msg, msg_len);
+	free(msg);
+	if(rv == -1)
         {
-                perror("send");
-                rv = -1;
                 goto cleanup;
         }
 
 	bf_log("[LOG] Sent interested message. Receiving response now.\n");
 	/******** RECEIVE RESPONSE TO INTERESTED *************/
-	while(!peer_status.unchoked)
+	// pieces the peer allowed us to fast download can be fetched before it unchokes us.
+	if(peer_status->num_allowed_fast == 0 && wait_for_unchoke(peer_status) != 0)
 	{
-		rv = receive_msg(socketfd, &recvfd, &recvd_msg, &len);
-		bf_log("[LOG] rv from receive_msg: %d.\n", rv);
-        	if(rv == RECV_ERROR)
-        	{
-			rv = -1;
-                	goto cleanup;
-        	}
-		if(rv == RECV_TO)
-		{
-			rv = -1;
-			goto cleanup;
-		}
-
-		bf_log("[LOG] Received response for INTERESTED message. Going to process it now.\n");
-		process_msgs(recvd_msg, len, 0, &peer_status);
-		if(recvd_msg)
-		{
-			free(recvd_msg);
-			recvd_msg = NULL;
-		}
+		rv = -1;
+		goto cleanup;
+	}
+	rv = get_pieces(socketfd, peer_status);
+	if(rv == 0)
+	{
+		// nothing more to download from this peer but it may still want pieces from us.
+		rv = serve_peer(peer_status);
 	}
-	rv = 0;
-	bf_log("[LOG] Peer has unchoked us.\n");	
-	// if here then pieces must be populated and we're unchoked too.
-	rv = get_pieces(socketfd, &peer_status);
 
 cleanup:
-	bf_log(" ------------------------------------ FINISH: TALK_TO_PEER  ----------------------------------------\n");	
-
-	bf_log("[LOG] In cleanup.\n");
-	if(socketfd > 0)
+	bf_log("---------------------------------------- FINISH:  PEER_SESSION ----------------------------------------\n");
+	if(registered)
 	{
-		bf_log("[LOG] Closing socket.\n");
-		close(socketfd);
+		unregister_peer(peer_status);
 	}
 	if(hs)
 	{
-		bf_log("[LOG] Freeing HS.\n");
 		free(hs);
-		hs = NULL;
 	}
 	if(recvd_msg)
         {
-		bf_log("[LOG] Freeing recvd_msg.\n");
 		free(recvd_msg);
-                recvd_msg = NULL;
         }
-	return (void *)rv;
+	return rv;
 }
 
 int receive_msg_hs(int socketfd, fd_set *recvfd, uint8_t **msg, int *len)
@@ -644,111 +1411,414 @@ int receive_msg(int socketfd, fd_set *recvfd, uint8_t **msg, int *len)
                 rv = RECV_ERROR; // even if it is timeout, at this stage it means error.
 		goto cleanup;
 	}
-	*len += 4;
+	*len += 4;
+
+cleanup:
+	bf_log(" -------------------------------------- FINISH: RECEIVE_MSG  ----------------------------------------\n");
+	return rv;
+}
+
+int get_len(int socketfd, fd_set *recvfd, int *len)
+{
+	bf_log("++++++++++++++++++++ START:  GET_LEN +++++++++++++++++++++++\n");
+	
+	int rv;
+	uint8_t *curr = (uint8_t *)len;
+
+	rv = receive_msg_for_len(socketfd, recvfd, 4, curr);	
+	*len = ntohl(*len);	
+
+	bf_log("---------------------------------------- FINISH:  GET_LEN ----------------------------------------\n");
+	return rv;
+}
+
+int get_len_hs(int socketfd, fd_set *recvfd, int *len)
+{
+	bf_log("++++++++++++++++++++ START:  GET_LEN_HS +++++++++++++++++++++++\n");
+        int rv;
+	uint8_t *p_name_len = malloc(1);
+
+        rv = receive_msg_for_len(socketfd, recvfd, 1, p_name_len);
+
+        *len = *p_name_len + 8 + 20 + 20;
+
+	bf_log("---------------------------------------- FINISH:  GET_LEN_HS ----------------------------------------\n");
+        return rv;
+}
+
+int receive_msg_for_len(int socketfd, fd_set *recvfd, int len, uint8_t *msg)
+{
+	bf_log("++++++++++++++++++++ START:  RECEIVE_MSG_FOR_LEN +++++++++++++++++++++++\n");
+	
+	if(len == 0)
+	{
+		return RECV_OK;
+	}
+	int r_bytes, rv;
+        uint8_t *curr = msg;
+	struct timeval tv;
+
+	tv.tv_sec = RECV_TIMEOUT_SECS;
+        tv.tv_usec = 0;
+	// select() clears the set on timeout, so it has to be rebuilt for every call.
+	FD_ZERO(recvfd);
+	FD_SET(socketfd, recvfd);
+        
+        rv = select(socketfd + 1, recvfd, NULL, NULL, &tv);
+        bf_log("[LOG] receive_msg_for_len: value of 'rv' after select: %d (1=OK; 0=timeout; -1=error)\n", rv);
+
+        if(rv == -1)
+        {
+                perror("select");
+                return RECV_ERROR;
+        }
+        if(rv == 0) // i.e. timeout
+        {
+                return RECV_TO;
+        }
+        rv = 0;
+        for(r_bytes = 0; r_bytes<len; r_bytes+=rv)
+        {
+                if((rv = recv(socketfd, curr + r_bytes, len - r_bytes, 0)) <= 0)
+                {
+			bf_log("[ERROR]receive_msg_for_len: Peer closed connection");
+                        return RECV_ERROR;
+                }
+		bf_log("[LOG] receive_msg_for_len(): received %d bytes when attempted to receive %d bytes.\n", rv, len - r_bytes); 
+        }
+
+	bf_log("---------------------------------------- FINISH:  RECEIVE_MSG_FOR_LEN ----------------------------------------\n");
+        return RECV_OK;
+}
+		
+uint8_t *compose_handshake(uint8_t *info_hash, uint8_t *our_peer_id, int *len)
+{
+	bf_log("++++++++++++++++++++ START:  COMPOSE_HANDSHAKE +++++++++++++++++++++++\n");
+	
+	uint8_t *hs, *curr;
+	uint8_t temp;
+	int i;
+
+	*len = 49+19;
+	hs = malloc(*len);
+	curr = hs;
+	temp = 19;
+	memcpy(curr, &temp, 1);
+	curr += 1;
+	strncpy((char *)curr, "BitTorrent protocol", 19);
+	curr += 19;
+	temp = 0;
+	for(i=0; i<8; i++)
+	{
+		memcpy(curr, &temp, 1);
+		curr += 1;
+	}
+	*(curr - 8 + FAST_EXTENSION_BYTE) |= FAST_EXTENSION_BIT;
+	*(curr - 8 + EXTENSION_PROTOCOL_BYTE) |= EXTENSION_PROTOCOL_BIT;
+	if(g_dht_enabled)
+	{
+		*(curr - 8 + DHT_BYTE) |= DHT_BIT;
+	}
+	memcpy(curr, info_hash, 20);
+	curr += 20;
+	memcpy(curr, our_peer_id, 20);
+
+	bf_log("---------------------------------------- FINISH:  COMPOSE_HANDSHAKE ----------------------------------------\n");
+	return hs;
+}
+
+int pwp_send(struct pwp_peer *peer, uint8_t *msg, int len)
+{
+	int rv, sent;
+
+	pthread_mutex_lock(&peer->send_mutex);
+	// what the timer thread queued was decided on first, so it goes first.
+	if(flush_outbox(peer, 1) == -1)
+	{
+		pthread_mutex_unlock(&peer->send_mutex);
+		bf_log("[ERROR] pwp_send(): Failed to send queued messages: %s\n", strerror(errno));
+		return -1;
+	}
+	for(sent = 0; sent < len; sent += rv)
+	{
+		if((rv = send(peer->socketfd, msg + sent, len - sent, MSG_NOSIGNAL)) <= 0)
+		{
+			if(rv == -1 && errno == EINTR)
+			{
+				rv = 0;
+				continue;
+			}
+			pthread_mutex_unlock(&peer->send_mutex);
+			bf_log("[ERROR] pwp_send(): Failed to send message: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	pthread_mutex_unlock(&peer->send_mutex);
+
+	// any message counts as a keep alive so push the next keep alive back.
+	timer_add(&g_timer_wheel, &peer->keep_alive_timer, KEEP_ALIVE_INTERVAL_MS);
+
+	return 0;
+}
+
+static void keep_alive_callback(void *arg)
+{
+	struct pwp_peer *peer = (struct pwp_peer *)arg;
+	uint8_t keep_alive[4] = {0, 0, 0, 0};
+
+	pwp_queue_msg(peer, keep_alive, 4);
+
+	bf_log("[LOG] keep_alive_callback(): Sent KEEP ALIVE message.\n");
+	timer_add(&g_timer_wheel, &peer->keep_alive_timer, KEEP_ALIVE_INTERVAL_MS);
+}
+
+static void choke_callback(void *arg)
+{
+	struct pwp_torrent *t = (struct pwp_torrent *)arg;
+	int seeding;
+	struct pwp_peer_node *node;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->downloaded_pieces_mutex);
+
+	seeding = t->downloaded_pieces >= t->num_of_pieces;
+
+	pthread_mutex_unlock(&t->downloaded_pieces_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->connected_peers_mutex);
+
+	choker_run(&t->choker, t->connected_peers, seeding);
+	// the rates the choker has just measured drive the buffer sizes.
+	for(node = t->connected_peers; node != NULL; node = node->next)
+	{
+		socktune_adjust(node->peer);
+	}
+
+	pthread_mutex_unlock(&t->connected_peers_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	timer_add(&g_timer_wheel, &t->choke_timer, CHOKER_INTERVAL_MS);
+}
+
+// queues msg for the peer and sends as much of the queue as the socket takes without waiting, unless
+// the peer's thread is sending right now. the rest goes out ahead of the thread's next message. this
+// is how the timer thread sends, as it must neither wait for a block being written nor for a peer
+// that doesn't read. a peer that has let PWP_OUTBOX_MAX bytes pile up is disconnected.
+void pwp_queue_msg(struct pwp_peer *peer, const uint8_t *msg, int len)
+{
+	int full;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&peer->outbox_mutex);
+
+	full = peer->outbox_len + len > PWP_OUTBOX_MAX;
+	if(!full)
+	{
+		if(peer->outbox_len + len > peer->outbox_size)
+		{
+			peer->outbox_size = (peer->outbox_len + len) * 2;
+			peer->outbox = realloc(peer->outbox, peer->outbox_size);
+		}
+		memcpy(peer->outbox + peer->outbox_len, msg, len);
+		peer->outbox_len += len;
+	}
+
+	pthread_mutex_unlock(&peer->outbox_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	if(full)
+	{
+		bf_log("[ERROR] pwp_queue_msg(): Too much queued for a peer that doesn't read, disconnecting it.\n");
+		shutdown(peer->socketfd, SHUT_RDWR);
+		return;
+	}
+	if(pthread_mutex_trylock(&peer->send_mutex) == 0)
+	{
+		flush_outbox(peer, 0);
+		pthread_mutex_unlock(&peer->send_mutex);
+	}
+}
+
+// sends what is queued in the outbox. with wait it waits for the socket until all of it is sent,
+// otherwise it stops once the socket is full. returns -1 on error.
+// NOTE: must be called with peer->send_mutex held.
+static int flush_outbox(struct pwp_peer *peer, int wait)
+{
+	struct pollfd pfd;
+	int n, err, empty;
+
+	for(;;)
+	{
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&peer->outbox_mutex);
+
+		n = 0;
+		err = 0;
+		while(peer->outbox_len > 0 && (n = send(peer->socketfd, peer->outbox, peer->outbox_len, MSG_DONTWAIT | MSG_NOSIGNAL)) > 0)
+		{
+			memmove(peer->outbox, peer->outbox + n, peer->outbox_len - n);
+			peer->outbox_len -= n;
+		}
+		if(n == -1)
+		{
+			err = errno;
+		}
+		empty = peer->outbox_len == 0;
+
+		pthread_mutex_unlock(&peer->outbox_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		if(empty)
+		{
+			return 0;
+		}
+		if(err != EAGAIN && err != EWOULDBLOCK && err != EINTR)
+		{
+			errno = err;
+			return -1;
+		}
+		if(!wait)
+		{
+			return 0;
+		}
+		// the outbox isn't locked while waiting, so the timer thread can still queue.
+		pfd.fd = peer->socketfd;
+		pfd.events = POLLOUT;
+		if(poll(&pfd, 1, -1) == -1 && errno != EINTR)
+		{
+			return -1;
+		}
+	}
+}
+
+// queues a HAVE for a piece we have just completed. the queue is flushed by have_callback().
+void announce_piece(struct pwp_torrent *t, int idx)
+{
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->have_mutex);
+
+	t->have_bitfield[idx / 8] |= 0x80 >> (idx % 8);
+	t->have_queue[t->have_queue_len++] = idx;
+	if(!timer_pending(&g_timer_wheel, &t->have_timer))
+	{
+		timer_add(&g_timer_wheel, &t->have_timer, HAVE_BATCH_MS);
+	}
+
+	pthread_mutex_unlock(&t->have_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+// queues the HAVEs for every connected peer in one message, leaving out the pieces it already has.
+// nothing here waits for a socket (see pwp_queue_msg()), so the peers list isn't held up either.
+static void have_callback(void *arg)
+{
+	struct pwp_torrent *t = (struct pwp_torrent *)arg;
+	struct pwp_peer_node *node;
+	int i, n, len;
+	uint32_t l = htonl(5), idx;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->have_mutex);
+
+	n = t->have_queue_len;
+	memcpy(t->have_flushing, t->have_queue, sizeof(int) * n);
+	t->have_queue_len = 0;
+
+	pthread_mutex_unlock(&t->have_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->connected_peers_mutex);
+
+	for(node = t->connected_peers; node; node = node->next)
+	{
+		len = 0;
+		for(i = 0; i < n; i++)
+		{
+			if(peer_has_piece(node->peer, t->have_flushing[i]))
+			{
+				continue;
+			}
+			idx = htonl(t->have_flushing[i]);
+			memcpy(t->have_batch + len, &l, 4);
+			t->have_batch[len + 4] = HAVE_MSG_ID;
+			memcpy(t->have_batch + len + 5, &idx, 4);
+			len += 9;
+		}
+		if(len > 0)
+		{
+			pwp_queue_msg(node->peer, t->have_batch, len);
+		}
+	}
 
-cleanup:
-	bf_log(" -------------------------------------- FINISH: RECEIVE_MSG  ----------------------------------------\n");
-	return rv;
+	pthread_mutex_unlock(&t->connected_peers_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	bf_log("[LOG] have_callback(): Announced %d piece(s) to the connected peers.\n", n);
 }
 
-int get_len(int socketfd, fd_set *recvfd, int *len)
+// returns -1 (and doesn't register the peer) if a peer with the same peer id is already registered.
+int register_peer(struct pwp_peer *peer)
 {
-	bf_log("++++++++++++++++++++ START:  GET_LEN +++++++++++++++++++++++\n");
-	
-	int rv;
-	uint8_t *curr = (uint8_t *)len;
+	struct pwp_torrent *t = peer->torrent;
+	int rv = 0;
 
-	rv = receive_msg_for_len(socketfd, recvfd, 4, curr);	
-	*len = ntohl(*len);	
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->connected_peers_mutex);
+
+	if(linked_list_contains_peer_id(t->connected_peers, peer->peer_id))
+	{
+		rv = -1;
+	}
+	else
+	{
+		linked_list_add(&t->connected_peers, peer);
+	}
+
+	pthread_mutex_unlock(&t->connected_peers_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
 
-	bf_log("---------------------------------------- FINISH:  GET_LEN ----------------------------------------\n");
 	return rv;
 }
 
-int get_len_hs(int socketfd, fd_set *recvfd, int *len)
+void unregister_peer(struct pwp_peer *peer)
 {
-	bf_log("++++++++++++++++++++ START:  GET_LEN_HS +++++++++++++++++++++++\n");
-        int rv;
-	uint8_t *p_name_len = malloc(1);
+	struct pwp_torrent *t = peer->torrent;
 
-        rv = receive_msg_for_len(socketfd, recvfd, 1, p_name_len);
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->connected_peers_mutex);
 
-        *len = *p_name_len + 8 + 20 + 20;
+	linked_list_remove(&t->connected_peers, peer);
 
-	bf_log("---------------------------------------- FINISH:  GET_LEN_HS ----------------------------------------\n");
-        return rv;
+	pthread_mutex_unlock(&t->connected_peers_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
 }
 
-int receive_msg_for_len(int socketfd, fd_set *recvfd, int len, uint8_t *msg)
+static void pex_callback(void *arg)
 {
-	bf_log("++++++++++++++++++++ START:  RECEIVE_MSG_FOR_LEN +++++++++++++++++++++++\n");
-	
-	if(len == 0)
+	struct pwp_peer *peer = (struct pwp_peer *)arg;
+	uint8_t *msg;
+	int len;
+
+	// queued like the HAVEs, as the timer thread mustn't wait for the peer's socket.
+	if((msg = extension_compose_pex(peer, &len)) != NULL)
 	{
-		return RECV_OK;
+		pwp_queue_msg(peer, msg, len);
+		free(msg);
 	}
-	int r_bytes, rv;
-        uint8_t *curr = msg;
-	struct timeval tv;
-
-	tv.tv_sec = 10;
-        tv.tv_usec = 0;
-        
-        rv = select(socketfd + 1, recvfd, NULL, NULL, &tv);
-        bf_log("[LOG] receive_msg_for_len: value of 'rv' after select: %d (1=OK; 0=timeout; -1=error)\n", rv);
-
-        if(rv == -1)
-        {
-                perror("select");
-                return RECV_ERROR;
-        }
-        if(rv == 0) // i.e. timeout
-        {
-                return RECV_TO;
-        }
-        rv = 0;
-        for(r_bytes = 0; r_bytes<len; r_bytes+=rv)
-        {
-                if((rv = recv(socketfd, curr + r_bytes, len - r_bytes, 0)) <= 0)
-                {
-			bf_log("[ERROR]receive_msg_for_len: Peer closed connection");
-                        return RECV_ERROR;
-                }
-		bf_log("[LOG] receive_msg_for_len(): received %d bytes when attempted to receive %d bytes.\n", rv, len - r_bytes); 
-        }
-
-	bf_log("---------------------------------------- FINISH:  RECEIVE_MSG_FOR_LEN ----------------------------------------\n");
-        return RECV_OK;
+	timer_add(&g_timer_wheel, &peer->pex_timer, PEX_INTERVAL_MS);
 }
-		
-uint8_t *compose_handshake(uint8_t *info_hash, uint8_t *our_peer_id, int *len)
-{
-	bf_log("++++++++++++++++++++ START:  COMPOSE_HANDSHAKE +++++++++++++++++++++++\n");
-	
-	uint8_t *hs, *curr;
-	uint8_t temp;
-	int i;
 
-	*len = 49+19;
-	hs = malloc(*len);
-	curr = hs;
-	temp = 19;
-	memcpy(curr, &temp, 1);
-	curr += 1;
-	strncpy((char *)curr, "BitTorrent protocol", 19);
-	curr += 19;
-	temp = 0;
-	for(i=0; i<8; i++)
-	{
-		memcpy(curr, &temp, 1);
-		curr += 1;
-	}
-	memcpy(curr, info_hash, 20);
-	curr += 20;
-	memcpy(curr, our_peer_id, 20);
+static void deadline_callback(void *arg)
+{
+	struct pwp_peer *peer = (struct pwp_peer *)arg;
 
-	bf_log("---------------------------------------- FINISH:  COMPOSE_HANDSHAKE ----------------------------------------\n");
-	return hs;
+	bf_log("[LOG] deadline_callback(): Peer missed its deadline. Shutting the connection down.\n");
+	peer->timed_out = 1;
+	// wakes up the peer's thread from select() or recv() with an error.
+	shutdown(peer->socketfd, SHUT_RDWR);
 }
 
 uint8_t *compose_interested(int *len)
@@ -771,6 +1841,177 @@ uint8_t *compose_interested(int *len)
 	return msg;
 }
 
+uint8_t *compose_choke(int *len)
+{
+	uint8_t *msg = malloc(5);
+	int l = htonl(1);
+
+	memcpy(msg, &l, 4);
+	msg[4] = CHOKE_MSG_ID;
+	*len = 5;
+
+	return msg;
+}
+
+uint8_t *compose_unchoke(int *len)
+{
+	uint8_t *msg = malloc(5);
+	int l = htonl(1);
+
+	memcpy(msg, &l, 4);
+	msg[4] = UNCHOKE_MSG_ID;
+	*len = 5;
+
+	return msg;
+}
+
+// composes a BITFIELD message out of the resume file. returns NULL if we don't have any pieces yet.
+uint8_t *compose_bitfield(struct pwp_torrent *t, int *len)
+{
+	uint8_t *msg = NULL;
+	int i, l;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->have_mutex);
+
+	for(i=0; i<t->have_bitfield_len; i++)
+	{
+		if(t->have_bitfield[i])
+		{
+			break;
+		}
+	}
+	if(i < t->have_bitfield_len)
+	{
+		*len = 5 + t->have_bitfield_len;
+		msg = malloc(*len);
+		l = htonl(1 + t->have_bitfield_len);
+		memcpy(msg, &l, 4);
+		msg[4] = BITFIELD_MSG_ID;
+		memcpy(msg + 5, t->have_bitfield, t->have_bitfield_len);
+	}
+
+	pthread_mutex_unlock(&t->have_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return msg;
+}
+
+uint8_t *compose_have(int piece_idx, int *len)
+{
+	uint8_t *msg = malloc(9);
+	int l = htonl(5);
+
+	memcpy(msg, &l, 4);
+	msg[4] = HAVE_MSG_ID;
+	l = htonl(piece_idx);
+	memcpy(msg + 5, &l, 4);
+	*len = 9;
+
+	return msg;
+}
+
+uint8_t *compose_port(uint16_t port, int *len)
+{
+	uint8_t *msg = malloc(7);
+	int l = htonl(3);
+
+	memcpy(msg, &l, 4);
+	msg[4] = PORT_MSG_ID;
+	port = htons(port);
+	memcpy(msg + 5, &port, 2);
+	*len = 7;
+
+	return msg;
+}
+
+uint8_t *compose_have_all(int *len)
+{
+	uint8_t *msg = malloc(5);
+	int l = htonl(1);
+
+	memcpy(msg, &l, 4);
+	msg[4] = HAVE_ALL_MSG_ID;
+	*len = 5;
+
+	return msg;
+}
+
+uint8_t *compose_have_none(int *len)
+{
+	uint8_t *msg = malloc(5);
+	int l = htonl(1);
+
+	memcpy(msg, &l, 4);
+	msg[4] = HAVE_NONE_MSG_ID;
+	*len = 5;
+
+	return msg;
+}
+
+// same layout as a REQUEST message.
+uint8_t *compose_reject(int piece_idx, int block_offset, int block_length, int *len)
+{
+	uint8_t *msg = compose_request(piece_idx, block_offset, block_length, len);
+
+	msg[4] = REJECT_MSG_ID;
+
+	return msg;
+}
+
+// tells a newly connected peer which pieces we have. with the fast extension an empty or full bitfield
+// is replaced by HAVE NONE or HAVE ALL. without it nothing is sent if we don't have any pieces.
+// a super seed claims to have nothing; its pieces are revealed one by one later.
+int send_have_state(struct pwp_peer *peer)
+{
+	struct pwp_torrent *t = peer->torrent;
+	uint8_t *msg = NULL;
+	int msg_len, count, rv = 0;
+
+	if(is_super_seeding(t))
+	{
+		if(peer->fast_extension)
+		{
+			bf_log("[LOG] Super seeding. Sending HAVE NONE.\n");
+			msg = compose_have_none(&msg_len);
+			rv = pwp_send(peer, msg, msg_len);
+			free(msg);
+		}
+		return rv;
+	}
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->downloaded_pieces_mutex);
+
+	count = t->downloaded_pieces;
+
+	pthread_mutex_unlock(&t->downloaded_pieces_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	if(peer->fast_extension && count >= t->num_of_pieces)
+	{
+		bf_log("[LOG] Sending HAVE ALL.\n");
+		msg = compose_have_all(&msg_len);
+	}
+	else if((msg = compose_bitfield(t, &msg_len)) != NULL)
+	{
+		bf_log("[LOG] Sending bitfield.\n");
+	}
+	else if(peer->fast_extension)
+	{
+		bf_log("[LOG] Sending HAVE NONE.\n");
+		msg = compose_have_none(&msg_len);
+	}
+
+	if(msg)
+	{
+		rv = pwp_send(peer, msg, msg_len);
+		free(msg);
+	}
+
+	return rv;
+}
+
 uint8_t extract_msg_id(uint8_t *response)
 {
 	bf_log("++++++++++++++++++++ START:  EXTRACT_MSG_ID +++++++++++++++++++++++\n");
@@ -786,6 +2027,7 @@ uint8_t extract_msg_id(uint8_t *response)
 
 int process_msgs(uint8_t *msgs, int len, int has_hs, struct pwp_peer *peer)
 {
+	struct pwp_torrent *t = peer->torrent;
 	bf_log("++++++++++++++++++++ START:  PROCESS_MSGS +++++++++++++++++++++++\n");
 	if(!msgs)
 	{
@@ -793,8 +2035,8 @@ int process_msgs(uint8_t *msgs, int len, int has_hs, struct pwp_peer *peer)
 		return -1;
 	}
 
-	int rv, jump;
-	uint8_t *curr, *temp;
+	int rv, jump, msg_len;
+	uint8_t *curr, *temp, msg_id;
 	curr = msgs;
 	rv = 0;
 
@@ -806,6 +2048,10 @@ int process_msgs(uint8_t *msgs, int len, int has_hs, struct pwp_peer *peer)
 		*/
 		temp = curr;
 		jump = (uint8_t)(*temp) + 1 + 8 + 20;
+		peer->fast_extension = (temp[(uint8_t)(*temp) + 1 + FAST_EXTENSION_BYTE] & FAST_EXTENSION_BIT) != 0;
+		peer->extension_protocol = (temp[(uint8_t)(*temp) + 1 + EXTENSION_PROTOCOL_BYTE] & EXTENSION_PROTOCOL_BIT) != 0;
+		peer->dht = g_dht_enabled && (temp[(uint8_t)(*temp) + 1 + DHT_BYTE] & DHT_BIT) != 0;
+		bf_log("*-*-* Peer %s the fast extension.\n", peer->fast_extension ? "supports" : "doesn't support");
 		temp += jump;
 		memcpy(peer->peer_id, temp, 20);
 		curr += jump + 20;
@@ -816,7 +2062,26 @@ int process_msgs(uint8_t *msgs, int len, int has_hs, struct pwp_peer *peer)
 	while(len > 0)
 	{
 		temp = curr;
-		switch(extract_msg_id(temp))
+		// the handlers read their fields at fixed offsets, so a message too short for its id isn't handed to them.
+		msg_len = len >= 4 ? (int)ntohl(*((int *)curr)) : -1;
+		if(msg_len < 0 || msg_len > len - 4 || !valid_msg_len(extract_msg_id(temp), msg_len))
+		{
+			bf_log("[ERROR] process_msgs(): Malformed message from %s:%d. Disconnecting it.\n", peer->addr.ip, peer->addr.port);
+			shutdown(peer->socketfd, SHUT_RDWR);
+			rv = -1;
+			goto cleanup;
+		}
+		msg_id = extract_msg_id(temp);
+		// BEP 6: the fast extension's messages may only be sent if both handshakes had its bit set.
+		if(msg_id >= SUGGEST_MSG_ID && msg_id <= ALLOWED_FAST_MSG_ID && !peer->fast_extension)
+		{
+			bf_log("[ERROR] process_msgs(): Fast extension message %d from %s:%d, which didn't negotiate it. Disconnecting it.\n",
+				msg_id, peer->addr.ip, peer->addr.port);
+			shutdown(peer->socketfd, SHUT_RDWR);
+			rv = -1;
+			goto cleanup;
+		}
+		switch(msg_id)
 		{
 			case BITFIELD_MSG_ID:
 				bf_log("*-*-* Got BITFIELD message.\n");
@@ -833,12 +2098,23 @@ int process_msgs(uint8_t *msgs, int len, int has_hs, struct pwp_peer *peer)
 				bf_log("*-*-* Got CHOKE message.\n");
 				break;
 			case INTERESTED_MSG_ID:
-				// TODO:
 				bf_log("*-*-* Got INTERESTED message.\n");
+				peer->interested = 1;
+				/* -X-X-X- CRITICAL REGION START -X-X-X- */
+				pthread_mutex_lock(&t->connected_peers_mutex);
+
+				// no need to wait for the next choke round if an upload slot is free.
+				if(peer->am_choking && choker_has_free_slot(t->connected_peers))
+				{
+					set_choking(peer, 0);
+				}
+
+				pthread_mutex_unlock(&t->connected_peers_mutex);
+				/* -X-X-X- CRITICAL REGION END -X-X-X- */
 				break;
 			case NOT_INTERESTED_MSG_ID:
-				// TODO:
 				bf_log("*-*-* Got NOT INTERESTED message.\n");
+				peer->interested = 0;
 				break;
 			case HAVE_MSG_ID:
 				// TODO:
@@ -847,145 +2123,429 @@ int process_msgs(uint8_t *msgs, int len, int has_hs, struct pwp_peer *peer)
 				peer->has_pieces = 1;
 				break;
 			case REQUEST_MSG_ID:
-				// TODO:
 				bf_log("*-*-* Got REQUEST message.\n");
+				process_request(temp, peer);
 				break;
 			case PIECE_MSG_ID:
 				// TODO:
 				bf_log("*-*-* Got PIECE message.\n");
 				break;
 			case CANCEL_MSG_ID:
-				// TODO:
+				// requests are served as soon as they are read so by now the block has already been sent.
 				bf_log("*-*-* Got CANCEL message.\n");
 				break;
+			case PORT_MSG_ID:
+				bf_log("*-*-* Got PORT message.\n");
+				process_port(temp, peer);
+				break;
 			case KEEP_ALIVE_MSG_ID:
 			        // TODO:
 				bf_log("*-*-* Got KEEP ALIVE message.\n");
 				break;
+			case HAVE_ALL_MSG_ID:
+				bf_log("*-*-* Got HAVE ALL message.\n");
+				process_have_all(peer);
+				peer->has_pieces = 1;
+				break;
+			case HAVE_NONE_MSG_ID:
+				bf_log("*-*-* Got HAVE NONE message.\n");
+				break;
+			case SUGGEST_MSG_ID:
+				bf_log("*-*-* Got SUGGEST PIECE message.\n");
+				process_suggest(temp, peer);
+				break;
+			case ALLOWED_FAST_MSG_ID:
+				bf_log("*-*-* Got ALLOWED FAST message.\n");
+				process_allowed_fast(temp, peer);
+				break;
+			case EXTENDED_MSG_ID:
+				extension_process_msg(temp, peer);
+				break;
+			case REJECT_MSG_ID:
+				// rejects of our outstanding requests are handled by download_block(). any other one is stale.
+				bf_log("*-*-* Got REJECT REQUEST message.\n");
+				break;
 			default:
 				rv = -1;
 				goto cleanup;
 		}
 
-		jump = ntohl(*((int *)curr)) + 4;
-		curr += jump;
-		len = len - jump;
+		jump = msg_len + 4;
+		curr += jump;
+		len = len - jump;
+	}
+
+cleanup:
+	bf_log("---------------------------------------- FINISH:  PROCESS_MSGS----------------------------------------\n");
+	return rv;
+}
+
+// returns 1 if msg_len, the length prefix of a message, is one a message msg_id may have.
+static int valid_msg_len(uint8_t msg_id, int msg_len)
+{
+	switch(msg_id)
+	{
+		case KEEP_ALIVE_MSG_ID:
+			return msg_len == 0;
+		case CHOKE_MSG_ID:
+		case UNCHOKE_MSG_ID:
+		case INTERESTED_MSG_ID:
+		case NOT_INTERESTED_MSG_ID:
+		case HAVE_ALL_MSG_ID:
+		case HAVE_NONE_MSG_ID:
+			return msg_len == 1;
+		case PORT_MSG_ID:
+			return msg_len == 3;
+		case HAVE_MSG_ID:
+		case SUGGEST_MSG_ID:
+		case ALLOWED_FAST_MSG_ID:
+			return msg_len == 5;
+		case REQUEST_MSG_ID:
+		case CANCEL_MSG_ID:
+		case REJECT_MSG_ID:
+			return msg_len == 13;
+		case PIECE_MSG_ID:
+			return msg_len >= 9;
+		case EXTENDED_MSG_ID:
+			return msg_len >= 2;
+		default:
+			// the bitfield is checked against the number of pieces as it is read, and unknown ids are
+			// left to the switch in process_msgs().
+			return msg_len >= 1;
+	}
+}
+
+int process_request(uint8_t *msg, struct pwp_peer *peer)
+{
+	struct pwp_torrent *t = peer->torrent;
+	bf_log("++++++++++++++++++++ START:  PROCESS_REQUEST +++++++++++++++++++++++\n");
+	int rv = 0;
+	int idx, block_offset, block_length, status, len;
+	int served = 0;
+	uint8_t *reject;
+
+	idx = ntohl(*((int *)(msg + 5)));
+	block_offset = ntohl(*((int *)(msg + 9)));
+	block_length = ntohl(*((int *)(msg + 13)));
+
+	if(peer->am_choking)
+	{
+		bf_log("[LOG] process_request(): Ignoring request from a peer that we are choking.\n");
+		rv = -1;
+		goto cleanup;
+	}
+	if(idx < 0 || idx >= t->num_of_pieces || block_offset < 0 || block_length <= 0 || block_length > MAX_REQUEST_LEN
+		|| block_offset + block_length > t->pieces[idx].piece_length)
+	{
+		bf_log("[ERROR] process_request(): Invalid request. idx: %d, offset: %d, length: %d.\n", idx, block_offset, block_length);
+		rv = -1;
+		goto cleanup;
+	}
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->pieces_mutexes[idx]);
+
+	status = t->pieces[idx].status;
+
+	pthread_mutex_unlock(&t->pieces_mutexes[idx]);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	if(status != PIECE_STATUS_COMPLETE)
+	{
+		bf_log("[LOG] process_request(): Peer requested piece %d which we don't have.\n", idx);
+		rv = -1;
+		goto cleanup;
+	}
+	if(is_super_seeding(t) && !(peer->revealed[idx / 8] & (0x80 >> (idx % 8))))
+	{
+		bf_log("[LOG] process_request(): Peer requested piece %d which wasn't revealed to it.\n", idx);
+		rv = -1;
+		goto cleanup;
+	}
+
+	rv = send_block(peer, idx, block_offset, block_length);
+	served = 1;
+
+cleanup:
+	// with the fast extension every request that isn't served must be rejected explicitly.
+	if(!served && peer->fast_extension)
+	{
+		reject = compose_reject(idx, block_offset, block_length, &len);
+		pwp_send(peer, reject, len);
+		free(reject);
+	}
+	bf_log("---------------------------------------- FINISH:  PROCESS_REQUEST ----------------------------------------\n");
+	return rv;
+}
+
+// sends a PIECE message whose data goes straight from the saved file to the socket.
+int send_block(struct pwp_peer *peer, int idx, int block_offset, int block_length)
+{
+	struct pwp_torrent *t = peer->torrent;
+	uint8_t header[13];
+	int temp, rv, sent;
+	off_t offset;
+	ssize_t n;
+
+	// upload rate limits are enforced here, before anything of the block is written.
+	ratelimit_acquire(&peer->upload_bucket, block_length, block_length);
+
+	temp = htonl(9 + block_length);
+	memcpy(header, &temp, 4);
+	header[4] = PIECE_MSG_ID;
+	temp = htonl(idx);
+	memcpy(header + 5, &temp, 4);
+	temp = htonl(block_offset);
+	memcpy(header + 9, &temp, 4);
+
+	rv = 0;
+	pthread_mutex_lock(&peer->send_mutex);
+	if(flush_outbox(peer, 1) == -1)
+	{
+		rv = -1;
+		goto unlock;
+	}
+	for(sent = 0; sent < 13; sent += n)
+	{
+		// MSG_MORE so that the header goes out in the same segment as the start of the data.
+		if((n = send(peer->socketfd, header + sent, 13 - sent, MSG_MORE | MSG_NOSIGNAL)) <= 0)
+		{
+			rv = -1;
+			goto unlock;
+		}
+	}
+	offset = (off_t)idx * t->piece_length + block_offset;
+	for(sent = 0; sent < block_length; sent += n)
+	{
+		if((n = sendfile(peer->socketfd, t->saved_fd, &offset, block_length - sent)) <= 0)
+		{
+			rv = -1;
+			goto unlock;
+		}
+	}
+
+unlock:
+	pthread_mutex_unlock(&peer->send_mutex);
+
+	if(rv == -1)
+	{
+		bf_log("[ERROR] send_block(): Failed to send block (idx: %d, offset: %d): %s\n", idx, block_offset, strerror(errno));
+		return rv;
 	}
+	timer_add(&g_timer_wheel, &peer->keep_alive_timer, KEEP_ALIVE_INTERVAL_MS);
+	peer->uploaded += block_length;
+	bf_log("[LOG] send_block(): Uploaded block (idx: %d, offset: %d, length: %d).\n", idx, block_offset, block_length);
 
-cleanup:
-	bf_log("---------------------------------------- FINISH:  PROCESS_MSGS----------------------------------------\n");
 	return rv;
 }
 
-int get_pieces(int socketfd, struct pwp_peer *peer)
+// tells the peer that we are (un)choking it. the choker calls this with the peers list locked, so
+// the message is queued rather than waited for (see pwp_queue_msg()).
+void set_choking(struct pwp_peer *peer, int choke)
 {
-	bf_log("++++++++++++++++++++ START:  GET_PIECES +++++++++++++++++++++++\n");
-	int count, rv = 0;
-	FILE *savedfp = NULL;
+	int len;
+	uint8_t *msg = choke ? compose_choke(&len) : compose_unchoke(&len);
 
-	/* -X-X-X- CRITICAL REGION START -X-X-X- */
-        pthread_mutex_lock(&g_downloaded_pieces_mutex);
+	pwp_queue_msg(peer, msg, len);
+	free(msg);
+	peer->am_choking = choke;
+}
 
-        count = g_downloaded_pieces;
+// keeps answering the peer's messages (REQUESTs in particular) until it goes quiet or disconnects.
+// a super seeded peer may be quiet while it waits for its next piece, so it is given longer.
+int serve_peer(struct pwp_peer *peer)
+{
+	bf_log("++++++++++++++++++++ START:  SERVE_PEER +++++++++++++++++++++++\n");
+	int rv, len;
+	int idle = 0;
+	uint8_t *recvd_msg = NULL;
+	fd_set recvfd;
+	int max_idle = is_super_seeding(peer->torrent) ? SUPERSEED_IDLE_TIMEOUTS : SERVE_IDLE_TIMEOUTS;
 
-        pthread_mutex_unlock(&g_downloaded_pieces_mutex);
-        /* -X-X-X- CRITICAL REGION END -X-X-X- */
+	// a choked peer has nothing to say until the choker unchokes it, and keep-alives only come every
+	// two minutes. so a quiet peer is kept until it has been quiet for that long, or the session
+	// shuts its socket down. a peer with every piece wants nothing from us.
+	while((rv = receive_msg(peer->socketfd, &recvfd, &recvd_msg, &len)) == RECV_OK
+		|| (rv == RECV_TO && ++idle < max_idle && !peer_has_all_pieces(peer)))
+	{
+		if(rv == RECV_TO)
+		{
+			// an UNCHOKE the socket had no room for may be what the peer waits for.
+			pthread_mutex_lock(&peer->send_mutex);
+			flush_outbox(peer, 0);
+			pthread_mutex_unlock(&peer->send_mutex);
+			continue;
+		}
+		idle = 0;
+		process_msgs(recvd_msg, len, 0, peer);
+		free(recvd_msg);
+		recvd_msg = NULL;
+	}
+	if(recvd_msg)
+	{
+		free(recvd_msg);
+	}
+
+	bf_log("[LOG] serve_peer(): Stopped serving the peer. Uploaded %ld bytes to it.\n", peer->uploaded);
+	bf_log("---------------------------------------- FINISH:  SERVE_PEER ----------------------------------------\n");
+	return rv == RECV_TO ? 0 : -1;
+}
+
+int get_pieces(int socketfd, struct pwp_peer *peer)
+{
+	struct pwp_torrent *t = peer->torrent;
+	bf_log("++++++++++++++++++++ START:  GET_PIECES +++++++++++++++++++++++\n");
+	int idx, rv = 0;
 
-        if(count >= g_num_of_pieces)
+        if(is_wanted_download_complete(t))
         {
                 bf_log("[LOG] get_pieces(): Not downloading any further pieces as the desired no of pieces have been downloaded.\n");
                 goto cleanup;
         }
 
-	int idx = choose_random_piece_idx(peer->peer_id);
-
-	savedfp = fopen(g_saved_filepath, "r+");
-        if(!savedfp)
-        {
-                bf_log("[ERROR] get_pieces(): Failed to open saved file. Aborting this thread.\n");
-                rv = -1;
-		goto cleanup;
-        }
-	
-	while(idx != -1) // idx is -1 when no piece to download is found
+	while(1)
 	{
+		idx = choose_random_piece_idx(peer);
+		if(idx == -1) // idx is -1 when no piece to download is found
+		{
+			// while choked only the allowed fast pieces can be chosen. once they are done wait to be unchoked.
+			if(!peer->unchoked)
+			{
+				if(wait_for_unchoke(peer) != 0)
+				{
+					rv = 0;
+					break;
+				}
+				continue;
+			}
+			// the sequential output wants more pieces as its window moves on, or when one is given back.
+			if(t->window_end != INT_MAX && wanted_pieces_left(t) && wait_for_window(peer) == 0)
+			{
+				continue;
+			}
+			rv = 0;
+			break;
+		}
 		bf_log("[LOG] Chose random piece index: %d\n", idx);
-		rv = download_piece(idx, socketfd, savedfp, peer);
+		rv = download_piece(idx, socketfd, peer);
 
 		if(rv == 0)
 		{
-			rv = update_resume_file(g_resume_filepath, idx);
-			if(rv == 0)
-			{
-				/* -X-X-X- CRITICAL REGION START -X-X-X- */
-		                pthread_mutex_lock(&g_pieces_mutexes[idx]);
-	
-				g_pieces[idx].status = PIECE_STATUS_COMPLETE;
+			rv = complete_piece(t, idx);
+		}
+		else
+		{
+			release_piece(t, idx);
+		}
+		if(rv == DOWNLOAD_PIECE_LOST)
+		{
+			bf_log("[LOG] get_pieces(): The connection to %s:%d is gone. Not trying other pieces.\n", peer->addr.ip, peer->addr.port);
+			rv = -1;
+			break;
+		}
 
-				pthread_mutex_unlock(&g_pieces_mutexes[idx]);
-		                /* -X-X-X- CRITICAL REGION END -X-X-X- */
+                if(is_wanted_download_complete(t))
+                {
+                        bf_log("[LOG] get_pieces(): Not downloading any further pieces as the desired no of pieces have been downloaded.\n");
 
-				/* -X-X-X- CRITICAL REGION START -X-X-X- */
-			        pthread_mutex_lock(&g_downloaded_pieces_mutex);
+                        break;
+                }	
+		// the torrent's connection limit went down (see conntune.h). the slower threads make way.
+		if(rv == 0 && peer->outbound && conntune_should_leave(&t->tune, peer->download_rate))
+		{
+			bf_log("[LOG] get_pieces(): Leaving %s:%d as the torrent runs more threads than its limit.\n", peer->addr.ip, peer->addr.port);
+			rv = GET_PIECES_LEAVE;
+			break;
+		}
+	}
+
+cleanup:
+	bf_log("---------------------------------------- FINISH:  GET_PIECES----------------------------------------\n");
+	return rv;	
+}
 
-			        g_downloaded_pieces++;
+// records a downloaded and verified piece in the resume file and announces it.
+int complete_piece(struct pwp_torrent *t, int idx)
+{
+	int already_complete, priority;
 
-		        	pthread_mutex_unlock(&g_downloaded_pieces_mutex);
-	        		/* -X-X-X- CRITICAL REGION END -X-X-X- */
-			}
-			else
-			{
-				bf_log("[ERROR] get_pieces(): Piece at idx %d downloaded successfully but failed to update resume file. This piece will be considered as failed to download.\n", idx);
-				/* -X-X-X- CRITICAL REGION START -X-X-X- */
-                                pthread_mutex_lock(&g_pieces_mutexes[idx]);
+	// of a piece downloaded twice (see stream.h) the copy verified first is recorded.
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->pieces_mutexes[idx]);
 
-                                g_pieces[idx].status = PIECE_STATUS_AVAILABLE;
+	already_complete = t->pieces[idx].status == PIECE_STATUS_COMPLETE;
+	t->pieces[idx].status = PIECE_STATUS_COMPLETE;
+	t->pieces[idx].hedges = 0;
+	priority = t->pieces[idx].priority;
 
-                                pthread_mutex_unlock(&g_pieces_mutexes[idx]);
-                                /* -X-X-X- CRITICAL REGION END -X-X-X- */
-			}
-		}
-		else
-		{
-			/* -X-X-X- CRITICAL REGION START -X-X-X- */
-                        pthread_mutex_lock(&g_pieces_mutexes[idx]);
+	pthread_mutex_unlock(&t->pieces_mutexes[idx]);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
 
-			g_pieces[idx].status = PIECE_STATUS_AVAILABLE;
+	if(already_complete)
+	{
+		bf_log("[LOG] complete_piece(): Piece %d was completed by another download already.\n", idx);
+		return 0;
+	}
 
-			pthread_mutex_unlock(&g_pieces_mutexes[idx]);
-			/* -X-X-X- CRITICAL REGION END -X-X-X- */
-		}
+	if(update_resume_file(t, idx) != 0)
+	{
+		bf_log("[ERROR] complete_piece(): Piece at idx %d downloaded successfully but failed to update resume file. This piece will be considered as failed to download.\n", idx);
 
 		/* -X-X-X- CRITICAL REGION START -X-X-X- */
-                pthread_mutex_lock(&g_downloaded_pieces_mutex);
+		pthread_mutex_lock(&t->pieces_mutexes[idx]);
 
-                count = g_downloaded_pieces;
+		t->pieces[idx].status = PIECE_STATUS_AVAILABLE;
 
-                pthread_mutex_unlock(&g_downloaded_pieces_mutex);
-                /* -X-X-X- CRITICAL REGION END -X-X-X- */
+		pthread_mutex_unlock(&t->pieces_mutexes[idx]);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+		return -1;
+	}
 
-                if(count >= g_num_of_pieces)
-                {
-                        bf_log("[LOG] get_pieces(): Not downloading any further pieces as the desired no of pieces have been downloaded.\n");
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->downloaded_pieces_mutex);
 
-                        break;
-                }	
+	t->downloaded_pieces++;
 
-		idx = choose_random_piece_idx(peer->peer_id);
-	}
+	pthread_mutex_unlock(&t->downloaded_pieces_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
 
-cleanup:
-	bf_log("---------------------------------------- FINISH:  GET_PIECES----------------------------------------\n");
-	if(savedfp)
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->priorities_mutex);
+
+	t->pieces_left[priority]--;
+
+	pthread_mutex_unlock(&t->priorities_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	announce_piece(t, idx);
+	stream_piece_done(t, idx);
+
+	return 0;
+}
+
+// gives up a piece that was chosen for downloading so that it can be chosen again. a piece that is
+// downloaded twice stays started for the other download, and one that it completed stays complete.
+void release_piece(struct pwp_torrent *t, int idx)
+{
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->pieces_mutexes[idx]);
+
+	if(t->pieces[idx].status == PIECE_STATUS_STARTED && t->pieces[idx].hedges > 0)
 	{
-		bf_log("[LOG] get_pieces(): closing saved file pointer.\n");
-		fclose(savedfp);
+		t->pieces[idx].hedges--;
 	}
-	return rv;	
+	else if(t->pieces[idx].status != PIECE_STATUS_COMPLETE)
+	{
+		t->pieces[idx].status = PIECE_STATUS_AVAILABLE;
+	}
+
+	pthread_mutex_unlock(&t->pieces_mutexes[idx]);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
 }
 
-int download_piece(int idx, int socketfd, FILE *savedfp, struct pwp_peer *peer)
+int download_piece(int idx, int socketfd, struct pwp_peer *peer)
 {
+	struct pwp_torrent *t = peer->torrent;
 	bf_log("++++++++++++++++++++ START:  DOWNLOAD_PIECE +++++++++++++++++++++++\n");
     /* Steps:
     1. Calculate number of blocks in this piece (2^14 (16384) bytes per block )
@@ -1005,14 +2565,15 @@ int download_piece(int idx, int socketfd, FILE *savedfp, struct pwp_peer *peer)
     */
 
 	int i, len, rv;
+	int rejected = 0;
 	uint8_t *requests;
 	struct pwp_block received_block;
 
 	rv = 0;
 // No 1 above:
 	// NOTE we don't need to acquire lock to read piece_length as that field is never modified once it is initialised.
-	int num_of_blocks = g_pieces[idx].piece_length / BLOCK_LEN;
-	int bytes_in_last_block = g_pieces[idx].piece_length % BLOCK_LEN;
+	int num_of_blocks = t->pieces[idx].piece_length / BLOCK_LEN;
+	int bytes_in_last_block = t->pieces[idx].piece_length % BLOCK_LEN;
 
 	if(bytes_in_last_block)
 	{
@@ -1032,22 +2593,43 @@ int download_piece(int idx, int socketfd, FILE *savedfp, struct pwp_peer *peer)
 	{
 		curr[num_of_blocks-1].length = bytes_in_last_block;
 	}
+	if(peer->hedging)
+	{
+		peer->hedge_data = malloc(t->pieces[idx].piece_length);
+	}
 
 // No 4 to 9 above:
-	requests = prepare_requests(idx, blocks, num_of_blocks, BLOCK_REQUESTS_COUNT, &len);
-	int outstanding_requests = BLOCK_REQUESTS_COUNT;
+	// the download rate limits are enforced here: only as many blocks are requested as there are tokens for.
+	int num_of_requests = pace_requests(peer, blocks, num_of_blocks, BLOCK_REQUESTS_COUNT);
+	requests = prepare_requests(idx, blocks, num_of_blocks, num_of_requests, &len);
+	int outstanding_requests = len / 17;
 	while(requests)
 	{
-		if(send(socketfd, requests, len, 0) == -1)
+		if(pwp_send(peer, requests, len) == -1)
         	{
-		        perror("send");
-		        rv = -1;
+		        rv = DOWNLOAD_PIECE_LOST;
 		        goto cleanup;
         	}
+		timer_add(&g_timer_wheel, &peer->deadline_timer, REQUEST_TIMEOUT_MS);
 		bf_log("[LOG] Sent piece requests. Receiving response now.\n");
-		while(outstanding_requests && (rv = download_block(socketfd, idx, savedfp,  &received_block, peer)) == RECV_OK)
+		while(outstanding_requests && (rv = download_block(socketfd, idx, &received_block, peer)) != RECV_TO && rv != RECV_ERROR)
 		{
+			if(rv == RECV_CHOKED)
+			{
+				bf_log("[LOG] download_piece(): Peer choked us and dropped our requests. Giving up piece %d for now.\n", idx);
+				rv = -1;
+				goto cleanup;
+			}
+			if(rv == RECV_REJECTED)
+			{
+				// the block stays NOT_DOWNLOADED and its slot is free straight away.
+				bf_log("[LOG] download_piece(): Peer rejected our request for block at offset %d.\n", received_block.offset);
+				rejected = 1;
+				outstanding_requests--;
+				continue;
+			}
 			bf_log("[LOG] Successfully downloaded one block :)\n");
+			timer_add(&g_timer_wheel, &peer->deadline_timer, REQUEST_TIMEOUT_MS);
 			// calculate block index
 			i = received_block.offset/BLOCK_LEN;
 			if(i >=	num_of_blocks)
@@ -1057,78 +2639,169 @@ int download_piece(int idx, int socketfd, FILE *savedfp, struct pwp_peer *peer)
 				goto cleanup;
 			}	
 			blocks[i].status = received_block.status;
+			peer->downloaded += received_block.length;
 			outstanding_requests--;
 		}
+		// the socket was closed or shut down, e.g. by a missed deadline or by the session stopping.
+		if(rv == RECV_ERROR)
+		{
+			bf_log("[LOG] download_piece(): Lost the connection while downloading piece %d.\n", idx);
+			rv = DOWNLOAD_PIECE_LOST;
+			goto cleanup;
+		}
 		
 		free(requests);
 		requests = NULL;
-		requests = prepare_requests(idx, blocks, num_of_blocks, BLOCK_REQUESTS_COUNT, &len);
-		outstanding_requests = BLOCK_REQUESTS_COUNT;
+		// asking again for rejected blocks would only get them rejected again.
+		if(rejected)
+		{
+			bf_log("[LOG] download_piece(): Giving up piece %d as the peer won't serve it now.\n", idx);
+			rv = -1;
+			goto cleanup;
+		}
+		num_of_requests = pace_requests(peer, blocks, num_of_blocks, BLOCK_REQUESTS_COUNT);
+		requests = prepare_requests(idx, blocks, num_of_blocks, num_of_requests, &len);
+		outstanding_requests = len / 17;
 	}
 	free(requests);
         requests = NULL;
+	timer_cancel(&g_timer_wheel, &peer->deadline_timer);
+
+	// waits for the blocks still queued for the disk before the piece is read back and hashed.
+	if(peer->hedge_data ? commit_hedge(t, idx, peer->hedge_data) != 0 : diskio_verify(t, idx) != 0)
+	{
+		rv = -1;
+		goto cleanup;
+	}
+
+	bf_log("[LOG] download_piece(): Successfulle verified SHA1 of piece at index %d.\n", idx);
+	rv = 0;
+
+        bf_log("[LOG] *-*-*-*- Downloaded piece!! Piece index: %d.\n", idx);
+
+cleanup:
+	bf_log("---------------------------------------- FINISH:  DOWNLOAD_PIECE ----------------------------------------\n");
+	timer_cancel(&g_timer_wheel, &peer->deadline_timer);
+	if(requests)
+	{
+		free(requests);
+	}
+	free(blocks);
+	free(peer->hedge_data);
+	peer->hedge_data = NULL;
+	return rv;
+} 
 
-	// again, we don't need to acquire lock to access piece_length of the current piece in g_pieces array as piece_length doesn't cahnge.
-	uint8_t *piece_data = (uint8_t *)malloc(g_pieces[idx].piece_length);
+// checks the piece in the saved file against its SHA1 hash. runs on a hash worker, once all writes of the
+// piece are done; everyone else goes through diskio_verify().
+int verify_piece(struct pwp_torrent *t, int idx)
+{
+	long int done;
+	ssize_t r;
 
-	// flush file buffer before reading the chunk. this is imporant because otherwise sha1 to be computed will be incorrect.
-	fflush(savedfp);
+	// again, we don't need to acquire lock to access piece_length of the current piece in t->pieces array as piece_length doesn't cahnge.
+	uint8_t *piece_data = (uint8_t *)malloc(t->pieces[idx].piece_length);
 
-	// TODO: this can be made to use savedfp rather than openinig the file separately. Take caution that util_read_file_chunk 
-	//	then doesn't change the position of file pointer so as to write at incorrect pos when downloading next piece.	
-	if(util_read_file_chunk(g_saved_filepath, idx *  g_piece_length, g_pieces[idx].piece_length, piece_data) != 0)
+	for(done = 0, r = 1; done < t->pieces[idx].piece_length && r > 0; done += r)
+	{
+		r = pread(t->saved_fd, piece_data + done, t->pieces[idx].piece_length - done, idx * t->piece_length + done);
+	}
+	if(r <= 0)
 	{
-		bf_log("[ERROR] download_piece(): Faile to read piece number %d from file, therefore unable to verify SHA1 hash.\n", idx );
+		bf_log("[ERROR] verify_piece(): Faile to read piece number %d from file, therefore unable to verify SHA1 hash.\n", idx );
 		free(piece_data);
 		piece_data = NULL;
-                rv = -1;
-                goto cleanup;
+                return -1;
 	}
 	
+	r = check_piece_hash(t, idx, piece_data);
+	free(piece_data);
+
+	return r;
+}
+
+// returns 0 if piece_data, the whole of piece idx, matches its SHA1 hash.
+static int check_piece_hash(struct pwp_torrent *t, int idx, uint8_t *piece_data)
+{
+	int i;
 	uint8_t piece_hash[20];
-	sha1_compute(piece_data, g_pieces[idx].piece_length, piece_hash);
+
+	sha1_compute(piece_data, t->pieces[idx].piece_length, piece_hash);
 
 	// compute the index of first byte of the actual piece hash inside the global piece hashes string
 	i = idx * 20;
-	uint8_t *actual_sha1 = g_piece_hashes + i;
+	uint8_t *actual_sha1 = t->piece_hashes + i;
 	for(i=0; i<20; i++)
 	{
 		if(piece_hash[i] != actual_sha1[i])
 		{
-			bf_log("[ERROR] download_piece(): Verification of SHA1 piece number %d failed.\n", idx );
+			bf_log("[ERROR] check_piece_hash(): Verification of SHA1 piece number %d failed.\n", idx );
 	                bf_log_binary("  > Computed piece hash: ", piece_hash, 20);
 			bf_log("\n");
 			bf_log_binary("  > Actual piece hash: ", actual_sha1, 20);
 			bf_log("\n");
-			rv = -1;
-                	goto cleanup;
+			return -1;
 		}
 	}
 
-	bf_log("[LOG] download_piece(): Successfulle verified SHA1 of piece at index %d.\n", idx);
-	rv = 0;
+	return 0;
+}
 
-        bf_log("[LOG] *-*-*-*- Downloaded piece!! Piece index: %d.\n", idx);
+// writes a hedged copy of piece idx (see stream.h) to the saved file if it matches its hash, unless
+// the other download completed the piece first. the copy is written and the piece sealed in one go
+// under the piece's lock, and the writers drop sealed pieces' blocks: what the other download still
+// has queued can neither be written over the copy nor hashed along with it. returns -1 if the copy
+// is bad or can't be written.
+static int commit_hedge(struct pwp_torrent *t, int idx, uint8_t *piece_data)
+{
+	long int written;
+	ssize_t rv;
 
-cleanup:
-	bf_log("---------------------------------------- FINISH:  DOWNLOAD_PIECE ----------------------------------------\n");
-	if(requests)
+	if(check_piece_hash(t, idx, piece_data) != 0)
 	{
-		free(requests);
+		return -1;
+	}
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->pieces_mutexes[idx]);
+
+	written = t->pieces[idx].piece_length;
+	if(t->pieces[idx].status != PIECE_STATUS_COMPLETE && !t->pieces[idx].sealed)
+	{
+		for(written = 0, rv = 0; written < t->pieces[idx].piece_length; written += rv)
+		{
+			if((rv = pwrite(t->saved_fd, piece_data + written, t->pieces[idx].piece_length - written, (off_t)idx * t->piece_length + written)) <= 0)
+			{
+				if(rv == -1 && errno == EINTR)
+				{
+					rv = 0;
+					continue;
+				}
+				bf_log("[ERROR] commit_hedge(): Failed to write piece %d to the saved file: %s\n", idx, strerror(errno));
+				break;
+			}
+		}
+		t->pieces[idx].sealed = written == t->pieces[idx].piece_length;
 	}
-	return rv;
-} 
 
-int download_block(int socketfd, int expected_piece_idx, FILE *savedfp, struct pwp_block *block, struct pwp_peer *peer)
+	pthread_mutex_unlock(&t->pieces_mutexes[idx]);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return written == t->pieces[idx].piece_length ? 0 : -1;
+}
+
+int download_block(int socketfd, int expected_piece_idx, struct pwp_block *block, struct pwp_peer *peer)
 {
+	struct pwp_torrent *t = peer->torrent;
 
 	bf_log("++++++++++++++++++++ START:  DOWNLOAD BLOCK +++++++++++++++++++++++\n");
-	uint8_t *msg, *temp;
-	int rv, len;
+	uint8_t *msg, *temp, *data;
+	int rv, len, complete;
 	uint8_t msg_id;
 	fd_set recvfd;
 	
 	temp = NULL;
+	data = NULL;
 	msg = NULL;
 	msg_id = 255;
 	FD_ZERO(&recvfd);
@@ -1164,31 +2837,49 @@ int download_block(int socketfd, int expected_piece_idx, FILE *savedfp, struct p
 		if(msg_id != PIECE_MSG_ID)
 		{
 			bf_log("[LOG] download_block: the message is not PIECE message. Message Id: %d; Message Length (excluding 4 bytes for length): %d\n", msg_id, len);
+			// read straight into temp as the message (e.g. a bitfield) may not fit in msg.
 			temp = malloc(len + 4);
-			rv = receive_msg_for_len(socketfd, &recvfd, len - 1, msg); 
+			rv = receive_msg_for_len(socketfd, &recvfd, len - 1, temp + 5); 
 			if(rv != RECV_OK)
 			{
 				bf_log("[ERROR] download_block: got a problem reading message. Message Id: %d\n", msg_id);
 				rv = RECV_ERROR;
 				goto cleanup;
 			}
-			len = htonl(len);
-			memcpy(temp, &len, 4);
+			int net_len = htonl(len);
+			memcpy(temp, &net_len, 4);
 			memcpy(temp + 4, &msg_id, 1);
-			memcpy(temp + 5, msg, ntohl(len) - 1);			
-			process_msgs(temp, len, 0, peer);
+			if(msg_id == REJECT_MSG_ID && peer->fast_extension && len == 13 && (int)ntohl(*((int *)(temp + 5))) == expected_piece_idx)
+			{
+				block->offset = ntohl(*((int *)(temp + 9)));
+				block->length = ntohl(*((int *)(temp + 13)));
+				block->status = BLOCK_STATUS_NOT_DOWNLOADED;
+				rv = RECV_REJECTED;
+				goto cleanup;
+			}
+			process_msgs(temp, len + 4, 0, peer);
 			free(temp);
 			temp = NULL;
+			if(!peer->unchoked && !peer->fast_extension)
+			{
+				rv = RECV_CHOKED;
+				goto cleanup;
+			}
 		}
 	}
 	bf_log("[LOG] Received PIECE message!! Going to process it now.\n");
 	// processing the piece message. here len = num of data bytes in block + 4(piece idx) + 4(block offset) + 1 (for msg id) & msg_id = PIECE_MSG_ID.
-	//	have a global file descriptor to the file that already has the total memory required
-	//	using piece length and idx and block offset calculate position of bytes to store inside that file
-	//	save the bytes in file and mark that block's status as BLOCK_DOWNLOADED
+	//	the block is received whole and handed to the disk writers (see diskio.h), which put it at its
+	//	position in the saved file. its status becomes BLOCK_DOWNLOADED.
 	int piece_idx, block_offset, remaining;
 	remaining = len - 9; // remaining is no of bytes in this block yet to be downloaded
 	block->length = remaining;
+	if(remaining <= 0 || remaining > BLOCK_LEN)
+	{
+		bf_log("[ERROR] download_block(): PIECE message with a block of %d bytes.\n", remaining);
+		rv = RECV_ERROR;
+		goto cleanup;
+	}
 
 	rv = receive_msg_for_len(socketfd, &recvfd, 4, msg);
         if(rv != RECV_OK)
@@ -1217,29 +2908,43 @@ int download_block(int socketfd, int expected_piece_idx, FILE *savedfp, struct p
 	block->offset = block_offset;
 	bf_log("[LOG] *-*-*- Going to receive piece_idx: %d, block_offset: %d, block length: %d.\n", piece_idx, block_offset, remaining);
 
-	fseek(savedfp, (piece_idx * g_piece_length) + block_offset, SEEK_SET);
-	len = 512; //use len as buffer for following loop	
+	if(block_offset < 0 || block_offset + remaining > t->pieces[piece_idx].piece_length)
+	{
+		bf_log("[ERROR] download_block(): Block at offset %d doesn't fit in piece %d.\n", block_offset, piece_idx);
+		rv = RECV_ERROR;
+		goto cleanup;
+	}
 
-	int bytes_saved = 0;
-	while(remaining)
+	data = malloc(remaining);
+	rv = receive_msg_for_len(socketfd, &recvfd, remaining, data);
+	if(rv != RECV_OK)
 	{
-		if(remaining < len)
-		{
-			len = remaining;
-		}
+		bf_log(  "[ERROR] receive_and_process_piece_msgs(): Failed to receive block data.\n");
+		rv = RECV_ERROR;
+		goto cleanup;
+	}
+	// a hedged copy stays in memory until it is verified, see commit_hedge().
+	if(peer->hedge_data)
+	{
+		memcpy(peer->hedge_data + block_offset, data, remaining);
+		block->status = BLOCK_STATUS_DOWNLOADED;
+		goto cleanup;
+	}
+	// the other download of a piece fetched twice (see stream.h) may have completed it. its blocks
+	// are on disk and verified, so ours are dropped rather than written over them.
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->pieces_mutexes[piece_idx]);
 
-		rv = receive_msg_for_len(socketfd, &recvfd, len, msg);
-        	if(rv != RECV_OK)
-	        {
-                	bf_log(  "[ERROR] receive_and_process_piece_msgs(): Failed to receive block data. bytes_saved= %d.\n", bytes_saved);
-			rv = RECV_ERROR;
-        	        goto cleanup;
-	        }
-		
-	        fwrite(msg, 1, len, savedfp);
+	complete = t->pieces[piece_idx].status == PIECE_STATUS_COMPLETE;
 
-		remaining -= len;
-		bytes_saved += len;
+	pthread_mutex_unlock(&t->pieces_mutexes[piece_idx]);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	if(!complete)
+	{
+		// the writers own the data from now on.
+		diskio_write(t, piece_idx, piece_idx * t->piece_length + block_offset, data, remaining);
+		data = NULL;
 	}
 
 	// if here then the block must have been successfully downloaded. update the block struct.
@@ -1254,9 +2959,40 @@ cleanup:
 
 	if(temp)
 	{
-		free(temp);
+		free(temp);
+	}
+	if(data)
+	{
+		free(data);
+	}
+	return rv;
+}
+
+// returns how many of the next (up to max_requests) blocks to be downloaded can be requested now, taking
+// the tokens for them from the peer's download bucket. waits for tokens if not even one block can be requested.
+int pace_requests(struct pwp_peer *peer, struct pwp_block *blocks, int num_of_blocks, int max_requests)
+{
+	int i, count;
+
+	count = 0;
+	for(i=0; i<num_of_blocks && count<max_requests; i++)
+	{
+		if(blocks[i].status != BLOCK_STATUS_NOT_DOWNLOADED)
+		{
+			continue;
+		}
+		if(count == 0)
+		{
+			ratelimit_acquire(&peer->download_bucket, blocks[i].length, blocks[i].length);
+		}
+		else if(ratelimit_request(&peer->download_bucket, blocks[i].length, blocks[i].length) == 0)
+		{
+			break;
+		}
+		count++;
 	}
-	return rv;
+
+	return count;
 }
 
 uint8_t *prepare_requests(int piece_idx, struct pwp_block *blocks, int num_of_blocks, int max_requests, int *len)
@@ -1265,6 +3001,11 @@ uint8_t *prepare_requests(int piece_idx, struct pwp_block *blocks, int num_of_bl
 	
 	int i, count;
 	int msg_len = 17; // 17 = length of request message
+	if(max_requests <= 0)
+	{
+		*len = 0;
+		return NULL;
+	}
 	uint8_t *requests = malloc(msg_len * max_requests); 
 	uint8_t *curr;
 	// find up to max_request blocks which are not downloaded.
@@ -1316,6 +3057,7 @@ uint8_t *compose_request(int piece_idx, int block_offset, int block_length, int
 
 int process_bitfield(uint8_t *msg, struct pwp_peer *peer)
 {
+	struct pwp_torrent *t = peer->torrent;
 	bf_log("++++++++++++++++++++ START:  PROCESS_BITFIELD +++++++++++++++++++++++\n");
     uint8_t *curr = msg;
     int i, j, rv, idx;
@@ -1323,7 +3065,7 @@ int process_bitfield(uint8_t *msg, struct pwp_peer *peer)
       
     rv = 0;
     // read bitfield, parse it and populate pieces array accordingly.
-    int len = ntohl(*((int *)curr));
+    int len = ntohl(*((int *)curr)) - 1; // length prefix includes the message id
     curr += 5; // get to start of bitfield.
       
     for(i=0; i<len; i++)
@@ -1335,7 +3077,7 @@ int process_bitfield(uint8_t *msg, struct pwp_peer *peer)
             if(bits & mask)
             {
                 idx = i*8 + j;
-                if(idx >= g_num_of_pieces)
+                if(idx >= t->num_of_pieces)
                 {
                     bf_log("[ERROR] process_bitfield(): Bitfield has more bits set than there are number of pieces.\n");
                     rv = -1;
@@ -1344,16 +3086,16 @@ int process_bitfield(uint8_t *msg, struct pwp_peer *peer)
                 }
 		
 		/* -X-X-X- CRITICAL REGION START -X-X-X- */
-                pthread_mutex_lock(&g_pieces_mutexes[idx]);
+                pthread_mutex_lock(&t->pieces_mutexes[idx]);
 
-                if(g_pieces[idx].status != PIECE_STATUS_COMPLETE)
+                if(t->pieces[idx].status != PIECE_STATUS_COMPLETE)
                 {
-                    g_pieces[idx].status = PIECE_STATUS_AVAILABLE;
+                    t->pieces[idx].status = PIECE_STATUS_AVAILABLE;
 		}
-		linked_list_add(&g_pieces[idx].peers, peer);
 
-		pthread_mutex_unlock(&g_pieces_mutexes[idx]);
+		pthread_mutex_unlock(&t->pieces_mutexes[idx]);
                 /* -X-X-X- CRITICAL REGION END -X-X-X- */
+                peer->bitfield[i] |= mask;
             }
             mask = mask / 2;
         }
@@ -1364,82 +3106,451 @@ cleanup:
     return rv;
 }
   
+// the peer's DHT node may become one of ours.
+int process_port(uint8_t *msg, struct pwp_peer *peer)
+{
+	uint16_t port;
+
+	if(ntohl(*((int *)msg)) != 3 || !peer->dht)
+	{
+		return -1;
+	}
+	memcpy(&port, msg + 5, 2);
+	dht_add_node(peer->addr.ip, ntohs(port));
+
+	return 0;
+}
+
 int process_have(uint8_t *msg, struct pwp_peer *peer)
 {
+	struct pwp_torrent *t = peer->torrent;
 	bf_log("++++++++++++++++++++ START:  PROCESS_HAVE +++++++++++++++++++++++\n");
     int rv = 0;
     uint8_t *curr = msg;
-    int idx = ntohl((int)(*(curr+5)));
-      
-    if(g_pieces[idx].status != PIECE_STATUS_COMPLETE)
+    int idx = ntohl(*((int *)(curr+5)));
+
+    if(idx < 0 || idx >= t->num_of_pieces)
+    {
+        bf_log("[ERROR] process_have(): Invalid piece index %d.\n", idx);
+        rv = -1;
+        goto cleanup;
+    }
+
+    /* -X-X-X- CRITICAL REGION START -X-X-X- */
+    pthread_mutex_lock(&t->pieces_mutexes[idx]);
+
+    if(t->pieces[idx].status != PIECE_STATUS_COMPLETE)
+    {
+        if(t->pieces[idx].status == PIECE_STATUS_NOT_AVAILABLE)
+        {
+            t->pieces[idx].status = PIECE_STATUS_AVAILABLE;
+        }
+    }
+
+    pthread_mutex_unlock(&t->pieces_mutexes[idx]);
+    /* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+    if(is_super_seeding(t))
+    {
+        /* -X-X-X- CRITICAL REGION START -X-X-X- */
+        pthread_mutex_lock(&t->connected_peers_mutex);
+
+        peer->bitfield[idx / 8] |= 0x80 >> (idx % 8);
+        superseed_have(t->connected_peers, peer, idx);
+
+        pthread_mutex_unlock(&t->connected_peers_mutex);
+        /* -X-X-X- CRITICAL REGION END -X-X-X- */
+    }
+    else
     {
-        g_pieces[idx].status = PIECE_STATUS_AVAILABLE;
-        linked_list_add(&g_pieces[idx].peers, peer);
+        peer->bitfield[idx / 8] |= 0x80 >> (idx % 8);
     }
 
+cleanup:
 	bf_log("---------------------------------------- FINISH:  PROCESS_HAVE ----------------------------------------\n");
     return rv;
 } 
 
-int choose_random_piece_idx(uint8_t *peer_id)
+// marks every piece we don't have as available. unlike process_bitfield() the peer isn't added to the
+// per piece lists; can_request_piece() checks peer->has_all instead.
+int process_have_all(struct pwp_peer *peer)
+{
+	struct pwp_torrent *t = peer->torrent;
+	int i;
+
+	peer->has_all = 1;
+	for(i=0; i<t->num_of_pieces; i++)
+	{
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&t->pieces_mutexes[i]);
+
+		if(t->pieces[i].status == PIECE_STATUS_NOT_AVAILABLE)
+		{
+			t->pieces[i].status = PIECE_STATUS_AVAILABLE;
+		}
+
+		pthread_mutex_unlock(&t->pieces_mutexes[i]);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+	}
+
+	return 0;
+}
+
+int process_allowed_fast(uint8_t *msg, struct pwp_peer *peer)
+{
+	struct pwp_torrent *t = peer->torrent;
+	int idx = ntohl(*((int *)(msg + 5)));
+
+	if(idx < 0 || idx >= t->num_of_pieces)
+	{
+		bf_log("[ERROR] process_allowed_fast(): Invalid piece index %d.\n", idx);
+		return -1;
+	}
+	if(is_allowed_fast(peer, idx) || peer->num_allowed_fast >= PWP_MAX_ALLOWED_FAST)
+	{
+		return 0;
+	}
+	peer->allowed_fast[peer->num_allowed_fast++] = idx;
+	bf_log("[LOG] process_allowed_fast(): Piece %d can be downloaded while choked.\n", idx);
+
+	return 0;
+}
+
+int process_suggest(uint8_t *msg, struct pwp_peer *peer)
+{
+	struct pwp_torrent *t = peer->torrent;
+	int idx = ntohl(*((int *)(msg + 5)));
+
+	if(idx < 0 || idx >= t->num_of_pieces)
+	{
+		bf_log("[ERROR] process_suggest(): Invalid piece index %d.\n", idx);
+		return -1;
+	}
+	peer->suggested_piece = idx;
+
+	return 0;
+}
+
+int is_allowed_fast(struct pwp_peer *peer, int idx)
+{
+	int i;
+
+	for(i=0; i<peer->num_allowed_fast; i++)
+	{
+		if(peer->allowed_fast[i] == idx)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int peer_has_piece(struct pwp_peer *peer, int idx)
+{
+	return peer->has_all || (peer->bitfield[idx / 8] & (0x80 >> (idx % 8)));
+}
+
+int peer_has_all_pieces(struct pwp_peer *peer)
+{
+	struct pwp_torrent *t = peer->torrent;
+	int i;
+
+	for(i=0; i<t->num_of_pieces; i++)
+	{
+		if(!peer_has_piece(peer, i))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// returns 1 if the peer has piece idx and we may request it right now. NOTE: the caller must hold t->pieces_mutexes[idx].
+int can_request_piece(struct pwp_peer *peer, int idx)
+{
+	struct pwp_torrent *t = peer->torrent;
+	if(t->pieces[idx].status != PIECE_STATUS_AVAILABLE || !is_piece_wanted(t, idx))
+	{
+		return 0;
+	}
+	if(!peer_has_piece(peer, idx))
+	{
+		return 0;
+	}
+
+	return peer->unchoked || is_allowed_fast(peer, idx);
+}
+
+// skipped pieces, and pieces outside the range given to the sequential output or past its window
+// (see pipeout.h), aren't downloaded. call with t->pieces_mutexes[idx] locked.
+int is_piece_wanted(struct pwp_torrent *t, int idx)
+{
+	return t->pieces[idx].priority != PIECE_PRIORITY_SKIP && idx >= t->first_wanted && idx <= t->last_wanted && idx <= t->window_end;
+}
+
+// whether a piece of the range of the sequential output isn't verified yet.
+static int wanted_pieces_left(struct pwp_torrent *t)
+{
+	int i, status;
+
+	for(i = t->first_wanted; i <= t->last_wanted && i < t->num_of_pieces; i++)
+	{
+		/*-X-X-X- START OF CRITICAL REGION  -X-X-X-*/
+		pthread_mutex_lock(&t->pieces_mutexes[i]);
+
+		status = t->pieces[i].status;
+
+		pthread_mutex_unlock(&t->pieces_mutexes[i]);
+		/*-X-X-X- END OF CRITICAL REGION  -X-X-X-*/
+
+		if(status != PIECE_STATUS_COMPLETE)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// receives and processes messages until the window of the sequential output moves on or the peer
+// is quiet for a second, after which the pieces are looked at again: one another peer started may
+// have been given back. returns -1 if the connection fails.
+int wait_for_window(struct pwp_peer *peer)
+{
+	struct pwp_torrent *t = peer->torrent;
+	int rv, len, window_end = t->window_end;
+	uint8_t *recvd_msg = NULL;
+	struct timeval tv;
+	fd_set recvfd;
+
+	while(t->window_end == window_end)
+	{
+		FD_ZERO(&recvfd);
+		FD_SET(peer->socketfd, &recvfd);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if((rv = select(peer->socketfd + 1, &recvfd, NULL, NULL, &tv)) == -1)
+		{
+			return -1;
+		}
+		if(rv == 0)
+		{
+			break;
+		}
+		if(receive_msg(peer->socketfd, &recvfd, &recvd_msg, &len) != RECV_OK)
+		{
+			return -1;
+		}
+		process_msgs(recvd_msg, len, 0, peer);
+		free(recvd_msg);
+		recvd_msg = NULL;
+	}
+
+	return 0;
+}
+
+// receives and processes messages until the peer unchokes us. returns -1 if it goes quiet or the connection fails first.
+int wait_for_unchoke(struct pwp_peer *peer)
+{
+	int rv, len;
+	uint8_t *recvd_msg = NULL;
+	fd_set recvfd;
+
+	while(!peer->unchoked)
+	{
+		rv = receive_msg(peer->socketfd, &recvfd, &recvd_msg, &len);
+		if(rv != RECV_OK)
+		{
+			bf_log("[LOG] wait_for_unchoke(): Peer didn't unchoke us. rv = %d.\n", rv);
+			return -1;
+		}
+		process_msgs(recvd_msg, len, 0, peer);
+		free(recvd_msg);
+		recvd_msg = NULL;
+	}
+	bf_log("[LOG] Peer has unchoked us.\n");
+
+	return 0;
+}
+
+int choose_random_piece_idx(struct pwp_peer *peer)
 {
+	struct pwp_torrent *t = peer->torrent;
 	bf_log("++++++++++++++++++++ START:  CHOOSE_RANDOM_PIECE_IDX +++++++++++++++++++++++\n");
-    int i, r, random_piece_idx;
+    int r, priority, random_piece_idx;
       
-    random_piece_idx = -1;
     srand(time(NULL));
+
+    // pieces a streaming client waits for come before anything else (see stream.h).
+    random_piece_idx = stream_choose_piece(peer);
+
+    // a piece the peer suggested is tried next as it is likely to be in its cache.
+    r = peer->suggested_piece;
+    peer->suggested_piece = -1;
+    if(r != -1 && random_piece_idx == -1)
+    {
+	/*-X-X-X- START OF CRITICAL REGION  -X-X-X-*/
+	pthread_mutex_lock(&t->pieces_mutexes[r]);
+
+	if(can_request_piece(peer, r))
+	{
+	    random_piece_idx = r;
+	    t->pieces[r].status = PIECE_STATUS_STARTED;
+	}
+
+	pthread_mutex_unlock(&t->pieces_mutexes[r]);
+	/*-X-X-X- END OF CRITICAL REGION  -X-X-X-*/
+    }
       
-    for(i=0; i<10; i++) // 10 attempts at getting a random available piece
+    // then the pieces of the highest priority that has any left, at random.
+    for(priority = PIECE_PRIORITY_HIGH; priority > PIECE_PRIORITY_SKIP && random_piece_idx == -1; priority--)
+    {
+	if(pieces_left_at_priority(t, priority) > 0)
+	{
+	    random_piece_idx = choose_piece_at_priority(peer, priority);
+	}
+    }
+
+	bf_log("---------------------------------------- FINISH:  CHOOSE_RANDOM_PIECE_IDX  ----------------------------------------\n");
+    return random_piece_idx;
+}
+
+// chooses a piece of the given priority the peer has, at random or else the first one, and marks it
+// as started. returns -1 if there is none.
+static int choose_piece_at_priority(struct pwp_peer *peer, int priority)
+{
+    struct pwp_torrent *t = peer->torrent;
+    int i, r, random_piece_idx = -1;
+
+    for(i=0; i<10 && random_piece_idx == -1; i++) // 10 attempts at getting a random available piece
     {
-        r = rand() % g_num_of_pieces;
+        r = rand() % t->num_of_pieces;
 	/*-X-X-X- START OF CRITICAL REGION  -X-X-X-*/
 	bf_log("[LOG] choose_random_piece_idx(): Found random number. Going to lock g_piece_mutexes[%d].\n", r);
-	pthread_mutex_lock(&g_pieces_mutexes[r]);
+	pthread_mutex_lock(&t->pieces_mutexes[r]);
 	bf_log("[LOG] choose_random_piece_idx(): Successfully locked g_piece_mutexes[%d].\n", r);
 
-        if(linked_list_contains_peer_id(g_pieces[r].peers, peer_id) && (g_pieces[r].status == PIECE_STATUS_AVAILABLE))
+        if(t->pieces[r].priority == priority && can_request_piece(peer, r))
         {
             random_piece_idx = r;
-	    g_pieces[r].status = PIECE_STATUS_STARTED; // this has to be done in the same critical region as when selecting it.
+	    t->pieces[r].status = PIECE_STATUS_STARTED; // this has to be done in the same critical region as when selecting it.
 							// otherwise two threads can choose same random piece.
 	    bf_log("[LOG] choose_random_piece_idx(): Found RANDOM available piece. Going to release g_piece_mutexes[%d].\n", r);
-	    pthread_mutex_unlock(&g_pieces_mutexes[r]);
+	    pthread_mutex_unlock(&t->pieces_mutexes[r]);
             break;
         }
 
 	bf_log("[LOG] choose_random_piece_idx(): Random piece index not available. Going to release g_piece_mutexes[%d].\n", r);
-	pthread_mutex_unlock(&g_pieces_mutexes[r]);
+	pthread_mutex_unlock(&t->pieces_mutexes[r]);
 	/*-X-X-X- END OF CRITICAL REGION  -X-X-X-*/
     }
       
     // if no piece found after random attempts then go sequentially
     if(random_piece_idx == -1)
     {
-        for(i=0; i<g_num_of_pieces; i++)
+        for(i=0; i<t->num_of_pieces; i++)
         {
 	    /*-X-X-X- START OF CRITICAL REGION  -X-X-X-*/
 	    bf_log("[LOG] choose_random_piece_idx(): Sequential search. Going to lock g_piece_mutexes[%d].\n", i);
-            pthread_mutex_lock(&g_pieces_mutexes[i]);
+            pthread_mutex_lock(&t->pieces_mutexes[i]);
          
-	   if(linked_list_contains_peer_id(g_pieces[i].peers, peer_id) && (g_pieces[i].status == PIECE_STATUS_AVAILABLE))
+	   if(t->pieces[i].priority == priority && can_request_piece(peer, i))
            {
                 random_piece_idx = i;
-		g_pieces[i].status = PIECE_STATUS_STARTED; // this has to be done in the same critical region as when selecting it.
+		t->pieces[i].status = PIECE_STATUS_STARTED; // this has to be done in the same critical region as when selecting it.
                                                         // otherwise two threads can choose same random piece.
 		bf_log("[LOG] choose_random_piece_idx(): Found sequential available piece index. Going to release g_piece_mutexes[%d].\n", i);
-		pthread_mutex_unlock(&g_pieces_mutexes[i]);
+		pthread_mutex_unlock(&t->pieces_mutexes[i]);
                 break;
            }
 	   bf_log("[LOG] choose_random_piece_idx(): Sequential piece index is not available. Going to release g_piece_mutexes[%d].\n", i);
-	   pthread_mutex_unlock(&g_pieces_mutexes[i]);
+	   pthread_mutex_unlock(&t->pieces_mutexes[i]);
            /*-X-X-X- END OF CRITICAL REGION  -X-X-X-*/
         }
     }
-      
-	bf_log("---------------------------------------- FINISH:  CHOOSE_RANDOM_PIECE_IDX  ----------------------------------------\n");
+
     return random_piece_idx;
 }
 
+static long int pieces_left_at_priority(struct pwp_torrent *t, int priority)
+{
+	long int left;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->priorities_mutex);
+
+	left = t->pieces_left[priority];
+
+	pthread_mutex_unlock(&t->priorities_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return left;
+}
+
+// chooses the next piece for a web seed, in order, marking it as started. pieces none of the connected
+// peers has come first. the rest are only chosen if thin_swarm is set. returns -1 if there is none.
+int choose_webseed_piece_idx(struct pwp_torrent *t, int thin_swarm)
+{
+	struct pwp_peer_node *node;
+	int i, pass, idx = -1;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->connected_peers_mutex);
+
+	for(pass = 0; pass < (thin_swarm ? 2 : 1) && idx == -1; pass++)
+	{
+		for(i = 0; i < t->num_of_pieces && idx == -1; i++)
+		{
+			if(pass == 0)
+			{
+				for(node = t->connected_peers; node && !peer_has_piece(node->peer, i); node = node->next);
+				if(node)
+				{
+					continue;
+				}
+			}
+
+			/*-X-X-X- START OF CRITICAL REGION  -X-X-X-*/
+			pthread_mutex_lock(&t->pieces_mutexes[i]);
+
+			if(t->pieces[i].status == PIECE_STATUS_AVAILABLE && is_piece_wanted(t, i))
+			{
+				t->pieces[i].status = PIECE_STATUS_STARTED;
+				idx = i;
+			}
+
+			pthread_mutex_unlock(&t->pieces_mutexes[i]);
+			/*-X-X-X- END OF CRITICAL REGION  -X-X-X-*/
+		}
+	}
+
+	pthread_mutex_unlock(&t->connected_peers_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return idx;
+}
+
+int num_of_connected_peers(struct pwp_torrent *t)
+{
+	struct pwp_peer_node *node;
+	int n = 0;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->connected_peers_mutex);
+
+	for(node = t->connected_peers; node; node = node->next)
+	{
+		n++;
+	}
+
+	pthread_mutex_unlock(&t->connected_peers_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return n;
+}
+
 int are_same_peers(uint8_t *peer_id1, uint8_t *peer_id2)
 {
 //	bf_log("++++++++++++++++++++ START:  ARE_SAME_PEERS +++++++++++++++++++++++\n");
@@ -1525,9 +3636,37 @@ void linked_list_free(struct pwp_peer_node **head)
 //        bf_log("---------------------------------------- FINISH:  LINKED_LIST_FREE ----------------------------------------\n");
 }
 
+// removes the node pointing to 'peer' if there is one.
+void linked_list_remove(struct pwp_peer_node **head, struct pwp_peer *peer)
+{
+	struct pwp_peer_node *curr, *prev;
+
+	prev = NULL;
+	for(curr = *head; curr; prev = curr, curr = curr->next)
+	{
+		if(curr->peer == peer)
+		{
+			if(prev)
+			{
+				prev->next = curr->next;
+			}
+			else
+			{
+				*head = curr->next;
+			}
+			free(curr);
+			return;
+		}
+	}
+}
+
 // NOTE: this method is not thread-safe. only call this in a single thread.
-int initialise_pieces(struct pwp_piece *pieces, long int total_length, long int num_of_pieces, long int piece_length, const char *path_to_resume_file)
+int initialise_pieces(struct pwp_torrent *t)
 {
+	struct pwp_piece *pieces = t->pieces;
+	long int num_of_pieces = t->num_of_pieces;
+	long int piece_length = t->piece_length;
+	const char *path_to_resume_file = t->resume_filepath;
 	int rv = 0;
 	int i, j;
 	uint8_t mask;
@@ -1541,17 +3680,20 @@ int initialise_pieces(struct pwp_piece *pieces, long int total_length, long int
 		goto cleanup;
 	}
 
-	for(i = 0; i < resume_len; i++)
+	// the bitfield comes first. the piece priorities after it are missing from older resume files.
+	for(i = 0; i < resume_len && i < t->have_bitfield_len; i++)
 	{
-		for(j = 0; j < 8; j++)
+		// the extra bits in the last byte don't correspond to any piece.
+		for(j = 0; j < 8 && i*8 + j < num_of_pieces; j++)
 		{
 			mask = 0x80 >> j;
 			if(resume_data[i] & mask)
 			{
-				// NOTE that no mutexes are used here because this method is called from pwp_start()
-				// method which is always called in a single thread.
+				// NOTE that no mutexes are used here because this method is called from pwp_torrent_create()
+				// before anyone else knows about the torrent.
 				pieces[i*8 + j].status = PIECE_STATUS_COMPLETE;
-				g_downloaded_pieces++;
+				t->have_bitfield[i] |= mask;
+				t->downloaded_pieces++;
 			}
 			else
 			{
@@ -1562,7 +3704,20 @@ int initialise_pieces(struct pwp_piece *pieces, long int total_length, long int
 	}
 
 	// length of last piece will be different from the rest of the pieces.
-	pieces[num_of_pieces - 1].piece_length = total_length % piece_length;
+	pieces[num_of_pieces - 1].piece_length = t->total_length - (num_of_pieces - 1) * piece_length;
+
+	for(i = 0; i < num_of_pieces; i++)
+	{
+		pieces[i].priority = PIECE_PRIORITY_NORMAL;
+		if(resume_len >= t->have_bitfield_len + num_of_pieces && resume_data[t->have_bitfield_len + i] <= PIECE_PRIORITY_HIGH)
+		{
+			pieces[i].priority = resume_data[t->have_bitfield_len + i];
+		}
+		if(pieces[i].status != PIECE_STATUS_COMPLETE)
+		{
+			t->pieces_left[pieces[i].priority]++;
+		}
+	}
 
 cleanup:
 	if(resume_data)
@@ -1573,24 +3728,60 @@ cleanup:
 	return rv;
 }
 
-int update_resume_file(const char *path_to_resume_file, int downloaded_piece_index)
+// writes the priorities of all pieces to the resume file, after the bitfield.
+static int save_piece_priorities(struct pwp_torrent *t)
+{
+	uint8_t *priorities;
+	FILE *resumefp;
+	int i, rv = 0;
+
+	priorities = malloc(t->num_of_pieces);
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->priorities_mutex);
+
+	for(i = 0; i < t->num_of_pieces; i++)
+	{
+		priorities[i] = t->pieces[i].priority;
+	}
+	if((resumefp = fopen(t->resume_filepath, "r+")) == NULL || fseek(resumefp, t->have_bitfield_len, SEEK_SET) != 0
+		|| fwrite(priorities, 1, t->num_of_pieces, resumefp) != (size_t)t->num_of_pieces)
+	{
+		bf_log("[ERROR] save_piece_priorities(): Failed to write the piece priorities to '%s'.\n", t->resume_filepath);
+		rv = -1;
+	}
+	if(resumefp)
+	{
+		fclose(resumefp);
+	}
+
+	pthread_mutex_unlock(&t->priorities_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	free(priorities);
+
+	return rv;
+}
+
+int update_resume_file(struct pwp_torrent *t, int downloaded_piece_index)
 {
+	const char *path_to_resume_file = t->resume_filepath;
 	int rv = 0;
 	int byte_index = downloaded_piece_index / 8;
 	uint8_t resume_byte;
 	uint8_t mask;
 
 	/*-X-X-X- START OF CRITICAL REGION  -X-X-X-*/
-        bf_log("[LOG] update_resume_file(): Going to lock g_resume_mutexes[%d].\n", byte_index);
-        pthread_mutex_lock(&g_resume_mutexes[byte_index]);
-        bf_log("[LOG] update_resume_file(): Successfully locked g_resume_mutexes[%d].\n", byte_index);
+        bf_log("[LOG] update_resume_file(): Going to lock t->resume_mutexes[%d].\n", byte_index);
+        pthread_mutex_lock(&t->resume_mutexes[byte_index]);
+        bf_log("[LOG] update_resume_file(): Successfully locked t->resume_mutexes[%d].\n", byte_index);
 
 	if(util_read_file_chunk(path_to_resume_file, byte_index, 1, &resume_byte) == -1)
 	{
-		// free the corresponding g_resume_mutexes here	
-		pthread_mutex_unlock(&g_resume_mutexes[byte_index]);	
+		// free the corresponding t->resume_mutexes here	
+		pthread_mutex_unlock(&t->resume_mutexes[byte_index]);	
 		rv = -1;
-		bf_log("[ERROR] update_resume_file(): Failed to read the correct byte from the resume file '%s'. Released g_resume_mutexes[%d].\n", path_to_resume_file, byte_index);
+		bf_log("[ERROR] update_resume_file(): Failed to read the correct byte from the resume file '%s'. Released t->resume_mutexes[%d].\n", path_to_resume_file, byte_index);
 		goto cleanup;
 	}
 	mask = 0x80 >> (downloaded_piece_index % 8);
@@ -1602,8 +3793,8 @@ int update_resume_file(const char *path_to_resume_file, int downloaded_piece_ind
 	fclose(resumefp);
 	resumefp = NULL;
 
-	bf_log("[LOG] Going to release g_resume_mutexes[%d].\n", byte_index);
-	pthread_mutex_unlock(&g_resume_mutexes[byte_index]);
+	bf_log("[LOG] Going to release t->resume_mutexes[%d].\n", byte_index);
+	pthread_mutex_unlock(&t->resume_mutexes[byte_index]);
 
 cleanup:
 	if(resumefp)
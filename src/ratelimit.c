@@ -0,0 +1,242 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<time.h>
+#include<pthread.h>
+
+#include "ratelimit.h"
+
+#include "bf_logger.h"
+
+#define MAX_DEPTH 8
+#define MAX_WAIT_MS 1000 // waiters re-check at least this often
+
+struct rate_bucket g_global_download_bucket = { RATELIMIT_UNLIMITED, 0, 0, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+struct rate_bucket g_global_upload_bucket = { RATELIMIT_UNLIMITED, 0, 0, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+
+// waiters in ratelimit_acquire() are woken up whenever a rate changes.
+pthread_mutex_t g_ratelimit_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_ratelimit_wait_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t monotonic_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long int burst_for_rate(long int rate)
+{
+	return rate > RATELIMIT_MIN_BURST ? rate : RATELIMIT_MIN_BURST;
+}
+
+// NOTE: must be called with b->mutex held.
+static void refill(struct rate_bucket *b, uint64_t now)
+{
+	if(b->rate == RATELIMIT_UNLIMITED)
+	{
+		b->last_refill_ms = now;
+		return;
+	}
+	if(now > b->last_refill_ms)
+	{
+		b->tokens += (double)b->rate * (now - b->last_refill_ms) / 1000;
+		b->last_refill_ms = now;
+	}
+	if(b->tokens > b->burst)
+	{
+		b->tokens = b->burst;
+	}
+}
+
+// locks the buckets from b up to the root (always in that order) and returns how many were locked.
+static int lock_chain(struct rate_bucket *b, struct rate_bucket **chain)
+{
+	int depth = 0;
+	uint64_t now = monotonic_ms();
+
+	while(b && depth < MAX_DEPTH)
+	{
+		pthread_mutex_lock(&b->mutex);
+		refill(b, now);
+		chain[depth++] = b;
+		b = b->parent;
+	}
+
+	return depth;
+}
+
+static void unlock_chain(struct rate_bucket **chain, int depth)
+{
+	while(depth--)
+	{
+		pthread_mutex_unlock(&chain[depth]->mutex);
+	}
+}
+
+void ratelimit_init(struct rate_bucket *b, long int rate, struct rate_bucket *parent)
+{
+	b->rate = rate;
+	b->burst = burst_for_rate(rate);
+	b->tokens = b->burst;
+	b->last_refill_ms = monotonic_ms();
+	b->used = 0;
+	b->parent = parent;
+	pthread_mutex_init(&b->mutex, NULL);
+}
+
+void ratelimit_destroy(struct rate_bucket *b)
+{
+	pthread_mutex_destroy(&b->mutex);
+}
+
+void ratelimit_set_rate(struct rate_bucket *b, long int rate)
+{
+	pthread_mutex_lock(&b->mutex);
+
+	refill(b, monotonic_ms());
+	b->rate = rate;
+	b->burst = burst_for_rate(rate);
+	if(b->tokens > b->burst)
+	{
+		b->tokens = b->burst;
+	}
+
+	pthread_mutex_unlock(&b->mutex);
+
+	bf_log("[LOG] ratelimit_set_rate(): Rate set to %ld bytes/s.\n", rate);
+
+	pthread_mutex_lock(&g_ratelimit_wait_mutex);
+	pthread_cond_broadcast(&g_ratelimit_wait_cond);
+	pthread_mutex_unlock(&g_ratelimit_wait_mutex);
+}
+
+long int ratelimit_get_rate(struct rate_bucket *b)
+{
+	long int rate;
+
+	pthread_mutex_lock(&b->mutex);
+	rate = b->rate;
+	pthread_mutex_unlock(&b->mutex);
+
+	return rate;
+}
+
+uint64_t ratelimit_get_used(struct rate_bucket *b)
+{
+	uint64_t used;
+
+	pthread_mutex_lock(&b->mutex);
+	used = b->used;
+	pthread_mutex_unlock(&b->mutex);
+
+	return used;
+}
+
+long int ratelimit_request(struct rate_bucket *b, long int bytes, long int min_bytes)
+{
+	struct rate_bucket *chain[MAX_DEPTH];
+	int depth, i;
+	long int granted = bytes;
+
+	depth = lock_chain(b, chain);
+
+	for(i = 0; i < depth; i++)
+	{
+		if(chain[i]->rate == RATELIMIT_UNLIMITED)
+		{
+			continue;
+		}
+		if(chain[i]->tokens < granted)
+		{
+			granted = chain[i]->tokens > 0 ? (long int)chain[i]->tokens : 0;
+		}
+		// a request bigger than the burst could never be satisfied
+		if(min_bytes > chain[i]->burst)
+		{
+			min_bytes = chain[i]->burst;
+		}
+	}
+
+	if(granted < min_bytes || granted == 0)
+	{
+		granted = 0;
+	}
+	else
+	{
+		for(i = 0; i < depth; i++)
+		{
+			if(chain[i]->rate != RATELIMIT_UNLIMITED)
+			{
+				chain[i]->tokens -= granted;
+			}
+			chain[i]->used += granted;
+		}
+	}
+
+	unlock_chain(chain, depth);
+
+	return granted;
+}
+
+long int ratelimit_delay_ms(struct rate_bucket *b, long int bytes)
+{
+	struct rate_bucket *chain[MAX_DEPTH];
+	int depth, i;
+	long int delay = 0, d, needed;
+
+	depth = lock_chain(b, chain);
+
+	for(i = 0; i < depth; i++)
+	{
+		if(chain[i]->rate == RATELIMIT_UNLIMITED)
+		{
+			continue;
+		}
+		needed = bytes < chain[i]->burst ? bytes : chain[i]->burst;
+		if(chain[i]->tokens < needed)
+		{
+			d = (long int)((needed - chain[i]->tokens) * 1000 / chain[i]->rate) + 1;
+			if(d > delay)
+			{
+				delay = d;
+			}
+		}
+	}
+
+	unlock_chain(chain, depth);
+
+	return delay;
+}
+
+long int ratelimit_acquire(struct rate_bucket *b, long int bytes, long int min_bytes)
+{
+	long int granted, delay;
+	struct timespec ts;
+
+	while((granted = ratelimit_request(b, bytes, min_bytes)) == 0)
+	{
+		delay = ratelimit_delay_ms(b, min_bytes);
+		if(delay > MAX_WAIT_MS)
+		{
+			delay = MAX_WAIT_MS;
+		}
+		if(delay < 1)
+		{
+			delay = 1;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += delay * 1000000;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec = ts.tv_nsec % 1000000000;
+
+		pthread_mutex_lock(&g_ratelimit_wait_mutex);
+		pthread_cond_timedwait(&g_ratelimit_wait_cond, &g_ratelimit_wait_mutex, &ts);
+		pthread_mutex_unlock(&g_ratelimit_wait_mutex);
+	}
+
+	return granted;
+}
@@ -0,0 +1,895 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<errno.h>
+#include<limits.h>
+#include<time.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<signal.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<sys/time.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+
+#include "session.h"
+
+#include "pwp.h"
+#include "timer.h"
+#include "peer_pool.h"
+#include "diskio.h"
+#include "fairshare.h"
+#include "conntune.h"
+#include "webseed.h"
+#include "utp.h"
+#include "lsd.h"
+#include "dht.h"
+#include "socktune.h"
+#include "blocklist.h"
+#include "util.h"
+#include "bf_logger.h"
+
+#define LISTEN_BACKLOG 16
+
+// an outbound peer thread. the slot is free if it isn't used.
+struct session_slot
+{
+	int used;
+	int finished; // set by the thread when talk_to_peer() has returned
+	pthread_t thread;
+	struct talk_to_peer_args args;
+};
+
+struct inbound_args
+{
+	int socketfd;
+	char ip[INET6_ADDRSTRLEN];
+};
+
+// a torrent whose state session_run() looks at without holding the session lock.
+struct session_check
+{
+	struct pwp_torrent *torrent;
+	int num_of_threads;
+};
+
+// all protocol timeouts and periodic events are driven by this wheel rather than by select() timeouts.
+struct timer_wheel g_timer_wheel;
+
+// the torrents and the outbound threads. g_session_cond is signalled when a thread, outbound or
+// inbound, finishes and when a torrent's users go down.
+static struct pwp_torrent *g_session_torrents = NULL;
+static struct session_slot g_session_slots[SESSION_MAX_THREADS];
+static pthread_mutex_t g_session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_session_cond = PTHREAD_COND_INITIALIZER;
+
+// inbound connections: the listener thread and the number of threads serving accepted peers.
+static pthread_t g_listener_thread;
+static volatile int g_stop_listening = 0;
+static int g_inbound_count = 0;
+static pthread_mutex_t g_inbound_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// set by session_shutdown(), possibly from a signal handler.
+static volatile sig_atomic_t g_session_shutdown = 0;
+
+static int g_timer_wheel_started = 0;
+static int g_diskio_started = 0;
+static int g_listener_started = 0;
+static int g_utp_started = 0;
+static int g_lsd_started = 0;
+static int g_dht_started = 0;
+
+static void *listen_for_peers(void *arg);
+static int start_inbound_peer(int socketfd, const char *ip);
+static void *inbound_thread(void *arg);
+static void utp_accepted(int fd, const char *ip, void *arg);
+static void *peer_thread(void *arg);
+static void join_slots(int wait);
+static void end_peer_threads(int inbound);
+static void start_peer_threads();
+static int can_take_slot(struct pwp_torrent *t);
+static long int elapsed_ms(struct timespec *since);
+static void disconnect_peers(struct pwp_torrent *t);
+static void drain_torrent(struct pwp_torrent *t);
+
+int session_start()
+{
+	g_session_shutdown = 0;
+	if(timer_wheel_init(&g_timer_wheel, TIMER_TICK_MS) != 0 || timer_wheel_start(&g_timer_wheel) != 0)
+	{
+		bf_log("[ERROR] session_start(): Failed to start the timer wheel. Aborting.\n");
+		return -1;
+	}
+	g_timer_wheel_started = 1;
+
+	if(diskio_start() != 0)
+	{
+		session_stop();
+		return -1;
+	}
+	g_diskio_started = 1;
+
+	g_stop_listening = 0;
+	if(pthread_create(&g_listener_thread, NULL, listen_for_peers, NULL) != 0)
+	{
+		bf_log("[ERROR] session_start(): Failed to start the listener thread. Only outbound connections will be made.\n");
+	}
+	else
+	{
+		g_listener_started = 1;
+	}
+	if(g_utp_enabled)
+	{
+		if(utp_init(PWP_LISTEN_PORT, utp_accepted, NULL) != 0)
+		{
+			bf_log("[ERROR] session_start(): Failed to start uTP. Only TCP connections will be made.\n");
+		}
+		else
+		{
+			g_utp_started = 1;
+		}
+	}
+	if(g_lsd_enabled)
+	{
+		if(lsd_start(PWP_LISTEN_PORT) != 0)
+		{
+			bf_log("[ERROR] session_start(): Failed to start local service discovery.\n");
+		}
+		else
+		{
+			g_lsd_started = 1;
+		}
+	}
+	if(g_dht_enabled)
+	{
+		if(dht_start(DHT_PORT, PWP_LISTEN_PORT) != 0)
+		{
+			bf_log("[ERROR] session_start(): Failed to start the DHT node.\n");
+		}
+		else
+		{
+			g_dht_started = 1;
+		}
+	}
+
+	return 0;
+}
+
+void session_add_torrent(struct pwp_torrent *t)
+{
+	struct pwp_torrent **curr;
+
+	t->num_of_threads = 0;
+	t->users = 0;
+	t->finished = 0;
+	t->paused = 0;
+	t->next = NULL;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_session_mutex);
+
+	for(curr = &g_session_torrents; *curr; curr = &(*curr)->next);
+	*curr = t;
+	pthread_cond_broadcast(&g_session_cond);
+
+	pthread_mutex_unlock(&g_session_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	// the torrent of a magnet link has nothing to download or seed until its metadata is in.
+	if(t->num_of_pieces > 0)
+	{
+		pwp_torrent_start(t);
+	}
+	if(g_lsd_started)
+	{
+		lsd_add_torrent(t->info_hash);
+	}
+	if(g_dht_started)
+	{
+		dht_add_torrent(t->info_hash);
+	}
+}
+
+void session_remove_torrent(struct pwp_torrent *t)
+{
+	struct pwp_torrent **curr;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_session_mutex);
+
+	for(curr = &g_session_torrents; *curr && *curr != t; curr = &(*curr)->next);
+	if(*curr)
+	{
+		*curr = t->next;
+	}
+	t->next = NULL;
+	t->finished = 1;
+
+	pthread_mutex_unlock(&g_session_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	if(g_lsd_started)
+	{
+		lsd_remove_torrent(t->info_hash);
+	}
+	if(g_dht_started)
+	{
+		dht_remove_torrent(t->info_hash);
+	}
+
+	drain_torrent(t);
+	pwp_torrent_stop(t);
+	diskio_wait(t);
+}
+
+void session_pause_torrent(struct pwp_torrent *t)
+{
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_session_mutex);
+
+	t->paused = 1;
+
+	pthread_mutex_unlock(&g_session_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	// session_find_torrent() hands it out no more, so once its threads are gone nothing touches it.
+	drain_torrent(t);
+	pwp_torrent_stop(t);
+	bf_log("[LOG] session_pause_torrent(): Paused %s.\n", t->saved_filepath);
+}
+
+void session_resume_torrent(struct pwp_torrent *t)
+{
+	// the peers dropped by the pause are tried again.
+	peer_pool_retry_all(&t->peer_pool);
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_session_mutex);
+
+	t->paused = 0;
+	t->finished = 0;
+	pthread_cond_broadcast(&g_session_cond);
+
+	pthread_mutex_unlock(&g_session_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	if(t->num_of_pieces > 0)
+	{
+		pwp_torrent_start(t);
+	}
+	bf_log("[LOG] session_resume_torrent(): Resumed %s.\n", t->saved_filepath);
+}
+
+int session_torrent_state(struct pwp_torrent *t, int *num_of_threads)
+{
+	int state;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_session_mutex);
+
+	state = t->paused ? SESSION_TORRENT_PAUSED : (t->finished ? SESSION_TORRENT_FINISHED : SESSION_TORRENT_ACTIVE);
+	*num_of_threads = t->num_of_threads;
+
+	pthread_mutex_unlock(&g_session_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return state;
+}
+
+int session_list_torrents(struct pwp_torrent ***torrents)
+{
+	struct pwp_torrent *t;
+	int n;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_session_mutex);
+
+	for(n = 0, t = g_session_torrents; t; t = t->next, n++);
+	*torrents = malloc(sizeof(struct pwp_torrent *) * (n + 1));
+	for(n = 0, t = g_session_torrents; t; t = t->next, n++)
+	{
+		t->users++;
+		(*torrents)[n] = t;
+	}
+
+	pthread_mutex_unlock(&g_session_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return n;
+}
+
+void session_shutdown()
+{
+	g_session_shutdown = 1;
+}
+
+struct pwp_torrent *session_find_torrent(const uint8_t *info_hash)
+{
+	struct pwp_torrent *t;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_session_mutex);
+
+	for(t = g_session_torrents; t && memcmp(t->info_hash, info_hash, 20) != 0; t = t->next);
+	if(t && t->paused)
+	{
+		t = NULL;
+	}
+	if(t)
+	{
+		t->users++;
+	}
+
+	pthread_mutex_unlock(&g_session_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return t;
+}
+
+void session_release_torrent(struct pwp_torrent *t)
+{
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_session_mutex);
+
+	t->users--;
+	pthread_cond_broadcast(&g_session_cond);
+
+	pthread_mutex_unlock(&g_session_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+int session_add_peer(const uint8_t *info_hash, const char *ip, uint16_t port, int priority)
+{
+	struct pwp_torrent *t;
+	int rv = 0;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_session_mutex);
+
+	for(t = g_session_torrents; t && memcmp(t->info_hash, info_hash, 20) != 0; t = t->next);
+	if(t)
+	{
+		rv = peer_pool_add(&t->peer_pool, ip, port, priority);
+	}
+
+	pthread_mutex_unlock(&g_session_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return rv;
+}
+
+int session_run(int keep_running)
+{
+	bf_log("++++++++++++++++++++ START:  SESSION_RUN +++++++++++++++++++++++\n");
+
+// NOTE: throughout this application one thread talks to one peer only.
+
+	struct session_check *checks = NULL;
+	struct pwp_torrent *t;
+	struct timespec ts, last_rebalance;
+	int i, n, unfinished;
+
+	clock_gettime(CLOCK_MONOTONIC, &last_rebalance);
+
+	while(1)
+	{
+		join_slots(0);
+
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_session_mutex);
+
+		start_peer_threads();
+		if(elapsed_ms(&last_rebalance) >= FAIRSHARE_INTERVAL_MS)
+		{
+			fairshare_rebalance(g_session_torrents, elapsed_ms(&last_rebalance));
+			for(t = g_session_torrents; t; t = t->next)
+			{
+				if(!t->finished && !t->paused)
+				{
+					conntune_update(t, elapsed_ms(&last_rebalance));
+				}
+			}
+			clock_gettime(CLOCK_MONOTONIC, &last_rebalance);
+		}
+		for(n = 0, t = g_session_torrents; t; t = t->next, n++);
+		checks = realloc(checks, sizeof(struct session_check) * (n + 1));
+		n = 0;
+		for(t = g_session_torrents; t; t = t->next)
+		{
+			if(!t->finished && !t->paused && t->num_of_pieces > 0)
+			{
+				t->users++;
+				checks[n].torrent = t;
+				checks[n].num_of_threads = t->num_of_threads;
+				n++;
+			}
+		}
+
+		pthread_mutex_unlock(&g_session_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		// this is done without the session lock: the DHT calls session_add_peer() with its own lock held.
+		unfinished = 0;
+		for(i = 0; i < n; i++)
+		{
+			t = checks[i].torrent;
+			if(is_wanted_download_complete(t))
+			{
+				bf_log("[LOG] session_run(): Downloaded all the pieces wanted of %s.\n", t->saved_filepath);
+			}
+			// a daemon waits for peers to turn up, e.g. from LSD or the DHT, for as long as it runs.
+			else if(!keep_running && checks[i].num_of_threads == 0 && !webseed_running(t) && !dht_searching(t->info_hash))
+			{
+				bf_log("[LOG] session_run(): Ran out of peers before downloading all the pieces of %s.\n", t->saved_filepath);
+			}
+			else
+			{
+				unfinished++;
+				session_release_torrent(t);
+				continue;
+			}
+
+			/* -X-X-X- CRITICAL REGION START -X-X-X- */
+			pthread_mutex_lock(&g_session_mutex);
+
+			t->finished = 1;
+			t->users--;
+			pthread_cond_broadcast(&g_session_cond);
+
+			pthread_mutex_unlock(&g_session_mutex);
+			/* -X-X-X- CRITICAL REGION END -X-X-X- */
+		}
+		if((unfinished == 0 && !keep_running) || g_session_shutdown)
+		{
+			break;
+		}
+
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_session_mutex);
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&g_session_cond, &g_session_mutex, &ts);
+
+		pthread_mutex_unlock(&g_session_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+	}
+	free(checks);
+
+	bf_log("[LOG] session_run(): Every torrent is finished or the session was shut down. Going to join all threads.\n");
+	// peer threads serving leechers don't end by themselves.
+	end_peer_threads(0);
+
+	bf_log(" ------------------------------------ FINISH: SESSION_RUN  ----------------------------------------\n");
+	return 0;
+}
+
+// waits until no thread uses the torrent. NOTE: no new threads may be started for it, i.e. it must
+// be paused, finished or out of the session.
+static void drain_torrent(struct pwp_torrent *t)
+{
+	struct timespec ts;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_session_mutex);
+
+	while(t->users > 0 || t->num_of_threads > 0)
+	{
+		pthread_mutex_unlock(&g_session_mutex);
+
+		// peers that were still connecting the last time round are shut down now.
+		disconnect_peers(t);
+
+		pthread_mutex_lock(&g_session_mutex);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&g_session_cond, &g_session_mutex, &ts);
+	}
+
+	pthread_mutex_unlock(&g_session_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+// shuts down the sockets of the torrent's connected peers, which ends their threads.
+static void disconnect_peers(struct pwp_torrent *t)
+{
+	struct pwp_peer_node *node;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->connected_peers_mutex);
+
+	for(node = t->connected_peers; node; node = node->next)
+	{
+		shutdown(node->peer->socketfd, SHUT_RDWR);
+	}
+
+	pthread_mutex_unlock(&t->connected_peers_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+static long int elapsed_ms(struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// NOTE: must be called with g_session_mutex held.
+static int can_take_slot(struct pwp_torrent *t)
+{
+	return !t->finished && !t->paused && t->num_of_pieces > 0 && !t->share.slot_blocked && t->num_of_threads < fairshare_max_threads(t);
+}
+
+// hands the free slots out to the torrents by deficit round robin (see fairshare.h).
+// NOTE: must be called with g_session_mutex held.
+static void start_peer_threads()
+{
+	struct session_slot *slot;
+	struct pwp_torrent *t;
+	struct peer_addr addr;
+	int slot_idx = 0, priority = INT_MIN, found, started;
+
+	for(t = g_session_torrents; t; t = t->next)
+	{
+		t->share.slot_blocked = 0;
+	}
+	while(1)
+	{
+		for(; slot_idx < SESSION_MAX_THREADS && g_session_slots[slot_idx].used; slot_idx++);
+		if(slot_idx == SESSION_MAX_THREADS)
+		{
+			break;
+		}
+		// torrents of a lower priority only get the slots the higher ones can't use.
+		found = 0;
+		for(t = g_session_torrents; t; t = t->next)
+		{
+			if(can_take_slot(t) && (!found || t->share.priority > priority))
+			{
+				priority = t->share.priority;
+				found = 1;
+			}
+		}
+		if(!found)
+		{
+			break;
+		}
+
+		started = 0;
+		for(t = g_session_torrents; t; t = t->next)
+		{
+			if(t->share.priority != priority || !can_take_slot(t))
+			{
+				continue;
+			}
+			t->share.slot_credits += t->share.weight;
+			while(t->share.slot_credits > 0 && can_take_slot(t))
+			{
+				for(; slot_idx < SESSION_MAX_THREADS && g_session_slots[slot_idx].used; slot_idx++);
+				if(slot_idx == SESSION_MAX_THREADS)
+				{
+					// what is left of the credits is kept for the next round.
+					return;
+				}
+				if(peer_pool_next(&t->peer_pool, &addr) != 0)
+				{
+					t->share.slot_blocked = 1;
+					break;
+				}
+				slot = &g_session_slots[slot_idx];
+				slot->args.torrent = t;
+				slot->args.ip = strdup(addr.ip);
+				slot->args.port = addr.port;
+				slot->finished = 0;
+				if(pthread_create(&slot->thread, NULL, peer_thread, (void *)slot) != 0)
+				{
+					free(slot->args.ip);
+					t->share.slot_blocked = 1;
+					break;
+				}
+				slot->used = 1;
+				t->num_of_threads++;
+				t->share.slot_credits--;
+				started++;
+				bf_log("[LOG] session_run(): Started a thread for peer %s:%d.\n", addr.ip, addr.port);
+			}
+			// a torrent that can't use its credits now doesn't save them up.
+			if(!can_take_slot(t))
+			{
+				t->share.slot_credits = 0;
+			}
+		}
+		if(!started)
+		{
+			break;
+		}
+	}
+}
+
+// shuts down the connections of the peers of every torrent until the outbound threads and, if
+// inbound is set, the inbound ones have ended, then joins the outbound threads. peers still
+// connecting or handshaking aren't in the lists yet, so the sockets are shut down again every
+// second until their threads are gone.
+static void end_peer_threads(int inbound)
+{
+	struct pwp_torrent *t;
+	struct timespec ts;
+	int i, busy;
+
+	while(1)
+	{
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_session_mutex);
+
+		for(t = g_session_torrents; t; t = t->next)
+		{
+			disconnect_peers(t);
+		}
+		busy = 0;
+		for(i = 0; i < SESSION_MAX_THREADS; i++)
+		{
+			busy |= g_session_slots[i].used && !g_session_slots[i].finished;
+		}
+
+		pthread_mutex_unlock(&g_session_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		if(inbound)
+		{
+			/* -X-X-X- CRITICAL REGION START -X-X-X- */
+			pthread_mutex_lock(&g_inbound_mutex);
+
+			busy |= g_inbound_count > 0;
+
+			pthread_mutex_unlock(&g_inbound_mutex);
+			/* -X-X-X- CRITICAL REGION END -X-X-X- */
+		}
+		if(!busy)
+		{
+			break;
+		}
+
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_session_mutex);
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&g_session_cond, &g_session_mutex, &ts);
+
+		pthread_mutex_unlock(&g_session_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+	}
+	join_slots(1);
+}
+
+// joins the outbound threads that have finished or, if wait is set, all of them.
+static void join_slots(int wait)
+{
+	struct session_slot *slot;
+	int i;
+
+	for(i = 0; i < SESSION_MAX_THREADS; i++)
+	{
+		slot = &g_session_slots[i];
+
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_session_mutex);
+
+		if(!slot->used || (!slot->finished && !wait))
+		{
+			pthread_mutex_unlock(&g_session_mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&g_session_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		pthread_join(slot->thread, NULL);
+		bf_log("[LOG] session_run(): >>> Thread Completed <<< for peer %s:%d.\n", slot->args.ip, slot->args.port);
+		free(slot->args.ip);
+
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_session_mutex);
+
+		slot->args.torrent->num_of_threads--;
+		slot->used = 0;
+		pthread_cond_broadcast(&g_session_cond);
+
+		pthread_mutex_unlock(&g_session_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+	}
+}
+
+static void *peer_thread(void *arg)
+{
+	struct session_slot *slot = (struct session_slot *)arg;
+
+	talk_to_peer((void *)&slot->args);
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_session_mutex);
+
+	slot->finished = 1;
+	pthread_cond_broadcast(&g_session_cond);
+
+	pthread_mutex_unlock(&g_session_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return NULL;
+}
+
+void session_stop()
+{
+	if(g_listener_started)
+	{
+		bf_log("[LOG] session_stop(): Stopping the listener and waiting for inbound peers to finish.\n");
+		g_stop_listening = 1;
+		pthread_join(g_listener_thread, NULL);
+		g_listener_started = 0;
+	}
+	if(g_utp_started)
+	{
+		// closes the uTP connections of inbound peers too, so they finish quickly.
+		utp_shutdown();
+		g_utp_started = 0;
+	}
+	end_peer_threads(1);
+	while(g_session_torrents)
+	{
+		struct pwp_torrent *t = g_session_torrents;
+
+		session_remove_torrent(t);
+		pwp_torrent_destroy(t);
+	}
+
+	if(g_lsd_started)
+	{
+		lsd_stop();
+		g_lsd_started = 0;
+	}
+	if(g_dht_started)
+	{
+		dht_stop();
+		g_dht_started = 0;
+	}
+	if(g_diskio_started)
+	{
+		diskio_stop();
+		g_diskio_started = 0;
+	}
+	if(g_timer_wheel_started)
+	{
+		bf_log("[LOG] session_stop(): stopping the timer wheel.\n");
+		timer_wheel_stop(&g_timer_wheel);
+		timer_wheel_destroy(&g_timer_wheel);
+		g_timer_wheel_started = 0;
+	}
+}
+
+// accepts inbound connections on PWP_LISTEN_PORT and starts a thread for each of them until g_stop_listening is set.
+static void *listen_for_peers(void *arg)
+{
+	bf_log("++++++++++++++++++++ START:  LISTEN_FOR_PEERS +++++++++++++++++++++++\n");
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	struct timeval tv;
+	fd_set acceptfd;
+	char ip[INET6_ADDRSTRLEN];
+	int listenfd, socketfd, rv;
+
+	rv = 0;
+	// IPv6 peers and, through the same socket, IPv4 ones.
+	if((listenfd = util_bind_dual_stack(SOCK_STREAM, PWP_LISTEN_PORT)) == -1 || listen(listenfd, LISTEN_BACKLOG) == -1)
+	{
+		bf_log("[ERROR] listen_for_peers(): Failed to listen on port %d: %s\n", PWP_LISTEN_PORT, strerror(errno));
+		rv = -1;
+		goto cleanup;
+	}
+	bf_log("[LOG] listen_for_peers(): Listening on port %d.\n", PWP_LISTEN_PORT);
+
+	while(!g_stop_listening)
+	{
+		FD_ZERO(&acceptfd);
+		FD_SET(listenfd, &acceptfd);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if(select(listenfd + 1, &acceptfd, NULL, NULL, &tv) <= 0)
+		{
+			continue;
+		}
+
+		addr_len = sizeof(addr);
+		if((socketfd = accept(listenfd, (struct sockaddr *)&addr, &addr_len)) == -1)
+		{
+			continue;
+		}
+		socktune_init(socketfd);
+		util_sockaddr_ip(&addr, ip, sizeof(ip));
+		bf_log("[LOG] listen_for_peers(): Accepted connection from %s.\n", ip);
+		start_inbound_peer(socketfd, ip);
+	}
+
+cleanup:
+	bf_log("---------------------------------------- FINISH:  LISTEN_FOR_PEERS ----------------------------------------\n");
+	if(listenfd != -1)
+	{
+		close(listenfd);
+	}
+	return (void *)(long)rv;
+}
+
+// starts an accept_peer() thread for a connection a peer opened with us, over TCP or uTP. the
+// connection is closed if the peer is on the blocklist or we have too many inbound peers already.
+static int start_inbound_peer(int socketfd, const char *ip)
+{
+	struct inbound_args *args;
+	pthread_t thread;
+
+	if(blocklist_contains(ip))
+	{
+		bf_log("[LOG] start_inbound_peer(): %s is on the blocklist. Closing connection.\n", ip);
+		close(socketfd);
+		return -1;
+	}
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_inbound_mutex);
+
+	if(g_stop_listening || g_inbound_count >= SESSION_MAX_INBOUND_THREADS)
+	{
+		pthread_mutex_unlock(&g_inbound_mutex);
+		bf_log("[LOG] start_inbound_peer(): Not taking more inbound peers. Closing connection.\n");
+		close(socketfd);
+		return -1;
+	}
+	g_inbound_count++;
+
+	pthread_mutex_unlock(&g_inbound_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	args = malloc(sizeof(struct inbound_args));
+	args->socketfd = socketfd;
+	strncpy(args->ip, ip, sizeof(args->ip) - 1);
+	args->ip[sizeof(args->ip) - 1] = '\0';
+	if(pthread_create(&thread, NULL, inbound_thread, (void *)args) != 0)
+	{
+		close(socketfd);
+		free(args);
+		pthread_mutex_lock(&g_inbound_mutex);
+		g_inbound_count--;
+		pthread_mutex_unlock(&g_inbound_mutex);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+static void *inbound_thread(void *arg)
+{
+	struct inbound_args *args = (struct inbound_args *)arg;
+
+	accept_peer(args->socketfd, args->ip);
+	free(args);
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_inbound_mutex);
+
+	g_inbound_count--;
+	// session_stop() may be waiting for the inbound threads to end.
+	pthread_cond_broadcast(&g_session_cond);
+
+	pthread_mutex_unlock(&g_inbound_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return NULL;
+}
+
+// called by the uTP thread for every connection a peer opens with us over uTP.
+static void utp_accepted(int fd, const char *ip, void *arg)
+{
+	start_inbound_peer(fd, ip);
+}
@@ -11,8 +11,8 @@ uint32_t H2 = 0x98BADCFE;
 uint32_t H3 = 0x10325476;
 uint32_t H4 = 0xC3D2E1F0;
 
-uint32_t _h0, _h1, _h2, _h3, _h4; // use these instead of H0, H1 etc because when sha1_compute called again,
-                                        // values of H0, H1 etc would have changed from original. (see sha1_compute method below)
+// the hash workers (see diskio.h) hash pieces at the same time, so the running H0 to H4 of a hash are
+// kept in its sha1_compute() call rather than in globals.
 
 uint32_t rotate_left(uint32_t val, int by)
 {
@@ -110,7 +110,7 @@ uint32_t get_k(int t)
     return 0;
 }
 
-void process_block(uint8_t *M)
+void process_block(uint8_t *M, uint32_t *h)
 {
 	int t;
 	uint32_t temp;
@@ -131,7 +131,7 @@ void process_block(uint8_t *M)
 		W[t] = rotate_left(W[t], 1);
 	}
 
-	A = _h0; B = _h1; C = _h2; D = _h3, E = _h4;
+	A = h[0]; B = h[1]; C = h[2]; D = h[3], E = h[4];
 
 	for(t = 0; t<80; t++)
 	{
@@ -139,7 +139,7 @@ void process_block(uint8_t *M)
 		E = D; D = C; C = rotate_left(B, 30); B = A; A = temp;
 	}
 
-	_h0 = _h0 + A; _h1 = _h1 + B; _h2 = _h2 + C; _h3 = _h3 + D; _h4 = _h4 + E;
+	h[0] = h[0] + A; h[1] = h[1] + B; h[2] = h[2] + C; h[3] = h[3] + D; h[4] = h[4] + E;
 }
 
 // uses the method described here: https://tools.ietf.org/html/rfc3174#section-6.1 
@@ -148,32 +148,26 @@ void sha1_compute(uint8_t *msg, int msg_len, uint8_t *sha1)
 	// pad msg
 	int pad_len, i;
 	uint8_t *padded;
+	uint32_t h[5] = {H0, H1, H2, H3, H4};
 
 	uint8_t *temp;
 
-	_h0 = H0; _h1 = H1; _h2 = H2; _h3 = H3; _h4 = H4;
 	padded = pad_msg(msg, msg_len, &pad_len);
 	// process in 512 byte chunks
 	temp = padded;
 	for(i=0; i<pad_len; i+=64)
 	{
-		process_block(temp);
+		process_block(temp, h);
 		temp += 64;
 	}
 
-	small_to_big_endian((unsigned char *)&_h0, 4);
-	small_to_big_endian((unsigned char *)&_h1, 4);
-	small_to_big_endian((unsigned char *)&_h2, 4);
-	small_to_big_endian((unsigned char *)&_h3, 4);
-	small_to_big_endian((unsigned char *)&_h4, 4);
+	for(i=0; i<5; i++)
+	{
+		small_to_big_endian((unsigned char *)&h[i], 4);
+	}
 	
 	// now copy H0 to H4 into the sha1 buffer
-	temp = sha1;
-	memcpy(temp, &_h0, 4);
-	memcpy(temp + 4, &_h1, 4);
-	memcpy(temp + 8, &_h2, 4);
-	memcpy(temp + 12, &_h3, 4);
-	memcpy(temp + 16, &_h4, 4);
+	memcpy(sha1, h, 20);
 	
 	free(padded);
 }
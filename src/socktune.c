@@ -0,0 +1,186 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<pthread.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+
+#include "socktune.h"
+
+#include "pwp.h"
+#include "bf_logger.h"
+
+// the most SO_RCVBUF and SO_SNDBUF may be set to, net.core.rmem_max and wmem_max. 0 if unknown.
+static long int g_rmem_max = 0;
+static long int g_wmem_max = 0;
+static pthread_once_t g_limits_once = PTHREAD_ONCE_INIT;
+
+static void read_limits();
+static long int read_sysctl(const char *path);
+static int get_rtt_us(int socketfd, long int *rtt_us);
+static int get_buf(int socketfd, int option);
+static long int buf_target(long int rate, long int rtt_us);
+static void set_buf(int socketfd, int option, int *tuned, long int target, long int max);
+
+int socktune_init(int socketfd)
+{
+	int one = 1;
+
+	if(setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+void socktune_adjust(struct pwp_peer *peer)
+{
+	long int rtt_us;
+	char desc[256];
+
+	if(peer->socketfd < 0 || get_rtt_us(peer->socketfd, &rtt_us) != 0)
+	{
+		return;
+	}
+
+	pthread_once(&g_limits_once, read_limits);
+	set_buf(peer->socketfd, SO_RCVBUF, &peer->rcvbuf, buf_target(peer->download_rate, rtt_us), g_rmem_max);
+	set_buf(peer->socketfd, SO_SNDBUF, &peer->sndbuf, buf_target(peer->upload_rate, rtt_us), g_wmem_max);
+
+	if(socktune_describe_peer(peer, desc, sizeof(desc)) == 0)
+	{
+		bf_log("[LOG] socktune: %s\n", desc);
+	}
+}
+
+int socktune_describe_peer(struct pwp_peer *peer, char *buf, size_t len)
+{
+	char desc[96];
+
+	if(peer->socketfd < 0 || socktune_describe(peer->socketfd, desc, sizeof(desc)) != 0)
+	{
+		return -1;
+	}
+	snprintf(buf, len, "%s:%d down %ld B/s up %ld B/s %s rcvbuf %s sndbuf %s", peer->addr.ip, peer->addr.port,
+		peer->download_rate, peer->upload_rate, desc, peer->rcvbuf ? "set" : "auto", peer->sndbuf ? "set" : "auto");
+	return 0;
+}
+
+int socktune_describe(int socketfd, char *buf, size_t len)
+{
+	long int rtt_us;
+	int nodelay;
+	socklen_t optlen = sizeof(nodelay);
+
+	if(get_rtt_us(socketfd, &rtt_us) != 0)
+	{
+		return -1;
+	}
+	if(getsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &optlen) == -1)
+	{
+		return -1;
+	}
+	snprintf(buf, len, "rtt %ld.%03ld ms rcvbuf %d sndbuf %d nodelay %d", rtt_us / 1000, rtt_us % 1000,
+		get_buf(socketfd, SO_RCVBUF), get_buf(socketfd, SO_SNDBUF), nodelay);
+	return 0;
+}
+
+static void read_limits()
+{
+	g_rmem_max = read_sysctl("/proc/sys/net/core/rmem_max");
+	g_wmem_max = read_sysctl("/proc/sys/net/core/wmem_max");
+	bf_log("[LOG] socktune: rmem_max %ld wmem_max %ld\n", g_rmem_max, g_wmem_max);
+}
+
+static long int read_sysctl(const char *path)
+{
+	FILE *fp;
+	long int value = 0;
+
+	if((fp = fopen(path, "r")) == NULL)
+	{
+		return 0;
+	}
+	if(fscanf(fp, "%ld", &value) != 1)
+	{
+		value = 0;
+	}
+	fclose(fp);
+	return value;
+}
+
+// smoothed RTT of the connection as measured by the kernel.
+static int get_rtt_us(int socketfd, long int *rtt_us)
+{
+	struct tcp_info info;
+	socklen_t optlen = sizeof(info);
+
+	if(getsockopt(socketfd, IPPROTO_TCP, TCP_INFO, &info, &optlen) == -1)
+	{
+		return -1;
+	}
+	*rtt_us = info.tcpi_rtt;
+	return 0;
+}
+
+static int get_buf(int socketfd, int option)
+{
+	int size = 0;
+	socklen_t optlen = sizeof(size);
+
+	getsockopt(socketfd, SOL_SOCKET, option, &size, &optlen);
+	return size;
+}
+
+static long int buf_target(long int rate, long int rtt_us)
+{
+	long int target = rate * rtt_us / 1000000 * SOCKTUNE_BDP_FACTOR;
+
+	if(target < SOCKTUNE_MIN_BUF)
+	{
+		target = SOCKTUNE_MIN_BUF;
+	}
+	if(target > SOCKTUNE_MAX_BUF)
+	{
+		target = SOCKTUNE_MAX_BUF;
+	}
+	return target;
+}
+
+// grows the buffer to target, but no further than max, the most setsockopt() grants. tuned is the
+// size the kernel gave us last time, 0 while it is still auto-tuning the buffer.
+static void set_buf(int socketfd, int option, int *tuned, long int target, long int max)
+{
+	const char *name = option == SO_RCVBUF ? "SO_RCVBUF" : "SO_SNDBUF";
+	int size, current;
+
+	if(max <= 0)
+	{
+		return;
+	}
+	if(target > max)
+	{
+		target = max;
+	}
+	// the kernel reports twice the size that was set, to account for its bookkeeping. the buffer is
+	// never set below what it is now: once auto-tuning is off it wouldn't grow back, and while it
+	// is on, a target it has reached already (which is always so if max is the cap) is left to it.
+	current = get_buf(socketfd, option) / 2;
+	if(target <= current)
+	{
+		return;
+	}
+	size = (int)target;
+	if(setsockopt(socketfd, SOL_SOCKET, option, &size, sizeof(size)) == -1)
+	{
+		bf_log("[ERROR] socktune set_buf(): Failed to set %s to %d.\n", name, size);
+		return;
+	}
+	*tuned = get_buf(socketfd, option) / 2;
+	if(*tuned < size)
+	{
+		bf_log("[LOG] socktune set_buf(): Asked for %s %d, got %d.\n", name, size, *tuned);
+	}
+}
@@ -0,0 +1,645 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<stdint.h>
+#include<time.h>
+#include<errno.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<sys/types.h>
+#include<sys/time.h>
+#include<sys/select.h>
+#include<sys/socket.h>
+#include<sys/sendfile.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+
+#include "stream.h"
+
+#include "pwp.h"
+#include "session.h"
+#include "bf_logger.h"
+
+#define STREAM_MAX_REQUEST 8192
+#define STREAM_TIMEOUT_S 10 // a client that takes longer to send its request or to take our data is dropped
+#define STREAM_LISTEN_BACKLOG 8
+
+static int g_stream_fd = -1;
+static pthread_t g_stream_thread;
+static volatile int g_stream_stop = 0;
+static int g_stream_started = 0;
+static int g_stream_clients = 0;
+static pthread_mutex_t g_stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_stream_cond = PTHREAD_COND_INITIALIZER;
+
+static void *stream_thread(void *arg);
+static void *client_thread(void *arg);
+static void serve_request(int fd);
+static struct pwp_torrent *find_torrent(const char *path);
+static int parse_range(char *request, long int length, long int *first, long int *last);
+static void set_deadlines(struct pwp_torrent *t, int idx, int last_idx);
+static void add_deadline(struct stream_deadlines *d, int idx, uint64_t due, uint64_t now);
+static void drop_stale(struct stream_deadlines *d, uint64_t now);
+static int compare_due(const void *a, const void *b);
+static int piece_status(struct pwp_torrent *t, int idx);
+static int is_fast_peer(struct pwp_peer *peer);
+static int client_gone(int fd);
+static void send_status(int fd, int status, const char *reason);
+
+static uint64_t monotonic_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void stream_deadlines_init(struct stream_deadlines *d)
+{
+	d->num = 0;
+	pthread_mutex_init(&d->mutex, NULL);
+	pthread_cond_init(&d->cond, NULL);
+}
+
+void stream_deadlines_destroy(struct stream_deadlines *d)
+{
+	pthread_mutex_destroy(&d->mutex);
+	pthread_cond_destroy(&d->cond);
+}
+
+int stream_start(uint16_t port)
+{
+	struct sockaddr_in addr;
+	int fd, on = 1;
+
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+	{
+		bf_log("[ERROR] stream_start(): Failed to create the socket: %s\n", strerror(errno));
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	// the file is only served to this host.
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, STREAM_LISTEN_BACKLOG) == -1)
+	{
+		bf_log("[ERROR] stream_start(): Failed to listen on port %d: %s\n", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	g_stream_fd = fd;
+	g_stream_stop = 0;
+	if(pthread_create(&g_stream_thread, NULL, stream_thread, NULL) != 0)
+	{
+		bf_log("[ERROR] stream_start(): Failed to start the streaming thread.\n");
+		stream_stop();
+		return -1;
+	}
+	g_stream_started = 1;
+	bf_log("[LOG] stream_start(): Serving on 127.0.0.1:%d.\n", port);
+
+	return 0;
+}
+
+void stream_stop()
+{
+	if(g_stream_started)
+	{
+		g_stream_stop = 1;
+		pthread_join(g_stream_thread, NULL);
+		g_stream_started = 0;
+	}
+
+	// the clients give up within a second, or once their socket times out.
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_stream_mutex);
+
+	while(g_stream_clients > 0)
+	{
+		pthread_cond_wait(&g_stream_cond, &g_stream_mutex);
+	}
+
+	pthread_mutex_unlock(&g_stream_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	if(g_stream_fd != -1)
+	{
+		close(g_stream_fd);
+		g_stream_fd = -1;
+	}
+}
+
+int stream_choose_piece(struct pwp_peer *peer)
+{
+	struct pwp_torrent *t = peer->torrent;
+	struct stream_deadlines *d = &t->deadlines;
+	struct stream_deadline entries[STREAM_MAX_DEADLINES];
+	struct pwp_piece *p;
+	uint64_t now = monotonic_ms();
+	int i, n, fast, idx = -1;
+
+	fast = is_fast_peer(peer);
+	peer->hedging = 0;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&d->mutex);
+
+	drop_stale(d, now);
+	n = d->num;
+	memcpy(entries, d->entries, sizeof(struct stream_deadline) * n);
+	qsort(entries, n, sizeof(struct stream_deadline), compare_due);
+
+	for(i = 0; i < n && idx == -1; i++)
+	{
+		/*-X-X-X- START OF CRITICAL REGION  -X-X-X-*/
+		pthread_mutex_lock(&t->pieces_mutexes[entries[i].idx]);
+
+		if(can_request_piece(peer, entries[i].idx))
+		{
+			t->pieces[entries[i].idx].status = PIECE_STATUS_STARTED;
+			idx = entries[i].idx;
+		}
+
+		pthread_mutex_unlock(&t->pieces_mutexes[entries[i].idx]);
+		/*-X-X-X- END OF CRITICAL REGION  -X-X-X-*/
+	}
+
+	// every piece with a deadline is taken. a fast peer races a slower one for a piece that is due soon.
+	for(i = 0; i < n && idx == -1 && fast && entries[i].due_ms <= now + STREAM_HEDGE_MS; i++)
+	{
+		/*-X-X-X- START OF CRITICAL REGION  -X-X-X-*/
+		pthread_mutex_lock(&t->pieces_mutexes[entries[i].idx]);
+
+		p = &t->pieces[entries[i].idx];
+		if(p->status == PIECE_STATUS_STARTED && p->hedges == 0
+			&& peer_has_piece(peer, entries[i].idx)
+			&& (peer->unchoked || is_allowed_fast(peer, entries[i].idx)))
+		{
+			p->hedges++;
+			peer->hedging = 1;
+			idx = entries[i].idx;
+			bf_log("[LOG] stream_choose_piece(): Hedging piece %d, which is due in %ld ms.\n", idx, (long int)(entries[i].due_ms - now));
+		}
+
+		pthread_mutex_unlock(&t->pieces_mutexes[entries[i].idx]);
+		/*-X-X-X- END OF CRITICAL REGION  -X-X-X-*/
+	}
+
+	pthread_mutex_unlock(&d->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return idx;
+}
+
+void stream_piece_done(struct pwp_torrent *t, int idx)
+{
+	struct stream_deadlines *d = &t->deadlines;
+	int i;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&d->mutex);
+
+	for(i = 0; i < d->num; i++)
+	{
+		if(d->entries[i].idx == idx)
+		{
+			d->entries[i] = d->entries[--d->num];
+			break;
+		}
+	}
+	pthread_cond_broadcast(&d->cond);
+
+	pthread_mutex_unlock(&d->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+// accepts connections and starts a thread for each of them until g_stream_stop is set.
+static void *stream_thread(void *arg)
+{
+	struct timeval tv;
+	fd_set acceptfd;
+	pthread_t thread;
+	int fd;
+
+	while(!g_stream_stop)
+	{
+		FD_ZERO(&acceptfd);
+		FD_SET(g_stream_fd, &acceptfd);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if(select(g_stream_fd + 1, &acceptfd, NULL, NULL, &tv) <= 0)
+		{
+			continue;
+		}
+		if((fd = accept(g_stream_fd, NULL, NULL)) == -1)
+		{
+			continue;
+		}
+
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&g_stream_mutex);
+
+		if(g_stream_clients >= STREAM_MAX_CLIENTS)
+		{
+			pthread_mutex_unlock(&g_stream_mutex);
+			send_status(fd, 503, "Service Unavailable");
+			close(fd);
+			continue;
+		}
+		g_stream_clients++;
+
+		pthread_mutex_unlock(&g_stream_mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+		if(pthread_create(&thread, NULL, client_thread, (void *)(long)fd) != 0)
+		{
+			close(fd);
+			pthread_mutex_lock(&g_stream_mutex);
+			g_stream_clients--;
+			pthread_mutex_unlock(&g_stream_mutex);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+static void *client_thread(void *arg)
+{
+	int fd = (int)(long)arg;
+
+	serve_request(fd);
+	close(fd);
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_stream_mutex);
+
+	g_stream_clients--;
+	pthread_cond_broadcast(&g_stream_cond);
+
+	pthread_mutex_unlock(&g_stream_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return NULL;
+}
+
+static void serve_request(int fd)
+{
+	char request[STREAM_MAX_REQUEST];
+	char header[512];
+	char method[8], path[128];
+	struct pwp_torrent *t;
+	struct timeval tv;
+	long int first, last, end;
+	off_t offset;
+	int len = 0, n, status, idx, last_idx;
+
+	tv.tv_sec = STREAM_TIMEOUT_S;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	request[0] = '\0';
+	while(len < STREAM_MAX_REQUEST - 1 && strstr(request, "\r\n\r\n") == NULL)
+	{
+		if((n = recv(fd, request + len, STREAM_MAX_REQUEST - 1 - len, 0)) <= 0)
+		{
+			return;
+		}
+		len += n;
+		request[len] = '\0';
+	}
+	if(sscanf(request, "%7s %127s", method, path) != 2)
+	{
+		send_status(fd, 400, "Bad Request");
+		return;
+	}
+	if(strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0)
+	{
+		send_status(fd, 405, "Method Not Allowed");
+		return;
+	}
+	if((t = find_torrent(path)) == NULL)
+	{
+		send_status(fd, 404, "Not Found");
+		return;
+	}
+	bf_log("[LOG] stream: %s %s\n", method, path);
+
+	status = parse_range(request, t->total_length, &first, &last);
+	if(status == 416)
+	{
+		len = snprintf(header, sizeof(header), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%ld\r\n"
+			"Content-Length: 0\r\nConnection: close\r\n\r\n", t->total_length);
+		send(fd, header, len, MSG_NOSIGNAL);
+		goto cleanup;
+	}
+	len = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nAccept-Ranges: bytes\r\nContent-Type: application/octet-stream\r\n"
+		"Content-Length: %ld\r\nConnection: close\r\n", status == 206 ? "206 Partial Content" : "200 OK", last - first + 1);
+	if(status == 206)
+	{
+		len += snprintf(header + len, sizeof(header) - len, "Content-Range: bytes %ld-%ld/%ld\r\n", first, last, t->total_length);
+	}
+	len += snprintf(header + len, sizeof(header) - len, "\r\n");
+	if(send(fd, header, len, MSG_NOSIGNAL) != len || strcmp(method, "HEAD") == 0)
+	{
+		goto cleanup;
+	}
+
+	// a piece at a time, each as soon as it is verified.
+	offset = first;
+	last_idx = last / t->piece_length;
+	while(offset <= last)
+	{
+		idx = offset / t->piece_length;
+		if(stream_wait_for_piece(t, idx, last_idx, fd) != 0)
+		{
+			break;
+		}
+		end = (long int)(idx + 1) * t->piece_length;
+		if(end > last + 1)
+		{
+			end = last + 1;
+		}
+		while(offset < end)
+		{
+			if(sendfile(fd, t->saved_fd, &offset, end - offset) <= 0)
+			{
+				goto cleanup;
+			}
+		}
+	}
+
+cleanup:
+	session_release_torrent(t);
+}
+
+// "/<info hash>" or, with one torrent in the session, "/". the torrent is held with session_release_torrent().
+static struct pwp_torrent *find_torrent(const char *path)
+{
+	struct pwp_torrent **torrents, *t = NULL;
+	char hex[41];
+	int i, j, n;
+
+	n = session_list_torrents(&torrents);
+	for(i = 0; i < n; i++)
+	{
+		for(j = 0; j < 20; j++)
+		{
+			snprintf(hex + 2 * j, 3, "%02x", torrents[i]->info_hash[j]);
+		}
+		if(t == NULL && torrents[i]->num_of_pieces > 0
+			&& ((n == 1 && strcmp(path, "/") == 0) || (strlen(path) == 41 && strcasecmp(path + 1, hex) == 0)))
+		{
+			t = torrents[i];
+			continue;
+		}
+		session_release_torrent(torrents[i]);
+	}
+	free(torrents);
+
+	return t;
+}
+
+// returns 206 and the range of a Range header, 200 and the whole file without one and 416 if the
+// range lies outside the file. only the first of several ranges is served.
+static int parse_range(char *request, long int length, long int *first, long int *last)
+{
+	char *line;
+	long int a, b;
+	int n;
+
+	*first = 0;
+	*last = length - 1;
+	for(line = strstr(request, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n"))
+	{
+		if(strncasecmp(line + 2, "Range:", 6) == 0)
+		{
+			break;
+		}
+	}
+	if(line == NULL || line[2] == '\r')
+	{
+		return 200;
+	}
+	line += 8;
+	while(*line == ' ')
+	{
+		line++;
+	}
+	// units other than bytes may be ignored (RFC 7233).
+	if(strncasecmp(line, "bytes=", 6) != 0)
+	{
+		return 200;
+	}
+	line += 6;
+
+	if(*line == '-')
+	{
+		// the last b bytes
+		if(sscanf(line + 1, "%ld", &b) != 1 || b <= 0)
+		{
+			return 416;
+		}
+		a = b >= length ? 0 : length - b;
+		b = length - 1;
+	}
+	else if((n = sscanf(line, "%ld-%ld", &a, &b)) >= 1)
+	{
+		if(n == 1 || b >= length)
+		{
+			b = length - 1;
+		}
+	}
+	else
+	{
+		return 200;
+	}
+	if(a < 0 || a > b || a >= length)
+	{
+		return 416;
+	}
+	*first = a;
+	*last = b;
+
+	return 206;
+}
+
+int stream_wait_for_piece(struct pwp_torrent *t, int idx, int last_idx, int client)
+{
+	struct stream_deadlines *d = &t->deadlines;
+	struct timespec ts;
+	int state, threads, complete;
+
+	while(piece_status(t, idx) != PIECE_STATUS_COMPLETE)
+	{
+		state = session_torrent_state(t, &threads);
+		if(g_stream_stop || state != SESSION_TORRENT_ACTIVE || (client != -1 && client_gone(client)))
+		{
+			return -1;
+		}
+		// renewed every time round, so the deadlines of a client that went away expire.
+		set_deadlines(t, idx, last_idx);
+
+		/* -X-X-X- CRITICAL REGION START -X-X-X- */
+		pthread_mutex_lock(&d->mutex);
+
+		complete = piece_status(t, idx) == PIECE_STATUS_COMPLETE;
+		if(!complete)
+		{
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			pthread_cond_timedwait(&d->cond, &d->mutex, &ts);
+		}
+
+		pthread_mutex_unlock(&d->mutex);
+		/* -X-X-X- CRITICAL REGION END -X-X-X- */
+	}
+
+	return 0;
+}
+
+static void set_deadlines(struct pwp_torrent *t, int idx, int last_idx)
+{
+	struct stream_deadlines *d = &t->deadlines;
+	uint64_t now = monotonic_ms();
+	int i;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&d->mutex);
+
+	drop_stale(d, now);
+	for(i = idx; i <= last_idx && i <= idx + STREAM_READAHEAD_PIECES; i++)
+	{
+		if(piece_status(t, i) != PIECE_STATUS_COMPLETE)
+		{
+			add_deadline(d, i, now + (uint64_t)(i - idx) * STREAM_DEADLINE_STEP_MS, now);
+		}
+	}
+
+	pthread_mutex_unlock(&d->mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+// a piece several clients wait for keeps the earliest deadline. once the table is full a piece
+// only gets in by pushing out one due later.
+static void add_deadline(struct stream_deadlines *d, int idx, uint64_t due, uint64_t now)
+{
+	int i, latest = -1;
+
+	for(i = 0; i < d->num; i++)
+	{
+		if(d->entries[i].idx == idx)
+		{
+			if(due < d->entries[i].due_ms)
+			{
+				d->entries[i].due_ms = due;
+			}
+			d->entries[i].renewed_ms = now;
+			return;
+		}
+		if(latest == -1 || d->entries[i].due_ms > d->entries[latest].due_ms)
+		{
+			latest = i;
+		}
+	}
+	if(d->num < STREAM_MAX_DEADLINES)
+	{
+		i = d->num++;
+	}
+	else if(d->entries[latest].due_ms > due)
+	{
+		i = latest;
+	}
+	else
+	{
+		return;
+	}
+	d->entries[i].idx = idx;
+	d->entries[i].due_ms = due;
+	d->entries[i].renewed_ms = now;
+}
+
+static void drop_stale(struct stream_deadlines *d, uint64_t now)
+{
+	int i = 0;
+
+	while(i < d->num)
+	{
+		if(d->entries[i].renewed_ms + STREAM_DEADLINE_TTL_MS < now)
+		{
+			d->entries[i] = d->entries[--d->num];
+			continue;
+		}
+		i++;
+	}
+}
+
+static int compare_due(const void *a, const void *b)
+{
+	const struct stream_deadline *x = a, *y = b;
+
+	return x->due_ms < y->due_ms ? -1 : (x->due_ms > y->due_ms ? 1 : 0);
+}
+
+static int piece_status(struct pwp_torrent *t, int idx)
+{
+	int status;
+
+	/*-X-X-X- START OF CRITICAL REGION  -X-X-X-*/
+	pthread_mutex_lock(&t->pieces_mutexes[idx]);
+
+	status = t->pieces[idx].status;
+
+	pthread_mutex_unlock(&t->pieces_mutexes[idx]);
+	/*-X-X-X- END OF CRITICAL REGION  -X-X-X-*/
+
+	return status;
+}
+
+// a peer downloading at least as fast as the average of the torrent's peers, as measured by the choker.
+static int is_fast_peer(struct pwp_peer *peer)
+{
+	struct pwp_torrent *t = peer->torrent;
+	struct pwp_peer_node *node;
+	long int total = 0;
+	int n = 0, fast;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&t->connected_peers_mutex);
+
+	for(node = t->connected_peers; node; node = node->next, n++)
+	{
+		total += node->peer->download_rate;
+	}
+	fast = n == 0 || peer->download_rate * n >= total;
+
+	pthread_mutex_unlock(&t->connected_peers_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return fast;
+}
+
+// the client closed the connection. anything it sent after its request is ignored.
+static int client_gone(int fd)
+{
+	char c;
+	int n;
+
+	n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+static void send_status(int fd, int status, const char *reason)
+{
+	char msg[256];
+	int len;
+
+	len = snprintf(msg, sizeof(msg), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status, reason);
+	send(fd, msg, len, MSG_NOSIGNAL);
+}
@@ -0,0 +1,100 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+
+#include "superseed.h"
+
+#include "pwp.h"
+#include "bf_logger.h"
+
+// the piece the peer lacks which the fewest connected peers have or were offered. ties are broken
+// at random so that peers connecting at the same time get different pieces.
+static int pick_piece(struct pwp_peer_node *peers, struct pwp_peer *peer)
+{
+	struct pwp_torrent *t = peer->torrent;
+	struct pwp_peer_node *node;
+	int *score;
+	int i, idx, start, best = -1;
+
+	score = calloc(t->num_of_pieces, sizeof(int));
+	for(node = peers; node; node = node->next)
+	{
+		for(i = 0; i < t->num_of_pieces; i++)
+		{
+			score[i] += peer_has_piece(node->peer, i);
+		}
+		if(node->peer->superseed_piece != -1)
+		{
+			score[node->peer->superseed_piece]++;
+		}
+	}
+
+	start = rand() % t->num_of_pieces;
+	for(i = 0; i < t->num_of_pieces; i++)
+	{
+		idx = (start + i) % t->num_of_pieces;
+		if(peer_has_piece(peer, idx) || (peer->revealed[idx / 8] & (0x80 >> (idx % 8))))
+		{
+			continue;
+		}
+		if(best == -1 || score[idx] < score[best])
+		{
+			best = idx;
+		}
+	}
+	free(score);
+
+	return best;
+}
+
+int superseed_reveal(struct pwp_peer_node *peers, struct pwp_peer *peer)
+{
+	uint8_t *msg;
+	int idx, len;
+
+	if((idx = pick_piece(peers, peer)) == -1)
+	{
+		peer->superseed_piece = -1;
+		return -1;
+	}
+	peer->superseed_piece = idx;
+	peer->revealed[idx / 8] |= 0x80 >> (idx % 8);
+
+	// the caller holds the peers list, and the peer may not be ours, so its socket isn't waited for.
+	msg = compose_have(idx, &len);
+	pwp_queue_msg(peer, msg, len);
+	free(msg);
+	bf_log("[LOG] superseed_reveal(): Revealed piece %d to the peer.\n", idx);
+
+	return idx;
+}
+
+void superseed_have(struct pwp_peer_node *peers, struct pwp_peer *from, int idx)
+{
+	struct pwp_peer_node *node;
+	int others_lack = 0;
+
+	// the piece revealed to these peers has made it to another peer.
+	for(node = peers; node; node = node->next)
+	{
+		if(node->peer == from)
+		{
+			continue;
+		}
+		if(node->peer->superseed_piece == idx)
+		{
+			superseed_reveal(peers, node->peer);
+		}
+		if(!peer_has_piece(node->peer, idx))
+		{
+			others_lack = 1;
+		}
+	}
+
+	// the peer has downloaded what we revealed to it. it should pass it on before it gets more.
+	if(from->superseed_piece == idx && !others_lack)
+	{
+		superseed_reveal(peers, from);
+	}
+}
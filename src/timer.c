@@ -0,0 +1,308 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<time.h>
+#include<pthread.h>
+
+#include "timer.h"
+
+#include "bf_logger.h"
+
+static void list_init(struct timer *head)
+{
+	head->prev = head;
+	head->next = head;
+}
+
+static int list_empty(struct timer *head)
+{
+	return head->next == head;
+}
+
+static void list_append(struct timer *head, struct timer *t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+static void list_unlink(struct timer *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->prev = NULL;
+	t->next = NULL;
+}
+
+// moves all the timers from 'from' to the (empty) list 'to'
+static void list_splice(struct timer *from, struct timer *to)
+{
+	if(list_empty(from))
+	{
+		list_init(to);
+		return;
+	}
+	to->next = from->next;
+	to->prev = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	list_init(from);
+}
+
+static uint64_t monotonic_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// NOTE: must be called with tw->mutex held.
+static void place_timer(struct timer_wheel *tw, struct timer *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t delta;
+	int level;
+
+	if(expires < tw->now)
+	{
+		// already due. it will be run when the current tick is processed.
+		expires = tw->now;
+	}
+	delta = expires - tw->now;
+
+	for(level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+	{
+		if(delta < ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))))
+		{
+			break;
+		}
+	}
+
+	if(level == TIMER_WHEEL_LEVELS - 1)
+	{
+		// clamp timers beyond the range of the top wheel to its last slot.
+		uint64_t max_delta = ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+		if(delta > max_delta)
+		{
+			expires = tw->now + max_delta;
+			t->expires = expires;
+		}
+	}
+
+	list_append(&tw->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], t);
+}
+
+// NOTE: must be called with tw->mutex held. returns the index of the slot that was cascaded.
+static int cascade(struct timer_wheel *tw, int level)
+{
+	struct timer list, *t;
+	int idx = (tw->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+	list_splice(&tw->slots[level][idx], &list);
+	while(!list_empty(&list))
+	{
+		t = list.next;
+		list_unlink(t);
+		place_timer(tw, t);
+	}
+
+	return idx;
+}
+
+// processes the tick tw->now. NOTE: must be called with tw->mutex held; the mutex is released
+// while the callbacks are run.
+static void process_tick(struct timer_wheel *tw)
+{
+	struct timer *t;
+	timer_callback callback;
+	void *arg;
+	int level;
+	int idx = tw->now & TIMER_WHEEL_MASK;
+
+	if(idx == 0)
+	{
+		for(level = 1; level < TIMER_WHEEL_LEVELS; level++)
+		{
+			if(cascade(tw, level) != 0)
+			{
+				break;
+			}
+		}
+	}
+
+	list_splice(&tw->slots[0][idx], &tw->expired);
+	tw->now++;
+
+	while(!list_empty(&tw->expired))
+	{
+		t = tw->expired.next;
+		list_unlink(t);
+		t->pending = 0;
+		callback = t->callback;
+		arg = t->arg;
+		tw->running = t;
+
+		pthread_mutex_unlock(&tw->mutex);
+		callback(arg);
+		pthread_mutex_lock(&tw->mutex);
+
+		tw->running = NULL;
+		pthread_cond_broadcast(&tw->cond);
+	}
+}
+
+static void *timer_wheel_thread(void *arg)
+{
+	struct timer_wheel *tw = (struct timer_wheel *)arg;
+	uint64_t start = monotonic_ms();
+	uint64_t target;
+	struct timespec ts;
+
+	pthread_mutex_lock(&tw->mutex);
+	while(!tw->stop)
+	{
+		target = (monotonic_ms() - start) / tw->tick_ms;
+		while(tw->now <= target && !tw->stop)
+		{
+			process_tick(tw);
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += tw->tick_ms * 1000000;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec = ts.tv_nsec % 1000000000;
+		pthread_cond_timedwait(&tw->cond, &tw->mutex, &ts);
+	}
+	pthread_mutex_unlock(&tw->mutex);
+
+	return NULL;
+}
+
+int timer_wheel_init(struct timer_wheel *tw, long int tick_ms)
+{
+	int i, j;
+
+	if(tick_ms <= 0)
+	{
+		return -1;
+	}
+
+	memset(tw, 0, sizeof(struct timer_wheel));
+	tw->tick_ms = tick_ms;
+	for(i = 0; i < TIMER_WHEEL_LEVELS; i++)
+	{
+		for(j = 0; j < TIMER_WHEEL_SLOTS; j++)
+		{
+			list_init(&tw->slots[i][j]);
+		}
+	}
+	list_init(&tw->expired);
+	pthread_mutex_init(&tw->mutex, NULL);
+	pthread_cond_init(&tw->cond, NULL);
+
+	return 0;
+}
+
+int timer_wheel_start(struct timer_wheel *tw)
+{
+	tw->stop = 0;
+	if(pthread_create(&tw->thread, NULL, timer_wheel_thread, (void *)tw) != 0)
+	{
+		bf_log("[ERROR] timer_wheel_start(): Failed to create the timer thread.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void timer_wheel_stop(struct timer_wheel *tw)
+{
+	pthread_mutex_lock(&tw->mutex);
+	tw->stop = 1;
+	pthread_cond_broadcast(&tw->cond);
+	pthread_mutex_unlock(&tw->mutex);
+
+	pthread_join(tw->thread, NULL);
+}
+
+void timer_wheel_destroy(struct timer_wheel *tw)
+{
+	pthread_mutex_destroy(&tw->mutex);
+	pthread_cond_destroy(&tw->cond);
+}
+
+void timer_wheel_advance(struct timer_wheel *tw, uint64_t ticks)
+{
+	pthread_mutex_lock(&tw->mutex);
+	while(ticks--)
+	{
+		process_tick(tw);
+	}
+	pthread_mutex_unlock(&tw->mutex);
+}
+
+void timer_init(struct timer *t, timer_callback callback, void *arg)
+{
+	t->expires = 0;
+	t->callback = callback;
+	t->arg = arg;
+	t->pending = 0;
+	t->prev = NULL;
+	t->next = NULL;
+}
+
+void timer_add(struct timer_wheel *tw, struct timer *t, long int delay_ms)
+{
+	uint64_t ticks = (delay_ms + tw->tick_ms - 1) / tw->tick_ms;
+
+	pthread_mutex_lock(&tw->mutex);
+
+	if(t->pending)
+	{
+		list_unlink(t);
+	}
+	t->expires = tw->now + ticks;
+	t->pending = 1;
+	place_timer(tw, t);
+
+	pthread_mutex_unlock(&tw->mutex);
+}
+
+void timer_cancel(struct timer_wheel *tw, struct timer *t)
+{
+	pthread_mutex_lock(&tw->mutex);
+
+	if(t->pending)
+	{
+		list_unlink(t);
+		t->pending = 0;
+	}
+
+	while(tw->running == t && !pthread_equal(pthread_self(), tw->thread))
+	{
+		pthread_cond_wait(&tw->cond, &tw->mutex);
+	}
+
+	// the callback may have re-armed the timer while we were waiting for it to return.
+	if(t->pending)
+	{
+		list_unlink(t);
+		t->pending = 0;
+	}
+
+	pthread_mutex_unlock(&tw->mutex);
+}
+
+int timer_pending(struct timer_wheel *tw, struct timer *t)
+{
+	int pending;
+
+	pthread_mutex_lock(&tw->mutex);
+	pending = t->pending;
+	pthread_mutex_unlock(&tw->mutex);
+
+	return pending;
+}
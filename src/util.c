@@ -2,6 +2,11 @@
 #include<stdio.h>
 #include<stdint.h>
 #include<string.h>
+#include<strings.h>
+#include<unistd.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
 
 #include "util.h"
 
@@ -133,7 +138,7 @@ int util_read_file_chunk(const char *filename, int start_idx, int chunk_len,  ui
 // concatenates the two null terminated strings and returns a newly malloc'd combined string.
 char *util_concatenate(char *str1, char *str2)
 {
-	int len = strlen(str1) + strlen(str2);
+	int len = strlen(str1) + strlen(str2) + 1; // +1 for the null terminator
 	char *combined = (char *)malloc(len);
 
 	strcpy(combined, str1);
@@ -249,3 +254,91 @@ int util_write_new_file(const char *filename, uint8_t *contents, int len)
 	
 	return 0;
 }
+
+int util_make_sockaddr(const char *ip, uint16_t port, struct sockaddr_storage *addr, int *len)
+{
+	struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+
+	bzero(addr, sizeof(struct sockaddr_storage));
+	if(inet_pton(AF_INET, ip, &addr4->sin_addr) == 1)
+	{
+		addr4->sin_family = AF_INET;
+		addr4->sin_port = htons(port);
+		*len = sizeof(struct sockaddr_in);
+		return 0;
+	}
+	if(inet_pton(AF_INET6, ip, &addr6->sin6_addr) == 1)
+	{
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_port = htons(port);
+		*len = sizeof(struct sockaddr_in6);
+		return 0;
+	}
+
+	return -1;
+}
+
+// IPv4 peers that reached a dual stack socket are written as a.b.c.d rather than ::ffff:a.b.c.d, so
+// they compare equal to the addresses we got from the tracker.
+void util_sockaddr_ip(struct sockaddr_storage *addr, char *ip, int ip_len)
+{
+	struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+
+	if(addr->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr))
+	{
+		inet_ntop(AF_INET, &addr6->sin6_addr.s6_addr[12], ip, ip_len);
+	}
+	else if(addr->ss_family == AF_INET6)
+	{
+		inet_ntop(AF_INET6, &addr6->sin6_addr, ip, ip_len);
+	}
+	else
+	{
+		inet_ntop(AF_INET, &((struct sockaddr_in *)addr)->sin_addr, ip, ip_len);
+	}
+}
+
+// returns a socket of the given type bound to port on all addresses. it is an IPv6 socket that
+// takes IPv4 traffic too if the host has IPv6, a plain IPv4 one otherwise. -1 on error.
+int util_bind_dual_stack(int type, uint16_t port)
+{
+	struct sockaddr_in6 addr6;
+	struct sockaddr_in addr4;
+	int fd, optval;
+
+	optval = 1;
+	if((fd = socket(AF_INET6, type, 0)) != -1)
+	{
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+		optval = 0;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(optval));
+		bzero(&addr6, sizeof(addr6));
+		addr6.sin6_family = AF_INET6;
+		addr6.sin6_addr = in6addr_any;
+		addr6.sin6_port = htons(port);
+		if(bind(fd, (struct sockaddr *)&addr6, sizeof(addr6)) == 0)
+		{
+			return fd;
+		}
+		close(fd);
+		optval = 1;
+	}
+
+	if((fd = socket(AF_INET, type, 0)) == -1)
+	{
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	bzero(&addr4, sizeof(addr4));
+	addr4.sin_family = AF_INET;
+	addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr4.sin_port = htons(port);
+	if(bind(fd, (struct sockaddr *)&addr4, sizeof(addr4)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
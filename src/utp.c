@@ -0,0 +1,1304 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<errno.h>
+#include<time.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<pthread.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+
+#include "utp.h"
+
+#include "util.h"
+#include "bf_logger.h"
+
+#define UTP_VERSION 1
+#define ST_DATA 0
+#define ST_FIN 1
+#define ST_STATE 2
+#define ST_RESET 3
+#define ST_SYN 4
+
+#define UTP_EXT_SACK 1
+
+#define UTP_HEADER_LEN 20
+#define UTP_MSS 1400 // payload bytes per packet, so that packets stay below common path MTUs
+#define UTP_MAX_PACKET_LEN (UTP_HEADER_LEN + 2 + 8 + UTP_MSS)
+#define UTP_OUTBUF_SIZE 512 // max packets in flight
+#define UTP_INBUF_SIZE 512 // max out of order packets kept
+#define UTP_RCVBUF_SIZE (1024 * 1024) // received bytes not yet read by the socketpair's other end
+#define UTP_SACK_BYTES 8 // selective ACKs cover the 64 packets after ack_nr + 1
+
+#define UTP_MIN_WINDOW UTP_MSS
+#define UTP_MAX_WINDOW (UTP_OUTBUF_SIZE * UTP_MSS)
+#define UTP_MAX_CWND_INCREASE 3000 // bytes per RTT when there is no queueing delay at all
+#define UTP_BASE_DELAY_MINUTES 2 // the base delay is the smallest delay seen over this many minutes
+
+#define UTP_INITIAL_RTO_MS 1000
+#define UTP_MIN_RTO_MS 500
+#define UTP_MAX_RTO_MS 60000
+#define UTP_MAX_TIMEOUTS 6 // connection is reset after this many retransmission timeouts in a row
+#define UTP_SYN_RETRIES 2
+#define UTP_LINGER_MS 5000 // how long to wait for the peer's FIN once ours is acked
+#define UTP_IDLE_TIMEOUT_MS 180000
+#define UTP_POLL_MS 50
+
+#define UTP_STATE_SYN_SENT 0
+#define UTP_STATE_CONNECTED 1
+#define UTP_STATE_FAILED 2 // connect failed, utp_connect() hasn't noticed yet
+#define UTP_STATE_CLOSED 3 // to be destroyed by the uTP thread
+
+struct utp_header
+{
+	uint8_t type;
+	uint8_t extension;
+	uint16_t connection_id;
+	uint32_t timestamp_us;
+	uint32_t timestamp_difference_us;
+	uint32_t wnd_size;
+	uint16_t seq_nr;
+	uint16_t ack_nr;
+};
+
+// a packet we sent and which hasn't been acked yet.
+struct utp_out_packet
+{
+	uint8_t type;
+	uint16_t seq_nr;
+	int payload_len;
+	uint64_t sent_us;
+	int transmissions;
+	int need_resend; // given up on after a timeout, not counted in cur_window until sent again
+	uint8_t payload[];
+};
+
+// a packet received ahead of the next one expected.
+struct utp_in_packet
+{
+	uint8_t type;
+	uint16_t seq_nr;
+	int payload_len;
+	uint8_t payload[];
+};
+
+struct utp_conn
+{
+	int state;
+	struct sockaddr_storage addr;
+	uint16_t recv_id; // connection id of the packets we receive
+	uint16_t send_id; // connection id of the packets we send
+	int fd; // our end of the socketpair
+	int app_fd; // the other end until utp_connect() hands it out
+
+	// sending
+	uint16_t seq_nr; // seq_nr of the next packet
+	uint16_t oldest; // seq_nr of the oldest packet not acked yet
+	struct utp_out_packet *outbuf[UTP_OUTBUF_SIZE];
+	long int cur_window; // payload bytes in flight
+	long int max_window; // congestion window
+	long int peer_wnd; // receive window advertised by the peer
+	int resend_waiting; // packets marked after a timeout that didn't fit into the window yet
+	int dup_acks;
+	uint16_t last_ack_nr;
+	int rtt, rtt_var, rto; // milliseconds
+	uint64_t last_resend_us;
+	uint64_t newest_acked_sent_us; // latest send time of a packet that was acked
+	uint64_t rto_deadline_us;
+	int timeouts;
+	uint64_t last_decay_us;
+	uint32_t base_delay[UTP_BASE_DELAY_MINUTES];
+	uint64_t base_delay_minute_us;
+	int eof_local; // the socketpair's other end stopped writing
+	int fin_sent;
+	int fin_acked;
+	uint64_t fin_acked_us;
+
+	// receiving
+	uint16_t ack_nr; // seq_nr of the last packet received in order
+	uint32_t reply_micro; // delay of the last packet received, echoed back to the peer
+	struct utp_in_packet *inbuf[UTP_INBUF_SIZE];
+	long int ooo_bytes; // payload bytes in inbuf
+	uint8_t *rcvbuf; // ring buffer of in order bytes
+	long int rcv_head, rcv_len;
+	long int last_adv_wnd;
+	int need_ack;
+	int got_fin;
+	int fin_delivered;
+	int app_gone; // the socketpair's other end was closed
+	uint64_t last_recv_us;
+
+	struct utp_conn *next;
+};
+
+int g_utp_socket = -1;
+int g_utp_family; // AF_INET6 for a dual stack socket, AF_INET if the host has no IPv6
+int g_utp_wake[2] = {-1, -1}; // pipe to wake the uTP thread up from poll()
+volatile int g_utp_stop = 0;
+pthread_t g_utp_thread;
+utp_accept_callback g_utp_on_accept = NULL;
+void *g_utp_accept_arg = NULL;
+
+// protects every connection and the list of them.
+pthread_mutex_t g_utp_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_utp_cond = PTHREAD_COND_INITIALIZER; // signalled when a connection attempt succeeds or fails
+struct utp_conn *g_utp_conns = NULL;
+
+// the addresses whose uTP support we know of. the oldest one makes room once it is full.
+struct utp_known
+{
+	char ip[INET6_ADDRSTRLEN];
+	uint16_t port;
+	int supported;
+};
+
+struct utp_known g_utp_known[UTP_KNOWN_MAX];
+int g_utp_num_known = 0;
+int g_utp_next_known = 0; // where the next address goes
+pthread_mutex_t g_utp_known_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *utp_thread(void *arg);
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void write_header(uint8_t *buf, struct utp_header *h)
+{
+	uint16_t s;
+	uint32_t l;
+
+	buf[0] = (h->type << 4) | UTP_VERSION;
+	buf[1] = h->extension;
+	s = htons(h->connection_id);
+	memcpy(buf + 2, &s, 2);
+	l = htonl(h->timestamp_us);
+	memcpy(buf + 4, &l, 4);
+	l = htonl(h->timestamp_difference_us);
+	memcpy(buf + 8, &l, 4);
+	l = htonl(h->wnd_size);
+	memcpy(buf + 12, &l, 4);
+	s = htons(h->seq_nr);
+	memcpy(buf + 16, &s, 2);
+	s = htons(h->ack_nr);
+	memcpy(buf + 18, &s, 2);
+}
+
+static int read_header(uint8_t *buf, int len, struct utp_header *h)
+{
+	uint16_t s;
+	uint32_t l;
+
+	if(len < UTP_HEADER_LEN || (buf[0] & 0x0F) != UTP_VERSION || (buf[0] >> 4) > ST_SYN)
+	{
+		return -1;
+	}
+	h->type = buf[0] >> 4;
+	h->extension = buf[1];
+	memcpy(&s, buf + 2, 2);
+	h->connection_id = ntohs(s);
+	memcpy(&l, buf + 4, 4);
+	h->timestamp_us = ntohl(l);
+	memcpy(&l, buf + 8, 4);
+	h->timestamp_difference_us = ntohl(l);
+	memcpy(&l, buf + 12, 4);
+	h->wnd_size = ntohl(l);
+	memcpy(&s, buf + 16, 2);
+	h->seq_nr = ntohs(s);
+	memcpy(&s, buf + 18, 2);
+	h->ack_nr = ntohs(s);
+
+	return 0;
+}
+
+static socklen_t addr_len(struct sockaddr_storage *addr)
+{
+	return addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static int same_addr(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+	struct sockaddr_in *a4 = (struct sockaddr_in *)a, *b4 = (struct sockaddr_in *)b;
+	struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)a, *b6 = (struct sockaddr_in6 *)b;
+
+	if(a->ss_family != b->ss_family)
+	{
+		return 0;
+	}
+	if(a->ss_family == AF_INET6)
+	{
+		return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(struct in6_addr)) == 0;
+	}
+	return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+static void send_raw(struct sockaddr_storage *addr, uint8_t *buf, int len)
+{
+#ifdef UTP_SIMULATED_LOSS
+	if(rand() % 100 < UTP_SIMULATED_LOSS)
+	{
+		return;
+	}
+#endif
+	sendto(g_utp_socket, buf, len, MSG_DONTWAIT, (struct sockaddr *)addr, addr_len(addr));
+}
+
+static long int our_window(struct utp_conn *c)
+{
+	long int wnd = UTP_RCVBUF_SIZE - c->rcv_len - c->ooo_bytes;
+
+	return wnd > 0 ? wnd : 0;
+}
+
+// fills in the header fields that are the same for every packet of the connection.
+static void fill_header(struct utp_conn *c, struct utp_header *h, uint8_t type, uint16_t seq_nr)
+{
+	h->type = type;
+	h->extension = 0;
+	h->connection_id = type == ST_SYN ? c->recv_id : c->send_id;
+	h->timestamp_us = (uint32_t)now_us();
+	h->timestamp_difference_us = c->reply_micro;
+	h->wnd_size = our_window(c);
+	h->seq_nr = seq_nr;
+	h->ack_nr = c->ack_nr;
+	c->last_adv_wnd = h->wnd_size;
+}
+
+static void transmit(struct utp_conn *c, struct utp_out_packet *p)
+{
+	uint8_t buf[UTP_MAX_PACKET_LEN];
+	struct utp_header h;
+
+	fill_header(c, &h, p->type, p->seq_nr);
+	write_header(buf, &h);
+	memcpy(buf + UTP_HEADER_LEN, p->payload, p->payload_len);
+	send_raw(&c->addr, buf, UTP_HEADER_LEN + p->payload_len);
+
+	p->sent_us = now_us();
+	if(p->transmissions > 0)
+	{
+		c->last_resend_us = p->sent_us;
+	}
+	p->transmissions++;
+	// an ack goes with every packet
+	c->need_ack = 0;
+}
+
+// sends a STATE packet, with selective ACKs for the out of order packets we have.
+static void send_state(struct utp_conn *c)
+{
+	uint8_t buf[UTP_HEADER_LEN + 2 + UTP_SACK_BYTES];
+	struct utp_header h;
+	struct utp_in_packet *p;
+	int i, len;
+	uint16_t seq;
+
+	fill_header(c, &h, ST_STATE, c->seq_nr);
+	len = UTP_HEADER_LEN;
+	if(c->ooo_bytes > 0 || c->inbuf[(uint16_t)(c->ack_nr + 2) % UTP_INBUF_SIZE])
+	{
+		h.extension = UTP_EXT_SACK;
+		buf[len] = 0; // no further extension
+		buf[len + 1] = UTP_SACK_BYTES;
+		memset(buf + len + 2, 0, UTP_SACK_BYTES);
+		for(i = 0; i < UTP_SACK_BYTES * 8; i++)
+		{
+			seq = c->ack_nr + 2 + i;
+			p = c->inbuf[seq % UTP_INBUF_SIZE];
+			if(p && p->seq_nr == seq)
+			{
+				buf[len + 2 + i / 8] |= 1 << (i % 8);
+			}
+		}
+		len += 2 + UTP_SACK_BYTES;
+	}
+	write_header(buf, &h);
+	send_raw(&c->addr, buf, len);
+	c->need_ack = 0;
+}
+
+static void send_reset(struct sockaddr_storage *addr, uint16_t connection_id, uint16_t ack_nr)
+{
+	uint8_t buf[UTP_HEADER_LEN];
+	struct utp_header h;
+
+	memset(&h, 0, sizeof(h));
+	h.type = ST_RESET;
+	h.connection_id = connection_id;
+	h.timestamp_us = (uint32_t)now_us();
+	h.seq_nr = rand();
+	h.ack_nr = ack_nr;
+	write_header(buf, &h);
+	send_raw(addr, buf, UTP_HEADER_LEN);
+}
+
+static int outstanding(struct utp_conn *c)
+{
+	return (uint16_t)(c->seq_nr - c->oldest);
+}
+
+static void queue_packet(struct utp_conn *c, uint8_t type, uint8_t *payload, int len)
+{
+	struct utp_out_packet *p = malloc(sizeof(struct utp_out_packet) + len);
+
+	p->type = type;
+	p->seq_nr = c->seq_nr++;
+	p->payload_len = len;
+	p->transmissions = 0;
+	p->need_resend = 0;
+	if(len > 0)
+	{
+		memcpy(p->payload, payload, len);
+	}
+	if(outstanding(c) == 1)
+	{
+		c->rto_deadline_us = now_us() + (uint64_t)c->rto * 1000;
+	}
+	c->outbuf[p->seq_nr % UTP_OUTBUF_SIZE] = p;
+	c->cur_window += len;
+	transmit(c, p);
+}
+
+static struct utp_conn *new_conn(struct sockaddr_storage *addr)
+{
+	struct utp_conn *c = calloc(1, sizeof(struct utp_conn));
+	int fds[2];
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+	{
+		bf_log("[ERROR] utp: Failed to create socketpair: %s\n", strerror(errno));
+		free(c);
+		return NULL;
+	}
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, NULL) | O_NONBLOCK);
+	c->fd = fds[0];
+	c->app_fd = fds[1];
+	c->addr = *addr;
+	c->seq_nr = rand();
+	c->oldest = c->seq_nr;
+	c->max_window = UTP_MIN_WINDOW * 2;
+	c->peer_wnd = UTP_MSS;
+	c->rto = UTP_INITIAL_RTO_MS;
+	c->rcvbuf = malloc(UTP_RCVBUF_SIZE);
+	c->last_recv_us = now_us();
+	c->base_delay_minute_us = c->last_recv_us;
+	memset(c->base_delay, 0xFF, sizeof(c->base_delay));
+	c->next = g_utp_conns;
+	g_utp_conns = c;
+
+	return c;
+}
+
+static void destroy_conn(struct utp_conn *c)
+{
+	struct utp_conn **pp;
+	int i;
+
+	for(pp = &g_utp_conns; *pp; pp = &(*pp)->next)
+	{
+		if(*pp == c)
+		{
+			*pp = c->next;
+			break;
+		}
+	}
+	for(i = 0; i < UTP_OUTBUF_SIZE; i++)
+	{
+		free(c->outbuf[i]);
+	}
+	for(i = 0; i < UTP_INBUF_SIZE; i++)
+	{
+		free(c->inbuf[i]);
+	}
+	close(c->fd);
+	if(c->app_fd != -1)
+	{
+		close(c->app_fd);
+	}
+	free(c->rcvbuf);
+	free(c);
+}
+
+// fast retransmit of a packet found lost. a packet that was retransmitted already is only sent
+// again once something sent after that retransmission made it. returns 1 if it was sent.
+static int retransmit(struct utp_conn *c, uint16_t seq)
+{
+	struct utp_out_packet *p = c->outbuf[seq % UTP_OUTBUF_SIZE];
+
+	if(!p || p->seq_nr != seq || p->need_resend || (p->transmissions > 1 && p->sent_us >= c->newest_acked_sent_us))
+	{
+		return 0;
+	}
+	transmit(c, p);
+
+	return 1;
+}
+
+// sends packets marked after a timeout again, oldest first, as long as the window allows. returns
+// the number still waiting.
+static int resend_marked(struct utp_conn *c)
+{
+	struct utp_out_packet *p;
+	long int window = c->max_window < c->peer_wnd ? c->max_window : c->peer_wnd;
+	uint16_t seq;
+	int waiting = 0;
+
+	for(seq = c->oldest; seq != c->seq_nr; seq++)
+	{
+		p = c->outbuf[seq % UTP_OUTBUF_SIZE];
+		if(!p || !p->need_resend)
+		{
+			continue;
+		}
+		if(c->cur_window != 0 && c->cur_window + p->payload_len > window)
+		{
+			waiting++;
+			continue;
+		}
+		p->need_resend = 0;
+		c->cur_window += p->payload_len;
+		transmit(c, p);
+	}
+	c->resend_waiting = waiting;
+
+	return waiting;
+}
+
+// multiplicative decrease, at most once per round trip.
+static void on_loss(struct utp_conn *c)
+{
+	uint64_t now = now_us();
+
+	if(now - c->last_decay_us < (uint64_t)(c->rtt > 100 ? c->rtt : 100) * 1000)
+	{
+		return;
+	}
+	c->last_decay_us = now;
+	c->max_window /= 2;
+	if(c->max_window < UTP_MIN_WINDOW)
+	{
+		c->max_window = UTP_MIN_WINDOW;
+	}
+	bf_log("[LOG] utp: Packet loss. Window now %ld bytes.\n", c->max_window);
+}
+
+// LEDBAT: grows the window while the queueing delay is below the target and shrinks it above.
+static void ledbat(struct utp_conn *c, long int acked_bytes, uint32_t delay)
+{
+	uint64_t now = now_us();
+	uint32_t base;
+	int32_t queueing;
+	double off_target, window_factor;
+	int i;
+
+	if(now - c->base_delay_minute_us > 60000000)
+	{
+		memmove(c->base_delay + 1, c->base_delay, (UTP_BASE_DELAY_MINUTES - 1) * sizeof(uint32_t));
+		c->base_delay[0] = delay;
+		c->base_delay_minute_us = now;
+	}
+	else if(delay < c->base_delay[0])
+	{
+		c->base_delay[0] = delay;
+	}
+	base = c->base_delay[0];
+	for(i = 1; i < UTP_BASE_DELAY_MINUTES; i++)
+	{
+		if(c->base_delay[i] < base)
+		{
+			base = c->base_delay[i];
+		}
+	}
+	// the clocks of the two ends aren't synchronised, only the difference to the base delay means anything.
+	queueing = (int32_t)(delay - base);
+	if(queueing < 0)
+	{
+		queueing = 0;
+	}
+
+	off_target = (double)(UTP_TARGET_DELAY_US - queueing) / UTP_TARGET_DELAY_US;
+	window_factor = (double)(acked_bytes < c->max_window ? acked_bytes : c->max_window) / (acked_bytes > c->max_window ? acked_bytes : c->max_window);
+	c->max_window += (long int)(UTP_MAX_CWND_INCREASE * off_target * window_factor);
+	if(c->max_window < UTP_MIN_WINDOW)
+	{
+		c->max_window = UTP_MIN_WINDOW;
+	}
+	if(c->max_window > UTP_MAX_WINDOW)
+	{
+		c->max_window = UTP_MAX_WINDOW;
+	}
+}
+
+// returns the payload length of the packet if it was waiting for an ack, -1 otherwise. only the
+// packet an ack was sent for gives an RTT sample, the ones covered along with it may have arrived
+// much earlier. so may packets sent before the last retransmission, if they waited for it to fill
+// a hole.
+static int ack_packet(struct utp_conn *c, uint16_t seq, int sample_rtt)
+{
+	struct utp_out_packet *p = c->outbuf[seq % UTP_OUTBUF_SIZE];
+	int len, sample;
+
+	if(!p || p->seq_nr != seq)
+	{
+		return -1;
+	}
+	// retransmitted packets give ambiguous samples (Karn's algorithm)
+	if(sample_rtt && p->transmissions == 1 && p->sent_us > c->last_resend_us)
+	{
+		sample = (now_us() - p->sent_us) / 1000;
+		if(c->rtt == 0)
+		{
+			c->rtt = sample;
+			c->rtt_var = sample / 2;
+		}
+		else
+		{
+			c->rtt_var += (abs(c->rtt - sample) - c->rtt_var) / 4;
+			c->rtt += (sample - c->rtt) / 8;
+		}
+	}
+	if(p->type == ST_FIN)
+	{
+		c->fin_acked = 1;
+		c->fin_acked_us = now_us();
+	}
+	if(p->sent_us > c->newest_acked_sent_us)
+	{
+		c->newest_acked_sent_us = p->sent_us;
+	}
+	len = p->payload_len;
+	if(!p->need_resend)
+	{
+		c->cur_window -= len;
+	}
+	free(p);
+	c->outbuf[seq % UTP_OUTBUF_SIZE] = NULL;
+
+	return len;
+}
+
+static void process_ack(struct utp_conn *c, struct utp_header *h, uint8_t *sack, int sack_len)
+{
+	long int acked_bytes = 0;
+	int n, i, len, acked = 0, sacked = 0, lost = 0;
+	uint16_t seq, before = c->oldest;
+
+	// cumulative ack of everything up to ack_nr
+	n = (uint16_t)(h->ack_nr - c->oldest) + 1;
+	if(n <= outstanding(c))
+	{
+		for(i = 0; i < n; i++)
+		{
+			if((len = ack_packet(c, c->oldest + i, i == n - 1)) != -1)
+			{
+				acked_bytes += len;
+				acked = 1;
+			}
+		}
+	}
+	// selective acks of packets after ack_nr + 1
+	for(i = 0; sack && i < sack_len * 8; i++)
+	{
+		if(!(sack[i / 8] & (1 << (i % 8))))
+		{
+			continue;
+		}
+		seq = h->ack_nr + 2 + i;
+		if((uint16_t)(seq - c->oldest) < outstanding(c) && (len = ack_packet(c, seq, 0)) != -1)
+		{
+			acked_bytes += len;
+			acked = 1;
+		}
+	}
+	while(c->oldest != c->seq_nr && !c->outbuf[c->oldest % UTP_OUTBUF_SIZE])
+	{
+		c->oldest++;
+	}
+
+	if(acked)
+	{
+		// the peer is answering again, so whatever the timeouts backed the RTO off to is undone.
+		c->timeouts = 0;
+		c->rto = c->rtt + 4 * c->rtt_var;
+		if(c->rto < UTP_MIN_RTO_MS)
+		{
+			c->rto = UTP_MIN_RTO_MS;
+		}
+		c->rto_deadline_us = now_us() + (uint64_t)c->rto * 1000;
+		if(h->timestamp_difference_us != 0)
+		{
+			ledbat(c, acked_bytes, h->timestamp_difference_us);
+		}
+	}
+	if(c->oldest == before && h->type == ST_STATE && h->ack_nr == c->last_ack_nr && outstanding(c) > 0)
+	{
+		c->dup_acks++;
+	}
+	else if(c->oldest != before)
+	{
+		c->dup_acks = 0;
+	}
+	c->last_ack_nr = h->ack_nr;
+
+	// a packet is lost once three packets sent after it made it. without selective acks this shows
+	// as three duplicate acks for the one before it.
+	for(i = sack_len * 8 - 1; sack && i >= -1; i--)
+	{
+		seq = h->ack_nr + 2 + i;
+		if(i >= 0 && (sack[i / 8] & (1 << (i % 8))))
+		{
+			sacked++;
+			continue;
+		}
+		if(sacked >= 3 && (uint16_t)(seq - c->oldest) < outstanding(c) && retransmit(c, seq))
+		{
+			lost = 1;
+		}
+	}
+	if(c->dup_acks >= 3)
+	{
+		lost |= retransmit(c, c->oldest);
+		c->dup_acks = 0;
+	}
+	if(lost)
+	{
+		on_loss(c);
+	}
+}
+
+// appends in order data to the ring buffer. returns -1 if there is no room for it.
+static int deliver(struct utp_conn *c, uint8_t type, uint8_t *payload, int len)
+{
+	long int tail, chunk;
+
+	if(type == ST_FIN)
+	{
+		c->got_fin = 1;
+		return 0;
+	}
+	if(c->app_gone)
+	{
+		return 0;
+	}
+	if(len > UTP_RCVBUF_SIZE - c->rcv_len)
+	{
+		return -1;
+	}
+	tail = (c->rcv_head + c->rcv_len) % UTP_RCVBUF_SIZE;
+	chunk = UTP_RCVBUF_SIZE - tail < len ? UTP_RCVBUF_SIZE - tail : len;
+	memcpy(c->rcvbuf + tail, payload, chunk);
+	memcpy(c->rcvbuf, payload + chunk, len - chunk);
+	c->rcv_len += len;
+
+	return 0;
+}
+
+static void process_data(struct utp_conn *c, struct utp_header *h, uint8_t *payload, int len)
+{
+	struct utp_in_packet *p;
+	uint16_t diff = h->seq_nr - (uint16_t)(c->ack_nr + 1);
+	uint16_t seq;
+
+	c->need_ack = 1;
+	if(c->got_fin)
+	{
+		return;
+	}
+	if(diff == 0)
+	{
+		if(deliver(c, h->type, payload, len) == -1)
+		{
+			return;
+		}
+		c->ack_nr++;
+		// now the packets that were waiting for this one
+		for(seq = c->ack_nr + 1; !c->got_fin; seq = c->ack_nr + 1)
+		{
+			p = c->inbuf[seq % UTP_INBUF_SIZE];
+			if(!p || p->seq_nr != seq || deliver(c, p->type, p->payload, p->payload_len) == -1)
+			{
+				break;
+			}
+			c->ooo_bytes -= p->payload_len;
+			free(p);
+			c->inbuf[seq % UTP_INBUF_SIZE] = NULL;
+			c->ack_nr++;
+		}
+	}
+	else if(diff < UTP_INBUF_SIZE && !c->inbuf[h->seq_nr % UTP_INBUF_SIZE] && len <= our_window(c))
+	{
+		p = malloc(sizeof(struct utp_in_packet) + len);
+		p->type = h->type;
+		p->seq_nr = h->seq_nr;
+		p->payload_len = len;
+		memcpy(p->payload, payload, len);
+		c->inbuf[h->seq_nr % UTP_INBUF_SIZE] = p;
+		c->ooo_bytes += len;
+	}
+	// anything else is a duplicate (or too far ahead) and only gets acked again.
+}
+
+static struct utp_conn *find_conn(struct sockaddr_storage *addr, uint16_t recv_id)
+{
+	struct utp_conn *c;
+
+	for(c = g_utp_conns; c; c = c->next)
+	{
+		if(c->recv_id == recv_id && same_addr(&c->addr, addr))
+		{
+			return c;
+		}
+	}
+
+	return NULL;
+}
+
+static void process_syn(struct sockaddr_storage *from, struct utp_header *h)
+{
+	struct utp_conn *c;
+	char ip[INET6_ADDRSTRLEN];
+	int fd;
+
+	if((c = find_conn(from, h->connection_id + 1)) != NULL)
+	{
+		// our STATE got lost
+		send_state(c);
+		return;
+	}
+	if(!g_utp_on_accept)
+	{
+		send_reset(from, h->connection_id, h->seq_nr);
+		return;
+	}
+	if((c = new_conn(from)) == NULL)
+	{
+		return;
+	}
+	c->recv_id = h->connection_id + 1;
+	c->send_id = h->connection_id;
+	c->ack_nr = h->seq_nr;
+	c->peer_wnd = h->wnd_size;
+	c->state = UTP_STATE_CONNECTED;
+	send_state(c);
+
+	util_sockaddr_ip(from, ip, sizeof(ip));
+	bf_log("[LOG] utp: Accepted connection from %s.\n", ip);
+	// the sin6_port and sin_port fields are at the same offset.
+	utp_note_peer(ip, ntohs(((struct sockaddr_in *)from)->sin_port), 1);
+	fd = c->app_fd;
+	c->app_fd = -1;
+	g_utp_on_accept(fd, ip, g_utp_accept_arg);
+}
+
+static void process_packet(uint8_t *buf, int len, struct sockaddr_storage *from)
+{
+	struct utp_header h;
+	struct utp_conn *c;
+	uint8_t *p, *end, *sack = NULL;
+	uint8_t ext;
+	int sack_len = 0, ext_len;
+
+	if(read_header(buf, len, &h) != 0)
+	{
+		return;
+	}
+	p = buf + UTP_HEADER_LEN;
+	end = buf + len;
+	for(ext = h.extension; ext; ext = p[0], p += 2 + ext_len)
+	{
+		if(p + 2 > end || p + 2 + p[1] > end)
+		{
+			return;
+		}
+		ext_len = p[1];
+		if(ext == UTP_EXT_SACK)
+		{
+			sack = p + 2;
+			sack_len = ext_len;
+		}
+	}
+
+	if(h.type == ST_SYN)
+	{
+		process_syn(from, &h);
+		return;
+	}
+	if((c = find_conn(from, h.connection_id)) == NULL)
+	{
+		if(h.type != ST_RESET)
+		{
+			send_reset(from, h.connection_id, h.seq_nr);
+		}
+		return;
+	}
+	if(c->state == UTP_STATE_CLOSED || c->state == UTP_STATE_FAILED)
+	{
+		return;
+	}
+
+	c->last_recv_us = now_us();
+	c->reply_micro = (uint32_t)c->last_recv_us - h.timestamp_us;
+	c->peer_wnd = h.wnd_size;
+
+	if(h.type == ST_RESET)
+	{
+		bf_log("[LOG] utp: Connection reset by peer.\n");
+		c->state = c->state == UTP_STATE_SYN_SENT ? UTP_STATE_FAILED : UTP_STATE_CLOSED;
+		pthread_cond_broadcast(&g_utp_cond);
+		return;
+	}
+	if(c->state == UTP_STATE_SYN_SENT)
+	{
+		if(h.type == ST_STATE && h.ack_nr == c->oldest)
+		{
+			// the peer's first data packet will carry the seq_nr of this STATE.
+			c->ack_nr = h.seq_nr - 1;
+			ack_packet(c, c->oldest, 1);
+			c->oldest++;
+			c->rto_deadline_us = 0;
+			c->timeouts = 0;
+			c->state = UTP_STATE_CONNECTED;
+			pthread_cond_broadcast(&g_utp_cond);
+		}
+		return;
+	}
+
+	process_ack(c, &h, sack, sack_len);
+	if(h.type == ST_DATA || h.type == ST_FIN)
+	{
+		process_data(c, &h, p, end - p);
+	}
+}
+
+// moves received bytes to the socketpair and tells the application end about the FIN.
+static void flush_rcvbuf(struct utp_conn *c)
+{
+	long int chunk;
+	ssize_t n;
+
+	while(c->rcv_len > 0 && !c->app_gone)
+	{
+		chunk = UTP_RCVBUF_SIZE - c->rcv_head < c->rcv_len ? UTP_RCVBUF_SIZE - c->rcv_head : c->rcv_len;
+		n = send(c->fd, c->rcvbuf + c->rcv_head, chunk, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(n <= 0)
+		{
+			if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			{
+				break;
+			}
+			// nobody reads any more; whatever the peer sends is dropped from now on.
+			c->app_gone = 1;
+			c->rcv_len = 0;
+			break;
+		}
+		c->rcv_head = (c->rcv_head + n) % UTP_RCVBUF_SIZE;
+		c->rcv_len -= n;
+	}
+	if(c->app_gone)
+	{
+		c->rcv_len = 0;
+	}
+	// a peer that saw a (nearly) closed window has to be told that it opened again.
+	if(c->last_adv_wnd < UTP_MSS && our_window(c) >= UTP_MSS)
+	{
+		c->need_ack = 1;
+	}
+	if(c->got_fin && c->rcv_len == 0 && !c->fin_delivered)
+	{
+		shutdown(c->fd, SHUT_WR);
+		c->fin_delivered = 1;
+	}
+}
+
+static int can_send(struct utp_conn *c)
+{
+	long int window = c->max_window < c->peer_wnd ? c->max_window : c->peer_wnd;
+
+	if(c->state != UTP_STATE_CONNECTED || c->eof_local || c->resend_waiting || outstanding(c) >= UTP_OUTBUF_SIZE - 1)
+	{
+		return 0;
+	}
+	// with nothing in flight one packet is always allowed, which also probes a closed receive window.
+	return c->cur_window == 0 || c->cur_window + UTP_MSS <= window;
+}
+
+// reads what the application wrote to the socketpair and sends it as long as the window allows.
+static void send_data(struct utp_conn *c)
+{
+	uint8_t payload[UTP_MSS];
+	ssize_t n;
+
+	// what was lost goes first
+	if(c->resend_waiting && resend_marked(c) > 0)
+	{
+		return;
+	}
+	while(can_send(c))
+	{
+		n = recv(c->fd, payload, UTP_MSS, MSG_DONTWAIT);
+		if(n > 0)
+		{
+			queue_packet(c, ST_DATA, payload, n);
+			continue;
+		}
+		if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		{
+			break;
+		}
+		c->eof_local = 1;
+	}
+	if(c->state == UTP_STATE_CONNECTED && c->eof_local && !c->fin_sent && outstanding(c) < UTP_OUTBUF_SIZE - 1)
+	{
+		queue_packet(c, ST_FIN, NULL, 0);
+		c->fin_sent = 1;
+	}
+}
+
+static void check_timeouts(struct utp_conn *c)
+{
+	struct utp_out_packet *p;
+	uint64_t now = now_us();
+	uint16_t seq;
+
+	// utp_connect() still has to see the failure before the connection can go.
+	if(c->state == UTP_STATE_FAILED)
+	{
+		return;
+	}
+	if(outstanding(c) > 0 && c->rto_deadline_us && now >= c->rto_deadline_us)
+	{
+		c->timeouts++;
+		if(c->state == UTP_STATE_SYN_SENT && c->timeouts > UTP_SYN_RETRIES)
+		{
+			c->state = UTP_STATE_FAILED;
+			pthread_cond_broadcast(&g_utp_cond);
+			return;
+		}
+		if(c->timeouts > UTP_MAX_TIMEOUTS)
+		{
+			bf_log("[LOG] utp: Peer stopped answering. Resetting the connection.\n");
+			send_reset(&c->addr, c->send_id, c->ack_nr);
+			c->state = UTP_STATE_CLOSED;
+			return;
+		}
+		c->max_window = UTP_MIN_WINDOW;
+		c->rto = c->rto * 2 < UTP_MAX_RTO_MS ? c->rto * 2 : UTP_MAX_RTO_MS;
+		c->rto_deadline_us = now + (uint64_t)c->rto * 1000;
+		// everything in flight is considered lost and goes out again as the window opens up.
+		for(seq = c->oldest; seq != c->seq_nr; seq++)
+		{
+			if((p = c->outbuf[seq % UTP_OUTBUF_SIZE]) != NULL && !p->need_resend)
+			{
+				p->need_resend = 1;
+				c->cur_window -= p->payload_len;
+			}
+		}
+		resend_marked(c);
+	}
+	if(c->state != UTP_STATE_CONNECTED)
+	{
+		return;
+	}
+	if(now - c->last_recv_us > (uint64_t)UTP_IDLE_TIMEOUT_MS * 1000)
+	{
+		bf_log("[LOG] utp: Connection idle for too long. Closing it.\n");
+		c->state = UTP_STATE_CLOSED;
+	}
+	else if(c->fin_acked && ((c->fin_delivered || c->app_gone) || now - c->fin_acked_us > (uint64_t)UTP_LINGER_MS * 1000))
+	{
+		c->state = UTP_STATE_CLOSED;
+	}
+}
+
+static void *utp_thread(void *arg)
+{
+	bf_log("++++++++++++++++++++ START:  UTP_THREAD +++++++++++++++++++++++\n");
+	struct pollfd *fds = NULL;
+	int nfds, max_fds = 0;
+	short events;
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	uint8_t buf[UTP_MAX_PACKET_LEN + 64];
+	char drain[64];
+	struct utp_conn *c, *next;
+	ssize_t n;
+
+	pthread_mutex_lock(&g_utp_mutex);
+	while(!g_utp_stop)
+	{
+		// the UDP socket, the wake up pipe and the socketpairs that have something to be done with.
+		nfds = 2;
+		for(c = g_utp_conns; c; c = c->next)
+		{
+			nfds++;
+		}
+		if(nfds > max_fds)
+		{
+			max_fds = nfds * 2;
+			fds = realloc(fds, max_fds * sizeof(struct pollfd));
+		}
+		fds[0].fd = g_utp_socket;
+		fds[0].events = POLLIN;
+		fds[1].fd = g_utp_wake[0];
+		fds[1].events = POLLIN;
+		nfds = 2;
+		for(c = g_utp_conns; c; c = c->next)
+		{
+			events = 0;
+			if(can_send(c))
+			{
+				events |= POLLIN;
+			}
+			if(c->state == UTP_STATE_CONNECTED && c->rcv_len > 0 && !c->app_gone)
+			{
+				events |= POLLOUT;
+			}
+			if(events)
+			{
+				fds[nfds].fd = c->fd;
+				fds[nfds].events = events;
+				nfds++;
+			}
+		}
+
+		pthread_mutex_unlock(&g_utp_mutex);
+		poll(fds, nfds, UTP_POLL_MS);
+		while(read(g_utp_wake[0], drain, sizeof(drain)) > 0);
+		pthread_mutex_lock(&g_utp_mutex);
+
+		for(;;)
+		{
+			from_len = sizeof(from);
+			n = recvfrom(g_utp_socket, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+			if(n <= 0)
+			{
+				break;
+			}
+			process_packet(buf, n, &from);
+		}
+
+		for(c = g_utp_conns; c; c = next)
+		{
+			next = c->next;
+			if(c->state == UTP_STATE_CONNECTED)
+			{
+				flush_rcvbuf(c);
+				send_data(c);
+				if(c->need_ack)
+				{
+					send_state(c);
+				}
+			}
+			check_timeouts(c);
+			if(c->state == UTP_STATE_CLOSED)
+			{
+				destroy_conn(c);
+			}
+		}
+	}
+	pthread_mutex_unlock(&g_utp_mutex);
+	free(fds);
+
+	bf_log("---------------------------------------- FINISH:  UTP_THREAD ----------------------------------------\n");
+	return NULL;
+}
+
+int utp_init(uint16_t port, utp_accept_callback on_accept, void *arg)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+
+	// IPv4 peers reach a dual stack socket with IPv4 mapped IPv6 addresses.
+	if((g_utp_socket = util_bind_dual_stack(SOCK_DGRAM, port)) == -1)
+	{
+		bf_log("[ERROR] utp_init(): Failed to bind UDP port %d: %s\n", port, strerror(errno));
+		return -1;
+	}
+	getsockname(g_utp_socket, (struct sockaddr *)&addr, &len);
+	g_utp_family = addr.ss_family;
+	if(pipe(g_utp_wake) == -1)
+	{
+		bf_log("[ERROR] utp_init(): Failed to create pipe: %s\n", strerror(errno));
+		close(g_utp_socket);
+		g_utp_socket = -1;
+		return -1;
+	}
+	fcntl(g_utp_wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(g_utp_wake[1], F_SETFL, O_NONBLOCK);
+
+	g_utp_on_accept = on_accept;
+	g_utp_accept_arg = arg;
+	g_utp_stop = 0;
+	if(pthread_create(&g_utp_thread, NULL, utp_thread, NULL) != 0)
+	{
+		close(g_utp_socket);
+		close(g_utp_wake[0]);
+		close(g_utp_wake[1]);
+		g_utp_socket = -1;
+		return -1;
+	}
+	bf_log("[LOG] utp_init(): uTP listening on UDP port %d.\n", port);
+
+	return 0;
+}
+
+void utp_shutdown()
+{
+	struct utp_conn *c;
+
+	if(g_utp_socket == -1)
+	{
+		return;
+	}
+	pthread_mutex_lock(&g_utp_mutex);
+	g_utp_stop = 1;
+	pthread_mutex_unlock(&g_utp_mutex);
+	write(g_utp_wake[1], "x", 1);
+	pthread_join(g_utp_thread, NULL);
+
+	while((c = g_utp_conns) != NULL)
+	{
+		if(c->state != UTP_STATE_FAILED)
+		{
+			send_reset(&c->addr, c->send_id, c->ack_nr);
+		}
+		destroy_conn(c);
+	}
+	close(g_utp_socket);
+	close(g_utp_wake[0]);
+	close(g_utp_wake[1]);
+	g_utp_socket = -1;
+}
+
+int utp_connect(const char *ip, uint16_t port, int timeout_ms)
+{
+	struct sockaddr_storage addr;
+	struct sockaddr_in addr4;
+	struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+	struct utp_conn *c;
+	struct timespec ts;
+	int fd = -1, len;
+
+	if(g_utp_socket == -1 || util_make_sockaddr(ip, port, &addr, &len) != 0)
+	{
+		return -1;
+	}
+	if(addr.ss_family != g_utp_family)
+	{
+		if(g_utp_family == AF_INET)
+		{
+			// IPv6 peers need IPv6 on this host.
+			return -1;
+		}
+		memcpy(&addr4, &addr, sizeof(addr4));
+		bzero(&addr, sizeof(addr));
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_port = addr4.sin_port;
+		addr6->sin6_addr.s6_addr[10] = 0xff;
+		addr6->sin6_addr.s6_addr[11] = 0xff;
+		memcpy(&addr6->sin6_addr.s6_addr[12], &addr4.sin_addr, 4);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	ts.tv_sec += ts.tv_nsec / 1000000000;
+	ts.tv_nsec = ts.tv_nsec % 1000000000;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_utp_mutex);
+
+	if((c = new_conn(&addr)) == NULL)
+	{
+		pthread_mutex_unlock(&g_utp_mutex);
+		return -1;
+	}
+	c->recv_id = rand();
+	c->send_id = c->recv_id + 1;
+	c->state = UTP_STATE_SYN_SENT;
+	queue_packet(c, ST_SYN, NULL, 0);
+
+	while(c->state == UTP_STATE_SYN_SENT)
+	{
+		if(pthread_cond_timedwait(&g_utp_cond, &g_utp_mutex, &ts) == ETIMEDOUT)
+		{
+			break;
+		}
+	}
+	if(c->state == UTP_STATE_CONNECTED)
+	{
+		fd = c->app_fd;
+		c->app_fd = -1;
+	}
+	else
+	{
+		c->state = UTP_STATE_CLOSED;
+	}
+
+	pthread_mutex_unlock(&g_utp_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	// the uTP thread may be asleep in poll() with nothing to say about the new connection yet.
+	write(g_utp_wake[1], "x", 1);
+	bf_log("[LOG] utp_connect(): %s %s:%d over uTP.\n", fd == -1 ? "Failed to connect to" : "Connected to", ip, port);
+	utp_note_peer(ip, port, fd != -1);
+
+	return fd;
+}
+
+void utp_note_peer(const char *ip, uint16_t port, int supported)
+{
+	int i;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_utp_known_mutex);
+
+	for(i = 0; i < g_utp_num_known && (g_utp_known[i].port != port || strcmp(g_utp_known[i].ip, ip) != 0); i++);
+	if(i == g_utp_num_known)
+	{
+		i = g_utp_next_known;
+		g_utp_next_known = (g_utp_next_known + 1) % UTP_KNOWN_MAX;
+		if(g_utp_num_known < UTP_KNOWN_MAX)
+		{
+			g_utp_num_known++;
+		}
+		strncpy(g_utp_known[i].ip, ip, INET6_ADDRSTRLEN - 1);
+		g_utp_known[i].ip[INET6_ADDRSTRLEN - 1] = '\0';
+		g_utp_known[i].port = port;
+	}
+	g_utp_known[i].supported = supported;
+
+	pthread_mutex_unlock(&g_utp_known_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+}
+
+int utp_peer_supported(const char *ip, uint16_t port)
+{
+	int i, supported = 0;
+
+	/* -X-X-X- CRITICAL REGION START -X-X-X- */
+	pthread_mutex_lock(&g_utp_known_mutex);
+
+	for(i = 0; i < g_utp_num_known; i++)
+	{
+		if(g_utp_known[i].port == port && strcmp(g_utp_known[i].ip, ip) == 0)
+		{
+			supported = g_utp_known[i].supported;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&g_utp_known_mutex);
+	/* -X-X-X- CRITICAL REGION END -X-X-X- */
+
+	return supported;
+}
@@ -0,0 +1,225 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<time.h>
+#include<unistd.h>
+#include<poll.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<sys/wait.h>
+
+#include "utp.h"
+#include "bf_logger.h"
+
+/*
+utp_loopback sends data over uTP (see utp.h) between two endpoints on 127.0.0.1 and checks that
+every byte arrives intact and in order.
+
+The uTP code has one UDP socket and one thread per process, so the receiver runs in a child
+process. The parent connects to it, writes the data and waits for the receiver to confirm it. Every
+byte depends on its offset, so a lost, duplicated or reordered packet shows as a mismatch. `make
+utp_loopback` builds it with UTP_SIMULATED_LOSS set to UTP_LOSS percent (5 by default) on both
+ends, so retransmissions, selective ACKs and timeouts are all exercised.
+
+	utp_loopback [bytes]
+
+Exits with 0 if the data arrived intact and in order.
+*/
+
+#define DEFAULT_BYTES (4 * 1024 * 1024)
+#define SENDER_PORT 46881
+#define RECEIVER_PORT 46882
+#define CONNECT_TIMEOUT_MS 10000
+#define STALL_TIMEOUT_MS 30000 // without a byte moving either way the transfer has failed
+#define LOG_FILE "logs/utp_loopback.log"
+
+#ifndef UTP_SIMULATED_LOSS
+#define UTP_SIMULATED_LOSS 0
+#endif
+
+static int g_accepted[2]; // pipe the accept callback passes the connection through
+
+static double now_s()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the byte at offset i of the data. consecutive words differ, so a packet out of place is noticed.
+static uint8_t pattern(long int i)
+{
+	uint32_t word = (uint32_t)(i / 4) * 2654435761u;
+
+	return word >> (8 * (i % 4));
+}
+
+static void on_accept(int fd, const char *ip, void *arg)
+{
+	write(g_accepted[1], &fd, sizeof(fd));
+}
+
+// waits up to STALL_TIMEOUT_MS for fd to become readable or writable. returns -1 on timeout.
+static int wait_for(int fd, short events)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+
+	return poll(&pfd, 1, STALL_TIMEOUT_MS) == 1 ? 0 : -1;
+}
+
+// reads the data, checks it and confirms it with one byte. returns 0 if it was intact and in order.
+static int receive(long int bytes, int ready)
+{
+	uint8_t buf[16384];
+	long int received = 0;
+	int fd, i, n;
+
+	if(pipe(g_accepted) == -1 || utp_init(RECEIVER_PORT, on_accept, NULL) != 0)
+	{
+		printf("Failed to start the receiver on UDP port %d.\n", RECEIVER_PORT);
+		return -1;
+	}
+	write(ready, "r", 1);
+	if(wait_for(g_accepted[0], POLLIN) == -1 || read(g_accepted[0], &fd, sizeof(fd)) != sizeof(fd))
+	{
+		printf("The sender didn't connect.\n");
+		utp_shutdown();
+		return -1;
+	}
+
+	while(received < bytes)
+	{
+		if(wait_for(fd, POLLIN) == -1 || (n = read(fd, buf, sizeof(buf))) <= 0)
+		{
+			printf("The connection stalled or closed after %ld of %ld bytes.\n", received, bytes);
+			goto fail;
+		}
+		for(i = 0; i < n; i++)
+		{
+			if(buf[i] != pattern(received + i))
+			{
+				printf("Byte %ld is wrong: the data was corrupted or reordered.\n", received + i);
+				goto fail;
+			}
+		}
+		received += n;
+	}
+	if(received > bytes)
+	{
+		printf("Got more than the %ld bytes sent.\n", bytes);
+		goto fail;
+	}
+	send(fd, "k", 1, MSG_NOSIGNAL);
+	// the sender closes once it has the confirmation. the connection has to live until then.
+	wait_for(fd, POLLIN);
+	read(fd, buf, 1);
+	close(fd);
+	utp_shutdown();
+	return 0;
+
+fail:
+	close(fd);
+	utp_shutdown();
+	return -1;
+}
+
+// connects to the receiver, writes the data and waits for the confirmation. returns 0 if it came.
+static int transmit(long int bytes)
+{
+	uint8_t buf[16384];
+	long int sent, len;
+	int fd, i, n;
+	char ok = 0;
+
+	if(utp_init(SENDER_PORT, NULL, NULL) != 0 || (fd = utp_connect("127.0.0.1", RECEIVER_PORT, CONNECT_TIMEOUT_MS)) == -1)
+	{
+		printf("Failed to connect to the receiver over uTP.\n");
+		utp_shutdown();
+		return -1;
+	}
+	for(sent = 0; sent < bytes; sent += n)
+	{
+		len = bytes - sent < (long int)sizeof(buf) ? bytes - sent : (long int)sizeof(buf);
+		for(i = 0; i < len; i++)
+		{
+			buf[i] = pattern(sent + i);
+		}
+		if(wait_for(fd, POLLOUT) == -1 || (n = send(fd, buf, len, MSG_NOSIGNAL)) <= 0)
+		{
+			printf("The connection stalled or closed after %ld of %ld bytes were sent.\n", sent, bytes);
+			close(fd);
+			utp_shutdown();
+			return -1;
+		}
+		// a short write leaves the rest of buf to be made again next time round.
+	}
+	if(wait_for(fd, POLLIN) == -1 || read(fd, &ok, 1) != 1 || ok != 'k')
+	{
+		printf("The receiver didn't confirm the data.\n");
+		close(fd);
+		utp_shutdown();
+		return -1;
+	}
+	close(fd);
+	utp_shutdown();
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	long int bytes = argc > 1 ? atol(argv[1]) : DEFAULT_BYTES;
+	int ready[2], status, rv;
+	double start, elapsed;
+	char c;
+	pid_t pid;
+
+	if(bytes < 1)
+	{
+		printf("Usage: utp_loopback [bytes]\n");
+		return 1;
+	}
+	bf_logger_init(LOG_FILE);
+	bf_logger_echo(0);
+
+	fflush(NULL);
+	if(pipe(ready) == -1 || (pid = fork()) == -1)
+	{
+		printf("Failed to start the receiver.\n");
+		return 1;
+	}
+	if(pid == 0)
+	{
+		// the two ends drop different packets.
+		srand(2);
+		close(ready[0]);
+		exit(receive(bytes, ready[1]) == 0 ? 0 : 1);
+	}
+	srand(1);
+	close(ready[1]);
+	if(read(ready[0], &c, 1) != 1)
+	{
+		printf("The receiver failed to start.\n");
+		waitpid(pid, &status, 0);
+		return 1;
+	}
+
+	start = now_s();
+	rv = transmit(bytes);
+	elapsed = now_s() - start;
+	waitpid(pid, &status, 0);
+	bf_logger_end();
+	if(rv != 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		printf("FAILED: %ld bytes over uTP with %d%% of the packets dropped.\n", bytes, UTP_SIMULATED_LOSS);
+		return 1;
+	}
+	printf("OK: %ld bytes arrived intact and in order in %.1f s (%.0f KiB/s) with %d%% of the packets dropped.\n",
+		bytes, elapsed, bytes / elapsed / 1024, UTP_SIMULATED_LOSS);
+
+	return 0;
+}
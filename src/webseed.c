@@ -0,0 +1,366 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<time.h>
+#include<pthread.h>
+
+#include<curl/curl.h>
+
+#include "webseed.h"
+
+#include "pwp.h"
+#include "ratelimit.h"
+#include "diskio.h"
+#include "bf_logger.h"
+
+struct webseed;
+
+struct webseed_request
+{
+	CURL *easy; // NULL once the transfer is over
+	struct diskio_job *verify; // the piece's hash job once it is downloaded; the slot is free without either
+	struct webseed *seed;
+	int piece_idx;
+	long int received; // bytes of the piece written so far
+	uint64_t resume_ms; // when to go on with a transfer paused by the rate limit, 0 if it isn't
+	char range[48];
+};
+
+struct webseed
+{
+	char *url;
+	struct pwp_torrent *torrent;
+	int failures; // failed requests in a row
+	struct rate_bucket download_bucket; // child of the torrent's download bucket
+	struct webseed_request requests[WEBSEED_MAX_REQUESTS];
+};
+
+// the web seeds of one torrent and the thread running them.
+struct webseed_set
+{
+	struct pwp_torrent *torrent;
+	struct webseed *seeds;
+	int num_of_seeds;
+	CURLM *multi;
+	pthread_t thread;
+	volatile int stop;
+	volatile int running;
+	int started;
+};
+
+static void *webseed_thread(void *arg);
+static size_t write_callback(char *data, size_t size, size_t nmemb, void *arg);
+static int start_request(struct webseed_set *ws, struct webseed_request *req, int idx);
+static void finish_request(struct webseed_set *ws, struct webseed_request *req, CURLcode result);
+static void finish_piece(struct webseed_set *ws, struct webseed_request *req, int result);
+static void verified(void *arg);
+static uint64_t monotonic_ms();
+
+int webseed_start(struct pwp_torrent *t)
+{
+	struct webseed_set *ws;
+	int i;
+
+	curl_global_init(CURL_GLOBAL_ALL);
+	ws = calloc(1, sizeof(struct webseed_set));
+	ws->torrent = t;
+	t->webseeds = ws;
+	if((ws->multi = curl_multi_init()) == NULL)
+	{
+		bf_log("[ERROR] webseed_start(): Failed to create the curl multi handle.\n");
+		webseed_stop(t);
+		return -1;
+	}
+
+	ws->seeds = calloc(t->num_of_web_seeds, sizeof(struct webseed));
+	ws->num_of_seeds = t->num_of_web_seeds;
+	for(i = 0; i < ws->num_of_seeds; i++)
+	{
+		ws->seeds[i].url = t->web_seed_urls[i];
+		ws->seeds[i].torrent = t;
+		ratelimit_init(&ws->seeds[i].download_bucket, RATELIMIT_UNLIMITED, &t->download_bucket);
+		bf_log("[LOG] webseed_start(): Web seed %s.\n", t->web_seed_urls[i]);
+	}
+
+	ws->stop = 0;
+	ws->running = 1;
+	if(pthread_create(&ws->thread, NULL, webseed_thread, (void *)ws) != 0)
+	{
+		bf_log("[ERROR] webseed_start(): Failed to start the web seed thread.\n");
+		ws->running = 0;
+		webseed_stop(t);
+		return -1;
+	}
+	ws->started = 1;
+
+	return 0;
+}
+
+int webseed_running(struct pwp_torrent *t)
+{
+	return t->webseeds && t->webseeds->running;
+}
+
+void webseed_stop(struct pwp_torrent *t)
+{
+	struct webseed_set *ws = t->webseeds;
+	int i;
+
+	if(!ws)
+	{
+		return;
+	}
+	if(ws->started)
+	{
+		ws->stop = 1;
+		curl_multi_wakeup(ws->multi);
+		pthread_join(ws->thread, NULL);
+	}
+
+	for(i = 0; i < ws->num_of_seeds; i++)
+	{
+		ratelimit_destroy(&ws->seeds[i].download_bucket);
+	}
+	free(ws->seeds);
+	if(ws->multi)
+	{
+		curl_multi_cleanup(ws->multi);
+	}
+	free(ws);
+	t->webseeds = NULL;
+}
+
+static void *webseed_thread(void *arg)
+{
+	bf_log("++++++++++++++++++++ START:  WEBSEED_THREAD +++++++++++++++++++++++\n");
+	struct webseed_set *ws = (struct webseed_set *)arg;
+	struct pwp_torrent *t = ws->torrent;
+	struct webseed *seed;
+	struct webseed_request *req;
+	CURLMsg *msg;
+	uint64_t now;
+	long int timeout;
+	int i, j, idx, thin_swarm, in_flight, alive, running, n, result;
+
+	while(!ws->stop)
+	{
+		thin_swarm = num_of_connected_peers(t) < WEBSEED_THIN_SWARM;
+		in_flight = 0;
+		alive = 0;
+		now = monotonic_ms();
+		timeout = WEBSEED_POLL_MS;
+		for(i = 0; i < ws->num_of_seeds; i++)
+		{
+			seed = &ws->seeds[i];
+			for(j = 0; j < WEBSEED_MAX_REQUESTS; j++)
+			{
+				req = &seed->requests[j];
+				if(req->verify && (result = diskio_verify_result(req->verify, 0)) != DISKIO_PENDING)
+				{
+					req->verify = NULL;
+					finish_piece(ws, req, result);
+				}
+				// curl hands the data it held back to write_callback() again, which may pause once more.
+				if(req->easy && req->resume_ms)
+				{
+					if(req->resume_ms <= now)
+					{
+						req->resume_ms = 0;
+						curl_easy_pause(req->easy, CURLPAUSE_CONT);
+					}
+					else if((long int)(req->resume_ms - now) < timeout)
+					{
+						timeout = req->resume_ms - now;
+					}
+				}
+				if(!req->easy && !req->verify && seed->failures < WEBSEED_MAX_FAILURES && (idx = choose_webseed_piece_idx(t, thin_swarm)) != -1)
+				{
+					req->seed = seed;
+					if(start_request(ws, req, idx) != 0)
+					{
+						release_piece(t, idx);
+					}
+				}
+				in_flight += req->easy || req->verify;
+			}
+			alive += seed->failures < WEBSEED_MAX_FAILURES;
+		}
+		if(in_flight == 0 && (alive == 0 || is_wanted_download_complete(t)))
+		{
+			break;
+		}
+
+		curl_multi_perform(ws->multi, &running);
+		while((msg = curl_multi_info_read(ws->multi, &n)) != NULL)
+		{
+			if(msg->msg == CURLMSG_DONE)
+			{
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+				finish_request(ws, req, msg->data.result);
+			}
+		}
+		curl_multi_poll(ws->multi, NULL, 0, timeout, NULL);
+	}
+
+	// the transfers that are still going are abandoned, and the pieces being hashed are waited for.
+	for(i = 0; i < ws->num_of_seeds; i++)
+	{
+		for(j = 0; j < WEBSEED_MAX_REQUESTS; j++)
+		{
+			req = &ws->seeds[i].requests[j];
+			if(req->easy)
+			{
+				curl_multi_remove_handle(ws->multi, req->easy);
+				curl_easy_cleanup(req->easy);
+				req->easy = NULL;
+				release_piece(t, req->piece_idx);
+			}
+			if(req->verify)
+			{
+				result = diskio_verify_result(req->verify, 1);
+				req->verify = NULL;
+				finish_piece(ws, req, result);
+			}
+		}
+	}
+
+	ws->running = 0;
+	bf_log("---------------------------------------- FINISH:  WEBSEED_THREAD ----------------------------------------\n");
+	return NULL;
+}
+
+// asks for piece idx with a Range request.
+static int start_request(struct webseed_set *ws, struct webseed_request *req, int idx)
+{
+	struct pwp_torrent *t = ws->torrent;
+	long int start = (long int)idx * t->piece_length;
+
+	if((req->easy = curl_easy_init()) == NULL)
+	{
+		return -1;
+	}
+	req->piece_idx = idx;
+	req->received = 0;
+	req->resume_ms = 0;
+	snprintf(req->range, sizeof(req->range), "%ld-%ld", start, start + t->pieces[idx].piece_length - 1);
+
+	curl_easy_setopt(req->easy, CURLOPT_URL, req->seed->url);
+	curl_easy_setopt(req->easy, CURLOPT_RANGE, req->range);
+	curl_easy_setopt(req->easy, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(req->easy, CURLOPT_CONNECTTIMEOUT, 10L);
+	// a server that stops sending is given up on like a peer that doesn't answer our requests.
+	curl_easy_setopt(req->easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(req->easy, CURLOPT_LOW_SPEED_TIME, 30L);
+	curl_easy_setopt(req->easy, CURLOPT_WRITEFUNCTION, write_callback);
+	curl_easy_setopt(req->easy, CURLOPT_WRITEDATA, (void *)req);
+	curl_easy_setopt(req->easy, CURLOPT_PRIVATE, (void *)req);
+	if(curl_multi_add_handle(ws->multi, req->easy) != CURLM_OK)
+	{
+		curl_easy_cleanup(req->easy);
+		req->easy = NULL;
+		return -1;
+	}
+	bf_log("[LOG] webseed: Requested piece %d (bytes %s) from %s.\n", idx, req->range, req->seed->url);
+
+	return 0;
+}
+
+static size_t write_callback(char *data, size_t size, size_t nmemb, void *arg)
+{
+	struct webseed_request *req = (struct webseed_request *)arg;
+	struct pwp_torrent *t = req->seed->torrent;
+	long int len = size * nmemb;
+	long int code = 0;
+	uint8_t *copy;
+
+	// a server that ignores the Range header would send the whole file.
+	curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &code);
+	if(code != 206 || req->received + len > t->pieces[req->piece_idx].piece_length)
+	{
+		bf_log("[ERROR] webseed: Unexpected response (HTTP %ld) for piece %d.\n", code, req->piece_idx);
+		return 0;
+	}
+
+	// the curl thread mustn't wait for tokens, so the transfer is paused until they are due.
+	if(ratelimit_request(&req->seed->download_bucket, len, len) == 0)
+	{
+		req->resume_ms = monotonic_ms() + ratelimit_delay_ms(&req->seed->download_bucket, len) + 1;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	// curl reuses its buffer, so the disk writers get a copy.
+	copy = malloc(len);
+	memcpy(copy, data, len);
+	diskio_write(t, req->piece_idx, (long int)req->piece_idx * t->piece_length + req->received, copy, len);
+	req->received += len;
+
+	return len;
+}
+
+// a downloaded piece is handed to the hash workers; finish_piece() completes it once it is verified.
+static void finish_request(struct webseed_set *ws, struct webseed_request *req, CURLcode result)
+{
+	struct pwp_torrent *t = ws->torrent;
+	int idx = req->piece_idx;
+	int ok = result == CURLE_OK && req->received == t->pieces[idx].piece_length;
+
+	curl_multi_remove_handle(ws->multi, req->easy);
+	curl_easy_cleanup(req->easy);
+	req->easy = NULL;
+
+	if(ok)
+	{
+		req->verify = diskio_verify_start(t, idx, verified, ws->multi);
+	}
+	else
+	{
+		bf_log("[ERROR] webseed: Failed to download piece %d from %s: %s\n", idx, req->seed->url, curl_easy_strerror(result));
+		release_piece(t, idx);
+		if(++req->seed->failures == WEBSEED_MAX_FAILURES)
+		{
+			bf_log("[ERROR] webseed: Giving up on %s.\n", req->seed->url);
+		}
+	}
+}
+
+// result is what the hash workers made of the piece, see diskio_verify().
+static void finish_piece(struct webseed_set *ws, struct webseed_request *req, int result)
+{
+	struct pwp_torrent *t = ws->torrent;
+	int idx = req->piece_idx;
+	int ok = result == 0;
+
+	if(!ok)
+	{
+		release_piece(t, idx);
+	}
+	else
+	{
+		// complete_piece() releases the piece itself if it fails.
+		ok = complete_piece(t, idx) == 0;
+	}
+
+	if(ok)
+	{
+		req->seed->failures = 0;
+		bf_log("[LOG] webseed: *-*-*-*- Downloaded piece!! Piece index: %d.\n", idx);
+	}
+	else if(++req->seed->failures == WEBSEED_MAX_FAILURES)
+	{
+		bf_log("[ERROR] webseed: Giving up on %s.\n", req->seed->url);
+	}
+}
+
+// wakes the web seed thread for the result. NOTE: called by a hash worker with diskio's lock held.
+static void verified(void *arg)
+{
+	curl_multi_wakeup((CURLM *)arg);
+}
+
+static uint64_t monotonic_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
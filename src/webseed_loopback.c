@@ -0,0 +1,321 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<limits.h>
+#include<time.h>
+#include<signal.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<sys/wait.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+
+#include "sha1.h"
+#include "util.h"
+
+/*
+webseed_loopback downloads a torrent from a web seed (BEP 19, see webseed.h) on 127.0.0.1 and
+checks what was saved.
+
+It makes up a file, writes a torrent for it whose url-list points at a small HTTP server of its own,
+and runs mtc on the torrent in a directory of its own. The server answers Range requests for the
+file with 206 and the bytes asked for, and the tracker's announce with no peers, so everything has
+to come from the web seed. mtc must exit with every byte of the file in its saved file, fetched
+with Range requests only.
+
+	webseed_loopback [path-to-mtc]
+
+mtc defaults to the one next to webseed_loopback. Exits with 0 if the download was right.
+*/
+
+#define PORT 46950
+#define PIECE_LENGTH 32768
+#define NUM_OF_PIECES 40
+#define FILE_LENGTH (PIECE_LENGTH * NUM_OF_PIECES + 1234) // the last piece is a short one
+#define TIMEOUT_S 120
+
+static uint8_t *g_data;
+static int g_range_requests = 0;
+static int g_other_requests = 0;
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int send_all(int fd, const void *buf, long int len)
+{
+	long int sent;
+	int n;
+
+	for(sent = 0; sent < len; sent += n)
+	{
+		if((n = send(fd, (const uint8_t *)buf + sent, len - sent, MSG_NOSIGNAL)) <= 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// answers one request. returns -1 if the connection should be closed.
+static int answer(int fd, const char *request)
+{
+	char header[256];
+	const char *range;
+	long int first, last;
+	int len;
+
+	if(strncmp(request, "GET /announce?", 14) == 0)
+	{
+		const char *body = "d8:intervali1800e5:peers0:e";
+
+		len = sprintf(header, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", (int)strlen(body));
+		return send_all(fd, header, len) == 0 && send_all(fd, body, strlen(body)) == 0 ? 0 : -1;
+	}
+	if(strncmp(request, "GET /files/test.bin ", 20) != 0)
+	{
+		len = sprintf(header, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+		return send_all(fd, header, len);
+	}
+
+	range = strstr(request, "\nRange: bytes=");
+	if(range == NULL || sscanf(range, "\nRange: bytes=%ld-%ld", &first, &last) != 2
+		|| first < 0 || last < first || last >= FILE_LENGTH)
+	{
+		// web seeds must only ever ask for ranges.
+		pthread_mutex_lock(&g_mutex);
+		g_other_requests++;
+		pthread_mutex_unlock(&g_mutex);
+		len = sprintf(header, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\n\r\n");
+		return send_all(fd, header, len);
+	}
+	pthread_mutex_lock(&g_mutex);
+	g_range_requests++;
+	pthread_mutex_unlock(&g_mutex);
+	len = sprintf(header, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %ld-%ld/%d\r\nContent-Length: %ld\r\n\r\n",
+		first, last, FILE_LENGTH, last - first + 1);
+
+	return send_all(fd, header, len) == 0 && send_all(fd, g_data + first, last - first + 1) == 0 ? 0 : -1;
+}
+
+// serves the requests of one connection, which curl keeps alive, until it is closed.
+static void *connection_thread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char buf[8192];
+	char *end;
+	int len = 0, n;
+
+	while((n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) > 0)
+	{
+		len += n;
+		buf[len] = '\0';
+		while((end = strstr(buf, "\r\n\r\n")) != NULL)
+		{
+			*end = '\0';
+			if(answer(fd, buf) != 0)
+			{
+				goto done;
+			}
+			len -= end + 4 - buf;
+			memmove(buf, end + 4, len + 1);
+		}
+		if(len == sizeof(buf) - 1)
+		{
+			break;
+		}
+	}
+
+done:
+	close(fd);
+	return NULL;
+}
+
+static void *server_thread(void *arg)
+{
+	int listen_fd = (int)(intptr_t)arg;
+	pthread_t thread;
+	int fd;
+
+	while((fd = accept(listen_fd, NULL, NULL)) != -1)
+	{
+		if(pthread_create(&thread, NULL, connection_thread, (void *)(intptr_t)fd) == 0)
+		{
+			pthread_detach(thread);
+		}
+		else
+		{
+			close(fd);
+		}
+	}
+
+	return NULL;
+}
+
+static int start_server()
+{
+	struct sockaddr_in addr;
+	pthread_t thread;
+	int fd, yes = 1;
+
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+	{
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1
+		|| pthread_create(&thread, NULL, server_thread, (void *)(intptr_t)fd) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+// writes the torrent of the file with the web seed as its url-list. the keys are in the order
+// read_metafile() expects them.
+static int write_torrent(const char *path)
+{
+	char url[64];
+	uint8_t hash[20];
+	FILE *fp;
+	int i, len;
+
+	if((fp = fopen(path, "w")) == NULL)
+	{
+		return -1;
+	}
+	sprintf(url, "http://127.0.0.1:%d/announce", PORT);
+	fprintf(fp, "d8:announce%d:%s4:infod6:lengthi%de4:name8:test.bin12:piece lengthi%de6:pieces%d:",
+		(int)strlen(url), url, FILE_LENGTH, PIECE_LENGTH, (NUM_OF_PIECES + 1) * 20);
+	for(i = 0; i <= NUM_OF_PIECES; i++)
+	{
+		len = i < NUM_OF_PIECES ? PIECE_LENGTH : FILE_LENGTH - NUM_OF_PIECES * PIECE_LENGTH;
+		sha1_compute(g_data + (long int)i * PIECE_LENGTH, len, hash);
+		fwrite(hash, 1, 20, fp);
+	}
+	sprintf(url, "http://127.0.0.1:%d/files/", PORT);
+	fprintf(fp, "e8:url-listl%d:%see", (int)strlen(url), url);
+
+	return fclose(fp);
+}
+
+// runs mtc on the torrent in dir. returns its exit status, or -1 if it had to be killed.
+static int run_mtc(const char *mtc, const char *dir)
+{
+	int status, waited;
+	pid_t pid;
+
+	fflush(NULL);
+	if((pid = fork()) == -1)
+	{
+		return -1;
+	}
+	if(pid == 0)
+	{
+		// the web seed is the only source.
+		if(chdir(dir) == 0 && freopen("/dev/null", "w", stdout) && freopen("mtc.stderr", "w", stderr))
+		{
+			execl(mtc, mtc, "--no-utp", "--no-dht", "--no-lsd", "test.torrent", (char *)NULL);
+		}
+		_exit(127);
+	}
+	for(waited = 0; waitpid(pid, &status, WNOHANG) == 0; waited++)
+	{
+		if(waited == TIMEOUT_S * 10)
+		{
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			return -1;
+		}
+		usleep(100 * 1000);
+	}
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/webseed_loopback.XXXXXX";
+	char mtc[PATH_MAX], path[PATH_MAX + 64];
+	uint8_t *saved = NULL;
+	time_t start;
+	int i, len, rc, rv = 1;
+
+	if(argc > 1)
+	{
+		snprintf(path, sizeof(path), "%s", argv[1]);
+	}
+	else
+	{
+		snprintf(path, sizeof(path), "%s", argv[0]);
+		*(strrchr(path, '/') ? strrchr(path, '/') + 1 : path) = '\0';
+		strcat(path, "mtc");
+	}
+	if(realpath(path, mtc) == NULL || access(mtc, X_OK) != 0)
+	{
+		printf("Usage: webseed_loopback [path-to-mtc]  (no mtc at %s)\n", path);
+		return 1;
+	}
+
+	srand(time(NULL));
+	g_data = malloc(FILE_LENGTH);
+	for(i = 0; i < FILE_LENGTH; i++)
+	{
+		g_data[i] = rand();
+	}
+	if(mkdtemp(dir) == NULL)
+	{
+		printf("Failed to create %s.\n", dir);
+		return 1;
+	}
+	// mtc logs to logs/ of the directory it runs in.
+	sprintf(path, "%s/logs", dir);
+	mkdir(path, 0755);
+	sprintf(path, "%s/test.torrent", dir);
+	if(write_torrent(path) != 0 || start_server() != 0)
+	{
+		printf("Failed to write the torrent or to start the HTTP server on port %d.\n", PORT);
+		goto cleanup;
+	}
+
+	start = time(NULL);
+	rc = run_mtc(mtc, dir);
+	sprintf(path, "%s/test/test.saved", dir);
+	if(rc != 0)
+	{
+		printf("FAILED: mtc %s (see %s/mtc.stderr and %s/logs).\n", rc == -1 ? "was killed" : "failed", dir, dir);
+		goto cleanup;
+	}
+	if(util_read_whole_file(path, &saved, &len) != 0 || len != FILE_LENGTH || memcmp(saved, g_data, FILE_LENGTH) != 0)
+	{
+		printf("FAILED: %s doesn't match the file the web seed served.\n", path);
+		goto cleanup;
+	}
+	if(g_other_requests > 0)
+	{
+		printf("FAILED: %d requests for the file weren't for a valid range.\n", g_other_requests);
+		goto cleanup;
+	}
+	printf("OK: %d bytes from the web seed in %d Range requests and %ld s.\n", FILE_LENGTH, g_range_requests, (long int)(time(NULL) - start));
+	rv = 0;
+
+cleanup:
+	free(saved);
+	free(g_data);
+	if(rv == 0)
+	{
+		sprintf(path, "rm -rf %s", dir);
+		system(path);
+	}
+
+	return rv;
+}